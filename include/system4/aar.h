@@ -17,6 +17,7 @@
 #ifndef SYSTEM4_AAR_H
 #define SYSTEM4_AAR_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -39,16 +40,38 @@ struct aar_entry {
 struct aar_archive {
 	struct archive ar;
 	char *filename;
-	size_t file_size;
+	struct archive_file file;
 	uint32_t version;
 	uint32_t nr_files;
 	struct aar_entry *files;
 	uint8_t *index_buf;
 	struct hash_table *ht;  // name -> aar_entry
-	void *mmap_ptr;
-	FILE *f;
 };
 
 struct aar_archive *aar_open(const char *file, int flags, int *error);
 
+/*
+ * AAR writer. Entries are added with `aar_writer_add_data` (which takes
+ * ownership of `data`) or `aar_writer_add_file`, then written out in one go
+ * by `aar_writer_write`. Entries are compressed in parallel but always written
+ * in the order they were added. The format can't represent an archive with no
+ * entries, so writing an empty writer fails.
+ */
+struct aar_writer;
+
+struct aar_writer_options {
+	uint32_t version;            // 0 or 2
+	int level;                   // zlib compression level
+	size_t min_compress_size;    // smaller entries are stored raw
+	float max_ratio;             // store raw unless compressed size <= size * max_ratio
+	bool dedup;                  // v2: store identical payloads once, as symlinks
+	int nr_threads;              // <= 0 = one per CPU
+};
+
+struct aar_writer *aar_writer_create(void);
+void aar_writer_free(struct aar_writer *w);
+void aar_writer_add_data(struct aar_writer *w, const char *name, uint8_t *data, size_t size);
+bool aar_writer_add_file(struct aar_writer *w, const char *name, const char *path);
+bool aar_writer_write(struct aar_writer *w, const char *path, const struct aar_writer_options *opts);
+
 #endif /* SYSTEM4_AAR_H */
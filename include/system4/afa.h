@@ -17,6 +17,7 @@
 #ifndef SYSTEM4_AFA_H
 #define SYSTEM4_AFA_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -38,7 +39,7 @@ struct afa_entry {
 struct afa_archive {
 	struct archive ar;
 	char *filename;
-	size_t file_size;
+	struct archive_file file;
 	uint32_t version;
 	uint32_t unknown;
 	uint32_t data_start;
@@ -47,8 +48,6 @@ struct afa_archive {
 	uint32_t nr_files;
 	struct afa_entry *files;
 	uint32_t data_size;
-	void *mmap_ptr;
-	FILE *f;
 	uint8_t *data;
 	struct hash_table *name_index;
 	struct hash_table *basename_index;
@@ -60,4 +59,25 @@ struct afa_archive *afa_open_conv(const char *file, int flags, int *error,
 				  struct string *(*conv)(const char*,size_t));
 struct archive_data *afa_entry_to_descriptor(struct afa_archive *ar, struct afa_entry *e);
 
+/*
+ * AFA writer. Entries are added with `afa_writer_add_data` (which takes
+ * ownership of `data`) or `afa_writer_add_file`, then written out in one go
+ * by `afa_writer_write`. Names are written verbatim, so they should already be
+ * in the archive's encoding (usually SJIS).
+ */
+struct afa_writer;
+
+struct afa_writer_options {
+	uint32_t version;  // 1 or 2 (0 = 2)
+	uint32_t align;    // alignment of entry data within the file (0 = 1)
+	bool dedup;        // store identical payloads only once
+	int nr_threads;    // threads used for hashing and copying (<= 0 = one per CPU)
+};
+
+struct afa_writer *afa_writer_create(void);
+void afa_writer_free(struct afa_writer *w);
+void afa_writer_add_data(struct afa_writer *w, const char *name, uint8_t *data, size_t size);
+bool afa_writer_add_file(struct afa_writer *w, const char *name, const char *path);
+bool afa_writer_write(struct afa_writer *w, const char *path, const struct afa_writer_options *opts);
+
 #endif /* SYSTEM4_AFA_H */
@@ -370,6 +370,10 @@ int ain_get_functype(struct ain *ain, const char *name);
 int ain_get_delegate(struct ain *ain, const char *name);
 int ain_get_string_no(struct ain *ain, const char *str);
 
+/*
+ * The ain_add_* functions modify the ain in place, and require exclusive
+ * access to it (the lookups above may be used from several threads).
+ */
 int ain_add_function(struct ain *ain, const char *name);
 int ain_dup_function(struct ain *ain, int no);
 int ain_add_global(struct ain *ain, const char *name);
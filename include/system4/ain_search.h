@@ -0,0 +1,78 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_AIN_SEARCH_H
+#define SYSTEM4_AIN_SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ain;
+
+/*
+ * Full-text search over the messages and strings of an .ain file.
+ *
+ * The index converts every message and string to UTF-8 once, and records
+ * for every character, character bigram and trigram the texts containing it
+ * (as delta-encoded posting lists). A query looks up the posting lists of its
+ * trigrams (or of its bigram or character, if it is shorter), intersects the
+ * rarest of them and checks the remaining candidates against the text. Only
+ * queries without a whole character (such as the empty string) check every
+ * text.
+ *
+ * Queries and results are UTF-8. Matching is byte-wise (and so case
+ * sensitive).
+ */
+struct ain_search;
+
+enum ain_search_kind {
+	AIN_SEARCH_MESSAGE,
+	AIN_SEARCH_STRING,
+};
+
+enum ain_search_flags {
+	// only search messages / strings (neither = both)
+	AIN_SEARCH_MESSAGES = 1,
+	AIN_SEARCH_STRINGS = 2,
+	// match at the start of the text only
+	AIN_SEARCH_PREFIX = 4,
+};
+
+struct ain_search_result {
+	enum ain_search_kind kind;
+	int32_t index; // in ain->messages or ain->strings
+};
+
+/*
+ * Build the index for the messages and strings of `ain` (<= 0 threads = one
+ * per CPU). The index keeps its own copy of the texts; `ain` may be freed
+ * afterwards.
+ */
+struct ain_search *ain_search_create(struct ain *ain, int nr_threads);
+void ain_search_free(struct ain_search *s);
+
+/*
+ * Texts containing (or starting with) `query`, messages first, each in
+ * index order. The result is freed with free(); NULL if nothing matches.
+ */
+struct ain_search_result *ain_search_find(struct ain_search *s, const char *query, int flags,
+		size_t *nr_results);
+
+// the UTF-8 text of a message or string (NULL if out of range)
+const char *ain_search_text(struct ain_search *s, enum ain_search_kind kind, int32_t index);
+
+#endif /* SYSTEM4_AIN_SEARCH_H */
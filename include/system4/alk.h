@@ -30,11 +30,9 @@ struct alk_entry {
 struct alk_archive {
 	struct archive ar;
 	char *filename;
-	size_t file_size;
+	struct archive_file file;
 	struct alk_entry *files;
 	int nr_files;
-	void *mmap_ptr;
-	FILE *f;
 };
 
 struct alk_archive *alk_open(const char *file, int flags, int *error);
@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "system4/trace.h"
 
 enum ald_error {
 	ARCHIVE_SUCCESS,
@@ -29,15 +30,33 @@ enum ald_error {
 };
 
 enum {
-	ARCHIVE_MMAP = 1
+	ARCHIVE_MMAP = 1,
+	ARCHIVE_IO_URING = 2,
+	// prefault the whole mapping at open time (implies ARCHIVE_MMAP)
+	ARCHIVE_MMAP_POPULATE = 4,
 };
 
 struct archive {
 	bool mmapped;
+	bool io_uring;
 	struct archive_ops *ops;
 	struct string *(*conv)(const char*,size_t);
 };
 
+struct archive_data;
+struct archive_extent;
+
+/*
+ * Backing store shared by the single-file archive formats. The file is opened
+ * once; `map` is a read-only mapping of the whole file when the archive was
+ * opened with ARCHIVE_MMAP, and NULL otherwise.
+ */
+struct archive_file {
+	int fd;
+	size_t size;
+	uint8_t *map;
+};
+
 struct archive_ops {
 	bool (*exists)(struct archive *ar, int no);
 	bool (*exists_by_name)(struct archive *ar, const char *name, int *id_out);
@@ -46,6 +65,8 @@ struct archive_ops {
 	struct archive_data *(*get_by_name)(struct archive *ar, const char *name);
 	struct archive_data *(*get_by_basename)(struct archive *ar, const char *name);
 	bool (*load_file)(struct archive_data *file);
+	bool (*load_files)(struct archive_data **files, size_t n);
+	bool (*get_extent)(struct archive_data *file, struct archive_extent *out);
 	void (*release_file)(struct archive_data *file);
 	struct archive_data *(*copy_descriptor)(struct archive_data *src);
 	void (*for_each)(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
@@ -61,6 +82,29 @@ struct archive_data {
 	struct archive *archive;
 };
 
+/*
+ * How a file's stored bytes are turned into its contents.
+ */
+enum archive_compression {
+	ARCHIVE_STORED,       // the stored bytes are the contents
+	ARCHIVE_ZLB,          // AAR "ZLB\0" header followed by a zlib stream
+	ARCHIVE_ZLIB_SIZE32,  // FLAT: 32-bit uncompressed size followed by a zlib stream
+};
+
+/*
+ * Location of a file's stored (possibly compressed) bytes. For mmapped
+ * archives `ptr` points into the mapping and `fd` is -1; otherwise `ptr` is
+ * NULL and the bytes can be read from `fd` at offset `off`. Archives held
+ * entirely in memory set `ptr` and leave `fd` at -1 as well.
+ */
+struct archive_extent {
+	int fd;
+	uint64_t off;
+	size_t size;
+	uint8_t *ptr;
+	enum archive_compression compression;
+};
+
 /*
  * Returns a human readable description of an error.
  */
@@ -93,24 +137,33 @@ static inline bool archive_exists_by_basename(struct archive *ar, const char *na
 /*
  * Retrieve a file from an archive by ID.
  */
+struct archive_data *_archive_get_traced(struct archive *ar, int no);
 static inline struct archive_data *archive_get(struct archive *ar, int no)
 {
+	if (sys4_trace_enabled())
+		return _archive_get_traced(ar, no);
 	return ar->ops->get ? ar->ops->get(ar, no) : NULL;
 }
 
 /*
  * Retrieve a file from an archive by name.
  */
+struct archive_data *_archive_get_by_name_traced(struct archive *ar, const char *name);
 static inline struct archive_data *archive_get_by_name(struct archive *ar, const char *name)
 {
+	if (sys4_trace_enabled())
+		return _archive_get_by_name_traced(ar, name);
 	return ar->ops->get_by_name ? ar->ops->get_by_name(ar, name) : NULL;
 }
 
 /*
  * Retrive a file from an archive by basename (i.e. ignoring file extension and case).
  */
+struct archive_data *_archive_get_by_basename_traced(struct archive *ar, const char *name);
 static inline struct archive_data *archive_get_by_basename(struct archive *ar, const char *name)
 {
+	if (sys4_trace_enabled())
+		return _archive_get_by_basename_traced(ar, name);
 	return ar->ops->get_by_basename ? ar->ops->get_by_basename(ar, name) : NULL;
 }
 
@@ -118,11 +171,40 @@ static inline struct archive_data *archive_get_by_basename(struct archive *ar, c
  * Load a file into memory, given an unloaded descriptor.
  * This should be used in conjunction with archive_for_each.
  */
+bool _archive_load_file_traced(struct archive_data *data);
 static inline bool archive_load_file(struct archive_data *data)
 {
+	if (sys4_trace_enabled())
+		return _archive_load_file_traced(data);
 	return data->archive->ops->load_file ? data->archive->ops->load_file(data) : false;
 }
 
+/*
+ * Load several files into memory at once, given unloaded descriptors belonging
+ * to the same archive. For archives that are not mmapped the reads are
+ * submitted as a single batch (via io_uring when the archive was opened with
+ * ARCHIVE_IO_URING, otherwise with pread). Returns false if any file failed
+ * to load; the others are left loaded.
+ */
+bool _archive_load_files(struct archive_data **files, size_t n);
+static inline bool archive_load_files(struct archive_data **files, size_t n)
+{
+	if (!n)
+		return true;
+	struct archive *ar = files[0]->archive;
+	if (ar->ops->load_files)
+		return ar->ops->load_files(files, n);
+	return _archive_load_files(files, n);
+}
+
+/*
+ * Get the location of a file's stored bytes within the archive.
+ */
+static inline bool archive_get_extent(struct archive_data *data, struct archive_extent *out)
+{
+	return data->archive->ops->get_extent ? data->archive->ops->get_extent(data, out) : false;
+}
+
 /*
  * Release file data loaded with `archive_load_file`.
  */
@@ -177,6 +259,45 @@ static inline void archive_free(struct archive *ar)
 	ar->ops->free(ar);
 }
 
+/*
+ * Integrity manifests. A manifest records the size and checksum of every
+ * entry's stored bytes (i.e. before decompression), keyed by name.
+ */
+enum archive_hash_type {
+	ARCHIVE_HASH_XXH64,
+	ARCHIVE_HASH_CRC32,
+};
+
+struct archive_manifest_entry {
+	char *name;
+	uint64_t size;
+	uint64_t hash;
+};
+
+struct archive_manifest {
+	enum archive_hash_type hash_type;
+	size_t nr_entries;
+	struct archive_manifest_entry *entries;
+};
+
+/*
+ * Hash every entry of `ar` and return the result as a manifest. Entries are
+ * hashed in parallel on `nr_threads` threads (<= 0 = one per CPU), reading in
+ * file order. Returns NULL if any entry could not be read.
+ */
+struct archive_manifest *archive_manifest_create(struct archive *ar, enum archive_hash_type type,
+		int nr_threads);
+void archive_manifest_free(struct archive_manifest *m);
+struct archive_manifest *archive_manifest_read(const char *path);
+bool archive_manifest_write(struct archive_manifest *m, const char *path);
+
+/*
+ * Check `ar` against `manifest` without decompressing anything. Returns the
+ * number of problems found (mismatched, unreadable, missing or unexpected
+ * entries), each of which is reported with a warning.
+ */
+int archive_verify(struct archive *ar, struct archive_manifest *manifest, int nr_threads);
+
 struct archive_data *_archive_make_descriptor(struct archive *ar, char *name, int no, size_t size);
 
 char *archive_basename(const char *name);
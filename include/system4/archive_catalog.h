@@ -0,0 +1,121 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_ARCHIVE_CATALOG_H
+#define SYSTEM4_ARCHIVE_CATALOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "system4/archive.h"
+
+/*
+ * Persistent catalog of the archives in a game directory.
+ *
+ * Resolving names normally means opening every archive of a game and
+ * building all of their indices at startup. A catalog does that once: it
+ * records where the stored bytes of every entry of every archive (.afa, .aar,
+ * .ald sets, .alk, .dlf, .flat) directly inside the directory are, along with
+ * per-archive hash tables of the entries' names and basenames, in a single
+ * file which is mapped when the catalog is opened. Lookups only touch the
+ * mapping; an archive's file is opened the first time one of its entries is
+ * loaded.
+ *
+ * Names are compared case-insensitively, with '/' and '\' equivalent
+ * (see sjis_normalize_path); basenames as with archive_get_by_basename.
+ *
+ * The catalog is rebuilt when the set of archives in the directory changes,
+ * or when the size or mtime of any of them no longer matches.
+ */
+struct archive_catalog;
+
+enum archive_catalog_format {
+	CATALOG_AFA,
+	CATALOG_AAR,
+	CATALOG_ALD,
+	CATALOG_ALK,
+	CATALOG_DLF,
+	CATALOG_FLAT,
+};
+
+struct archive_catalog_entry {
+	const char *name;  // points into the catalog
+	int archive;       // archive index within the catalog
+	int no;            // entry number within the archive
+	uint64_t off;      // offset of the stored bytes in the archive's file (or ALD volume)
+	uint64_t size;     // size of the stored bytes
+	enum archive_compression compression;
+};
+
+/*
+ * Scan `dir` and write a catalog of its archives to `path`. Archives which
+ * can't be opened are left out with a warning. Archives are indexed on
+ * `nr_threads` threads (<= 0 = one per CPU).
+ */
+bool archive_catalog_build(const char *dir, const char *path, int nr_threads);
+
+/*
+ * Open the catalog at `path` for the game directory `dir`, building it first
+ * if it is missing, invalid or out of date. `flags` (ARCHIVE_MMAP, ...) apply
+ * to the archive files opened on demand.
+ */
+struct archive_catalog *archive_catalog_open(const char *dir, const char *path, int flags);
+void archive_catalog_close(struct archive_catalog *cat);
+
+/*
+ * Check whether the directory still matches the catalog.
+ */
+bool archive_catalog_is_current(struct archive_catalog *cat);
+
+int archive_catalog_nr_archives(struct archive_catalog *cat);
+const char *archive_catalog_archive_name(struct archive_catalog *cat, int i);
+enum archive_catalog_format archive_catalog_archive_format(struct archive_catalog *cat, int i);
+
+/*
+ * Find an archive by file name (case-insensitive). ALD sets can be found by
+ * the name of any of their volumes, or by their set name, which is the file
+ * name without the volume letter (e.g. "GAMEG.ALD" for "GAMEGA.ALD").
+ * Returns -1 if there is no such archive.
+ */
+int archive_catalog_find(struct archive_catalog *cat, const char *name);
+
+/*
+ * Get a catalog-backed view of archive `i`. Lookups by number, name and
+ * basename are answered from the catalog, and loading entries works as with
+ * the archive itself. The view belongs to the catalog and stays valid until
+ * it is closed; archive_free() on it does nothing.
+ */
+struct archive *archive_catalog_archive(struct archive_catalog *cat, int i);
+
+/*
+ * Ask the OS to start reading the stored bytes of entry `no` of archive `i`
+ * in the background, opening the archive's file if it isn't open yet.
+ * Returns false if there is no such entry.
+ */
+bool archive_catalog_prefetch(struct archive_catalog *cat, int i, int no);
+
+/*
+ * Directory-wide lookups. When several archives contain the same name, the
+ * first archive in catalog order (i.e. by file name) wins. Data returned by
+ * the get functions belongs to the view of the archive holding the entry.
+ */
+bool archive_catalog_lookup(struct archive_catalog *cat, const char *name,
+		struct archive_catalog_entry *out);
+bool archive_catalog_lookup_basename(struct archive_catalog *cat, const char *name,
+		struct archive_catalog_entry *out);
+struct archive_data *archive_catalog_get_by_name(struct archive_catalog *cat, const char *name);
+struct archive_data *archive_catalog_get_by_basename(struct archive_catalog *cat, const char *name);
+
+#endif /* SYSTEM4_ARCHIVE_CATALOG_H */
@@ -0,0 +1,93 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_ARCHIVE_DELTA_H
+#define SYSTEM4_ARCHIVE_DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct archive;
+
+/*
+ * Archive delta patches.
+ *
+ * A patch turns one version of an archive into another. Entries are matched
+ * by name and compared by the size and hash of their (loaded) contents; the
+ * patch lists the names removed, the entries added or replaced, and for large
+ * changed entries a byte-level delta against the old contents (ranges copied
+ * from the old entry plus new bytes, found with a rolling hash).
+ *
+ * A patch can be applied without rewriting the archive:
+ *  - archive_delta_overlay presents the old archive with the patch on top of
+ *    it as a single archive;
+ *  - archive_delta_apply_afa updates an AFA file in place by appending the
+ *    new data and rewriting its index.
+ * Either way, the I/O needed is proportional to the size of the patch (plus
+ * the old contents of delta-encoded entries), not to the size of the archive.
+ */
+
+struct archive_delta_options {
+	// changed entries smaller than this are stored whole (0 = 64 KiB)
+	size_t min_delta_size;
+	// block size of the matcher; smaller finds more matches but uses more
+	// memory (0 = 64)
+	unsigned block_size;
+	// threads used for hashing and matching (<= 0 = one per CPU)
+	int nr_threads;
+};
+
+struct archive_delta_stats {
+	unsigned nr_unchanged;
+	unsigned nr_added;
+	unsigned nr_replaced;  // changed entries stored whole
+	unsigned nr_deltas;    // changed entries stored as a delta
+	unsigned nr_removed;
+	uint64_t patch_size;
+};
+
+/*
+ * Write a patch from `old` to `new` to `path`. `stats` may be NULL.
+ */
+bool archive_delta_create(struct archive *old, struct archive *new, const char *path,
+		const struct archive_delta_options *opts, struct archive_delta_stats *stats);
+
+/*
+ * Open the patch at `path` on top of `base`. Entries keep their numbers in
+ * `base`; added entries are numbered after the last entry of `base`. The
+ * overlay reads from `base`, which must outlive it (freeing the overlay does
+ * not free `base`). `flags` are the archive file flags used for the patch.
+ * Fails if the patch was made against a different archive.
+ */
+struct archive *archive_delta_overlay(struct archive *base, const char *path, int flags,
+		int *error);
+
+/*
+ * Apply a patch to an AFA (v1 or v2) archive in place. New data is appended
+ * to the archive and the index is rewritten; the data of removed and changed
+ * entries is left behind as unused space. If the new index doesn't fit in
+ * front of the data section, the first entries of the data section are moved
+ * to the end of the file to make room. Since AFAv2 numbers entries by
+ * position, removing entries renumbers those after them.
+ *
+ * The archive must not be open elsewhere while it is patched. If patching
+ * fails before the index is replaced, the archive is left unchanged (apart
+ * from unused data at its end).
+ */
+bool archive_delta_apply_afa(const char *afa_path, const char *patch_path);
+
+#endif /* SYSTEM4_ARCHIVE_DELTA_H */
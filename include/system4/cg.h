@@ -55,15 +55,104 @@ struct cg_metrics {
 	int alpha_pitch;
 };
 
+/*
+ * Classification of CG_TILE_SIZE x CG_TILE_SIZE tiles by their alpha values.
+ */
+enum cg_tile_class {
+	CG_TILE_EMPTY = 0,  // fully transparent
+	CG_TILE_OPAQUE = 1, // fully opaque
+	CG_TILE_MIXED = 2,
+};
+
+#define CG_TILE_SIZE 16
+
+/*
+ * Alpha coverage of a decoded CG, for trimming quads and skipping blending.
+ * Computed by the decoders while they write the alpha channel where
+ * possible, otherwise on the first call to cg_get_coverage.
+ */
+struct cg_coverage {
+	bool valid;
+	bool opaque; // every pixel has alpha 0xFF
+	// bounding box of the pixels with non-zero alpha (w = h = 0 if none)
+	int x;
+	int y;
+	int w;
+	int h;
+	int tiles_w;
+	int tiles_h;
+	uint8_t *tiles; // enum cg_tile_class, row-major
+};
+
 /*
  * Information for displaying CG data
  */
 struct cg {
 	enum cg_type type; // cg format type
 	struct cg_metrics metrics;
+	struct cg_coverage coverage;
 	void *pixels;
+	// if non-NULL, `pixels` points into this mapping rather than the heap
+	void *mapping;
+	size_t mapping_size;
+	// `pixels` was allocated with cg_pool_alloc (see cg_pool.h)
+	bool pooled;
 };
 
+/*
+ * A destination for decoding a CG directly into part of a larger RGBA image
+ * (e.g. a composited canvas or a sprite atlas). Rows are `stride` bytes
+ * apart.
+ */
+struct cg_canvas {
+	uint8_t *pixels;
+	int w;
+	int h;
+	size_t stride;
+};
+
+static inline bool cg_canvas_fits(const struct cg_canvas *canvas, int x, int y, int w, int h)
+{
+	return x >= 0 && y >= 0 && w >= 0 && h >= 0 && w <= canvas->w - x && h <= canvas->h - y;
+}
+
+static inline uint8_t *cg_canvas_at(const struct cg_canvas *canvas, int x, int y)
+{
+	return canvas->pixels + (size_t)y * canvas->stride + (size_t)x * 4;
+}
+
+/*
+ * PNG row filters (the values are the PNG filter types).
+ */
+enum cg_png_filter {
+	CG_PNG_FILTER_NONE = 0,
+	CG_PNG_FILTER_SUB = 1,
+	CG_PNG_FILTER_UP = 2,
+	CG_PNG_FILTER_AVERAGE = 3,
+	CG_PNG_FILTER_PAETH = 4,
+	CG_PNG_FILTER_ADAPTIVE = 5, // pick a filter for each row
+};
+
+/*
+ * Encoder settings for cg_write_with_options. Formats without a setting
+ * ignore it.
+ */
+struct cg_write_options {
+	int level;                     // 0 (fastest) to 9 (smallest)
+	enum cg_png_filter png_filter;
+	bool lossy;                    // WebP: lossy rather than lossless
+	float quality;                 // WebP: lossy quality, 0-100
+	int nr_threads;                // <= 0 = one per CPU
+};
+
+#define CG_WRITE_OPTIONS_DEFAULT { \
+	.level = 6, \
+	.png_filter = CG_PNG_FILTER_ADAPTIVE, \
+	.lossy = false, \
+	.quality = 75, \
+	.nr_threads = 0, \
+}
+
 extern const char *cg_file_extensions[_ALCG_NR_FORMATS];
 
 static inline const char *cg_file_extension(enum cg_type t)
@@ -82,7 +171,15 @@ struct cg *cg_load_data(struct archive_data *dfile);
 struct cg *cg_load(struct archive *ar, int no);
 struct cg *cg_load_file(const char *filename);
 struct cg *cg_load_buffer(uint8_t *buf, size_t buf_size);
+bool cg_load_data_into(struct archive_data *dfile, struct cg_canvas *dst, int x, int y,
+		struct cg_metrics *metrics);
+bool cg_load_buffer_into(uint8_t *buf, size_t buf_size, struct cg_canvas *dst, int x, int y,
+		struct cg_metrics *metrics);
+void cg_canvas_clear_border(struct cg_canvas *canvas, int x, int y, int w, int h);
 int cg_write(struct cg *cg, enum cg_type type, FILE *f);
+int cg_write_with_options(struct cg *cg, enum cg_type type, FILE *f,
+		const struct cg_write_options *opts);
+const struct cg_coverage *cg_get_coverage(struct cg *cg);
 void cg_free(struct cg *cg);
 
 #endif /* SYSTEM4_CG_H */
@@ -0,0 +1,78 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_CG_ATLAS_H
+#define SYSTEM4_CG_ATLAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct archive;
+
+/*
+ * A CG to be placed in an atlas.
+ */
+struct cg_atlas_source {
+	struct archive *ar;
+	int no;
+};
+
+/*
+ * Where a CG ended up in the atlas. `x` and `y` are the display offset of the
+ * CG (from its metrics), i.e. the image should be drawn at (x,y) relative to
+ * the sprite origin.
+ */
+struct cg_atlas_rect {
+	bool packed;  // false if the CG failed to load or didn't fit
+	int atlas_x;
+	int atlas_y;
+	int w;
+	int h;
+	int x;
+	int y;
+};
+
+struct cg_atlas {
+	int w;
+	int h;
+	uint8_t *pixels; // RGBA
+	size_t nr_rects;
+	struct cg_atlas_rect *rects; // in the same order as the sources
+};
+
+struct cg_atlas_options {
+	int max_w;
+	int max_h;
+	int padding;    // transparent pixels between images
+	int nr_threads; // <= 0 = one per CPU
+};
+
+/*
+ * Pack and decode a set of CGs into a single RGBA image. The width of the
+ * atlas is `max_w`; its height is trimmed to the used area (rounded up to a
+ * multiple of 4, so that it can be block-compressed) and never exceeds
+ * `max_h`. If `max_h` is not a multiple of 4, the rows past the last multiple
+ * of 4 are left unused. CGs that don't fit are marked as not packed and can be
+ * passed to another call.
+ *
+ * If `opts` is NULL, a 4096x4096 atlas with 1 pixel of padding is built.
+ */
+struct cg_atlas *cg_atlas_build(struct cg_atlas_source *sources, size_t nr_sources,
+		const struct cg_atlas_options *opts);
+void cg_atlas_free(struct cg_atlas *atlas);
+
+#endif /* SYSTEM4_CG_ATLAS_H */
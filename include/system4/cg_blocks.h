@@ -0,0 +1,74 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_CG_BLOCKS_H
+#define SYSTEM4_CG_BLOCKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cg;
+
+/*
+ * Block-compressed texture formats. The values are stored in the CG cache,
+ * so they must never change.
+ */
+enum cg_block_format {
+	CG_BLOCK_BC1 = 1, // RGB, 8 bytes per block (alpha is ignored)
+	CG_BLOCK_BC3 = 3, // RGBA, 16 bytes per block
+	CG_BLOCK_BC7 = 7, // RGBA, 16 bytes per block (mode 6 only)
+};
+
+/*
+ * Encoding effort. Higher levels are slower and produce better results.
+ */
+enum cg_block_quality {
+	CG_BLOCK_FAST = 0,   // bounding box endpoints
+	CG_BLOCK_NORMAL = 1, // principal axis endpoints
+	CG_BLOCK_HIGH = 2,   // principal axis + least squares refinement
+};
+
+/*
+ * A block-compressed image, ready to upload as a compressed texture. Blocks
+ * are stored in row-major order; images whose dimensions are not multiples
+ * of 4 are padded by repeating the edge pixels.
+ */
+struct cg_blocks {
+	enum cg_block_format format;
+	int quality;
+	int w;
+	int h;
+	int blocks_w;
+	int blocks_h;
+	size_t size;
+	uint8_t *data;
+	// if non-NULL, `data` points into this mapping rather than the heap
+	void *mapping;
+	size_t mapping_size;
+};
+
+/*
+ * Get the size in bytes of a single 4x4 block.
+ */
+size_t cg_block_size(enum cg_block_format format);
+
+/*
+ * Encode the pixels of a CG into blocks. The work is split over all CPUs.
+ */
+struct cg_blocks *cg_encode_blocks(struct cg *cg, enum cg_block_format format, int quality);
+void cg_blocks_free(struct cg_blocks *blocks);
+
+#endif /* SYSTEM4_CG_BLOCKS_H */
@@ -0,0 +1,111 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_CG_CACHE_H
+#define SYSTEM4_CG_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "system4/cg_blocks.h"
+
+struct archive;
+struct archive_data;
+struct cg;
+
+/*
+ * Persistent on-disk cache of decoded CGs.
+ *
+ * Each entry is stored in its own file in the cache directory, holding the
+ * decoded RGBA pixels behind a codec. Entries stored with the raw codec are
+ * mapped straight into the pixel buffer of the returned CG (copy-on-write),
+ * so loading them costs little more than the page faults.
+ *
+ * A cache may be shared between threads (everything except open/close).
+ */
+struct cg_cache;
+
+/*
+ * Identifies a cached image: where it came from and what it contained.
+ */
+struct cg_cache_key {
+	const char *archive_path;
+	uint64_t off;    // offset of the entry within the archive (or entry number)
+	uint64_t size;   // size of the encoded image
+	uint64_t hash;   // content hash of the encoded image
+};
+
+/*
+ * Pixel storage codec. Codecs are identified on disk by `id`, so ids must
+ * never be reused.
+ */
+struct cg_cache_codec {
+	uint32_t id;
+	const char *name;
+	// Returns a newly allocated buffer, or NULL to store the data raw instead.
+	uint8_t *(*encode)(const uint8_t *in, size_t in_size, size_t *out_size);
+	bool (*decode)(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size);
+};
+
+extern const struct cg_cache_codec cg_cache_codec_raw;
+extern const struct cg_cache_codec cg_cache_codec_rle;
+
+/*
+ * Open (creating it if necessary) the cache in `dir`. Once the total size of
+ * the cache exceeds `max_size` bytes, the least recently used entries are
+ * evicted. New entries are stored with `codec` (NULL = raw); entries written
+ * with any built-in codec or `codec` can be read.
+ */
+struct cg_cache *cg_cache_open(const char *dir, uint64_t max_size, const struct cg_cache_codec *codec);
+void cg_cache_close(struct cg_cache *cache);
+
+/*
+ * Build the key for a loaded archive entry.
+ */
+void cg_cache_key_init(struct cg_cache_key *key, const char *archive_path, struct archive_data *dfile);
+
+struct cg *cg_cache_get(struct cg_cache *cache, const struct cg_cache_key *key);
+bool cg_cache_put(struct cg_cache *cache, const struct cg_cache_key *key, struct cg *cg);
+
+/*
+ * Load a CG through the cache: return the cached image if there is one,
+ * otherwise decode it and add it to the cache.
+ */
+struct cg *cg_cache_load_data(struct cg_cache *cache, const char *archive_path,
+		struct archive_data *dfile);
+struct cg *cg_cache_load(struct cg_cache *cache, const char *archive_path,
+		struct archive *ar, int no);
+
+/*
+ * Block-compressed images (see cg_blocks.h) are cached separately from the
+ * pixels of the same image, one entry per format and quality.
+ * cg_cache_load_blocks() returns the cached blocks if there are any, and
+ * otherwise decodes and encodes the image and adds the result to the cache.
+ */
+struct cg_blocks *cg_cache_get_blocks(struct cg_cache *cache, const struct cg_cache_key *key,
+		enum cg_block_format format, int quality);
+bool cg_cache_put_blocks(struct cg_cache *cache, const struct cg_cache_key *key,
+		struct cg_blocks *blocks);
+struct cg_blocks *cg_cache_load_blocks(struct cg_cache *cache, const char *archive_path,
+		struct archive_data *dfile, enum cg_block_format format, int quality);
+
+/*
+ * Evict entries until the cache fits in its size limit.
+ */
+void cg_cache_trim(struct cg_cache *cache);
+
+#endif /* SYSTEM4_CG_CACHE_H */
@@ -0,0 +1,66 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_CG_MIPS_H
+#define SYSTEM4_CG_MIPS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cg;
+
+#define CG_MIPS_MAX_LEVELS 32
+
+enum cg_mip_filter {
+	CG_MIP_BOX,    // 2x2 box (3-tap polyphase box for odd dimensions)
+	CG_MIP_KAISER, // separable Kaiser-windowed sinc; sharper, slower
+};
+
+enum {
+	// the CG's pixels are premultiplied by alpha, and the mips will be too
+	CG_MIP_PREMULTIPLIED = 1,
+};
+
+struct cg_mip_level {
+	int w;
+	int h;
+	uint8_t *pixels; // RGBA, points into cg_mips.data
+};
+
+/*
+ * A mip chain. Level 0 is a copy of the CG itself; each following level is
+ * half the size of the previous one (rounded down, minimum 1). All levels
+ * are stored back to back in `data`.
+ */
+struct cg_mips {
+	int nr_levels;
+	struct cg_mip_level levels[CG_MIPS_MAX_LEVELS];
+	size_t size;
+	uint8_t *data;
+};
+
+/*
+ * Generate up to `levels` mip levels (including level 0) for a CG, or the
+ * full chain down to 1x1 if `levels` <= 0. Filtering is done on
+ * premultiplied colors, so that transparent pixels don't bleed into their
+ * neighbours; unless CG_MIP_PREMULTIPLIED is given, the input is assumed to
+ * be straight alpha and the output is converted back.
+ */
+struct cg_mips *cg_generate_mips(struct cg *cg, int levels, enum cg_mip_filter filter, int flags);
+void cg_mips_free(struct cg_mips *mips);
+
+#endif /* SYSTEM4_CG_MIPS_H */
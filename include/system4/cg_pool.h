@@ -0,0 +1,63 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_CG_POOL_H
+#define SYSTEM4_CG_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recycling pool for pixel buffers. The CG decoders allocate their output
+ * and scratch buffers here, and cg_free returns them, so that loading CGs in
+ * a steady state doesn't go back to the system allocator (and fault in
+ * fresh pages) for every image.
+ *
+ * Buffers are grouped in size classes spaced by factors of ~1.5; each class
+ * has its own lock, so threads decoding different sizes don't contend.
+ * Buffers smaller than 64KiB are not pooled. Buffers of 2MiB and up may be
+ * backed by transparent huge pages.
+ */
+
+struct cg_pool_stats {
+	uint64_t allocs;
+	uint64_t reuses;         // allocations served from the pool
+	uint64_t frees;
+	size_t resident_bytes;   // idle bytes held by the pool
+	size_t in_use_bytes;     // bytes handed out and not yet freed
+	size_t huge_page_bytes;  // bytes in huge-page-backed buffers (idle or in use)
+};
+
+void *cg_pool_alloc(size_t size);
+void *cg_pool_calloc(size_t nmemb, size_t size);
+void cg_pool_free(void *p);
+
+/*
+ * Set the maximum number of idle bytes kept by the pool (0 disables
+ * pooling), and whether large buffers use huge pages. The defaults are
+ * 256MiB and true.
+ */
+void cg_pool_configure(size_t max_resident, bool huge_pages);
+
+/*
+ * Release all idle buffers.
+ */
+void cg_pool_trim(void);
+
+void cg_pool_get_stats(struct cg_pool_stats *stats);
+
+#endif /* SYSTEM4_CG_POOL_H */
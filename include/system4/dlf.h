@@ -32,10 +32,8 @@ struct dlf_entry {
 struct dlf_archive {
 	struct archive ar;
 	char *filename;
-	size_t file_size;
+	struct archive_file file;
 	struct dlf_entry files[DLF_NR_ENTRIES];
-	void *mmap_ptr;
-	FILE *f;
 };
 
 struct dlf_archive *dlf_open(const char *file, int flags, int *error);
@@ -53,7 +53,15 @@ struct ex_field {
 	struct ex_field *subfields;
 };
 
+/*
+ * Tables, lists and trees are shared between copies of a value: copying takes
+ * a reference, and a shared node is cloned before ex_append and friends modify
+ * it. `refs` counts the references besides the first, so that a
+ * zero-initialized node has a single owner. Nodes reached from an ex object
+ * which may share them with another one must not be modified directly.
+ */
 struct ex_table {
+	unsigned int refs;
 	uint32_t nr_fields;
 	struct ex_field *fields;
 	uint32_t nr_columns;
@@ -67,6 +75,7 @@ struct ex_list_item {
 };
 
 struct ex_list {
+	unsigned int refs;
 	uint32_t nr_items;
 	struct ex_list_item *items;
 };
@@ -78,6 +87,7 @@ struct ex_leaf {
 };
 
 struct ex_tree {
+	unsigned int refs; // only for trees referenced by an ex_value
 	struct string *name;
 	bool is_leaf;
 	union {
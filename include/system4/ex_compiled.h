@@ -0,0 +1,128 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_EX_COMPILED_H
+#define SYSTEM4_EX_COMPILED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "system4/ex.h"
+
+/*
+ * Compiled EX files.
+ *
+ * An EX file is compressed and has to be parsed into a tree of allocations
+ * before it can be queried. Since it never changes between launches, it can
+ * instead be compiled once into a position-independent image which is
+ * mmapped and queried in place: no decompression, no parsing and no
+ * allocation per value.
+ *
+ * The image holds a hashed directory of blocks, tables stored by column
+ * (with a sorted key index for tables that have an index field), lists, trees
+ * stored as node arrays, and a blob of NUL-terminated strings. It records the
+ * hash of the EX file it was compiled from, so that a stale image can be
+ * detected (see ex_open_cached).
+ *
+ * Values in the image are accessed through handles (struct exc_value), which
+ * are passed around by value and stay valid until the image is closed. The
+ * queries mirror those of ex.h. Handles of the wrong type are treated as
+ * empty, so lookups can be chained without checking every step. Unlike the ex_*
+ * functions, names are always matched exactly.
+ */
+struct ex_compiled;
+
+struct exc_value {
+	const struct ex_compiled *ex;
+	enum ex_value_type type; // 0 = no value
+	union {
+		int32_t i;
+		float f;
+		uint32_t off; // strings, tables, lists and trees: position in the image
+	};
+};
+
+struct exc_field {
+	enum ex_value_type type;
+	const char *name;
+	bool is_index;
+	struct exc_value value;  // the field's default value, if it has one
+	uint32_t nr_subfields;
+	uint32_t subfields;      // position of the subfields in the image
+};
+
+/*
+ * Hash of an EX file, as recorded in the images compiled from it.
+ */
+bool ex_file_hash(const char *path, uint64_t *hash_out);
+
+/*
+ * Compile `ex` into an image at `path`. `source_hash` is the hash of the file
+ * `ex` was read from (see ex_file_hash).
+ */
+bool ex_compile(struct ex *ex, uint64_t source_hash, const char *path);
+
+struct ex_compiled *ex_open_compiled(const char *path);
+void ex_compiled_close(struct ex_compiled *ex);
+uint64_t ex_compiled_source_hash(struct ex_compiled *ex);
+
+/*
+ * Open the compiled image of the EX file at `ex_path`, stored at
+ * `cache_path`. If there is no image or it was compiled from a different
+ * version of the file, the EX file is parsed and compiled again.
+ */
+struct ex_compiled *ex_open_cached(const char *ex_path, const char *cache_path);
+
+uint32_t ex_compiled_nr_blocks(struct ex_compiled *ex);
+const char *ex_compiled_block_name(struct ex_compiled *ex, uint32_t i);
+struct exc_value ex_compiled_block(struct ex_compiled *ex, uint32_t i);
+
+struct exc_value exc_get(struct ex_compiled *ex, const char *name);
+int32_t exc_get_int(struct ex_compiled *ex, const char *name, int32_t dflt);
+float exc_get_float(struct ex_compiled *ex, const char *name, float dflt);
+const char *exc_get_string(struct ex_compiled *ex, const char *name);
+struct exc_value exc_get_table(struct ex_compiled *ex, const char *name);
+struct exc_value exc_get_list(struct ex_compiled *ex, const char *name);
+struct exc_value exc_get_tree(struct ex_compiled *ex, const char *name);
+
+// NUL-terminated; NULL if `v` is not a string
+const char *exc_string(struct exc_value v);
+uint32_t exc_string_size(struct exc_value v);
+
+uint32_t exc_table_nr_rows(struct exc_value table);
+uint32_t exc_table_nr_columns(struct exc_value table);
+uint32_t exc_table_nr_fields(struct exc_value table);
+bool exc_table_field(struct exc_value table, uint32_t i, struct exc_field *out);
+bool exc_field_subfield(const struct ex_compiled *ex, struct exc_field *field, uint32_t i,
+		struct exc_field *out);
+struct exc_value exc_table_get(struct exc_value table, unsigned row, unsigned col);
+int exc_row_at_int_key(struct exc_value table, int key);
+int exc_row_at_string_key(struct exc_value table, const char *key);
+int exc_col_from_name(struct exc_value table, const char *name);
+
+uint32_t exc_list_nr_items(struct exc_value list);
+struct exc_value exc_list_get(struct exc_value list, unsigned i);
+
+const char *exc_tree_name(struct exc_value tree);
+bool exc_tree_is_leaf(struct exc_value tree);
+uint32_t exc_tree_nr_children(struct exc_value tree);
+struct exc_value exc_tree_child(struct exc_value tree, unsigned i);
+struct exc_value exc_tree_get_child(struct exc_value tree, const char *name);
+const char *exc_leaf_name(struct exc_value tree);
+struct exc_value exc_leaf_value(struct exc_value tree);
+
+#endif /* SYSTEM4_EX_COMPILED_H */
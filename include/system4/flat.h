@@ -20,6 +20,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "system4/archive.h"
 
 enum flat_data_type {
@@ -53,12 +54,29 @@ struct talt_entry {
 	struct talt_metadata *metadata;
 };
 
+/*
+ * Flattened view of the LIBL and TALT entries, built once when the archive is
+ * opened. Entry numbers index into this array.
+ */
+struct flat_entry {
+	uint32_t off;
+	uint32_t size;
+	enum flat_data_type type;
+	char *name;
+	// inflate cache (FLAT_ZLIB entries only)
+	uint8_t *inflated;
+	size_t inflated_size;
+	unsigned refs;
+	uint64_t last_use;
+};
+
 struct flat_data {
 	struct archive_data super;
 	size_t off;
 	size_t size;
 	enum flat_data_type type;
-	bool inflated;
+	bool inflated;  // data is owned by this descriptor
+	bool cached;    // data is borrowed from the inflate cache
 };
 
 struct flat_section {
@@ -83,13 +101,31 @@ struct flat_archive {
 	uint32_t nr_talt_entries;
 	struct talt_entry *talt_entries;
 
+	uint32_t nr_entries;
+	struct flat_entry *entries;
+
+	// inflated FLAT_ZLIB entries are kept around up to this many bytes
+	// (cache_lock protects the cache fields and the entries' cache state)
+	pthread_mutex_t cache_lock;
+	size_t cache_budget;
+	size_t cache_size;
+	uint64_t cache_clock;
+
 	bool needs_free;
+	struct archive_file file;  // backing store when mmapped
 	size_t data_size;
 	uint8_t *data;
 };
 
+#define FLAT_DEFAULT_CACHE_BUDGET (8 * 1024 * 1024)
+
 struct flat_archive *flat_new(void);
 struct flat_archive *flat_open(uint8_t *data, size_t size, int *error);
 struct flat_archive *flat_open_file(const char *path, int flags, int *error);
 
+/*
+ * Set the byte budget of the inflated entry cache (0 disables caching).
+ */
+void flat_set_cache_budget(struct flat_archive *ar, size_t budget);
+
 #endif /* SYSTEM4_FLAT_H */
@@ -37,6 +37,22 @@ bool _ht_get(struct hash_table *ht, const char *key, void **out);
 struct ht_slot *ht_put(struct hash_table *ht, const char *key, void *dflt);
 void ht_foreach_value(struct hash_table *ht, void(*fun)(void*));
 
+/*
+ * Lazily built indices shared between threads. A hash table may be read by
+ * any number of threads at once as long as nobody modifies it; this returns
+ * the table stored in `*slot`, building it with `build(user)` first if
+ * needed. The table is only published once it is fully built, so readers
+ * never see a partially built table and lookups take no locks. If several
+ * threads race to build the same index, one table wins and the others are
+ * freed with `free_table`.
+ *
+ * This only makes the build safe. Modifying a published table (ht_put etc.)
+ * is not, and requires that no other thread is using it at the same time.
+ */
+struct hash_table *ht_get_or_build(struct hash_table **slot,
+		struct hash_table *(*build)(void *user), void *user,
+		void (*free_table)(struct hash_table *ht));
+
 /*
  * Integer-keyed hash tables. These functions should not be used together
  * with the regular ht_get/ht_put functions on the same hash table.
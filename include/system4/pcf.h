@@ -20,5 +20,6 @@
 bool pcf_checkfmt(const uint8_t *data);
 bool pcf_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *dst);
 bool pcf_extract(const uint8_t *data, size_t size, struct cg *cg);
+bool pcf_extract_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y);
 
 #endif // SYSTEM4_PCF_H
@@ -22,12 +22,14 @@
 #include <stdint.h>
 
 struct cg;
+struct cg_canvas;
 
 bool pms_checkfmt(const uint8_t *data);
 bool pms8_checkfmt(const uint8_t *data);
 bool pms16_checkfmt(const uint8_t *data);
 bool pms_get_metrics(const uint8_t *data, struct cg_metrics *dst);
 void pms_extract(const uint8_t *data, size_t size, struct cg *cg);
+bool pms_extract_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y);
 uint8_t *pms_extract_mask(const uint8_t *data, size_t size);
 
 #endif /* SYSTEM4_PMS_H */
@@ -23,11 +23,15 @@
 #include <stdio.h>
 
 struct cg;
+struct cg_canvas;
+struct cg_write_options;
 struct cg_metrics;
 
 bool png_cg_checkfmt(const uint8_t *data);
 bool png_cg_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *dst);
 void png_cg_extract(const uint8_t *data, size_t size, struct cg *cg);
+bool png_cg_extract_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y);
 int png_cg_write(struct cg *cg, FILE *f);
+int png_cg_write_with_options(struct cg *cg, FILE *f, const struct cg_write_options *opts);
 
 #endif /* SYSTEM4_PNG_H */
@@ -0,0 +1,83 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_PREFETCH_H
+#define SYSTEM4_PREFETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ain;
+struct archive_catalog;
+
+/*
+ * Prefetch manifests.
+ *
+ * Most assets a scene loads are named by string constants in the script. A
+ * prefetch manifest is built by scanning the code of an .ain file for string
+ * (and message) literals which name entries of the game's archives, grouped
+ * per function and per scenario label. When a scenario starts, the entries of
+ * its group can be prefetched so that they are already in memory when they
+ * are first loaded.
+ *
+ * A function's group holds the entries named in its own code. A scenario
+ * label's group holds the entries named between the label and the next label
+ * (or the end of the function), plus those of the functions called directly
+ * from there.
+ */
+
+enum prefetch_scope {
+	PREFETCH_FUNCTION,
+	PREFETCH_SCENARIO,
+};
+
+struct prefetch_entry {
+	char *archive; // archive name, as in the catalog
+	char *name;    // entry name
+};
+
+struct prefetch_group {
+	enum prefetch_scope scope;
+	char *name;    // function name (overloads share a group) or scenario label
+	size_t nr_entries;
+	struct prefetch_entry *entries;
+};
+
+// groups are sorted by scope, then name
+struct prefetch_manifest {
+	size_t nr_groups;
+	struct prefetch_group *groups;
+};
+
+/*
+ * Scan the code of `ain` and resolve its literals against the archives in
+ * `cat` (by name, then by basename). Groups without entries are left out.
+ */
+struct prefetch_manifest *prefetch_manifest_create(struct ain *ain, struct archive_catalog *cat);
+void prefetch_manifest_free(struct prefetch_manifest *m);
+struct prefetch_manifest *prefetch_manifest_read(const char *path);
+bool prefetch_manifest_write(struct prefetch_manifest *m, const char *path);
+
+struct prefetch_group *prefetch_manifest_get(struct prefetch_manifest *m,
+		enum prefetch_scope scope, const char *name);
+
+/*
+ * Start reading the entries of a group in the background (see
+ * archive_catalog_prefetch). Returns the number of entries found in `cat`.
+ */
+int prefetch_group_start(struct prefetch_group *g, struct archive_catalog *cat);
+
+#endif /* SYSTEM4_PREFETCH_H */
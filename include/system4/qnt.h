@@ -31,6 +31,7 @@
 #include <stdio.h>
 
 struct cg;
+struct cg_canvas;
 struct cg_metrics;
 
 struct qnt_header {
@@ -48,6 +49,7 @@ struct qnt_header {
 bool qnt_checkfmt(const uint8_t *data);
 bool qnt_get_metrics(const uint8_t *data, struct cg_metrics *dst);
 void qnt_extract(const uint8_t *data, struct cg *cg);
+bool qnt_extract_into(const uint8_t *data, struct cg_canvas *dst, int x, int y);
 void qnt_extract_header(const uint8_t *b, struct qnt_header *qnt);
 int qnt_write(struct cg *cg, FILE *f);
 
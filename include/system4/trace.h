@@ -0,0 +1,177 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_TRACE_H
+#define SYSTEM4_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Access tracing.
+ *
+ * While a trace is being recorded, every archive_get*, archive_load_file,
+ * cg_load*, ex_get* and ain_get_* call is logged to a compact binary file
+ * along with its start time, calling thread, archive, entry, size and
+ * latency. Only the outermost call is logged (e.g. the archive_get made by
+ * cg_load is part of the cg_load event). When no trace is being recorded the
+ * hooks cost a single branch.
+ *
+ * Archives are identified by the path they were opened with, so tracing
+ * should be started before the game's archives are opened; events on
+ * archives opened earlier are logged with an unknown archive.
+ *
+ * A recorded trace can be summarized, or replayed against a game directory
+ * (see sys4_trace_replay) to measure the same access pattern with different
+ * settings.
+ */
+
+enum sys4_trace_op {
+	SYS4_TRACE_ARCHIVE_GET,
+	SYS4_TRACE_ARCHIVE_GET_BY_NAME,
+	SYS4_TRACE_ARCHIVE_GET_BY_BASENAME,
+	SYS4_TRACE_ARCHIVE_LOAD_FILE,
+	SYS4_TRACE_CG_LOAD,       // cg_load, cg_load_data, cg_load_data_into
+	SYS4_TRACE_CG_LOAD_FILE,
+	SYS4_TRACE_EX_GET,
+	SYS4_TRACE_AIN_GET,
+	SYS4_TRACE_NR_OPS
+};
+
+struct archive;
+
+// true while a trace is being recorded; use sys4_trace_enabled() to read it
+extern bool sys4_tracing;
+
+// read on every hooked call from any thread, so it is accessed atomically
+static inline bool sys4_trace_enabled(void)
+{
+	return __builtin_expect(__atomic_load_n(&sys4_tracing, __ATOMIC_RELAXED), 0);
+}
+
+/*
+ * Start recording a trace to `path`. If `path` is NULL, the SYS4_TRACE
+ * environment variable is used instead (and nothing happens if it isn't
+ * set). Returns false if no trace was started.
+ */
+bool sys4_trace_start(const char *path);
+void sys4_trace_stop(void);
+
+/*
+ * Hooks. An event is logged by calling _sys4_trace_begin before the operation
+ * and _sys4_trace_end with its result; `ar` may be NULL and `name` is the name
+ * looked up, if any. For CG loads `bytes` is the size of the decoded pixels.
+ */
+uint64_t _sys4_trace_begin(void);
+void _sys4_trace_end(uint64_t start, enum sys4_trace_op op, struct archive *ar, int no,
+		const char *name, size_t bytes, bool ok);
+
+/*
+ * Returns 0 when not tracing; _sys4_trace_end must be called if the result
+ * is non-zero.
+ */
+static inline uint64_t sys4_trace_begin(void)
+{
+	return sys4_trace_enabled() ? _sys4_trace_begin() : 0;
+}
+
+// called by the archive openers
+void _sys4_trace_archive_open(struct archive *ar, const char *path);
+
+const char *sys4_trace_op_name(enum sys4_trace_op op);
+
+/*
+ * A trace read back from a file.
+ */
+struct sys4_trace_event {
+	uint64_t time;      // ns since the start of the trace
+	uint32_t latency;   // ns (saturated)
+	uint16_t op;        // enum sys4_trace_op
+	uint16_t thread;    // recording thread (1, 2, ...)
+	uint32_t archive;   // index into archive_names (0 = none or unknown)
+	int32_t no;         // entry number; lookup result for ex/ain events
+	uint32_t bytes;
+	bool failed;
+	const char *name;   // name looked up, or NULL
+};
+
+struct sys4_trace {
+	uint64_t start;     // wall clock time at the start of the trace (ns since the epoch)
+	size_t nr_events;
+	struct sys4_trace_event *events;
+	uint32_t nr_archives;
+	char **archive_names; // path each archive was opened with; [0] = NULL
+	uint32_t nr_strings;
+	char **strings;
+};
+
+struct sys4_trace *sys4_trace_read(const char *path);
+void sys4_trace_free(struct sys4_trace *trace);
+
+/*
+ * Latency distribution of one kind of event, in ns.
+ */
+struct sys4_trace_latency {
+	uint64_t count;
+	uint64_t failed;
+	uint64_t skipped;   // replay only: events which couldn't be replayed
+	uint64_t bytes;
+	uint64_t total;
+	uint32_t min, p50, p90, p99, max;
+};
+
+struct sys4_trace_stats {
+	uint64_t wall_time; // ns from the start of the first event to the end of the last
+	struct sys4_trace_latency ops[SYS4_TRACE_NR_OPS];
+};
+
+/*
+ * Compute the latency distributions recorded in a trace.
+ */
+void sys4_trace_summarize(struct sys4_trace *trace, struct sys4_trace_stats *out);
+void sys4_trace_print_stats(const struct sys4_trace_stats *stats, FILE *out);
+
+struct sys4_replay_options {
+	// Number of threads to replay on (<= 0 = one per CPU). Each recorded
+	// thread's events are replayed in order by one thread; 1 replays the
+	// recorded threads one after another.
+	int nr_threads;
+	// flags for the archive files (ARCHIVE_MMAP, ARCHIVE_IO_URING, ...)
+	int archive_flags;
+	// catalog of the game directory (see archive_catalog.h); built if needed
+	const char *catalog_path;
+	// if set, CG loads go through a cg_cache in this directory
+	const char *cg_cache_dir;
+	uint64_t cg_cache_size;
+	// wait until each event's recorded start time instead of replaying as
+	// fast as possible
+	bool realtime;
+};
+
+/*
+ * Replay the archive and CG events of a trace against the game directory
+ * `dir`. Archives are resolved through the catalog by the file name they
+ * were opened with, so the trace may have been recorded with the game in a
+ * different location. ex/ain lookups (and events on unknown archives) are
+ * counted as skipped. Returns false if the catalog or cache couldn't be
+ * opened.
+ */
+bool sys4_trace_replay(struct sys4_trace *trace, const char *dir,
+		const struct sys4_replay_options *opts, struct sys4_trace_stats *out);
+
+#endif /* SYSTEM4_TRACE_H */
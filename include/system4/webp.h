@@ -25,10 +25,15 @@
 struct cg;
 struct cg_metrics;
 struct archive;
+struct cg_canvas;
+struct cg_write_options;
 
 bool webp_checkfmt(const uint8_t *data);
 void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar);
+bool webp_extract_into(uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y,
+		struct archive *ar);
 void webp_get_metrics(uint8_t *data, size_t size, struct cg_metrics *m);
 int webp_write(struct cg *cg, FILE *f);
+int webp_write_with_options(struct cg *cg, FILE *f, const struct cg_write_options *opts);
 
 #endif /* SYSTEM4_WEBP_H */
@@ -19,16 +19,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/aar.h"
 #include "system4/archive.h"
-#include "system4/file.h"
 #include "system4/hashtable.h"
 #include "system4/utfsjis.h"
+#include "archive_io.h"
+#include "compression.h"
 
 static void *ht_get_ignorecase(struct hash_table *ht, const char *key, void *dflt)
 {
@@ -52,6 +50,8 @@ static bool aar_exists(struct archive *ar, int no);
 static struct archive_data *aar_get(struct archive *ar, int no);
 static struct archive_data *aar_get_by_name(struct archive *ar, const char *name);
 static bool aar_load_file(struct archive_data *data);
+static bool aar_load_files(struct archive_data **files, size_t n);
+static bool aar_get_extent(struct archive_data *data, struct archive_extent *out);
 static void aar_release_file(struct archive_data *data);
 static void aar_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void aar_free_data(struct archive_data *data);
@@ -63,6 +63,8 @@ struct archive_ops aar_archive_ops = {
 	.get_by_name = aar_get_by_name,
 	.get_by_basename = NULL,
 	.load_file = aar_load_file,
+	.load_files = aar_load_files,
+	.get_extent = aar_get_extent,
 	.release_file = aar_release_file,
 	.copy_descriptor = NULL,
 	.for_each = aar_for_each,
@@ -85,15 +87,16 @@ static bool aar_inflate_entry(struct archive_data *data, uint8_t *buf, uint32_t
 		WARNING("unknown ZLB version: %u", version);
 		return false;
 	}
-	unsigned long out_size = LittleEndian_getDW(buf, 8);
+	size_t out_size = LittleEndian_getDW(buf, 8);
 	uint32_t in_size = LittleEndian_getDW(buf, 12);
 	if (in_size + 16 > size) {
 		WARNING("Bad ZLB size");
 		return false;
 	}
 	uint8_t *out = xmalloc(out_size);
-	if (uncompress(out, &out_size, buf + 16, in_size) != Z_OK) {
-		WARNING("uncompress failed");
+	enum sys4_z_status r = sys4_inflate(out, &out_size, buf + 16, in_size);
+	if (r != SYS4_Z_OK) {
+		WARNING("uncompress failed: %s", sys4_z_strerror(r));
 		free(out);
 		return false;
 	}
@@ -102,49 +105,129 @@ static bool aar_inflate_entry(struct archive_data *data, uint8_t *buf, uint32_t
 	return true;
 }
 
-static bool aar_load_file(struct archive_data *data)
+static struct aar_entry *aar_resolve_entry(struct aar_archive *ar, int no)
 {
-	if (data->data)
-		return true;
-
-	struct aar_archive *ar = (struct aar_archive*)data->archive;
-	struct aar_entry *e = &ar->files[data->no];
-
+	struct aar_entry *e = &ar->files[no];
 	while (e->type == AAR_SYMLINK) {
 		e = ht_get_ignorecase(ar->ht, e->link_target, NULL);
 		if (!e) {
-			WARNING("orphaned symlink: %s", ar->files[data->no].name);
-			return false;
+			WARNING("orphaned symlink: %s", ar->files[no].name);
+			return NULL;
 		}
 	}
+	return e;
+}
 
-	if (ar->ar.mmapped) {
-		uint8_t *ptr = (uint8_t *)ar->mmap_ptr + e->off;
-		if (e->type == AAR_COMPRESSED)
-			return aar_inflate_entry(data, ptr, e->size);
-		data->data = ptr;
-		data->size = e->size;
-		return true;
+/*
+ * Finish loading an entry given its stored bytes. Takes ownership of `buf`
+ * unless the archive is mmapped.
+ */
+static bool aar_load_stored(struct archive_data *data, struct aar_entry *e, uint8_t *buf)
+{
+	if (e->type == AAR_COMPRESSED) {
+		bool result = aar_inflate_entry(data, buf, e->size);
+		if (!data->archive->mmapped)
+			free(buf);
+		return result;
 	}
+	data->data = buf;
+	data->size = e->size;
+	return true;
+}
+
+static bool aar_load_file(struct archive_data *data)
+{
+	if (data->data)
+		return true;
+
+	struct aar_archive *ar = (struct aar_archive*)data->archive;
+	struct aar_entry *e = aar_resolve_entry(ar, data->no);
+	if (!e)
+		return false;
+
+	if (ar->ar.mmapped)
+		return aar_load_stored(data, e, ar->file.map + e->off);
 
-	fseek(ar->f, e->off, SEEK_SET);
 	uint8_t *buf = xmalloc(e->size);
-	if (e->size > 0 && fread(buf, e->size, 1, ar->f) != 1) {
+	if (e->size > 0 && !archive_file_read(&ar->file, buf, e->size, e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(buf);
 		return false;
 	}
-	if (e->type == AAR_COMPRESSED) {
-		bool result = aar_inflate_entry(data, buf, e->size);
-		free(buf);
-		return result;
-	}
+	return aar_load_stored(data, e, buf);
+}
 
-	data->data = buf;
-	data->size = e->size;
+static bool aar_get_extent(struct archive_data *data, struct archive_extent *out)
+{
+	struct aar_archive *ar = (struct aar_archive*)data->archive;
+	struct aar_entry *e = aar_resolve_entry(ar, data->no);
+	if (!e)
+		return false;
+
+	out->off = e->off;
+	out->size = e->size;
+	out->compression = e->type == AAR_COMPRESSED ? ARCHIVE_ZLB : ARCHIVE_STORED;
+	if (ar->ar.mmapped) {
+		out->fd = -1;
+		out->ptr = ar->file.map + e->off;
+	} else {
+		out->fd = ar->file.fd;
+		out->ptr = NULL;
+	}
 	return true;
 }
 
+static bool aar_load_files(struct archive_data **files, size_t n)
+{
+	struct aar_archive *ar = (struct aar_archive*)files[0]->archive;
+	if (ar->ar.mmapped) {
+		bool ok = true;
+		for (size_t i = 0; i < n; i++) {
+			ok = aar_load_file(files[i]) && ok;
+		}
+		return ok;
+	}
+
+	bool ok = true;
+	size_t nr_reqs = 0;
+	struct archive_read_req *reqs = xcalloc(n, sizeof(struct archive_read_req));
+	struct archive_data **req_files = xcalloc(n, sizeof(struct archive_data*));
+	struct aar_entry **req_entries = xcalloc(n, sizeof(struct aar_entry*));
+	for (size_t i = 0; i < n; i++) {
+		if (files[i]->data)
+			continue;
+		struct aar_entry *e = aar_resolve_entry(ar, files[i]->no);
+		if (!e) {
+			ok = false;
+			continue;
+		}
+		reqs[nr_reqs].fd = ar->file.fd;
+		reqs[nr_reqs].off = e->off;
+		reqs[nr_reqs].size = e->size;
+		reqs[nr_reqs].buf = xmalloc(e->size);
+		req_files[nr_reqs] = files[i];
+		req_entries[nr_reqs] = e;
+		nr_reqs++;
+	}
+
+	archive_read_batch(reqs, nr_reqs, ar->ar.io_uring);
+
+	for (size_t i = 0; i < nr_reqs; i++) {
+		if (!reqs[i].ok) {
+			WARNING("Failed to read '%s': %s", ar->filename, req_files[i]->name);
+			free(reqs[i].buf);
+			ok = false;
+			continue;
+		}
+		ok = aar_load_stored(req_files[i], req_entries[i], reqs[i].buf) && ok;
+	}
+
+	free(reqs);
+	free(req_files);
+	free(req_entries);
+	return ok;
+}
+
 static struct archive_data *aar_get_descriptor(struct archive *_ar, int no)
 {
 	struct aar_archive *ar = (struct aar_archive*)_ar;
@@ -185,8 +268,8 @@ static void aar_release_file(struct archive_data *data)
 	if (!data->data)
 		return;
 	struct aar_archive *ar = (struct aar_archive*)data->archive;
-	uint8_t *mmap_ptr = ar->mmap_ptr;
-	if (!(mmap_ptr && mmap_ptr <= data->data && data->data < mmap_ptr + ar->file_size))
+	uint8_t *map = ar->file.map;
+	if (!(map && map <= data->data && data->data < map + ar->file.size))
 		free(data->data);
 	data->data = NULL;
 }
@@ -212,10 +295,7 @@ static void aar_free_data(struct archive_data *data)
 static void aar_free(struct archive *_ar)
 {
 	struct aar_archive *ar = (struct aar_archive*)_ar;
-	if (ar->mmap_ptr)
-		munmap(ar->mmap_ptr, ar->file_size);
-	if (ar->f)
-		fclose(ar->f);
+	archive_file_close(&ar->file);
 	ht_free(ar->ht);
 	free(ar->filename);
 	free(ar->files);
@@ -233,10 +313,11 @@ static char *get_string(uint8_t **ptr, struct aar_archive *ar)
 	return str;
 }
 
-static bool aar_read_index(FILE *f, struct aar_archive *ar, int *error)
+static bool aar_read_index(struct aar_archive *ar, int *error)
 {
-	uint8_t header[16];
-	if (fread(header, 16, 1, f) != 1) {
+	uint8_t buf[16];
+	const uint8_t *header = archive_file_view(&ar->file, buf, 16, 0);
+	if (!header) {
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
 	}
@@ -253,10 +334,14 @@ static bool aar_read_index(FILE *f, struct aar_archive *ar, int *error)
 	}
 	ar->nr_files = LittleEndian_getDW(header, 8);
 	uint32_t first_entry_offset = LittleEndian_getDW(header, 12);
+	if (first_entry_offset < 16) {
+		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+		return false;
+	}
 
+	// names are decoded in place, so the index is always copied
 	ar->index_buf = xmalloc(first_entry_offset);
-	memcpy(ar->index_buf, header, 16);
-	if (fread(ar->index_buf + 16, first_entry_offset - 16, 1, f) != 1) {
+	if (!archive_file_read(&ar->file, ar->index_buf, first_entry_offset, 0)) {
 		free(ar->index_buf);
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
@@ -286,57 +371,24 @@ static bool aar_read_index(FILE *f, struct aar_archive *ar, int *error)
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
 	}
-
-	fseek(f, 0, SEEK_END);
-	ar->file_size = ftell(f);
-	fseek(f, 0, SEEK_SET);
 	return true;
 }
 
 struct aar_archive *aar_open(const char *file, int flags, int *error)
 {
-#ifdef _WIN32
-	flags &= ~ARCHIVE_MMAP;
-#endif
-	FILE *fp;
 	struct aar_archive *ar = xcalloc(1, sizeof(struct aar_archive));
-
-	if (!(fp = file_open_utf8(file, "rb"))) {
-		WARNING("fopen failed: %s", strerror(errno));
-		*error = ARCHIVE_FILE_ERROR;
+	if (!archive_file_open(&ar->file, file, flags, error))
 		goto exit_err;
-	}
-	if (!aar_read_index(fp, ar, error)) {
+	ar->ar.mmapped = !!ar->file.map;
+	if (!aar_read_index(ar, error)) {
 		WARNING("aar_read_index failed");
-		fclose(fp);
+		archive_file_close(&ar->file);
 		goto exit_err;
 	}
-	if (flags & ARCHIVE_MMAP) {
-		if (fclose(fp)) {
-			WARNING("fclose failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-
-		int fd = open(file, O_RDONLY);
-		if (fd < 0) {
-			WARNING("open failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-		ar->mmap_ptr = mmap(0, ar->file_size, PROT_READ, MAP_SHARED, fd, 0);
-		close(fd);
-		if (ar->mmap_ptr == MAP_FAILED) {
-			WARNING("mmap failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-		ar->ar.mmapped = true;
-	} else {
-		ar->f = fp;
-	}
 	ar->filename = strdup(file);
+	ar->ar.io_uring = flags & ARCHIVE_IO_URING;
 	ar->ar.ops = &aar_archive_ops;
+	_sys4_trace_archive_open(&ar->ar, file);
 	return ar;
 exit_err:
 	free(ar);
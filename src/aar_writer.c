@@ -0,0 +1,410 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "little_endian.h"
+#include "system4.h"
+#include "system4/aar.h"
+#include "system4/buffer.h"
+#include "system4/file.h"
+#include "hash.h"
+#include "kvec.h"
+#include "thread_pool.h"
+#include "compression.h"
+
+// entries are compressed in windows of roughly this many input bytes, so
+// that memory use stays bounded while keeping output order deterministic
+#define WINDOW_BYTES (256 * 1024 * 1024)
+
+struct aar_writer_entry {
+	char *name;
+	char *path;      // file-backed entry
+	uint8_t *data;   // memory-backed entry
+	size_t size;
+	uint64_t hash;
+	int link;        // index of the entry this one links to, or -1
+	// output
+	enum aar_entry_type type;
+	uint8_t *out;
+	size_t out_size;
+	uint32_t off;
+	bool failed;
+};
+
+struct aar_writer {
+	kvec_t(struct aar_writer_entry) entries;
+};
+
+struct aar_write_job {
+	struct aar_writer *w;
+	const struct aar_writer_options *opts;
+	size_t first;
+};
+
+struct aar_writer *aar_writer_create(void)
+{
+	struct aar_writer *w = xcalloc(1, sizeof(struct aar_writer));
+	kv_init(w->entries);
+	return w;
+}
+
+void aar_writer_free(struct aar_writer *w)
+{
+	for (size_t i = 0; i < kv_size(w->entries); i++) {
+		struct aar_writer_entry *e = &kv_A(w->entries, i);
+		free(e->name);
+		free(e->path);
+		free(e->data);
+	}
+	kv_destroy(w->entries);
+	free(w);
+}
+
+void aar_writer_add_data(struct aar_writer *w, const char *name, uint8_t *data, size_t size)
+{
+	struct aar_writer_entry e = {
+		.name = xstrdup(name),
+		.data = data,
+		.size = size,
+		.link = -1,
+	};
+	kv_push(struct aar_writer_entry, w->entries, e);
+}
+
+bool aar_writer_add_file(struct aar_writer *w, const char *name, const char *path)
+{
+	off_t size = file_size(path);
+	if (size < 0) {
+		WARNING("Not a regular file: '%s'", path);
+		return false;
+	}
+	struct aar_writer_entry e = {
+		.name = xstrdup(name),
+		.path = xstrdup(path),
+		.size = size,
+		.link = -1,
+	};
+	kv_push(struct aar_writer_entry, w->entries, e);
+	return true;
+}
+
+/*
+ * Get the payload of an entry. Must be released with `release_payload`.
+ */
+static uint8_t *get_payload(struct aar_writer_entry *e)
+{
+	if (e->data)
+		return e->data;
+	size_t size;
+	uint8_t *data = file_read(e->path, &size);
+	if (!data) {
+		WARNING("Failed to read '%s': %s", e->path, strerror(errno));
+		return NULL;
+	}
+	if (size != e->size) {
+		WARNING("'%s' changed size while packing", e->path);
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static void release_payload(struct aar_writer_entry *e, uint8_t *data)
+{
+	if (data != e->data)
+		free(data);
+}
+
+static void hash_entry(size_t i, possibly_unused int worker, void *user)
+{
+	struct aar_write_job *job = user;
+	struct aar_writer_entry *e = &kv_A(job->w->entries, i);
+	uint8_t *data = get_payload(e);
+	if (!data) {
+		e->failed = true;
+		return;
+	}
+	e->hash = hash64(data, e->size, 0);
+	release_payload(e, data);
+}
+
+static int entry_cmp(const void *_a, const void *_b)
+{
+	const struct aar_writer_entry *a = *(const struct aar_writer_entry**)_a;
+	const struct aar_writer_entry *b = *(const struct aar_writer_entry**)_b;
+	if (a->size != b->size)
+		return a->size < b->size ? -1 : 1;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	// keep the earliest entry first so that it becomes the link target
+	return a < b ? -1 : a > b;
+}
+
+static bool same_payload(struct aar_writer_entry *a, struct aar_writer_entry *b)
+{
+	uint8_t *da = get_payload(a);
+	if (!da) {
+		a->failed = true;
+		return false;
+	}
+	uint8_t *db = get_payload(b);
+	if (!db) {
+		b->failed = true;
+		release_payload(a, da);
+		return false;
+	}
+	bool same = !memcmp(da, db, a->size);
+	release_payload(a, da);
+	release_payload(b, db);
+	return same;
+}
+
+/*
+ * Turn entries with identical contents into symlinks to the first such
+ * entry. Entries are grouped by (size, hash) and then compared byte for
+ * byte, so a hash collision never links different files. Returns false if
+ * an entry could not be read.
+ */
+static bool link_duplicates(struct aar_writer *w)
+{
+	size_t n = kv_size(w->entries);
+	struct aar_writer_entry **sorted = xcalloc(n, sizeof(struct aar_writer_entry*));
+	for (size_t i = 0; i < n; i++) {
+		sorted[i] = &kv_A(w->entries, i);
+	}
+	qsort(sorted, n, sizeof(struct aar_writer_entry*), entry_cmp);
+	bool ok = true;
+	size_t run = 0;
+	for (size_t i = 1; i < n && ok; i++) {
+		struct aar_writer_entry *e = sorted[i];
+		if (e->size != sorted[run]->size || e->hash != sorted[run]->hash) {
+			run = i;
+			continue;
+		}
+		if (!e->size)
+			continue;
+		// link to the first earlier entry in the run with the same contents
+		for (size_t j = run; j < i; j++) {
+			struct aar_writer_entry *target = sorted[j];
+			if (target->link >= 0)
+				continue;
+			if (same_payload(target, e)) {
+				e->link = target - kv_data(w->entries);
+				e->type = AAR_SYMLINK;
+				break;
+			}
+			if (target->failed || e->failed) {
+				ok = false;
+				break;
+			}
+		}
+	}
+	free(sorted);
+	return ok;
+}
+
+/*
+ * Compress an entry into a ZLB blob, keeping the result only if it is small
+ * enough to be worth it. Otherwise the entry is stored raw.
+ */
+static void pack_entry(size_t i, possibly_unused int worker, void *user)
+{
+	struct aar_write_job *job = user;
+	struct aar_writer_entry *e = &kv_A(job->w->entries, job->first + i);
+	if (e->link >= 0)
+		return;
+
+	uint8_t *data = get_payload(e);
+	if (!data) {
+		e->failed = true;
+		return;
+	}
+
+	if (e->size >= job->opts->min_compress_size) {
+		size_t packed_size = sys4_deflate_bound(e->size);
+		uint8_t *zlb = xmalloc(16 + packed_size);
+		enum sys4_z_status r = sys4_deflate(zlb + 16, &packed_size, data, e->size, job->opts->level);
+		if (r == SYS4_Z_OK && 16 + packed_size <= e->size * job->opts->max_ratio) {
+			memcpy(zlb, "ZLB\0", 4);
+			LittleEndian_putDW(zlb, 4, 0);
+			LittleEndian_putDW(zlb, 8, e->size);
+			LittleEndian_putDW(zlb, 12, packed_size);
+			release_payload(e, data);
+			e->type = AAR_COMPRESSED;
+			e->out = zlb;
+			e->out_size = 16 + packed_size;
+			return;
+		}
+		free(zlb);
+	}
+
+	e->type = AAR_RAW;
+	e->out = data;
+	e->out_size = e->size;
+}
+
+static void write_string(struct buffer *b, const char *s, int key)
+{
+	for (; *s; s++) {
+		buffer_write_int8(b, (uint8_t)*s + key);
+	}
+	buffer_write_int8(b, 0);
+}
+
+static size_t index_size(struct aar_writer *w, uint32_t version)
+{
+	size_t size = 12;
+	for (size_t i = 0; i < kv_size(w->entries); i++) {
+		struct aar_writer_entry *e = &kv_A(w->entries, i);
+		size += 12 + strlen(e->name) + 1;
+		if (version >= 2)
+			size += (e->link >= 0 ? strlen(kv_A(w->entries, e->link).name) : 0) + 1;
+	}
+	return size;
+}
+
+static void build_index(struct aar_writer *w, uint32_t version, struct buffer *b)
+{
+	const int key = version >= 2 ? 0x60 : 0;
+	buffer_write_bytes(b, (uint8_t*)"AAR\0", 4);
+	buffer_write_int32(b, version);
+	buffer_write_int32(b, kv_size(w->entries));
+	for (size_t i = 0; i < kv_size(w->entries); i++) {
+		struct aar_writer_entry *e = &kv_A(w->entries, i);
+		buffer_write_int32(b, e->link >= 0 ? 0 : e->off);
+		buffer_write_int32(b, e->link >= 0 ? 0 : e->out_size);
+		buffer_write_int32(b, e->type);
+		write_string(b, e->name, key);
+		if (version >= 2)
+			write_string(b, e->link >= 0 ? kv_A(w->entries, e->link).name : "", key);
+	}
+}
+
+bool aar_writer_write(struct aar_writer *w, const char *path, const struct aar_writer_options *opts)
+{
+	struct aar_writer_options dflt = {
+		.version = 2,
+		.level = SYS4_Z_DEFAULT_COMPRESSION,
+		.min_compress_size = 256,
+		.max_ratio = 0.9,
+		.dedup = true,
+		.nr_threads = 0,
+	};
+	if (!opts)
+		opts = &dflt;
+	uint32_t version = opts->version;
+	if (version != 0 && version != 2) {
+		WARNING("Unsupported AAR version: %u", version);
+		return false;
+	}
+	// readers find the end of the index through the first entry's offset
+	if (!kv_size(w->entries)) {
+		WARNING("Can't write an empty AAR archive: %s", path);
+		return false;
+	}
+
+	bool ok = false;
+	size_t n = kv_size(w->entries);
+	struct aar_write_job job = { .w = w, .opts = opts };
+	struct thread_pool *pool = thread_pool_create(opts->nr_threads);
+
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		goto out;
+	}
+
+	// symlinks only exist in v2+
+	if (opts->dedup && version >= 2) {
+		thread_pool_run(pool, n, hash_entry, &job);
+		for (size_t i = 0; i < n; i++) {
+			if (kv_A(w->entries, i).failed)
+				goto out_close;
+		}
+		if (!link_duplicates(w))
+			goto out_close;
+	}
+
+	// the index size doesn't depend on compression results, so entry data
+	// can be streamed out first and the index filled in afterwards
+	uint64_t off = index_size(w, version);
+	if (fseek(f, off, SEEK_SET)) {
+		WARNING("fseek failed: %s", strerror(errno));
+		goto out_close;
+	}
+
+	for (size_t first = 0; first < n;) {
+		size_t end = first, window_bytes = 0;
+		while (end < n && window_bytes < WINDOW_BYTES) {
+			window_bytes += kv_A(w->entries, end).size;
+			end++;
+		}
+
+		job.first = first;
+		thread_pool_run(pool, end - first, pack_entry, &job);
+
+		for (size_t i = first; i < end; i++) {
+			struct aar_writer_entry *e = &kv_A(w->entries, i);
+			if (e->failed)
+				goto out_close;
+			if (e->link >= 0)
+				continue;
+			if (off + e->out_size > UINT32_MAX) {
+				WARNING("AAR archives are limited to 4GiB");
+				goto out_close;
+			}
+			e->off = off;
+			if (e->out_size && fwrite(e->out, e->out_size, 1, f) != 1) {
+				WARNING("Write failed: %s", strerror(errno));
+				goto out_close;
+			}
+			off += e->out_size;
+			if (e->out != e->data)
+				free(e->out);
+			e->out = NULL;
+		}
+		first = end;
+	}
+
+	struct buffer index;
+	buffer_init(&index, NULL, 0);
+	build_index(w, version, &index);
+	if (fseek(f, 0, SEEK_SET) || fwrite(index.buf, index.index, 1, f) != 1) {
+		WARNING("Write failed: %s", strerror(errno));
+		free(index.buf);
+		goto out_close;
+	}
+	free(index.buf);
+	ok = true;
+out_close:
+	if (fclose(f)) {
+		WARNING("fclose failed: %s", strerror(errno));
+		ok = false;
+	}
+out:
+	for (size_t i = 0; i < n; i++) {
+		struct aar_writer_entry *e = &kv_A(w->entries, i);
+		if (e->out != e->data)
+			free(e->out);
+		e->out = NULL;
+	}
+	thread_pool_free(pool);
+	return ok;
+}
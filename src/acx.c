@@ -17,13 +17,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <zlib.h>
 
 #include "system4.h"
 #include "system4/acx.h"
 #include "system4/file.h"
 #include "system4/string.h"
 #include "little_endian.h"
+#include "compression.h"
 
 // FIXME: guard against invalid .acx file (use `struct buffer` to prevent overflow)
 static struct acx *acx_read(uint8_t *data_raw, struct string*(*conv)(const char*,size_t))
@@ -79,10 +79,10 @@ struct acx *acx_load_conv(const char *path, int *error, struct string*(*conv)(co
 
 	// decompress
 	int compressed_size = LittleEndian_getDW(buf, 8);
-	unsigned long size = LittleEndian_getDW(buf, 12);
+	size_t size = LittleEndian_getDW(buf, 12);
 	uint8_t *data_raw = xmalloc(size);
 
-	if (Z_OK != uncompress(data_raw, &size, buf+16, compressed_size)) {
+	if (sys4_inflate(data_raw, &size, buf+16, compressed_size) != SYS4_Z_OK) {
 		WARNING("ACXLoader.Load: uncompress failed");
 		free(buf);
 		free(data_raw);
@@ -19,17 +19,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/afa.h"
 #include "system4/archive.h"
 #include "system4/buffer.h"
-#include "system4/file.h"
 #include "system4/hashtable.h"
 #include "system4/string.h"
+#include "archive_io.h"
+#include "compression.h"
 
 typedef struct string *(*string_conv_fun)(const char*,size_t);
 
@@ -40,6 +38,7 @@ static struct archive_data *afa_get(struct archive *ar, int no);
 static struct archive_data *afa_get_by_name(struct archive *ar, const char *name);
 static struct archive_data *afa_get_by_basename(struct archive *ar, const char *name);
 static bool afa_load_file(struct archive_data *data);
+static bool afa_get_extent(struct archive_data *data, struct archive_extent *out);
 static void afa_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void afa_free_data(struct archive_data *data);
 static void afa_free(struct archive *ar);
@@ -52,6 +51,8 @@ struct archive_ops afa_archive_ops = {
 	.get_by_name = afa_get_by_name,
 	.get_by_basename = afa_get_by_basename,
 	.load_file = afa_load_file,
+	.load_files = NULL,
+	.get_extent = afa_get_extent,
 	.release_file = NULL,
 	.copy_descriptor = NULL,
 	.for_each = afa_for_each,
@@ -59,30 +60,52 @@ struct archive_ops afa_archive_ops = {
 	.free = afa_free,
 };
 
-static struct afa_entry *afa_get_entry_by_name(struct afa_archive *ar, const char *name)
+// indices are built on first use; see ht_get_or_build
+
+static struct hash_table *build_name_index(void *user)
 {
-	if (!ar->name_index) {
-		ar->name_index = ht_create(ar->nr_files * 3 / 2);
-		for (unsigned i = 0; i < ar->nr_files; i++) {
-			ht_put(ar->name_index, ar->files[i].name->text, &ar->files[i]);
-		}
+	struct afa_archive *ar = user;
+	struct hash_table *ht = ht_create(ar->nr_files * 3 / 2);
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		ht_put(ht, ar->files[i].name->text, &ar->files[i]);
 	}
-	return ht_get(ar->name_index, name, NULL);
+	return ht;
 }
 
-static struct afa_entry *afa_get_entry_by_basename(struct afa_archive *ar, const char *name)
+static struct hash_table *build_basename_index(void *user)
 {
-	if (!ar->basename_index) {
-		ar->basename_index = ht_create(ar->nr_files * 3 / 2);
-		for (unsigned i = 0; i < ar->nr_files; i++) {
-			char *basename = archive_basename(ar->files[i].name->text);
-			ht_put(ar->basename_index, basename, &ar->files[i]);
-			free(basename);
-		}
+	struct afa_archive *ar = user;
+	struct hash_table *ht = ht_create(ar->nr_files * 3 / 2);
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		char *basename = archive_basename(ar->files[i].name->text);
+		ht_put(ht, basename, &ar->files[i]);
+		free(basename);
 	}
+	return ht;
+}
+
+static struct hash_table *build_number_index(void *user)
+{
+	struct afa_archive *ar = user;
+	struct hash_table *ht = ht_create(ar->nr_files * 3 / 2);
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		ht_put_int(ht, ar->files[i].no, &ar->files[i]);
+	}
+	return ht;
+}
+
+static struct afa_entry *afa_get_entry_by_name(struct afa_archive *ar, const char *name)
+{
+	struct hash_table *index = ht_get_or_build(&ar->name_index, build_name_index, ar, ht_free);
+	return ht_get(index, name, NULL);
+}
 
+static struct afa_entry *afa_get_entry_by_basename(struct afa_archive *ar, const char *name)
+{
+	struct hash_table *index = ht_get_or_build(&ar->basename_index, build_basename_index,
+			ar, ht_free);
 	char *basename = archive_basename(name);
-	struct afa_entry *entry = ht_get(ar->basename_index, basename, NULL);
+	struct afa_entry *entry = ht_get(index, basename, NULL);
 	free(basename);
 	return entry;
 }
@@ -93,13 +116,9 @@ static struct afa_entry *afa_get_entry_by_number(struct afa_archive *ar, int no)
 		return ((uint32_t)no < ar->nr_files) ? &ar->files[no] : NULL;
 	}
 
-	if (!ar->number_index) {
-		ar->number_index = ht_create(ar->nr_files * 3 / 2);
-		for (unsigned i = 0; i < ar->nr_files; i++) {
-			ht_put_int(ar->number_index, ar->files[i].no, &ar->files[i]);
-		}
-	}
-	return ht_get_int(ar->number_index, no, NULL);
+	struct hash_table *index = ht_get_or_build(&ar->number_index, build_number_index,
+			ar, ht_free_int);
+	return ht_get_int(index, no, NULL);
 }
 
 static bool afa_exists(struct archive *_ar, int no)
@@ -139,23 +158,41 @@ static bool afa_load_file(struct archive_data *data)
 	struct afa_entry *e = afa_get_entry_by_number(ar, data->no);
 
 	if (ar->ar.mmapped) {
-		data->data = (uint8_t*)ar->mmap_ptr + ar->data_start + e->off;
+		data->data = ar->file.map + ar->data_start + e->off;
 		return true;
 	}
 
-	fseek(ar->f, ar->data_start + e->off, SEEK_SET);
-
 	data->data = xmalloc(e->size);
-	if (fread(data->data, e->size, 1, ar->f) != 1) {
+	if (!archive_file_read(&ar->file, data->data, e->size, ar->data_start + e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(data->data);
-		free(data);
+		data->data = NULL;
 		return false;
 	}
 
 	return true;
 }
 
+static bool afa_get_extent(struct archive_data *data, struct archive_extent *out)
+{
+	struct afa_archive *ar = (struct afa_archive*)data->archive;
+	struct afa_entry *e = afa_get_entry_by_number(ar, data->no);
+	if (!e)
+		return false;
+
+	out->off = ar->data_start + e->off;
+	out->size = e->size;
+	out->compression = ARCHIVE_STORED;
+	if (ar->ar.mmapped) {
+		out->fd = -1;
+		out->ptr = ar->file.map + out->off;
+	} else {
+		out->fd = ar->file.fd;
+		out->ptr = NULL;
+	}
+	return true;
+}
+
 struct archive_data *afa_entry_to_descriptor(struct afa_archive *ar, struct afa_entry *e)
 {
 	struct archive_data *data = xcalloc(1, sizeof(struct archive_data));
@@ -220,8 +257,7 @@ static void afa_free(struct archive *_ar)
 	for (uint32_t i = 0; i < ar->nr_files; i++) {
 		free_string(ar->files[i].name);
 	}
-	if (ar->f)
-		fclose(ar->f);
+	archive_file_close(&ar->file);
 	if (ar->name_index)
 		ht_free(ar->name_index);
 	if (ar->basename_index)
@@ -259,18 +295,17 @@ static bool afa_read_entry(struct buffer *in, struct afa_archive *ar, struct afa
 	return true;
 }
 
-static bool afa_read_file_table(FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv)
+static bool afa_read_file_table(struct afa_archive *ar, int *error, string_conv_fun conv)
 {
-	uint8_t *buf = xmalloc(ar->compressed_size);
+	uint8_t *buf = ar->ar.mmapped ? NULL : xmalloc(ar->compressed_size);
 	uint8_t *table = xmalloc(ar->uncompressed_size);
-	fseek(f, 44, SEEK_SET);
-	if (fread(buf, ar->compressed_size, 1, f) != 1) {
+	const uint8_t *packed = archive_file_view(&ar->file, buf, ar->compressed_size, 44);
+	if (!packed) {
 		*error = ARCHIVE_FILE_ERROR;
 		goto exit_err;
 	}
 
-	unsigned long uncompressed_size = ar->uncompressed_size;
-	if (uncompress(table, &uncompressed_size, buf, ar->compressed_size) != Z_OK) {
+	if (sys4_inflate_exact(table, ar->uncompressed_size, packed, ar->compressed_size) != SYS4_Z_OK) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		goto exit_err;
 	}
@@ -295,118 +330,87 @@ exit_err:
 	return false;
 }
 
-bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv);
+bool afa3_read_metadata(const uint8_t *hdr, struct archive_file *file, struct afa_archive *ar,
+			int *error, string_conv_fun conv);
 
-static bool afa_read_metadata(FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv)
+static bool afa_read_metadata(struct afa_archive *ar, int *error, string_conv_fun conv)
 {
-	char buf[44];
-	if (fread(buf, 44, 1, f) != 1) {
+	uint8_t hdr_buf[44];
+	const uint8_t *hdr = archive_file_view(&ar->file, hdr_buf, 44, 0);
+	if (!hdr) {
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
 	}
 
-	fseek(f, 0, SEEK_END);
-	ar->file_size = ftell(f);
-	fseek(f, 0, SEEK_SET);
-
-	if (strncmp(buf, "AFAH", 4)) {
+	if (strncmp((const char*)hdr, "AFAH", 4)) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
 	}
 
-	if (strncmp(buf+8, "AlicArch", 8)) {
-		if (LittleEndian_getDW((uint8_t*)buf, 8) == 3) {
-			return afa3_read_metadata(buf, f, ar, error, conv);
+	if (strncmp((const char*)hdr+8, "AlicArch", 8)) {
+		if (LittleEndian_getDW(hdr, 8) == 3) {
+			return afa3_read_metadata(hdr, &ar->file, ar, error, conv);
 		}
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
 	}
 
-	if (strncmp(buf+28, "INFO", 4) ||
-	    LittleEndian_getDW((uint8_t*)buf, 4) != 0x1c) {
+	if (strncmp((const char*)hdr+28, "INFO", 4) ||
+	    LittleEndian_getDW(hdr, 4) != 0x1c) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
 	}
 
-	ar->version = LittleEndian_getDW((uint8_t*)buf, 16);
-	ar->unknown = LittleEndian_getDW((uint8_t*)buf, 20);
-	ar->data_start = LittleEndian_getDW((uint8_t*)buf, 24);
-	ar->compressed_size = LittleEndian_getDW((uint8_t*)buf, 32) - 16;
-	ar->uncompressed_size = LittleEndian_getDW((uint8_t*)buf, 36);
-	ar->nr_files = LittleEndian_getDW((uint8_t*)buf, 40);
+	ar->version = LittleEndian_getDW(hdr, 16);
+	ar->unknown = LittleEndian_getDW(hdr, 20);
+	ar->data_start = LittleEndian_getDW(hdr, 24);
+	ar->compressed_size = LittleEndian_getDW(hdr, 32) - 16;
+	ar->uncompressed_size = LittleEndian_getDW(hdr, 36);
+	ar->nr_files = LittleEndian_getDW(hdr, 40);
 
-	if (ar->data_start+8 >= ar->file_size) {
+	if (ar->data_start+8 >= ar->file.size) {
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
 	}
 
-	fseek(f, ar->data_start, SEEK_SET);
-	if (fread(buf, 8, 1, f) != 1) {
+	uint8_t data_buf[8];
+	const uint8_t *data_hdr = archive_file_view(&ar->file, data_buf, 8, ar->data_start);
+	if (!data_hdr) {
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
 	}
-	fseek(f, 0, SEEK_SET);
 
-	if (strncmp(buf, "DATA", 4)) {
+	if (strncmp((const char*)data_hdr, "DATA", 4)) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
 	}
 
-	ar->data_size = LittleEndian_getDW((uint8_t*)buf, 4);
-	if (ar->data_start + ar->data_size > ar->file_size) {
+	ar->data_size = LittleEndian_getDW(data_hdr, 4);
+	if (ar->data_start + ar->data_size > ar->file.size) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
 	}
 
-	return afa_read_file_table(f, ar, error, conv);
+	return afa_read_file_table(ar, error, conv);
 }
 
 struct afa_archive *afa_open_conv(const char *file, int flags, int *error,
 				  struct string *(*conv)(const char*,size_t))
 {
-#ifdef _WIN32
-	flags &= ~ARCHIVE_MMAP;
-#endif
-	FILE *fp;
 	struct afa_archive *ar = xcalloc(1, sizeof(struct afa_archive));
-
-	if (!(fp = file_open_utf8(file, "rb"))) {
-		WARNING("fopen failed: %s", strerror(errno));
-		*error = ARCHIVE_FILE_ERROR;
+	if (!archive_file_open(&ar->file, file, flags, error))
 		goto exit_err;
-	}
-	if (!afa_read_metadata(fp, ar, error, conv)) {
+	ar->ar.mmapped = !!ar->file.map;
+	if (!afa_read_metadata(ar, error, conv)) {
 		WARNING("afa_read_metadata failed");
-		fclose(fp);
+		archive_file_close(&ar->file);
 		goto exit_err;
 	}
-	if (flags & ARCHIVE_MMAP) {
-		if (fclose(fp)) {
-			WARNING("fclose failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-
-		int fd = open(file, O_RDONLY);
-		if (fd < 0) {
-			WARNING("open failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-		ar->mmap_ptr = mmap(0, ar->file_size, PROT_READ, MAP_SHARED, fd, 0);
-		close(fd);
-		if (ar->mmap_ptr == MAP_FAILED) {
-			WARNING("mmap failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-		ar->ar.mmapped = true;
-	} else {
-		ar->f = fp;
-	}
 	ar->filename = strdup(file);
+	ar->ar.io_uring = flags & ARCHIVE_IO_URING;
 	ar->ar.ops = &afa_archive_ops;
 	ar->ar.conv = conv;
+	_sys4_trace_archive_open(&ar->ar, file);
 	return ar;
 exit_err:
 	free(ar);
@@ -44,13 +44,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/afa.h"
 #include "system4/archive.h"
 #include "system4/buffer.h"
 #include "system4/string.h"
+#include "archive_io.h"
+#include "compression.h"
 
 typedef struct string *(*string_conv_fun)(const char*,size_t);
 
@@ -115,40 +116,20 @@ static uint32_t rnd_get_next(void)
 }
 
 /*
- * Stream abstraction for reading non-byte-aligned data.
- * Can be backed by either a FILE* or a memory resident buffer.
+ * Stream abstraction for reading non-byte-aligned data from a memory resident
+ * buffer.
  */
 struct bitstream {
-	enum {
-		BITSTREAM_FILE,
-		BITSTREAM_BUFFER
-	} type;
-	union {
-		FILE *f;
-		struct buffer b;
-	};
+	struct buffer b;
 	int nr_cached;
 	uint32_t cache;
 };
 
-/*
- * Initialize a bitstream from a FILE*.
- */
-static void bs_init_file(struct bitstream *bs, FILE *f, long off)
-{
-	bs->type = BITSTREAM_FILE;
-	bs->f = f;
-	fseek(f, off, SEEK_SET);
-	bs->nr_cached = 0;
-	bs->cache = 0;
-}
-
 /*
  * Initialize a bitsream from a buffer.
  */
 static void bs_init_buffer(struct bitstream *bs, uint8_t *buf, size_t size)
 {
-	bs->type = BITSTREAM_BUFFER;
 	buffer_init(&bs->b, buf, size);
 	bs->nr_cached = 0;
 	bs->cache = 0;
@@ -159,13 +140,6 @@ static void bs_init_buffer(struct bitstream *bs, uint8_t *buf, size_t size)
  */
 static int _bs_next_byte(struct bitstream *bs)
 {
-	if (bs->type == BITSTREAM_FILE) {
-		uint8_t b;
-		if (fread(&b, 1, 1, bs->f) != 1) {
-			return -1;
-		}
-		return b;
-	}
 	if (buffer_remaining(&bs->b) < 1) {
 		return -1;
 	}
@@ -329,28 +303,47 @@ err:
 /*
  * Read the archive metadata.
  */
-bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv)
+bool afa3_read_metadata(const uint8_t *hdr, struct archive_file *file, struct afa_archive *ar,
+			int *error, string_conv_fun conv)
 {
 	uint8_t *packed = NULL;
 	uint8_t *unpacked = NULL;
-	uint32_t index_size = LittleEndian_getDW((uint8_t*)hdr, 4);
+	uint8_t *index_buf = NULL;
+	uint32_t index_size = LittleEndian_getDW(hdr, 4);
+	if (index_size < 4) {
+		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+		return false;
+	}
+
+	// the (obfuscated) index runs from the end of the header to data_start
+	size_t index_len = index_size - 4;
+	if (!file->map)
+		index_buf = xmalloc(index_len);
+	const uint8_t *index = archive_file_view(file, index_buf, index_len, 12);
+	if (!index) {
+		free(index_buf);
+		*error = ARCHIVE_FILE_ERROR;
+		return false;
+	}
 
 	struct bitstream bs;
-	bs_init_file(&bs, f, 12);
+	bs_init_buffer(&bs, (uint8_t*)index, index_len);
 	bs_read_bits(&bs, 1); // skip first bit (obfuscation)
 	read_dict(&bs);
-	unsigned long packed_size = bs_read_int32(&bs);
-	unsigned long unpacked_size = bs_read_int32(&bs);
+	size_t packed_size = bs_read_int32(&bs);
+	size_t unpacked_size = bs_read_int32(&bs);
 
 	// read zlib compressed data
 	packed = xmalloc(packed_size);
 	for (unsigned i = 0; i < packed_size; i++) {
 		packed[i] = (uint8_t)bs_read_bits(&bs, 8);
 	}
+	free(index_buf);
+	index_buf = NULL;
 
 	// decompress
 	unpacked = xmalloc(unpacked_size);
-	if (uncompress(unpacked, &unpacked_size, packed, packed_size) != Z_OK) {
+	if (sys4_inflate(unpacked, &unpacked_size, packed, packed_size) != SYS4_Z_OK) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		goto err;
 	}
@@ -378,6 +371,7 @@ bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error,
 	free(unpacked);
 	return true;
 err:
+	free(index_buf);
 	free(packed);
 	free(unpacked);
 	return false;
@@ -0,0 +1,385 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "system4.h"
+#include "system4/afa.h"
+#include "system4/buffer.h"
+#include "system4/file.h"
+#include "archive_io.h"
+#include "hash.h"
+#include "kvec.h"
+#include "thread_pool.h"
+#include "compression.h"
+
+// size of the per-thread buffer used to copy file-backed entries
+#define COPY_BUF_SIZE (4 * 1024 * 1024)
+
+struct afa_writer_entry {
+	char *name;
+	char *path;     // file-backed entry
+	uint8_t *data;  // memory-backed entry
+	uint64_t size;
+	uint64_t hash;
+	uint64_t off;   // relative to data_start
+	int shared;     // index of the entry whose data this entry shares, or -1
+	bool failed;
+};
+
+struct afa_writer {
+	kvec_t(struct afa_writer_entry) entries;
+};
+
+struct afa_write_job {
+	struct afa_writer *w;
+	int fd;
+	uint64_t data_start;
+	uint8_t **bufs;
+};
+
+struct afa_writer *afa_writer_create(void)
+{
+	struct afa_writer *w = xcalloc(1, sizeof(struct afa_writer));
+	kv_init(w->entries);
+	return w;
+}
+
+void afa_writer_free(struct afa_writer *w)
+{
+	for (size_t i = 0; i < kv_size(w->entries); i++) {
+		struct afa_writer_entry *e = &kv_A(w->entries, i);
+		free(e->name);
+		free(e->path);
+		free(e->data);
+	}
+	kv_destroy(w->entries);
+	free(w);
+}
+
+void afa_writer_add_data(struct afa_writer *w, const char *name, uint8_t *data, size_t size)
+{
+	struct afa_writer_entry e = {
+		.name = xstrdup(name),
+		.data = data,
+		.size = size,
+		.shared = -1,
+	};
+	kv_push(struct afa_writer_entry, w->entries, e);
+}
+
+bool afa_writer_add_file(struct afa_writer *w, const char *name, const char *path)
+{
+	off_t size = file_size(path);
+	if (size < 0) {
+		WARNING("Not a regular file: '%s'", path);
+		return false;
+	}
+	struct afa_writer_entry e = {
+		.name = xstrdup(name),
+		.path = xstrdup(path),
+		.size = size,
+		.shared = -1,
+	};
+	kv_push(struct afa_writer_entry, w->entries, e);
+	return true;
+}
+
+/*
+ * Call `fn` on successive chunks of a file-backed entry.
+ */
+static bool read_chunks(struct afa_writer_entry *e, uint8_t *buf,
+		bool (*fn)(const uint8_t *chunk, size_t size, uint64_t pos, void *user),
+		void *user)
+{
+	FILE *f = file_open_utf8(e->path, "rb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", e->path, strerror(errno));
+		return false;
+	}
+	uint64_t pos = 0;
+	while (pos < e->size) {
+		size_t n = min((uint64_t)COPY_BUF_SIZE, e->size - pos);
+		if (fread(buf, n, 1, f) != 1) {
+			WARNING("Failed to read '%s': %s", e->path, strerror(errno));
+			fclose(f);
+			return false;
+		}
+		if (!fn(buf, n, pos, user)) {
+			fclose(f);
+			return false;
+		}
+		pos += n;
+	}
+	fclose(f);
+	return true;
+}
+
+static bool hash_chunk(const uint8_t *chunk, size_t size, possibly_unused uint64_t pos, void *user)
+{
+	hash64_update(user, chunk, size);
+	return true;
+}
+
+static void hash_entry(size_t i, int worker, void *user)
+{
+	struct afa_write_job *job = user;
+	struct afa_writer_entry *e = &kv_A(job->w->entries, i);
+	if (e->data) {
+		e->hash = hash64(e->data, e->size, 0);
+		return;
+	}
+
+	struct hash64_state s;
+	hash64_init(&s, 0);
+	if (!read_chunks(e, job->bufs[worker], hash_chunk, &s)) {
+		e->failed = true;
+		return;
+	}
+	e->hash = hash64_digest(&s);
+}
+
+static int entry_cmp(const void *_a, const void *_b)
+{
+	const struct afa_writer_entry *a = *(const struct afa_writer_entry**)_a;
+	const struct afa_writer_entry *b = *(const struct afa_writer_entry**)_b;
+	if (a->size != b->size)
+		return a->size < b->size ? -1 : 1;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	// keep the earliest entry first so that it becomes the canonical copy
+	return a < b ? -1 : a > b;
+}
+
+/*
+ * Mark entries with identical (size, hash) as sharing the data region of the
+ * first such entry.
+ */
+static void dedup_entries(struct afa_writer *w)
+{
+	size_t n = kv_size(w->entries);
+	struct afa_writer_entry **sorted = xcalloc(n, sizeof(struct afa_writer_entry*));
+	for (size_t i = 0; i < n; i++) {
+		sorted[i] = &kv_A(w->entries, i);
+	}
+	qsort(sorted, n, sizeof(struct afa_writer_entry*), entry_cmp);
+	for (size_t i = 1; i < n; i++) {
+		struct afa_writer_entry *prev = sorted[i-1];
+		struct afa_writer_entry *e = sorted[i];
+		if (e->size != prev->size || e->hash != prev->hash || !e->size)
+			continue;
+		int canonical = prev->shared >= 0 ? prev->shared : prev - kv_data(w->entries);
+		e->shared = canonical;
+	}
+	free(sorted);
+}
+
+static bool write_chunk(const uint8_t *chunk, size_t size, uint64_t pos, void *user)
+{
+	struct afa_write_job *job = ((void**)user)[0];
+	struct afa_writer_entry *e = ((void**)user)[1];
+	if (!archive_pwrite(job->fd, chunk, size, job->data_start + e->off + pos)) {
+		WARNING("Write failed: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void write_entry(size_t i, int worker, void *user)
+{
+	struct afa_write_job *job = user;
+	struct afa_writer_entry *e = &kv_A(job->w->entries, i);
+	if (e->shared >= 0 || !e->size)
+		return;
+
+	if (e->data) {
+		if (!archive_pwrite(job->fd, e->data, e->size, job->data_start + e->off)) {
+			WARNING("Write failed: %s", strerror(errno));
+			e->failed = true;
+		}
+		return;
+	}
+
+	void *args[2] = { job, e };
+	if (!read_chunks(e, job->bufs[worker], write_chunk, args))
+		e->failed = true;
+}
+
+static uint8_t *build_file_table(struct afa_writer *w, uint32_t version, size_t *size_out)
+{
+	struct buffer b;
+	buffer_init(&b, NULL, 0);
+	for (size_t i = 0; i < kv_size(w->entries); i++) {
+		struct afa_writer_entry *e = &kv_A(w->entries, i);
+		size_t name_len = strlen(e->name);
+		// name is NUL-terminated and padded to a multiple of 4 bytes
+		size_t padded_len = (name_len + 4) & ~(size_t)3;
+		buffer_write_int32(&b, name_len);
+		buffer_write_int32(&b, padded_len);
+		buffer_write_bytes(&b, (uint8_t*)e->name, name_len);
+		for (size_t j = name_len; j < padded_len; j++) {
+			buffer_write_int8(&b, 0);
+		}
+		if (version == 1)
+			buffer_write_int32(&b, i + 1);
+		buffer_write_int32(&b, 0); // unknown0
+		buffer_write_int32(&b, 0); // unknown1
+		buffer_write_int32(&b, e->off);
+		buffer_write_int32(&b, e->size);
+	}
+	*size_out = b.index;
+	return b.buf;
+}
+
+bool afa_writer_write(struct afa_writer *w, const char *path, const struct afa_writer_options *opts)
+{
+	struct afa_writer_options dflt = { .version = 2, .align = 1, .dedup = false, .nr_threads = 0 };
+	if (!opts)
+		opts = &dflt;
+	uint32_t version = opts->version ? opts->version : 2;
+	uint32_t align = opts->align ? opts->align : 1;
+	if (version != 1 && version != 2) {
+		WARNING("Unsupported AFA version: %u", version);
+		return false;
+	}
+
+	bool ok = false;
+	uint8_t *table = NULL, *packed = NULL;
+	size_t n = kv_size(w->entries);
+	struct thread_pool *pool = thread_pool_create(opts->nr_threads);
+#ifdef _WIN32
+	// no pwrite on Windows; entries must be written one at a time
+	thread_pool_free(pool);
+	pool = thread_pool_create(1);
+#endif
+	struct afa_write_job job = { .w = w, .fd = -1 };
+	job.bufs = xcalloc(thread_pool_nr_threads(pool), sizeof(uint8_t*));
+	for (int i = 0; i < thread_pool_nr_threads(pool); i++) {
+		job.bufs[i] = xmalloc(COPY_BUF_SIZE);
+	}
+
+	if (opts->dedup) {
+		thread_pool_run(pool, n, hash_entry, &job);
+		for (size_t i = 0; i < n; i++) {
+			if (kv_A(w->entries, i).failed)
+				goto out;
+		}
+		dedup_entries(w);
+	}
+
+	// assign data offsets; the data section begins with an 8-byte header.
+	// Offsets are relative to the start of the data section, which is itself
+	// aligned below, so aligning them aligns the entries in the file.
+	size_t table_size;
+	uint64_t cur = 8;
+	for (size_t i = 0; i < n; i++) {
+		struct afa_writer_entry *e = &kv_A(w->entries, i);
+		if (e->shared >= 0)
+			continue;
+		cur = (cur + align - 1) / align * align;
+		e->off = cur;
+		cur += e->size;
+	}
+	for (size_t i = 0; i < n; i++) {
+		struct afa_writer_entry *e = &kv_A(w->entries, i);
+		if (e->shared >= 0)
+			e->off = kv_A(w->entries, e->shared).off;
+	}
+
+	// build and compress the file table
+	table = build_file_table(w, version, &table_size);
+	size_t packed_size = sys4_deflate_bound(table_size);
+	packed = xmalloc(packed_size);
+	if (sys4_deflate(packed, &packed_size, table, table_size, SYS4_Z_BEST_COMPRESSION) != SYS4_Z_OK) {
+		WARNING("compress2 failed");
+		goto out;
+	}
+	uint64_t data_start = (44 + packed_size + align - 1) / align * align;
+	for (size_t i = 0; i < n; i++) {
+		struct afa_writer_entry *e = &kv_A(w->entries, i);
+		assert((data_start + e->off) % align == 0);
+	}
+	uint64_t data_size = cur;
+	if (data_start + data_size > UINT32_MAX) {
+		WARNING("AFA archives are limited to 4GiB");
+		goto out;
+	}
+	job.data_start = data_start;
+
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		goto out;
+	}
+	job.fd = fileno(f);
+
+	struct buffer hdr;
+	buffer_init(&hdr, NULL, 0);
+	buffer_write_bytes(&hdr, (uint8_t*)"AFAH", 4);
+	buffer_write_int32(&hdr, 0x1c);
+	buffer_write_bytes(&hdr, (uint8_t*)"AlicArch", 8);
+	buffer_write_int32(&hdr, version);
+	buffer_write_int32(&hdr, 1);
+	buffer_write_int32(&hdr, data_start);
+	buffer_write_bytes(&hdr, (uint8_t*)"INFO", 4);
+	buffer_write_int32(&hdr, packed_size + 16);
+	buffer_write_int32(&hdr, table_size);
+	buffer_write_int32(&hdr, n);
+	buffer_write_bytes(&hdr, packed, packed_size);
+	while (hdr.index < data_start) {
+		buffer_write_int8(&hdr, 0);
+	}
+	buffer_write_bytes(&hdr, (uint8_t*)"DATA", 4);
+	buffer_write_int32(&hdr, data_size);
+	bool hdr_ok = archive_pwrite(job.fd, hdr.buf, hdr.index, 0);
+	free(hdr.buf);
+	if (!hdr_ok) {
+		WARNING("Write failed: %s", strerror(errno));
+		fclose(f);
+		goto out;
+	}
+
+	// entry data is written directly at its final offset, so entries can be
+	// copied in any order and in parallel
+	thread_pool_run(pool, n, write_entry, &job);
+	ok = true;
+	for (size_t i = 0; i < n; i++) {
+		if (kv_A(w->entries, i).failed)
+			ok = false;
+	}
+
+	// extend the file in case the last entries were empty or shared
+	fseek(f, 0, SEEK_END);
+	if (ok && (uint64_t)ftell(f) < data_start + data_size)
+		ok = archive_pwrite(job.fd, "", 1, data_start + data_size - 1);
+	if (fclose(f)) {
+		WARNING("fclose failed: %s", strerror(errno));
+		ok = false;
+	}
+out:
+	for (int i = 0; i < thread_pool_nr_threads(pool); i++) {
+		free(job.bufs[i]);
+	}
+	free(job.bufs);
+	thread_pool_free(pool);
+	free(table);
+	free(packed);
+	return ok;
+}
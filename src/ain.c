@@ -25,7 +25,6 @@
 #include <string.h>
 #include <libgen.h>
 #include <assert.h>
-#include <zlib.h>
 
 #include "little_endian.h"
 #include "system4.h"
@@ -35,6 +34,8 @@
 #include "system4/instructions.h"
 #include "system4/mt19937int.h"
 #include "system4/string.h"
+#include "system4/trace.h"
+#include "compression.h"
 
 struct func_list {
 	int nr_slots;
@@ -91,14 +92,9 @@ static void init_struct_ht(struct ain *ain)
 	}
 }
 
-static intptr_t string_ht_get(struct ain *ain, const char *str)
+static intptr_t string_ht_add(struct hash_table *ht, const char *str, intptr_t i)
 {
-	return (intptr_t)ht_get(ain->_string_ht, str, (void*)-1);
-}
-
-static intptr_t string_ht_add(struct ain *ain, const char *str, intptr_t i)
-{
-	struct ht_slot *kv = ht_put(ain->_string_ht, str, (void*)-1);
+	struct ht_slot *kv = ht_put(ht, str, (void*)-1);
 	if ((intptr_t)kv->value >= 0) {
 		return (intptr_t)kv->value;
 	}
@@ -106,14 +102,25 @@ static intptr_t string_ht_add(struct ain *ain, const char *str, intptr_t i)
 	return i;
 }
 
-static void init_string_ht(struct ain *ain)
+static struct hash_table *build_string_ht(void *user)
 {
-	ain->_string_ht = ht_create(1024);
+	struct ain *ain = user;
+	struct hash_table *ht = ht_create(1024);
 	for (int i = 0; i < ain->nr_strings; i++) {
-		if (string_ht_add(ain, ain->strings[i]->text, i) != i) {
+		if (string_ht_add(ht, ain->strings[i]->text, i) != i) {
 			WARNING("Duplicate string in string table");
 		}
 	}
+	return ht;
+}
+
+/*
+ * The string index is built on first use, which may happen on several
+ * threads at once (see ht_get_or_build).
+ */
+static struct hash_table *string_ht(struct ain *ain)
+{
+	return ht_get_or_build(&ain->_string_ht, build_string_ht, ain, ht_free);
 }
 
 static bool function_is_member_of(char *func_name, char *struct_name)
@@ -179,6 +186,16 @@ void ain_init_member_functions(struct ain *ain, char *(*to_ascii)(const char*))
 	free(enum_names);
 }
 
+/*
+ * Log a name lookup started with sys4_trace_begin (see trace.h).
+ */
+static int trace_lookup(uint64_t t, const char *name, int result)
+{
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_AIN_GET, NULL, result, name, 0, result >= 0);
+	return result;
+}
+
 static struct func_list *get_function(struct ain *ain, const char *name)
 {
 	return ht_get(ain->_func_ht, name, NULL);
@@ -186,6 +203,7 @@ static struct func_list *get_function(struct ain *ain, const char *name)
 
 int ain_get_function(struct ain *ain, char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	size_t len;
 	long n = 0;
 
@@ -205,8 +223,8 @@ int ain_get_function(struct ain *ain, char *name)
 
 	struct func_list *funs = get_function(ain, name);
 	if (!funs || n >= funs->nr_slots)
-		return -1;
-	return funs->slots[n];
+		return trace_lookup(t, name, -1);
+	return trace_lookup(t, name, funs->slots[n]);
 }
 
 int ain_get_function_index(struct ain *ain, struct ain_function *f)
@@ -226,7 +244,8 @@ err:
 
 int ain_get_struct(struct ain *ain, char *name)
 {
-	return (intptr_t)ht_get(ain->_struct_ht, name, (void*)-1);
+	uint64_t t = sys4_trace_begin();
+	return trace_lookup(t, name, (intptr_t)ht_get(ain->_struct_ht, name, (void*)-1));
 }
 
 int ain_add_struct(struct ain *ain, const char *name)
@@ -243,11 +262,12 @@ int ain_add_struct(struct ain *ain, const char *name)
 
 int ain_get_enum(struct ain *ain, char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	for (int i = 0; i < ain->nr_enums; i++) {
 		if (!strcmp(ain->enums[i].name, name))
-			return i;
+			return trace_lookup(t, name, i);
 	}
-	return -1;
+	return trace_lookup(t, name, -1);
 }
 
 int ain_add_global(struct ain *ain, const char *name)
@@ -264,11 +284,12 @@ int ain_add_global(struct ain *ain, const char *name)
 
 int ain_get_global(struct ain *ain, const char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	for (int i = 0; i < ain->nr_globals; i++) {
 		if (!strcmp(ain->globals[i].name, name))
-			return i;
+			return trace_lookup(t, name, i);
 	}
-	return -1;
+	return trace_lookup(t, name, -1);
 }
 
 int ain_add_initval(struct ain *ain, int global_index)
@@ -370,11 +391,12 @@ int ain_add_functype(struct ain *ain, const char *name)
 
 int ain_get_functype(struct ain *ain, const char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	for (int i = 0; i < ain->nr_function_types; i++) {
 		if (!strcmp(ain->function_types[i].name, name))
-			return i;
+			return trace_lookup(t, name, i);
 	}
-	return -1;
+	return trace_lookup(t, name, -1);
 }
 
 int ain_add_delegate(struct ain *ain, const char *name)
@@ -389,18 +411,21 @@ int ain_add_delegate(struct ain *ain, const char *name)
 
 int ain_get_delegate(struct ain *ain, const char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	for (int i = 0; i < ain->nr_delegates; i++) {
 		if (!strcmp(ain->delegates[i].name, name))
-			return i;
+			return trace_lookup(t, name, i);
 	}
-	return -1;
+	return trace_lookup(t, name, -1);
 }
 
+/*
+ * Modifies the shared string index, so unlike ain_get_string_no this must
+ * not be called while other threads are using `ain`.
+ */
 int ain_add_string(struct ain *ain, const char *str)
 {
-	if (!ain->_string_ht)
-		init_string_ht(ain);
-	int i = string_ht_add(ain, str, ain->nr_strings);
+	int i = string_ht_add(string_ht(ain), str, ain->nr_strings);
 	if (i == ain->nr_strings) {
 		ain->strings = xrealloc_array(ain->strings, ain->nr_strings, ain->nr_strings+1, sizeof(struct string*));
 		ain->strings[ain->nr_strings++] = make_string(str, strlen(str));
@@ -410,9 +435,8 @@ int ain_add_string(struct ain *ain, const char *str)
 
 int ain_get_string_no(struct ain *ain, const char *str)
 {
-	if (!ain->_string_ht)
-		init_string_ht(ain);
-	return string_ht_get(ain, str);
+	uint64_t t = sys4_trace_begin();
+	return trace_lookup(t, str, (intptr_t)ht_get(string_ht(ain), str, (void*)-1));
 }
 
 int ain_add_message(struct ain *ain, const char *str)
@@ -450,22 +474,24 @@ int ain_add_library(struct ain *ain, const char *name)
 
 int ain_get_library(struct ain *ain, const char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	for (int i = 0; i < ain->nr_libraries; i++) {
 		if (!strcmp(ain->libraries[i].name, name))
-			return i;
+			return trace_lookup(t, name, i);
 	}
-	return -1;
+	return trace_lookup(t, name, -1);
 }
 
 int ain_get_library_function(struct ain *ain, int libno, const char *name)
 {
+	uint64_t t = sys4_trace_begin();
 	assert(libno < ain->nr_libraries);
 	struct ain_library *lib = &ain->libraries[libno];
 	for (int i = 0; i < lib->nr_functions; i++) {
 		if (!strcmp(lib->functions[i].name, name))
-			return i;
+			return trace_lookup(t, name, i);
 	}
-	return -1;
+	return trace_lookup(t, name, -1);
 }
 
 static const char *errtab[AIN_MAX_ERROR] = {
@@ -1256,19 +1282,15 @@ static uint8_t *decompress_ain(uint8_t *in, long *len)
 		return NULL;
 
 	out = xmalloc(out_len);
-	int r = uncompress(out, (unsigned long*)&out_len, in+16, in_len);
-	if (r != Z_OK) {
-		if (r == Z_BUF_ERROR)
-			WARNING("uncompress failed: Z_BUF_ERROR");
-		else if (r == Z_MEM_ERROR)
-			WARNING("uncompress failed: Z_MEM_ERROR");
-		else if (r == Z_DATA_ERROR)
-			WARNING("uncompress failed: Z_DATA_ERROR");
+	size_t size = out_len;
+	enum sys4_z_status r = sys4_inflate(out, &size, in+16, in_len);
+	if (r != SYS4_Z_OK) {
+		WARNING("uncompress failed: %s", sys4_z_strerror(r));
 		free(out);
 		return NULL;
 	}
 
-	*len = out_len;
+	*len = size;
 	return out;
 }
 
@@ -0,0 +1,487 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/ain_search.h"
+#include "system4/buffer.h"
+#include "system4/string.h"
+#include "system4/utfsjis.h"
+#include "kvec.h"
+#include "thread_pool.h"
+
+/*
+ * Texts are numbered messages first, then strings. Grams are made of
+ * characters rather than bytes: in UTF-8 Japanese text, byte trigrams mostly
+ * amount to single characters, which are far too common to narrow a search
+ * down. Single characters are indexed as well, since one-character queries
+ * are common in Japanese. All grams share one 32-bit key space (a trigram key
+ * is a hash); a collision only adds candidates, which are checked anyway.
+ */
+#define TEXTS_PER_JOB 1024
+
+// don't intersect with lists this many times longer than the candidate set;
+// checking the candidates is cheaper
+#define INTERSECT_RATIO 32
+
+struct ain_search {
+	uint32_t nr_messages;
+	uint32_t nr_texts;
+	// texts, NUL-terminated, back to back
+	char *text;
+	size_t *text_off;
+	// gram directory, sorted by key
+	uint32_t nr_grams;
+	uint32_t *keys;
+	uint32_t *counts;
+	size_t *postings_off;
+	// delta-encoded text numbers
+	uint8_t *postings;
+	size_t postings_size;
+};
+
+struct search_job {
+	struct ain *ain;
+	uint32_t nr_texts;
+	struct search_chunk *chunks;
+};
+
+// the texts of one job, and the (key << 32 | text) pairs of their grams
+struct search_chunk {
+	uint32_t nr_texts;
+	struct buffer text;
+	size_t *text_len;
+	kvec_t(uint64_t) pairs;
+};
+
+static uint32_t bigram_key(uint32_t c0, uint32_t c1)
+{
+	return c0 << 16 ^ c1;
+}
+
+static uint32_t trigram_key(uint32_t c0, uint32_t c1, uint32_t c2)
+{
+	uint32_t h = c0 * 0x9e3779b1u;
+	h = (h ^ c1) * 0x85ebca77u;
+	h = (h ^ c2) * 0xc2b2ae3du;
+	return h ^ h >> 15;
+}
+
+// decode one UTF-8 character; returns its length, or 0 if it is invalid
+static int utf8_char(const uint8_t *s, size_t len, uint32_t *c)
+{
+	int n;
+	if (s[0] < 0x80) {
+		*c = s[0];
+		return 1;
+	} else if ((s[0] & 0xe0) == 0xc0) {
+		*c = s[0] & 0x1f;
+		n = 2;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		*c = s[0] & 0x0f;
+		n = 3;
+	} else if ((s[0] & 0xf8) == 0xf0) {
+		*c = s[0] & 0x07;
+		n = 4;
+	} else {
+		return 0;
+	}
+	if ((size_t)n > len)
+		return 0;
+	for (int i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		*c = *c << 6 | (s[i] & 0x3f);
+	}
+	return n;
+}
+
+/*
+ * Append the keys of the `n`-grams (n <= 3) of the characters of `s` to
+ * `grams`. Invalid bytes split the text into runs, and grams never span two
+ * runs: a query may start or end in the middle of a character, but the whole
+ * characters inside it are whole characters in every text that contains it.
+ */
+typedef kvec_t(uint32_t) gram_vec;
+static void get_grams(const uint8_t *s, size_t len, int n, gram_vec *grams)
+{
+	uint32_t c[3] = {0};
+	int run = 0;
+	for (size_t i = 0; i < len; ) {
+		int l = utf8_char(s + i, len - i, &c[2]);
+		if (!l) {
+			run = 0;
+			i++;
+			continue;
+		}
+		i += l;
+		if (++run >= n)
+			kv_push(uint32_t, *grams, n == 1 ? c[2] : n == 2 ? bigram_key(c[1], c[2])
+					: trigram_key(c[0], c[1], c[2]));
+		c[0] = c[1];
+		c[1] = c[2];
+	}
+}
+
+static struct string *text_string(struct ain *ain, uint32_t no)
+{
+	if (no < (uint32_t)ain->nr_messages)
+		return ain->messages[no];
+	return ain->strings[no - ain->nr_messages];
+}
+
+static void index_chunk(size_t i, possibly_unused int worker, void *user)
+{
+	struct search_job *job = user;
+	struct search_chunk *chunk = &job->chunks[i];
+	uint32_t first = i * TEXTS_PER_JOB;
+	uint32_t n = min(job->nr_texts - first, TEXTS_PER_JOB);
+
+	chunk->nr_texts = n;
+	buffer_init(&chunk->text, NULL, 0);
+	chunk->text_len = xcalloc(n, sizeof(size_t));
+	kv_init(chunk->pairs);
+
+	gram_vec grams;
+	kv_init(grams);
+	for (uint32_t j = 0; j < n; j++) {
+		struct string *s = text_string(job->ain, first + j);
+		char *utf = s && s->size ? sjis2utf(s->text, s->size) : xstrdup("");
+		size_t len = strlen(utf);
+		buffer_write_bytes(&chunk->text, (uint8_t*)utf, len + 1);
+		chunk->text_len[j] = len;
+
+		kv_size(grams) = 0;
+		for (int k = 1; k <= 3; k++) {
+			get_grams((uint8_t*)utf, len, k, &grams);
+		}
+		// repeated grams are dropped when the posting lists are encoded
+		for (size_t k = 0; k < kv_size(grams); k++) {
+			kv_push(uint64_t, chunk->pairs, (uint64_t)kv_A(grams, k) << 32 | (first + j));
+		}
+		free(utf);
+	}
+	kv_destroy(grams);
+}
+
+/*
+ * Stable radix sort on the key (high) half of the pairs. Since the pairs are
+ * generated in text order, the texts of each gram stay sorted. The pairs are
+ * first distributed by the top byte of their key, then every bucket is sorted
+ * on the lower bytes (LSD) in parallel.
+ */
+struct sort_job {
+	uint64_t *pairs;
+	uint64_t *tmp;
+	size_t bucket[257];
+};
+
+static void radix_pass(const uint64_t *src, uint64_t *dst, size_t n, int shift, size_t *count)
+{
+	memset(count, 0, 257 * sizeof(size_t));
+	for (size_t i = 0; i < n; i++) {
+		count[((src[i] >> shift) & 0xff) + 1]++;
+	}
+	for (int b = 0; b < 256; b++) {
+		count[b + 1] += count[b];
+	}
+	for (size_t i = 0; i < n; i++) {
+		dst[count[(src[i] >> shift) & 0xff]++] = src[i];
+	}
+}
+
+static void sort_bucket(size_t i, possibly_unused int worker, void *user)
+{
+	struct sort_job *job = user;
+	size_t first = job->bucket[i];
+	size_t n = job->bucket[i + 1] - first;
+	size_t count[257];
+	// tmp -> pairs -> tmp -> pairs
+	radix_pass(job->tmp + first, job->pairs + first, n, 32, count);
+	radix_pass(job->pairs + first, job->tmp + first, n, 40, count);
+	radix_pass(job->tmp + first, job->pairs + first, n, 48, count);
+}
+
+static void sort_pairs(uint64_t *pairs, size_t n, int nr_threads)
+{
+	struct sort_job job = {
+		.pairs = pairs,
+		.tmp = xmalloc((n + 1) * sizeof(uint64_t)),
+	};
+	radix_pass(pairs, job.tmp, n, 56, job.bucket);
+	// radix_pass leaves the end of every bucket in its slot
+	memmove(job.bucket + 1, job.bucket, 256 * sizeof(size_t));
+	job.bucket[0] = 0;
+	parallel_for(nr_threads, 256, sort_bucket, &job);
+	free(job.tmp);
+}
+
+static void put_varint(struct buffer *b, uint32_t v)
+{
+	while (v >= 0x80) {
+		buffer_write_int8(b, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	buffer_write_int8(b, v);
+}
+
+static uint32_t get_varint(const uint8_t **p)
+{
+	uint32_t v = 0;
+	for (int shift = 0; ; shift += 7) {
+		uint8_t c = *(*p)++;
+		v |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return v;
+	}
+}
+
+struct ain_search *ain_search_create(struct ain *ain, int nr_threads)
+{
+	struct ain_search *s = xcalloc(1, sizeof(struct ain_search));
+	s->nr_messages = max(ain->nr_messages, 0);
+	s->nr_texts = s->nr_messages + max(ain->nr_strings, 0);
+
+	// convert the texts and collect their grams, in parallel
+	size_t nr_chunks = (s->nr_texts + TEXTS_PER_JOB - 1) / TEXTS_PER_JOB;
+	struct search_job job = {
+		.ain = ain,
+		.nr_texts = s->nr_texts,
+		.chunks = xcalloc(nr_chunks + 1, sizeof(struct search_chunk)),
+	};
+	parallel_for(nr_threads, nr_chunks, index_chunk, &job);
+
+	size_t text_size = 0, nr_pairs = 0;
+	for (size_t i = 0; i < nr_chunks; i++) {
+		text_size += job.chunks[i].text.index;
+		nr_pairs += kv_size(job.chunks[i].pairs);
+	}
+	s->text = xmalloc(text_size + 1);
+	s->text_off = xcalloc(s->nr_texts + 1, sizeof(size_t));
+	uint64_t *pairs = xmalloc((nr_pairs + 1) * sizeof(uint64_t));
+	size_t text_pos = 0, pair_pos = 0;
+	uint32_t no = 0;
+	for (size_t i = 0; i < nr_chunks; i++) {
+		struct search_chunk *chunk = &job.chunks[i];
+		memcpy(s->text + text_pos, chunk->text.buf, chunk->text.index);
+		for (uint32_t j = 0; j < chunk->nr_texts; j++) {
+			s->text_off[no++] = text_pos;
+			text_pos += chunk->text_len[j] + 1;
+		}
+		memcpy(pairs + pair_pos, chunk->pairs.a, kv_size(chunk->pairs) * sizeof(uint64_t));
+		pair_pos += kv_size(chunk->pairs);
+		free(chunk->text.buf);
+		free(chunk->text_len);
+		kv_destroy(chunk->pairs);
+	}
+	s->text_off[s->nr_texts] = text_pos;
+	free(job.chunks);
+
+	// group the pairs by gram and encode the posting lists
+	sort_pairs(pairs, nr_pairs, nr_threads);
+	for (size_t i = 0; i < nr_pairs; i++) {
+		if (!i || pairs[i] >> 32 != pairs[i-1] >> 32)
+			s->nr_grams++;
+	}
+	s->keys = xcalloc(s->nr_grams + 1, sizeof(uint32_t));
+	s->counts = xcalloc(s->nr_grams + 1, sizeof(uint32_t));
+	s->postings_off = xcalloc(s->nr_grams + 1, sizeof(size_t));
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	uint32_t g = 0, prev = 0;
+	for (size_t i = 0; i < nr_pairs; i++) {
+		uint32_t key = pairs[i] >> 32;
+		uint32_t text = (uint32_t)pairs[i];
+		if (!i || key != s->keys[g - 1]) {
+			s->keys[g] = key;
+			s->postings_off[g] = out.index;
+			g++;
+			prev = 0;
+		} else if (text == prev) {
+			continue;
+		}
+		put_varint(&out, text - prev);
+		s->counts[g - 1]++;
+		prev = text;
+	}
+	s->postings_off[s->nr_grams] = out.index;
+	s->postings = out.buf;
+	s->postings_size = out.index;
+	free(pairs);
+	return s;
+}
+
+void ain_search_free(struct ain_search *s)
+{
+	if (!s)
+		return;
+	free(s->text);
+	free(s->text_off);
+	free(s->keys);
+	free(s->counts);
+	free(s->postings_off);
+	free(s->postings);
+	free(s);
+}
+
+const char *ain_search_text(struct ain_search *s, enum ain_search_kind kind, int32_t index)
+{
+	if (index < 0)
+		return NULL;
+	uint32_t no = index;
+	if (kind == AIN_SEARCH_STRING)
+		no += s->nr_messages;
+	else if (no >= s->nr_messages)
+		return NULL;
+	if (no >= s->nr_texts)
+		return NULL;
+	return s->text + s->text_off[no];
+}
+
+static int find_gram(struct ain_search *s, uint32_t key)
+{
+	uint32_t lo = 0, hi = s->nr_grams;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (s->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < s->nr_grams && s->keys[lo] == key ? (int)lo : -1;
+}
+
+// sort the grams of a query (a handful) by the length of their lists
+static void sort_grams(struct ain_search *s, int *grams, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		int g = grams[i];
+		size_t j = i;
+		for (; j > 0 && s->counts[grams[j-1]] > s->counts[g]; j--) {
+			grams[j] = grams[j-1];
+		}
+		grams[j] = g;
+	}
+}
+
+// keep the candidates which are also in the posting list of gram `g`
+static uint32_t intersect(struct ain_search *s, int g, uint32_t *cand, uint32_t nr_cand)
+{
+	const uint8_t *p = s->postings + s->postings_off[g];
+	uint32_t left = s->counts[g] - 1;
+	uint32_t text = get_varint(&p);
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < nr_cand; i++) {
+		while (text < cand[i] && left) {
+			text += get_varint(&p);
+			left--;
+		}
+		if (text == cand[i])
+			cand[n++] = cand[i];
+		else if (text < cand[i])
+			break; // end of the list
+	}
+	return n;
+}
+
+static bool matches(struct ain_search *s, uint32_t no, const char *query, size_t len, int flags)
+{
+	const char *text = s->text + s->text_off[no];
+	if (flags & AIN_SEARCH_PREFIX)
+		return !strncmp(text, query, len);
+	return strstr(text, query);
+}
+
+struct ain_search_result *ain_search_find(struct ain_search *s, const char *query, int flags,
+		size_t *nr_results)
+{
+	*nr_results = 0;
+	uint32_t first = 0, end = s->nr_texts;
+	if ((flags & (AIN_SEARCH_MESSAGES | AIN_SEARCH_STRINGS)) == AIN_SEARCH_MESSAGES)
+		end = s->nr_messages;
+	else if ((flags & (AIN_SEARCH_MESSAGES | AIN_SEARCH_STRINGS)) == AIN_SEARCH_STRINGS)
+		first = s->nr_messages;
+
+	size_t len = strlen(query);
+	gram_vec keys;
+	kv_init(keys);
+	// the longest grams available
+	for (int k = 3; k > 0 && !kv_size(keys); k--) {
+		get_grams((const uint8_t*)query, len, k, &keys);
+	}
+
+	uint32_t *cand = NULL;
+	uint32_t nr_cand = 0;
+	if (!kv_size(keys)) {
+		// nothing to look up: check every text
+		cand = xmalloc((end - first + 1) * sizeof(uint32_t));
+		for (uint32_t no = first; no < end; no++) {
+			cand[nr_cand++] = no;
+		}
+	} else {
+		size_t nr_grams = kv_size(keys);
+		int *grams = xmalloc(nr_grams * sizeof(int));
+		for (size_t i = 0; i < nr_grams; i++) {
+			if ((grams[i] = find_gram(s, kv_A(keys, i))) < 0) {
+				free(grams);
+				kv_destroy(keys);
+				return NULL;
+			}
+		}
+		sort_grams(s, grams, nr_grams);
+
+		// decode the rarest list, then narrow it down with the others
+		uint32_t count = s->counts[grams[0]];
+		const uint8_t *p = s->postings + s->postings_off[grams[0]];
+		cand = xmalloc((count + 1) * sizeof(uint32_t));
+		for (uint32_t i = 0, text = 0; i < count; i++) {
+			text += get_varint(&p);
+			if (text >= first && text < end)
+				cand[nr_cand++] = text;
+		}
+		for (size_t i = 1; i < nr_grams && nr_cand; i++) {
+			if (s->counts[grams[i]] / INTERSECT_RATIO > nr_cand)
+				break;
+			nr_cand = intersect(s, grams[i], cand, nr_cand);
+		}
+		free(grams);
+	}
+	kv_destroy(keys);
+
+	struct ain_search_result *results = NULL;
+	size_t n = 0;
+	for (uint32_t i = 0; i < nr_cand; i++) {
+		if (!matches(s, cand[i], query, len, flags))
+			continue;
+		if (!results)
+			results = xmalloc((nr_cand - i) * sizeof(struct ain_search_result));
+		if (cand[i] < s->nr_messages) {
+			results[n].kind = AIN_SEARCH_MESSAGE;
+			results[n].index = cand[i];
+		} else {
+			results[n].kind = AIN_SEARCH_STRING;
+			results[n].index = cand[i] - s->nr_messages;
+		}
+		n++;
+	}
+	free(cand);
+	*nr_results = n;
+	return results;
+}
@@ -19,12 +19,14 @@
 #include <string.h>
 #include <turbojpeg.h>
 #include <webp/decode.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/pms.h"
 #include "system4/webp.h"
+#include "coverage.h"
+#include "compression.h"
 
 bool ajp_checkfmt(const uint8_t *data)
 {
@@ -98,14 +100,15 @@ static uint8_t *read_mask(uint8_t *pixels, uint8_t *mask_data, struct ajp_header
 		return mask;
 	} else if (mask_data[0] == 0x78) {
 		// compressed
-		unsigned long uncompressed_size = ajp->width * ajp->height;
+		size_t uncompressed_size = (size_t)ajp->width * ajp->height;
 		uint8_t *mask = xmalloc(uncompressed_size);
-		if (uncompress(mask, &uncompressed_size, mask_data, ajp->mask_size) != Z_OK) {
-			WARNING("uncompress failed");
+		enum sys4_z_status r = sys4_inflate_exact(mask, uncompressed_size, mask_data, ajp->mask_size);
+		if (r == SYS4_Z_SHORT) {
+			WARNING("Unexpected AJP mask size");
+		} else if (r != SYS4_Z_OK) {
+			WARNING("uncompress failed: %s", sys4_z_strerror(r));
 			free(mask);
 			return NULL;
-		} else if (uncompressed_size != (unsigned)ajp->width * (unsigned)ajp->height) {
-			WARNING("Unexpected AJP mask size");
 		}
 		return mask;
 	}
@@ -116,22 +119,34 @@ static uint8_t *read_mask(uint8_t *pixels, uint8_t *mask_data, struct ajp_header
 	return NULL;
 }
 
-static uint8_t *load_mask(uint8_t *pixels, uint8_t *mask_data, struct ajp_header *ajp)
+static uint8_t *load_mask(uint8_t *pixels, uint8_t *mask_data, struct ajp_header *ajp,
+		struct cg_coverage *coverage)
 {
+	struct coverage_builder cov;
 	uint8_t *mask = read_mask(pixels, mask_data, ajp);
-	if (!mask) {
+	bool has_mask = mask;
+	if (has_mask) {
+		coverage_begin(&cov, coverage, ajp->width, ajp->height);
+	} else {
 		mask = xmalloc(ajp->width * ajp->height);
 		memset(mask, 0xFF, ajp->width * ajp->height);
+		coverage_set_opaque(coverage, ajp->width, ajp->height);
 	}
 
-	uint8_t *out = xmalloc(ajp->width * ajp->height * 4);
-	for (int i = 0; i < ajp->width * ajp->height; i++) {
-		out[i*4+0] = pixels[i*3+0];
-		out[i*4+1] = pixels[i*3+1];
-		out[i*4+2] = pixels[i*3+2];
-		out[i*4+3] = mask[i];
+	uint8_t *out = cg_pool_alloc(ajp->width * ajp->height * 4);
+	for (int i = 0, y = 0; y < ajp->height; y++) {
+		for (int x = 0; x < ajp->width; x++, i++) {
+			out[i*4+0] = pixels[i*3+0];
+			out[i*4+1] = pixels[i*3+1];
+			out[i*4+2] = pixels[i*3+2];
+			out[i*4+3] = mask[i];
+		}
+		if (has_mask)
+			coverage_add_row(&cov, mask + i - ajp->width, 1);
 	}
-	free(pixels);
+	if (has_mask)
+		coverage_end(&cov);
+	cg_pool_free(pixels);
 	free(mask);
 	return out;
 }
@@ -175,17 +190,18 @@ void ajp_extract(const uint8_t *data, size_t size, struct cg *cg)
 	if ((uint32_t)height != ajp.height)
 		WARNING("AJP height doesn't match JPEG height (%d vs. %u)", height, ajp.height);
 
-	buf = xmalloc(width * height * 3);
+	buf = cg_pool_alloc(width * height * 3);
 	if (tjDecompress2(decompressor, jpeg_data, ajp.jpeg_size, buf, width, 0, height, TJPF_RGB, TJFLAG_FASTDCT) < 0) {
 		WARNING("JPEG decompression failed: %s", tjGetErrorStr());
-		free(buf);
+		cg_pool_free(buf);
 		goto cleanup;
 	}
 
-	buf = load_mask(buf, mask_data, &ajp);
+	buf = load_mask(buf, mask_data, &ajp, &cg->coverage);
 
 	cg->type = ALCG_AJP;
 	cg->pixels = buf;
+	cg->pooled = true;
 
 cleanup:
 	free(jpeg_data);
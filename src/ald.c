@@ -28,11 +28,13 @@
 #include "system4.h"
 #include "system4/ald.h"
 #include "system4/file.h"
+#include "archive_io.h"
 
 static bool ald_exists(struct archive *ar, int no);
 static struct archive_data *ald_get(struct archive *ar, int no);
 static struct archive_data *ald_get_by_name(struct archive *_ar, const char *name);
 static bool ald_load_file(struct archive_data *data);
+static bool ald_get_extent(struct archive_data *data, struct archive_extent *out);
 static struct archive_data *ald_copy_descriptor(struct archive_data *src);
 static void ald_for_each(struct archive *_ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void ald_free_data(struct archive_data *data);
@@ -44,6 +46,8 @@ struct archive_ops ald_archive_ops = {
 	.get_by_name = ald_get_by_name,
 	.get_by_basename = NULL,
 	.load_file = ald_load_file,
+	.load_files = NULL,
+	.get_extent = ald_get_extent,
 	.release_file = NULL,
 	.copy_descriptor = ald_copy_descriptor,
 	.for_each = ald_for_each,
@@ -295,11 +299,32 @@ static bool ald_load_file(struct archive_data *data)
 	} else {
 		FILE *fp = ar->files[dfile->disk].fp;
 		data->data = xmalloc(data->size);
+		if (!archive_pread(fileno(fp), data->data, data->size, dfile->dataptr + dfile->hdr_size)) {
+			WARNING("Failed to read '%s'", ar->files[dfile->disk].name);
+			free(data->data);
+			data->data = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool ald_get_extent(struct archive_data *data, struct archive_extent *out)
+{
+	struct ald_archive *ar = (struct ald_archive*)data->archive;
+	struct ald_archive_data *dfile = (struct ald_archive_data*)data;
 
-		fseek(fp, dfile->dataptr + dfile->hdr_size, SEEK_SET);
-		fread(data->data, data->size, 1, fp);
+	out->off = dfile->dataptr + dfile->hdr_size;
+	out->size = data->size;
+	out->compression = ARCHIVE_STORED;
+	if (data->archive->mmapped) {
+		out->fd = -1;
+		out->ptr = ar->files[dfile->disk].data + out->off;
+	} else {
+		out->fd = fileno(ar->files[dfile->disk].fp);
+		out->ptr = NULL;
 	}
-	return data;
+	return true;
 }
 
 static struct archive_data *ald_copy_descriptor(struct archive_data *_src)
@@ -424,8 +449,15 @@ struct archive *ald_open_conv(char **files, int count, int flags, int *error, ch
 		c++;
 	}
 	ar->ar.mmapped = flags & ARCHIVE_MMAP;
+	ar->ar.io_uring = flags & ARCHIVE_IO_URING;
 	ar->nr_files = count;
 	ar->ar.ops = &ald_archive_ops;
+	for (int i = 0; i < count; i++) {
+		if (files[i]) {
+			_sys4_trace_archive_open(&ar->ar, files[i]);
+			break;
+		}
+	}
 	return &ar->ar;
 exit_err:
 	free(ar);
@@ -19,17 +19,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <unistd.h>
-#include <fcntl.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/archive.h"
 #include "system4/alk.h"
-#include "system4/file.h"
+#include "archive_io.h"
 
 static bool alk_exists(struct archive *ar, int no);
 static struct archive_data *alk_get(struct archive *ar, int no);
 static bool alk_load_file(struct archive_data *data);
+static bool alk_get_extent(struct archive_data *data, struct archive_extent *out);
 static void alk_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void alk_free_data(struct archive_data *data);
 static void alk_free(struct archive *_ar);
@@ -40,6 +39,8 @@ struct archive_ops alk_archive_ops = {
 	.get_by_name = NULL,
 	.get_by_basename = NULL,
 	.load_file = alk_load_file,
+	.load_files = NULL,
+	.get_extent = alk_get_extent,
 	.release_file = NULL,
 	.copy_descriptor = NULL,
 	.for_each = alk_for_each,
@@ -64,14 +65,12 @@ static bool alk_load_file(struct archive_data *data)
 	struct alk_entry *e = &ar->files[data->no];
 
 	if (ar->ar.mmapped) {
-		data->data = (uint8_t*)ar->mmap_ptr + e->off;
+		data->data = ar->file.map + e->off;
 		return true;
 	}
 
-	fseek(ar->f, e->off, SEEK_SET);
-
 	data->data = xmalloc(e->size);
-	if (fread(data->data, e->size, 1, ar->f) != 1) {
+	if (!archive_file_read(&ar->file, data->data, e->size, e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(data->data);
 		data->data = NULL;
@@ -81,6 +80,24 @@ static bool alk_load_file(struct archive_data *data)
 	return true;
 }
 
+static bool alk_get_extent(struct archive_data *data, struct archive_extent *out)
+{
+	struct alk_archive *ar = (struct alk_archive*)data->archive;
+	struct alk_entry *e = &ar->files[data->no];
+
+	out->off = e->off;
+	out->size = e->size;
+	out->compression = ARCHIVE_STORED;
+	if (ar->ar.mmapped) {
+		out->fd = -1;
+		out->ptr = ar->file.map + e->off;
+	} else {
+		out->fd = ar->file.fd;
+		out->ptr = NULL;
+	}
+	return true;
+}
+
 static struct archive_data *alk_get_descriptor(struct archive *_ar, int no)
 {
 	struct alk_archive *ar = (struct alk_archive*)_ar;
@@ -133,87 +150,64 @@ static void alk_free_data(struct archive_data *data)
 static void alk_free(struct archive *_ar)
 {
 	struct alk_archive *ar = (struct alk_archive*)_ar;
-	if (ar->mmap_ptr)
-		munmap(ar->mmap_ptr, ar->file_size);
-	if (ar->f)
-		fclose(ar->f);
+	archive_file_close(&ar->file);
 	free(ar->files);
 	free(ar->filename);
 	free(ar);
 }
 
-static bool alk_read_header(FILE *f, struct alk_archive *ar, int *error)
+static bool alk_read_header(struct alk_archive *ar, int *error)
 {
 	uint8_t buf[8];
-	if (fread(buf, 8, 1, f) != 1) {
+	const uint8_t *p = archive_file_view(&ar->file, buf, 8, 0);
+	if (!p) {
 		*error = ARCHIVE_FILE_ERROR;
 		return false;
 	}
 
-	if (memcmp(buf, "ALK0", 4)) {
+	if (memcmp(p, "ALK0", 4)) {
+		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+		return false;
+	}
+	ar->nr_files = LittleEndian_getDW(p, 4);
+	if (ar->nr_files < 0 || (uint64_t)ar->nr_files * 8 + 8 > ar->file.size) {
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
 	}
-	ar->nr_files = LittleEndian_getDW(buf, 4);
+
+	// read the whole table at once
+	size_t table_size = ar->nr_files * 8;
+	uint8_t *table_buf = ar->ar.mmapped ? NULL : xmalloc(table_size);
+	const uint8_t *table = archive_file_view(&ar->file, table_buf, table_size, 8);
+	if (!table) {
+		free(table_buf);
+		*error = ARCHIVE_FILE_ERROR;
+		return false;
+	}
 	ar->files = xcalloc(ar->nr_files, sizeof(struct alk_entry));
 	for (int i = 0; i < ar->nr_files; i++) {
-		if (fread(buf, 8, 1, f) != 1) {
-			*error = ARCHIVE_FILE_ERROR;
-			return false;
-		}
-		ar->files[i].off = LittleEndian_getDW(buf, 0);
-		ar->files[i].size = LittleEndian_getDW(buf, 4);
+		ar->files[i].off = LittleEndian_getDW(table, i * 8);
+		ar->files[i].size = LittleEndian_getDW(table, i * 8 + 4);
 	}
-
-	fseek(f, 0, SEEK_END);
-	ar->file_size = ftell(f);
+	free(table_buf);
 	return true;
 }
 
 struct alk_archive *alk_open(const char *file, int flags, int *error)
 {
-#ifdef _WIN32
-	flags &= ~ARCHIVE_MMAP;
-#endif
-	FILE *fp;
 	struct alk_archive *ar = xcalloc(1, sizeof(struct alk_archive));
-
-	if (!(fp = file_open_utf8(file, "rb"))) {
-		WARNING("fopen failed: %s", strerror(errno));
-		*error = ARCHIVE_FILE_ERROR;
+	if (!archive_file_open(&ar->file, file, flags, error))
 		goto exit_err;
-	}
-	if (!alk_read_header(fp, ar, error)) {
+	ar->ar.mmapped = !!ar->file.map;
+	if (!alk_read_header(ar, error)) {
 		WARNING("alk_read_header failed");
-		fclose(fp);
+		archive_file_close(&ar->file);
 		goto exit_err;
 	}
-	if (flags & ARCHIVE_MMAP) {
-		if (fclose(fp)) {
-			WARNING("fclose failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-
-		int fd = open(file, O_RDONLY);
-		if (fd < 0) {
-			WARNING("open failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-		ar->mmap_ptr = mmap(0, ar->file_size, PROT_READ, MAP_SHARED, fd, 0);
-		close(fd);
-		if (ar->mmap_ptr == MAP_FAILED) {
-			WARNING("mmap failed: %s", strerror(errno));
-			*error = ARCHIVE_FILE_ERROR;
-			goto exit_err;
-		}
-		ar->ar.mmapped = true;
-	} else {
-		ar->f = fp;
-	}
 	ar->filename = strdup(file);
+	ar->ar.io_uring = flags & ARCHIVE_IO_URING;
 	ar->ar.ops = &alk_archive_ops;
+	_sys4_trace_archive_open(&ar->ar, file);
 	return ar;
 exit_err:
 	free(ar);
@@ -19,6 +19,7 @@
 #include "system4.h"
 #include "system4/ald.h"
 #include "system4/utfsjis.h"
+#include "archive_io.h"
 
 static const char *errtab[ARCHIVE_MAX_ERROR] = {
 	[ARCHIVE_SUCCESS]           = "Success",
@@ -41,6 +42,59 @@ void _archive_release_file(struct archive_data *data)
 	data->data = NULL;
 }
 
+/*
+ * Default implementation for `archive_load_files`.
+ * Archives which store file data verbatim only need to implement `get_extent`
+ * to benefit from batched reads.
+ */
+bool _archive_load_files(struct archive_data **files, size_t n)
+{
+	struct archive *ar = files[0]->archive;
+	if (ar->mmapped || !ar->ops->get_extent) {
+		bool ok = true;
+		for (size_t i = 0; i < n; i++) {
+			ok = archive_load_file(files[i]) && ok;
+		}
+		return ok;
+	}
+
+	bool ok = true;
+	size_t nr_reqs = 0;
+	struct archive_read_req *reqs = xcalloc(n, sizeof(struct archive_read_req));
+	struct archive_data **req_files = xcalloc(n, sizeof(struct archive_data*));
+	for (size_t i = 0; i < n; i++) {
+		struct archive_extent e;
+		if (files[i]->data)
+			continue;
+		if (!archive_get_extent(files[i], &e)) {
+			ok = false;
+			continue;
+		}
+		reqs[nr_reqs].fd = e.fd;
+		reqs[nr_reqs].off = e.off;
+		reqs[nr_reqs].size = e.size;
+		reqs[nr_reqs].buf = xmalloc(e.size);
+		req_files[nr_reqs] = files[i];
+		nr_reqs++;
+	}
+
+	archive_read_batch(reqs, nr_reqs, ar->io_uring);
+
+	for (size_t i = 0; i < nr_reqs; i++) {
+		if (!reqs[i].ok) {
+			WARNING("Failed to read '%s'", req_files[i]->name);
+			free(reqs[i].buf);
+			ok = false;
+			continue;
+		}
+		req_files[i]->data = reqs[i].buf;
+	}
+
+	free(reqs);
+	free(req_files);
+	return ok;
+}
+
 /*
  * Default implementation for `archive_copy_descriptor`.
  * If the archive implementation extends the `archive_data` structure,
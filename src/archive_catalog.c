@@ -0,0 +1,1273 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "system4.h"
+#include "system4/aar.h"
+#include "system4/afa.h"
+#include "system4/ald.h"
+#include "system4/alk.h"
+#include "system4/archive.h"
+#include "system4/archive_catalog.h"
+#include "system4/buffer.h"
+#include "system4/dlf.h"
+#include "system4/file.h"
+#include "system4/flat.h"
+#include "system4/trace.h"
+#include "system4/utfsjis.h"
+#include "archive_io.h"
+#include "compression.h"
+#include "hash.h"
+#include "kvec.h"
+#include "little_endian.h"
+#include "thread_pool.h"
+
+/*
+ * Catalog file layout (little endian):
+ *
+ *     0   "S4AC"
+ *     4   format version
+ *     8   number of files
+ *     12  number of archives
+ *     16  number of entries
+ *     20  number of hash slots
+ *     24  size of the string table
+ *     28  reserved
+ *     32  file records, archive records, entry records, name hash slots,
+ *         basename hash slots (u32 each), string table
+ *
+ * file:    path, archive, volume, reserved, size (u64), mtime (i64)
+ * archive: name, format, first file, nr files, first entry, nr entries,
+ *          first slot, nr slots
+ * entry:   off (u64), size (u64), name, key, basename, archive, file, no,
+ *          compression, reserved
+ *
+ * Strings are offsets into the string table (paths are relative to the game
+ * directory). Files that look like archives but were left out (because they
+ * couldn't be opened, or are duplicate or out of range ALD volumes) come
+ * after the files of the archives, with archive = CATALOG_NO_ARCHIVE, so that
+ * the whole directory listing can be checked for changes. An archive's files
+ * are contiguous and ordered by volume, and
+ * its entries are contiguous and ordered by number. Each archive has its own
+ * pair of open-addressed hash tables, a power of two in size, whose slots
+ * hold entry index + 1 (0 = empty).
+ */
+#define CATALOG_MAGIC "S4AC"
+#define CATALOG_VERSION 2
+#define CATALOG_HEADER_SIZE 32
+#define CATALOG_FILE_SIZE 32
+#define CATALOG_ARCHIVE_SIZE 32
+#define CATALOG_ENTRY_SIZE 48
+
+// u32 fields of the records
+enum { FILE_PATH, FILE_ARCHIVE, FILE_VOLUME };
+enum { AR_NAME, AR_FORMAT, AR_FIRST_FILE, AR_NR_FILES, AR_FIRST_ENTRY, AR_NR_ENTRIES,
+	AR_FIRST_SLOT, AR_NR_SLOTS };
+enum { ENT_NAME = 4, ENT_KEY, ENT_BASENAME, ENT_ARCHIVE, ENT_FILE, ENT_NO, ENT_COMPRESSION };
+
+// ALD volumes are lettered A-Z
+#define MAX_VOLUMES 26
+
+// archive of the file records of skipped files
+#define CATALOG_NO_ARCHIVE UINT32_MAX
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)LittleEndian_getDW(p, 0);
+}
+
+static inline uint64_t get_u64(const uint8_t *p)
+{
+	return get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void buffer_write_int64(struct buffer *b, uint64_t v)
+{
+	buffer_write_int32(b, v);
+	buffer_write_int32(b, v >> 32);
+}
+
+static uint32_t slot_hash(const char *key)
+{
+	return hash64(key, strlen(key), 0);
+}
+
+static char *name_key(const char *name)
+{
+	char *key = xstrdup(name);
+	sjis_normalize_path(key);
+	return key;
+}
+
+/*
+ * Directory scanning.
+ */
+
+struct dir_file {
+	char *name;
+	uint64_t size;
+	int64_t mtime;
+	enum archive_catalog_format format;
+};
+
+typedef kvec_t(struct dir_file) dir_list;
+
+static bool format_from_name(const char *name, enum archive_catalog_format *out)
+{
+	static const struct {
+		const char *ext;
+		enum archive_catalog_format format;
+	} exts[] = {
+		{ "afa", CATALOG_AFA },
+		{ "aar", CATALOG_AAR },
+		{ "ald", CATALOG_ALD },
+		{ "alk", CATALOG_ALK },
+		{ "dlf", CATALOG_DLF },
+		{ "flat", CATALOG_FLAT },
+	};
+	const char *ext = file_extension(name);
+	if (!ext)
+		return false;
+	for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+		if (!strcasecmp(ext, exts[i].ext)) {
+			*out = exts[i].format;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int dir_file_cmp(const void *_a, const void *_b)
+{
+	const struct dir_file *a = _a;
+	const struct dir_file *b = _b;
+	return strcmp(a->name, b->name);
+}
+
+static void dir_list_free(dir_list *list)
+{
+	for (size_t i = 0; i < kv_size(*list); i++) {
+		free(kv_A(*list, i).name);
+	}
+	kv_destroy(*list);
+}
+
+/*
+ * List the archives directly inside `dir`, sorted by name.
+ */
+static bool scan_dir(const char *dir, dir_list *out)
+{
+	kv_init(*out);
+	UDIR *d = opendir_utf8(dir);
+	if (!d) {
+		WARNING("Failed to open directory '%s': %s", dir, strerror(errno));
+		return false;
+	}
+
+	char *name;
+	while ((name = readdir_utf8(d))) {
+		struct dir_file f = { .name = name };
+		if (!format_from_name(name, &f.format)) {
+			free(name);
+			continue;
+		}
+		char *path = path_join(dir, name);
+		ustat s;
+		if (stat_utf8(path, &s) || !S_ISREG(s.st_mode)) {
+			free(path);
+			free(name);
+			continue;
+		}
+		free(path);
+		f.size = s.st_size;
+		f.mtime = s.st_mtime;
+		kv_push(struct dir_file, *out, f);
+	}
+	closedir_utf8(d);
+
+	qsort(out->a, kv_size(*out), sizeof(struct dir_file), dir_file_cmp);
+	return true;
+}
+
+/*
+ * Split an ALD file name into its set name and volume number. Names without
+ * a volume letter form a set of their own.
+ */
+static char *ald_set_name(const char *name, int *volume)
+{
+	const char *ext = file_extension(name);
+	size_t stem_len = ext - 1 - name;
+	*volume = 0;
+	if (stem_len < 2 || !isalpha((unsigned char)name[stem_len-1]))
+		return xstrdup(name);
+	*volume = toupper((unsigned char)name[stem_len-1]) - 'A';
+	char *set = xmalloc(strlen(name));
+	memcpy(set, name, stem_len - 1);
+	strcpy(set + stem_len - 1, ext - 1);
+	return set;
+}
+
+/*
+ * Catalog building.
+ */
+
+struct build_entry {
+	char *name;
+	int no;
+	int volume;
+	uint64_t off;
+	uint64_t size;
+	enum archive_compression compression;
+};
+
+struct build_archive {
+	char *name;
+	enum archive_catalog_format format;
+	int nr_volumes;
+	int files[MAX_VOLUMES];        // index into the directory listing, -1 = missing
+	uint32_t file_no[MAX_VOLUMES]; // file record number
+	kvec_t(struct build_entry) entries;
+	bool ok;
+};
+
+struct build_job {
+	const char *dir;
+	dir_list *list;
+	struct build_archive *archives;
+};
+
+static struct archive *open_archive(const char *dir, dir_list *list, struct build_archive *ba)
+{
+	int error = ARCHIVE_SUCCESS;
+	struct archive *ar = NULL;
+	if (ba->format == CATALOG_ALD) {
+		char *paths[MAX_VOLUMES] = {0};
+		for (int v = 0; v < ba->nr_volumes; v++) {
+			if (ba->files[v] >= 0)
+				paths[v] = path_join(dir, kv_A(*list, ba->files[v]).name);
+		}
+		ar = ald_open(paths, ba->nr_volumes, ARCHIVE_MMAP, &error);
+		for (int v = 0; v < ba->nr_volumes; v++) {
+			free(paths[v]);
+		}
+	} else {
+		char *path = path_join(dir, kv_A(*list, ba->files[0]).name);
+		switch (ba->format) {
+		case CATALOG_AFA: {
+			struct afa_archive *a = afa_open(path, ARCHIVE_MMAP, &error);
+			ar = a ? &a->ar : NULL;
+			break;
+		}
+		case CATALOG_AAR: {
+			struct aar_archive *a = aar_open(path, ARCHIVE_MMAP, &error);
+			ar = a ? &a->ar : NULL;
+			break;
+		}
+		case CATALOG_ALK: {
+			struct alk_archive *a = alk_open(path, ARCHIVE_MMAP, &error);
+			ar = a ? &a->ar : NULL;
+			break;
+		}
+		case CATALOG_DLF: {
+			struct dlf_archive *a = dlf_open(path, ARCHIVE_MMAP, &error);
+			ar = a ? &a->ar : NULL;
+			break;
+		}
+		case CATALOG_FLAT: {
+			struct flat_archive *a = flat_open_file(path, ARCHIVE_MMAP, &error);
+			ar = a ? &a->ar : NULL;
+			break;
+		}
+		case CATALOG_ALD:
+			break;
+		}
+		free(path);
+	}
+	if (!ar)
+		WARNING("Failed to open archive '%s': %s", ba->name, archive_strerror(error));
+	return ar;
+}
+
+static void collect_entry(struct archive_data *data, void *user)
+{
+	struct build_archive *ba = user;
+	struct archive_extent ext;
+	if (!archive_get_extent(data, &ext)) {
+		WARNING("%s: can't locate '%s'", ba->name, data->name ? data->name : "");
+		return;
+	}
+	int volume = 0;
+	if (ba->format == CATALOG_ALD)
+		volume = ((struct ald_archive_data*)data)->disk;
+	if (volume < 0 || volume >= ba->nr_volumes || ba->files[volume] < 0) {
+		WARNING("%s: '%s' is in a missing volume", ba->name, data->name ? data->name : "");
+		return;
+	}
+	struct build_entry e = {
+		.name = xstrdup(data->name ? data->name : ""),
+		.no = data->no,
+		.volume = volume,
+		.off = ext.off,
+		.size = ext.size,
+		.compression = ext.compression,
+	};
+	kv_push(struct build_entry, ba->entries, e);
+}
+
+static int build_entry_cmp(const void *_a, const void *_b)
+{
+	const struct build_entry *a = _a;
+	const struct build_entry *b = _b;
+	return (a->no > b->no) - (a->no < b->no);
+}
+
+static void index_archive(size_t i, possibly_unused int worker, void *user)
+{
+	struct build_job *job = user;
+	struct build_archive *ba = &job->archives[i];
+	struct archive *ar = open_archive(job->dir, job->list, ba);
+	if (!ar)
+		return;
+	archive_for_each(ar, collect_entry, ba);
+	archive_free(ar);
+	qsort(ba->entries.a, kv_size(ba->entries), sizeof(struct build_entry), build_entry_cmp);
+	ba->ok = true;
+}
+
+/*
+ * Group the directory listing into archives (ALD volumes into sets).
+ */
+static size_t group_archives(dir_list *list, struct build_archive *archives)
+{
+	size_t nr_archives = 0;
+	for (size_t i = 0; i < kv_size(*list); i++) {
+		struct dir_file *f = &kv_A(*list, i);
+		int volume = 0;
+		char *name = f->format == CATALOG_ALD ? ald_set_name(f->name, &volume) : xstrdup(f->name);
+		if (volume < 0 || volume >= MAX_VOLUMES) {
+			free(name);
+			continue;
+		}
+
+		struct build_archive *ba = NULL;
+		if (f->format == CATALOG_ALD) {
+			for (size_t j = 0; j < nr_archives; j++) {
+				if (archives[j].format == CATALOG_ALD && !strcasecmp(archives[j].name, name)) {
+					ba = &archives[j];
+					break;
+				}
+			}
+		}
+		if (ba) {
+			free(name);
+			if (ba->files[volume] >= 0) {
+				WARNING("Duplicate ALD volume: %s", f->name);
+				continue;
+			}
+		} else {
+			ba = &archives[nr_archives++];
+			memset(ba, 0, sizeof(struct build_archive));
+			ba->name = name;
+			ba->format = f->format;
+			for (int v = 0; v < MAX_VOLUMES; v++) {
+				ba->files[v] = -1;
+			}
+			kv_init(ba->entries);
+		}
+		ba->files[volume] = i;
+		ba->nr_volumes = max(ba->nr_volumes, volume + 1);
+	}
+	return nr_archives;
+}
+
+static uint32_t add_string(struct buffer *strings, const char *s)
+{
+	uint32_t off = strings->index;
+	buffer_write_cstringz(strings, s);
+	return off;
+}
+
+static uint32_t table_size(size_t nr_entries)
+{
+	if (!nr_entries)
+		return 0;
+	uint32_t size = 1;
+	while (size < nr_entries * 2)
+		size <<= 1;
+	return size;
+}
+
+static void table_insert(uint32_t *slots, uint32_t nr_slots, char **keys, uint32_t first_entry,
+		const char *key, uint32_t entry)
+{
+	uint32_t mask = nr_slots - 1;
+	for (uint32_t i = slot_hash(key) & mask;; i = (i + 1) & mask) {
+		if (!slots[i]) {
+			slots[i] = entry + 1;
+			return;
+		}
+		// first entry with a given name wins
+		if (!strcmp(keys[slots[i] - 1 - first_entry], key))
+			return;
+	}
+}
+
+static void write_file_record(struct buffer *out, struct buffer *strings, struct dir_file *f,
+		uint32_t archive, int volume)
+{
+	buffer_write_int32(out, add_string(strings, f->name));
+	buffer_write_int32(out, archive);
+	buffer_write_int32(out, volume);
+	buffer_write_int32(out, 0);
+	buffer_write_int64(out, f->size);
+	buffer_write_int64(out, f->mtime);
+}
+
+bool archive_catalog_build(const char *dir, const char *path, int nr_threads)
+{
+	dir_list list;
+	if (!scan_dir(dir, &list)) {
+		dir_list_free(&list);
+		return false;
+	}
+
+	struct build_archive *archives = xcalloc(kv_size(list) + 1, sizeof(struct build_archive));
+	size_t nr_archives = group_archives(&list, archives);
+	struct build_job job = { .dir = dir, .list = &list, .archives = archives };
+	parallel_for(nr_threads, nr_archives, index_archive, &job);
+
+	// number the files and entries of the archives that could be indexed
+	uint32_t nr_files = 0, nr_entries = 0, nr_slots = 0, nr_out = 0;
+	for (size_t i = 0; i < nr_archives; i++) {
+		struct build_archive *ba = &archives[i];
+		if (!ba->ok)
+			continue;
+		for (int v = 0; v < ba->nr_volumes; v++) {
+			if (ba->files[v] >= 0)
+				ba->file_no[v] = nr_files++;
+		}
+		nr_entries += kv_size(ba->entries);
+		nr_slots += table_size(kv_size(ba->entries));
+		nr_out++;
+	}
+
+	struct buffer strings = {0};
+	struct buffer out = {0};
+	buffer_write_int8(&strings, 0);
+	buffer_write_bytes(&out, (const uint8_t*)CATALOG_MAGIC, 4);
+	buffer_write_int32(&out, CATALOG_VERSION);
+	buffer_write_int32(&out, nr_files);
+	buffer_write_int32(&out, nr_out);
+	buffer_write_int32(&out, nr_entries);
+	buffer_write_int32(&out, nr_slots);
+	size_t strings_size_off = out.index;
+	buffer_write_int32(&out, 0);
+	buffer_write_int32(&out, 0);
+
+	// file records: the files of the archives, then the skipped files
+	bool *used = xcalloc(kv_size(list) + 1, sizeof(bool));
+	uint32_t archive_no = 0;
+	for (size_t i = 0; i < nr_archives; i++) {
+		struct build_archive *ba = &archives[i];
+		if (!ba->ok)
+			continue;
+		for (int v = 0; v < ba->nr_volumes; v++) {
+			if (ba->files[v] < 0)
+				continue;
+			used[ba->files[v]] = true;
+			write_file_record(&out, &strings, &kv_A(list, ba->files[v]), archive_no, v);
+		}
+		archive_no++;
+	}
+	for (size_t i = 0; i < kv_size(list); i++) {
+		if (used[i])
+			continue;
+		write_file_record(&out, &strings, &kv_A(list, i), CATALOG_NO_ARCHIVE, 0);
+		nr_files++;
+	}
+	buffer_write_int32_at(&out, 8, nr_files);
+	free(used);
+
+	// archive records
+	uint32_t first_file = 0, first_entry = 0, first_slot = 0;
+	for (size_t i = 0; i < nr_archives; i++) {
+		struct build_archive *ba = &archives[i];
+		if (!ba->ok)
+			continue;
+		uint32_t files = 0;
+		for (int v = 0; v < ba->nr_volumes; v++) {
+			files += ba->files[v] >= 0;
+		}
+		uint32_t entries = kv_size(ba->entries);
+		uint32_t slots = table_size(entries);
+		buffer_write_int32(&out, add_string(&strings, ba->name));
+		buffer_write_int32(&out, ba->format);
+		buffer_write_int32(&out, first_file);
+		buffer_write_int32(&out, files);
+		buffer_write_int32(&out, first_entry);
+		buffer_write_int32(&out, entries);
+		buffer_write_int32(&out, first_slot);
+		buffer_write_int32(&out, slots);
+		first_file += files;
+		first_entry += entries;
+		first_slot += slots;
+	}
+
+	// entry records and hash tables
+	uint32_t *name_slots = xcalloc(nr_slots + 1, sizeof(uint32_t));
+	uint32_t *base_slots = xcalloc(nr_slots + 1, sizeof(uint32_t));
+	archive_no = 0;
+	first_entry = 0;
+	first_slot = 0;
+	for (size_t i = 0; i < nr_archives; i++) {
+		struct build_archive *ba = &archives[i];
+		if (!ba->ok)
+			continue;
+		size_t n = kv_size(ba->entries);
+		uint32_t slots = table_size(n);
+		char **keys = xcalloc(n + 1, sizeof(char*));
+		char **bases = xcalloc(n + 1, sizeof(char*));
+		for (size_t j = 0; j < n; j++) {
+			struct build_entry *e = &kv_A(ba->entries, j);
+			keys[j] = name_key(e->name);
+			bases[j] = archive_basename(e->name);
+			buffer_write_int64(&out, e->off);
+			buffer_write_int64(&out, e->size);
+			buffer_write_int32(&out, add_string(&strings, e->name));
+			buffer_write_int32(&out, add_string(&strings, keys[j]));
+			buffer_write_int32(&out, add_string(&strings, bases[j]));
+			buffer_write_int32(&out, archive_no);
+			buffer_write_int32(&out, ba->file_no[e->volume]);
+			buffer_write_int32(&out, e->no);
+			buffer_write_int32(&out, e->compression);
+			buffer_write_int32(&out, 0);
+			table_insert(name_slots + first_slot, slots, keys, first_entry, keys[j],
+					first_entry + j);
+			table_insert(base_slots + first_slot, slots, bases, first_entry, bases[j],
+					first_entry + j);
+		}
+		for (size_t j = 0; j < n; j++) {
+			free(keys[j]);
+			free(bases[j]);
+		}
+		free(keys);
+		free(bases);
+		first_entry += n;
+		first_slot += slots;
+		archive_no++;
+	}
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		buffer_write_int32(&out, name_slots[i]);
+	}
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		buffer_write_int32(&out, base_slots[i]);
+	}
+	free(name_slots);
+	free(base_slots);
+
+	buffer_write_int32_at(&out, strings_size_off, strings.index);
+	buffer_write_bytes(&out, strings.buf, strings.index);
+	free(strings.buf);
+
+	for (size_t i = 0; i < nr_archives; i++) {
+		for (size_t j = 0; j < kv_size(archives[i].entries); j++) {
+			free(kv_A(archives[i].entries, j).name);
+		}
+		kv_destroy(archives[i].entries);
+		free(archives[i].name);
+	}
+	free(archives);
+	dir_list_free(&list);
+
+	// write to a temporary file first, so that a catalog mapped by someone
+	// else is never truncated under them (named uniquely, since other
+	// threads or processes may be rebuilding the same catalog)
+	static uint64_t tmp_seq = 0;
+	uint64_t seq = __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED);
+	int tmp_len = snprintf(NULL, 0, "%s.%ld.%" PRIu64 ".tmp", path, (long)getpid(), seq);
+	char *tmp = xmalloc(tmp_len + 1);
+	snprintf(tmp, tmp_len + 1, "%s.%ld.%" PRIu64 ".tmp", path, (long)getpid(), seq);
+	bool ok = file_write(tmp, out.buf, out.index);
+	free(out.buf);
+	if (ok) {
+#ifdef _WIN32
+		remove_utf8(path);
+#endif
+		if (rename(tmp, path)) {
+			WARNING("Failed to write '%s': %s", path, strerror(errno));
+			remove_utf8(tmp);
+			ok = false;
+		}
+	} else {
+		WARNING("Failed to write '%s'", tmp);
+	}
+	free(tmp);
+	return ok;
+}
+
+/*
+ * Catalog-backed archives.
+ */
+
+struct catalog_view {
+	struct archive ar;
+	struct archive_catalog *cat;
+	int index;
+};
+
+struct catalog_data {
+	struct archive_data data;
+	uint32_t entry;
+	bool owned;  // data was allocated (not borrowed from a mapping)
+};
+
+struct archive_catalog {
+	char *dir;
+	int flags;
+	struct archive_file file;
+	uint8_t *buf;  // catalog contents, when they couldn't be mapped
+	const uint8_t *data;
+	size_t size;
+
+	uint32_t nr_files;
+	uint32_t nr_archives;
+	uint32_t nr_entries;
+	uint32_t nr_slots;
+	uint32_t strings_size;
+	const uint8_t *files;
+	const uint8_t *archives;
+	const uint8_t *entries;
+	const uint8_t *name_slots;
+	const uint8_t *base_slots;
+	const char *strings;
+
+	struct catalog_view *views;
+
+	// archive files, opened on demand
+	pthread_mutex_t lock;
+	struct archive_file *archive_files;
+	uint8_t *file_state;  // 0 = not opened, 1 = open, 2 = failed
+};
+
+enum { FILE_CLOSED, FILE_OPEN, FILE_FAILED };
+
+static inline uint32_t file_field(struct archive_catalog *cat, uint32_t i, int field)
+{
+	return get_u32(cat->files + (size_t)i * CATALOG_FILE_SIZE + field * 4);
+}
+
+static inline uint32_t archive_field(struct archive_catalog *cat, uint32_t i, int field)
+{
+	return get_u32(cat->archives + (size_t)i * CATALOG_ARCHIVE_SIZE + field * 4);
+}
+
+static inline const uint8_t *entry_ptr(struct archive_catalog *cat, uint32_t i)
+{
+	return cat->entries + (size_t)i * CATALOG_ENTRY_SIZE;
+}
+
+static inline uint32_t entry_field(struct archive_catalog *cat, uint32_t i, int field)
+{
+	return get_u32(entry_ptr(cat, i) + field * 4);
+}
+
+static const char *cat_string(struct archive_catalog *cat, uint32_t off)
+{
+	// the table ends with a NUL, so any offset within it is a valid string
+	return off < cat->strings_size ? cat->strings + off : "";
+}
+
+static struct archive_ops catalog_archive_ops;
+
+static bool catalog_parse(struct archive_catalog *cat)
+{
+	const uint8_t *d = cat->data;
+	if (cat->size < CATALOG_HEADER_SIZE || memcmp(d, CATALOG_MAGIC, 4)
+			|| get_u32(d + 4) != CATALOG_VERSION)
+		return false;
+	cat->nr_files = get_u32(d + 8);
+	cat->nr_archives = get_u32(d + 12);
+	cat->nr_entries = get_u32(d + 16);
+	cat->nr_slots = get_u32(d + 20);
+	cat->strings_size = get_u32(d + 24);
+
+	uint64_t off = CATALOG_HEADER_SIZE;
+	cat->files = d + off;
+	off += (uint64_t)cat->nr_files * CATALOG_FILE_SIZE;
+	cat->archives = d + off;
+	off += (uint64_t)cat->nr_archives * CATALOG_ARCHIVE_SIZE;
+	cat->entries = d + off;
+	off += (uint64_t)cat->nr_entries * CATALOG_ENTRY_SIZE;
+	cat->name_slots = d + off;
+	off += (uint64_t)cat->nr_slots * 4;
+	cat->base_slots = d + off;
+	off += (uint64_t)cat->nr_slots * 4;
+	cat->strings = (const char*)d + off;
+	off += cat->strings_size;
+	if (off != cat->size || !cat->strings_size || cat->strings[cat->strings_size-1])
+		return false;
+
+	// archive records are few; check them all now so that lookups only
+	// need to check individual entries
+	for (uint32_t i = 0; i < cat->nr_archives; i++) {
+		uint64_t files_end = (uint64_t)archive_field(cat, i, AR_FIRST_FILE)
+			+ archive_field(cat, i, AR_NR_FILES);
+		uint64_t entries_end = (uint64_t)archive_field(cat, i, AR_FIRST_ENTRY)
+			+ archive_field(cat, i, AR_NR_ENTRIES);
+		uint32_t nr_slots = archive_field(cat, i, AR_NR_SLOTS);
+		uint64_t slots_end = (uint64_t)archive_field(cat, i, AR_FIRST_SLOT) + nr_slots;
+		if (files_end > cat->nr_files || entries_end > cat->nr_entries
+				|| slots_end > cat->nr_slots || (nr_slots & (nr_slots - 1)))
+			return false;
+	}
+	return true;
+}
+
+static void catalog_unload(struct archive_catalog *cat)
+{
+	archive_file_close(&cat->file);
+	free(cat->buf);
+	cat->buf = NULL;
+	cat->data = NULL;
+	cat->size = 0;
+}
+
+static bool catalog_load(struct archive_catalog *cat, const char *path)
+{
+	if (!file_exists(path))
+		return false;
+	int error;
+	if (!archive_file_open(&cat->file, path, ARCHIVE_MMAP, &error))
+		return false;
+	if (cat->file.map) {
+		cat->data = cat->file.map;
+		cat->size = cat->file.size;
+	} else {
+		// no mmap on this platform: read the whole catalog
+		archive_file_close(&cat->file);
+		if (!(cat->buf = file_read(path, &cat->size)))
+			return false;
+		cat->data = cat->buf;
+	}
+	if (!catalog_parse(cat)) {
+		WARNING("Invalid archive catalog: %s", path);
+		catalog_unload(cat);
+		return false;
+	}
+	return true;
+}
+
+bool archive_catalog_is_current(struct archive_catalog *cat)
+{
+	dir_list list;
+	if (!scan_dir(cat->dir, &list)) {
+		dir_list_free(&list);
+		return false;
+	}
+	// skipped files are recorded too, so every file in the catalog must
+	// still be there unchanged, and no new file may appear
+	bool current = kv_size(list) == cat->nr_files;
+	for (uint32_t i = 0; current && i < cat->nr_files; i++) {
+		const uint8_t *rec = cat->files + (size_t)i * CATALOG_FILE_SIZE;
+		struct dir_file key = { .name = (char*)cat_string(cat, get_u32(rec)) };
+		struct dir_file *f = bsearch(&key, list.a, kv_size(list), sizeof(struct dir_file),
+				dir_file_cmp);
+		current = f && f->size == get_u64(rec + 16) && (uint64_t)f->mtime == get_u64(rec + 24);
+	}
+	dir_list_free(&list);
+	return current;
+}
+
+struct archive_catalog *archive_catalog_open(const char *dir, const char *path, int flags)
+{
+	struct archive_catalog *cat = xcalloc(1, sizeof(struct archive_catalog));
+	cat->dir = xstrdup(dir);
+	cat->flags = flags;
+	cat->file.fd = -1;
+
+	if (!catalog_load(cat, path) || !archive_catalog_is_current(cat)) {
+		catalog_unload(cat);
+		if (!archive_catalog_build(dir, path, 0) || !catalog_load(cat, path)) {
+			free(cat->dir);
+			free(cat);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&cat->lock, NULL);
+	cat->archive_files = xcalloc(cat->nr_files + 1, sizeof(struct archive_file));
+	cat->file_state = xcalloc(cat->nr_files + 1, 1);
+	cat->views = xcalloc(cat->nr_archives + 1, sizeof(struct catalog_view));
+	for (uint32_t i = 0; i < cat->nr_archives; i++) {
+		struct catalog_view *v = &cat->views[i];
+		v->ar.ops = &catalog_archive_ops;
+		// the files are opened later, but whether they will be mapped
+		// is already known
+		v->ar.mmapped = archive_file_maps(flags);
+		v->ar.io_uring = flags & ARCHIVE_IO_URING;
+		v->cat = cat;
+		v->index = i;
+		_sys4_trace_archive_open(&v->ar, archive_catalog_archive_name(cat, i));
+	}
+	return cat;
+}
+
+void archive_catalog_close(struct archive_catalog *cat)
+{
+	for (uint32_t i = 0; i < cat->nr_files; i++) {
+		if (cat->file_state[i] == FILE_OPEN)
+			archive_file_close(&cat->archive_files[i]);
+	}
+	pthread_mutex_destroy(&cat->lock);
+	free(cat->archive_files);
+	free(cat->file_state);
+	free(cat->views);
+	catalog_unload(cat);
+	free(cat->dir);
+	free(cat);
+}
+
+int archive_catalog_nr_archives(struct archive_catalog *cat)
+{
+	return cat->nr_archives;
+}
+
+const char *archive_catalog_archive_name(struct archive_catalog *cat, int i)
+{
+	if (i < 0 || (uint32_t)i >= cat->nr_archives)
+		return NULL;
+	return cat_string(cat, archive_field(cat, i, AR_NAME));
+}
+
+enum archive_catalog_format archive_catalog_archive_format(struct archive_catalog *cat, int i)
+{
+	return archive_field(cat, i, AR_FORMAT);
+}
+
+int archive_catalog_find(struct archive_catalog *cat, const char *name)
+{
+	for (uint32_t i = 0; i < cat->nr_archives; i++) {
+		if (!strcasecmp(cat_string(cat, archive_field(cat, i, AR_NAME)), name))
+			return i;
+	}
+	for (uint32_t i = 0; i < cat->nr_files; i++) {
+		if (file_field(cat, i, FILE_ARCHIVE) != CATALOG_NO_ARCHIVE
+				&& !strcasecmp(cat_string(cat, file_field(cat, i, FILE_PATH)), name))
+			return file_field(cat, i, FILE_ARCHIVE);
+	}
+	return -1;
+}
+
+struct archive *archive_catalog_archive(struct archive_catalog *cat, int i)
+{
+	if (i < 0 || (uint32_t)i >= cat->nr_archives)
+		return NULL;
+	return &cat->views[i].ar;
+}
+
+/*
+ * Lookups.
+ */
+
+static bool entry_valid(struct archive_catalog *cat, uint32_t e, int archive)
+{
+	return e < cat->nr_entries && entry_field(cat, e, ENT_ARCHIVE) == (uint32_t)archive
+		&& entry_field(cat, e, ENT_FILE) < cat->nr_files;
+}
+
+// Returns the entry index, or -1.
+static int64_t find_by_key(struct archive_catalog *cat, int archive, const uint8_t *slots,
+		int key_field, const char *key)
+{
+	uint32_t nr_slots = archive_field(cat, archive, AR_NR_SLOTS);
+	if (!nr_slots)
+		return -1;
+	slots += (size_t)archive_field(cat, archive, AR_FIRST_SLOT) * 4;
+	uint32_t mask = nr_slots - 1;
+	uint32_t i = slot_hash(key) & mask;
+	for (uint32_t probes = 0; probes < nr_slots; probes++, i = (i + 1) & mask) {
+		uint32_t v = get_u32(slots + i * 4);
+		if (!v)
+			return -1;
+		if (!entry_valid(cat, v - 1, archive))
+			return -1;
+		if (!strcmp(cat_string(cat, entry_field(cat, v - 1, key_field)), key))
+			return v - 1;
+	}
+	return -1;
+}
+
+static int64_t find_by_name(struct archive_catalog *cat, int archive, const char *name)
+{
+	char *key = name_key(name);
+	int64_t e = find_by_key(cat, archive, cat->name_slots, ENT_KEY, key);
+	free(key);
+	return e;
+}
+
+static int64_t find_by_basename(struct archive_catalog *cat, int archive, const char *name)
+{
+	char *key = archive_basename(name);
+	int64_t e = find_by_key(cat, archive, cat->base_slots, ENT_BASENAME, key);
+	free(key);
+	return e;
+}
+
+static int64_t find_by_no(struct archive_catalog *cat, int archive, int no)
+{
+	uint32_t lo = archive_field(cat, archive, AR_FIRST_ENTRY);
+	uint32_t hi = lo + archive_field(cat, archive, AR_NR_ENTRIES);
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int32_t mid_no = entry_field(cat, mid, ENT_NO);
+		if (mid_no == no)
+			return entry_valid(cat, mid, archive) ? (int64_t)mid : -1;
+		if (mid_no < no)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+static void entry_info(struct archive_catalog *cat, uint32_t e, struct archive_catalog_entry *out)
+{
+	const uint8_t *p = entry_ptr(cat, e);
+	out->name = cat_string(cat, entry_field(cat, e, ENT_NAME));
+	out->archive = entry_field(cat, e, ENT_ARCHIVE);
+	out->no = (int32_t)entry_field(cat, e, ENT_NO);
+	out->off = get_u64(p);
+	out->size = get_u64(p + 8);
+	out->compression = entry_field(cat, e, ENT_COMPRESSION);
+}
+
+static struct archive_data *make_data(struct archive_catalog *cat, uint32_t e)
+{
+	struct catalog_data *data = xcalloc(1, sizeof(struct catalog_data));
+	data->entry = e;
+	data->data.name = xstrdup(cat_string(cat, entry_field(cat, e, ENT_NAME)));
+	data->data.no = (int32_t)entry_field(cat, e, ENT_NO);
+	data->data.size = get_u64(entry_ptr(cat, e) + 8);
+	data->data.archive = &cat->views[entry_field(cat, e, ENT_ARCHIVE)].ar;
+	return &data->data;
+}
+
+bool archive_catalog_lookup(struct archive_catalog *cat, const char *name,
+		struct archive_catalog_entry *out)
+{
+	char *key = name_key(name);
+	int64_t e = -1;
+	for (uint32_t i = 0; e < 0 && i < cat->nr_archives; i++) {
+		e = find_by_key(cat, i, cat->name_slots, ENT_KEY, key);
+	}
+	free(key);
+	if (e < 0)
+		return false;
+	entry_info(cat, e, out);
+	return true;
+}
+
+bool archive_catalog_lookup_basename(struct archive_catalog *cat, const char *name,
+		struct archive_catalog_entry *out)
+{
+	char *key = archive_basename(name);
+	int64_t e = -1;
+	for (uint32_t i = 0; e < 0 && i < cat->nr_archives; i++) {
+		e = find_by_key(cat, i, cat->base_slots, ENT_BASENAME, key);
+	}
+	free(key);
+	if (e < 0)
+		return false;
+	entry_info(cat, e, out);
+	return true;
+}
+
+static struct archive_data *get_loaded(struct archive_catalog *cat, int64_t e)
+{
+	if (e < 0)
+		return NULL;
+	struct archive_data *data = make_data(cat, e);
+	if (!archive_load_file(data)) {
+		archive_free_data(data);
+		return NULL;
+	}
+	return data;
+}
+
+struct archive_data *archive_catalog_get_by_name(struct archive_catalog *cat, const char *name)
+{
+	struct archive_catalog_entry info;
+	if (!archive_catalog_lookup(cat, name, &info))
+		return NULL;
+	return get_loaded(cat, find_by_no(cat, info.archive, info.no));
+}
+
+struct archive_data *archive_catalog_get_by_basename(struct archive_catalog *cat, const char *name)
+{
+	struct archive_catalog_entry info;
+	if (!archive_catalog_lookup_basename(cat, name, &info))
+		return NULL;
+	return get_loaded(cat, find_by_no(cat, info.archive, info.no));
+}
+
+/*
+ * Archive operations of the views.
+ */
+
+static struct archive_file *get_file(struct archive_catalog *cat, uint32_t i)
+{
+	pthread_mutex_lock(&cat->lock);
+	if (cat->file_state[i] == FILE_CLOSED) {
+		int error;
+		char *path = path_join(cat->dir, cat_string(cat, file_field(cat, i, FILE_PATH)));
+		if (archive_file_open(&cat->archive_files[i], path, cat->flags, &error)) {
+			cat->file_state[i] = FILE_OPEN;
+		} else {
+			WARNING("Failed to open '%s': %s", path, archive_strerror(error));
+			cat->file_state[i] = FILE_FAILED;
+		}
+		free(path);
+	}
+	struct archive_file *f = cat->file_state[i] == FILE_OPEN ? &cat->archive_files[i] : NULL;
+	pthread_mutex_unlock(&cat->lock);
+	return f;
+}
+
+bool archive_catalog_prefetch(struct archive_catalog *cat, int i, int no)
+{
+	if (i < 0 || (uint32_t)i >= cat->nr_archives)
+		return false;
+	int64_t e = find_by_no(cat, i, no);
+	if (e < 0)
+		return false;
+	struct archive_file *f = get_file(cat, entry_field(cat, e, ENT_FILE));
+	if (f)
+		archive_file_prefetch(f, get_u64(entry_ptr(cat, e)), get_u64(entry_ptr(cat, e) + 8));
+	return true;
+}
+
+static bool catalog_exists(struct archive *ar, int no)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	return find_by_no(v->cat, v->index, no) >= 0;
+}
+
+static bool catalog_exists_by_name(struct archive *ar, const char *name, int *id_out)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	int64_t e = find_by_name(v->cat, v->index, name);
+	if (e < 0)
+		return false;
+	if (id_out)
+		*id_out = (int32_t)entry_field(v->cat, e, ENT_NO);
+	return true;
+}
+
+static bool catalog_exists_by_basename(struct archive *ar, const char *name, int *id_out)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	int64_t e = find_by_basename(v->cat, v->index, name);
+	if (e < 0)
+		return false;
+	if (id_out)
+		*id_out = (int32_t)entry_field(v->cat, e, ENT_NO);
+	return true;
+}
+
+static struct archive_data *catalog_get(struct archive *ar, int no)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	return get_loaded(v->cat, find_by_no(v->cat, v->index, no));
+}
+
+static struct archive_data *catalog_get_by_name(struct archive *ar, const char *name)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	return get_loaded(v->cat, find_by_name(v->cat, v->index, name));
+}
+
+static struct archive_data *catalog_get_by_basename(struct archive *ar, const char *name)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	return get_loaded(v->cat, find_by_basename(v->cat, v->index, name));
+}
+
+static bool catalog_get_extent(struct archive_data *data, struct archive_extent *out)
+{
+	struct catalog_view *v = (struct catalog_view*)data->archive;
+	struct archive_catalog *cat = v->cat;
+	uint32_t e = ((struct catalog_data*)data)->entry;
+	struct archive_file *f = get_file(cat, entry_field(cat, e, ENT_FILE));
+	if (!f)
+		return false;
+
+	out->off = get_u64(entry_ptr(cat, e));
+	out->size = get_u64(entry_ptr(cat, e) + 8);
+	out->compression = entry_field(cat, e, ENT_COMPRESSION);
+	if (out->off > f->size || out->size > f->size - out->off) {
+		WARNING("Archive catalog entry out of bounds: %s", data->name);
+		return false;
+	}
+	out->fd = f->fd;
+	out->ptr = f->map ? f->map + out->off : NULL;
+	return true;
+}
+
+static bool inflate_stored(struct archive_data *data, const uint8_t *in, size_t in_size,
+		enum archive_compression compression)
+{
+	size_t out_size;
+	if (compression == ARCHIVE_ZLB) {
+		if (in_size < 16 || memcmp(in, "ZLB\0", 4) || get_u32(in + 4) != 0
+				|| get_u32(in + 12) > in_size - 16) {
+			WARNING("Bad ZLB header: %s", data->name);
+			return false;
+		}
+		out_size = get_u32(in + 8);
+		in_size = get_u32(in + 12);
+		in += 16;
+	} else {
+		if (in_size < 4)
+			return false;
+		out_size = get_u32(in);
+		in_size -= 4;
+		in += 4;
+	}
+
+	uint8_t *out = xmalloc(out_size ? out_size : 1);
+	enum sys4_z_status r = sys4_inflate(out, &out_size, in, in_size);
+	if (r != SYS4_Z_OK) {
+		WARNING("uncompress failed: %s", sys4_z_strerror(r));
+		free(out);
+		return false;
+	}
+	data->data = out;
+	data->size = out_size;
+	return true;
+}
+
+static bool catalog_load_file(struct archive_data *data)
+{
+	if (data->data)
+		return true;
+
+	struct catalog_data *cdata = (struct catalog_data*)data;
+	struct archive_extent ext;
+	if (!catalog_get_extent(data, &ext))
+		return false;
+
+	uint8_t *buf = NULL;
+	const uint8_t *stored = ext.ptr;
+	if (!stored) {
+		buf = xmalloc(ext.size ? ext.size : 1);
+		if (ext.size && !archive_pread(ext.fd, buf, ext.size, ext.off)) {
+			WARNING("Failed to read '%s'", data->name);
+			free(buf);
+			return false;
+		}
+		stored = buf;
+	}
+
+	if (ext.compression == ARCHIVE_STORED) {
+		data->data = (uint8_t*)stored;
+		data->size = ext.size;
+		cdata->owned = !!buf;
+		return true;
+	}
+
+	bool ok = inflate_stored(data, stored, ext.size, ext.compression);
+	cdata->owned = ok;
+	free(buf);
+	return ok;
+}
+
+static bool catalog_load_files(struct archive_data **files, size_t n)
+{
+	bool ok = true;
+	for (size_t i = 0; i < n; i++) {
+		ok = catalog_load_file(files[i]) && ok;
+	}
+	return ok;
+}
+
+static void catalog_release_file(struct archive_data *data)
+{
+	struct catalog_data *cdata = (struct catalog_data*)data;
+	if (cdata->owned)
+		free(data->data);
+	data->data = NULL;
+	cdata->owned = false;
+	data->size = get_u64(entry_ptr(((struct catalog_view*)data->archive)->cat, cdata->entry) + 8);
+}
+
+static struct archive_data *catalog_copy_descriptor(struct archive_data *src)
+{
+	struct catalog_view *v = (struct catalog_view*)src->archive;
+	return make_data(v->cat, ((struct catalog_data*)src)->entry);
+}
+
+static void catalog_free_data(struct archive_data *data)
+{
+	catalog_release_file(data);
+	free(data->name);
+	free(data);
+}
+
+static void catalog_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user),
+		void *user)
+{
+	struct catalog_view *v = (struct catalog_view*)ar;
+	uint32_t first = archive_field(v->cat, v->index, AR_FIRST_ENTRY);
+	uint32_t n = archive_field(v->cat, v->index, AR_NR_ENTRIES);
+	for (uint32_t e = first; e < first + n; e++) {
+		if (!entry_valid(v->cat, e, v->index))
+			continue;
+		struct archive_data *data = make_data(v->cat, e);
+		iter(data, user);
+		catalog_free_data(data);
+	}
+}
+
+// views belong to the catalog
+static void catalog_free(possibly_unused struct archive *ar) {}
+
+static struct archive_ops catalog_archive_ops = {
+	.exists = catalog_exists,
+	.exists_by_name = catalog_exists_by_name,
+	.exists_by_basename = catalog_exists_by_basename,
+	.get = catalog_get,
+	.get_by_name = catalog_get_by_name,
+	.get_by_basename = catalog_get_by_basename,
+	.load_file = catalog_load_file,
+	.load_files = catalog_load_files,
+	.get_extent = catalog_get_extent,
+	.release_file = catalog_release_file,
+	.copy_descriptor = catalog_copy_descriptor,
+	.for_each = catalog_for_each,
+	.free_data = catalog_free_data,
+	.free = catalog_free,
+};
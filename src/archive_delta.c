@@ -0,0 +1,1363 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "system4.h"
+#include "system4/afa.h"
+#include "system4/archive.h"
+#include "system4/archive_delta.h"
+#include "system4/buffer.h"
+#include "system4/file.h"
+#include "system4/hashtable.h"
+#include "system4/string.h"
+#include "archive_io.h"
+#include "compression.h"
+#include "hash.h"
+#include "kvec.h"
+#include "little_endian.h"
+#include "thread_pool.h"
+
+/*
+ * Patch file format (little endian):
+ *
+ *   header (32 bytes):
+ *     0  "S4PA"
+ *     4  u32 version
+ *     8  u32 number of operations
+ *     12 u32 reserved
+ *     16 u64 fingerprint of the old archive (see archive_fingerprint)
+ *     24 u64 reserved
+ *
+ *   operations, each a 48-byte header followed by the name and the payload:
+ *     0  u32 type (OP_*)
+ *     4  u32 name length
+ *     8  u64 size of the new contents
+ *     16 u64 hash64 of the new contents
+ *     24 u64 payload size
+ *     32 u64 size of the old contents (OP_DELTA)
+ *     40 u64 hash64 of the old contents (OP_DELTA)
+ *
+ * The payload of OP_PUT is the new contents. The payload of OP_DELTA is a
+ * sequence of commands, each starting with a varint (len << 1 | CMD_*):
+ * CMD_COPY is followed by a varint offset into the old contents, CMD_INSERT
+ * by `len` literal bytes. OP_REMOVE has no payload.
+ */
+
+#define PATCH_MAGIC "S4PA"
+#define PATCH_VERSION 1
+#define HEADER_SIZE 32
+#define OP_HEADER_SIZE 48
+
+enum {
+	OP_REMOVE = 1,
+	OP_PUT = 2,
+	OP_DELTA = 3,
+};
+
+enum {
+	CMD_COPY = 0,
+	CMD_INSERT = 1,
+};
+
+#define DEFAULT_MIN_DELTA_SIZE (64 * 1024)
+#define DEFAULT_BLOCK_SIZE 64
+#define MIN_BLOCK_SIZE 16
+
+// candidate blocks examined per position (and per block when indexing)
+#define MAX_PROBES 8
+
+// entries are loaded and diffed in batches of at most this many entries/bytes
+#define BATCH_ENTRIES 256
+#define BATCH_BYTES (64 * 1024 * 1024)
+
+static void put_u64(uint8_t *b, int i, uint64_t v)
+{
+	LittleEndian_putDW(b, i, v);
+	LittleEndian_putDW(b, i + 4, v >> 32);
+}
+
+static uint64_t get_u64(const uint8_t *b, int i)
+{
+	return (uint32_t)LittleEndian_getDW(b, i) | ((uint64_t)(uint32_t)LittleEndian_getDW(b, i + 4) << 32);
+}
+
+static void put_varint(struct buffer *b, uint64_t v)
+{
+	while (v >= 0x80) {
+		buffer_write_int8(b, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	buffer_write_int8(b, v);
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *out)
+{
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*p >= end)
+			return false;
+		uint8_t c = *(*p)++;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*out = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void fingerprint_entry(struct archive_data *data, void *user)
+{
+	uint64_t *fp = user;
+	*fp += hash64(data->name, strlen(data->name), ((uint64_t)data->no << 32) ^ data->size);
+}
+
+/*
+ * Identifies the archive a patch was made against, from the names, numbers
+ * and sizes of its entries. This is a sum so that it doesn't depend on the
+ * order in which the archive lists its entries.
+ */
+static uint64_t archive_fingerprint(struct archive *ar)
+{
+	uint64_t fp = 0;
+	archive_for_each(ar, fingerprint_entry, &fp);
+	return fp;
+}
+
+/*
+ * Byte-level deltas.
+ *
+ * The old contents are split into blocks, which are indexed by a polynomial
+ * rolling hash. The hash is then rolled over the new contents one byte at a
+ * time; when it matches a block (and the bytes agree) the match is extended in
+ * both directions and emitted as a copy.
+ */
+
+#define ROLL_MULT 0x01000193u
+
+struct block_index {
+	const uint8_t *data;
+	unsigned block_size;
+	unsigned bits;
+	uint32_t *slots;  // block number + 1 (0 = empty)
+	uint32_t *hashes; // rolling hash of each block
+};
+
+static uint32_t roll_init(const uint8_t *p, unsigned n)
+{
+	uint32_t h = 0;
+	for (unsigned i = 0; i < n; i++) {
+		h = h * ROLL_MULT + p[i];
+	}
+	return h;
+}
+
+static inline uint32_t slot_of(struct block_index *idx, uint32_t h)
+{
+	return (h * 0x9e3779b1u) >> (32 - idx->bits);
+}
+
+static void block_index_init(struct block_index *idx, const uint8_t *data, size_t size,
+		unsigned block_size)
+{
+	size_t nr_blocks = size / block_size;
+	idx->data = data;
+	idx->block_size = block_size;
+	idx->bits = 4;
+	while (((size_t)1 << idx->bits) < nr_blocks * 2)
+		idx->bits++;
+	uint32_t mask = (1u << idx->bits) - 1;
+	idx->slots = xcalloc((size_t)1 << idx->bits, sizeof(uint32_t));
+	idx->hashes = xmalloc(max(nr_blocks, (size_t)1) * sizeof(uint32_t));
+
+	for (size_t k = 0; k < nr_blocks; k++) {
+		const uint8_t *block = data + k * block_size;
+		uint32_t h = roll_init(block, block_size);
+		idx->hashes[k] = h;
+		// repeated blocks (e.g. runs of zeros) are indexed once; the probe
+		// limit keeps long collision chains from degrading the index
+		uint32_t s = slot_of(idx, h);
+		for (int probe = 0; probe < MAX_PROBES; probe++, s = (s + 1) & mask) {
+			uint32_t other = idx->slots[s];
+			if (!other) {
+				idx->slots[s] = k + 1;
+				break;
+			}
+			if (idx->hashes[other-1] == h && !memcmp(data + (other-1) * block_size, block, block_size))
+				break;
+		}
+	}
+}
+
+static void block_index_fini(struct block_index *idx)
+{
+	free(idx->slots);
+	free(idx->hashes);
+}
+
+/*
+ * Find the longest match of the block at `new + pos` (whose hash is `h`) in
+ * the old contents, extended forwards. Returns its length (0 = no match).
+ */
+static size_t find_match(struct block_index *idx, size_t old_size, uint32_t h,
+		const uint8_t *new, size_t new_size, size_t pos, size_t *off_out)
+{
+	uint32_t mask = (1u << idx->bits) - 1;
+	uint32_t s = slot_of(idx, h);
+	size_t best = 0;
+	for (int probe = 0; probe < MAX_PROBES && idx->slots[s]; probe++, s = (s + 1) & mask) {
+		uint32_t k = idx->slots[s] - 1;
+		if (idx->hashes[k] != h)
+			continue;
+		size_t off = (size_t)k * idx->block_size;
+		if (memcmp(idx->data + off, new + pos, idx->block_size))
+			continue;
+		size_t len = idx->block_size;
+		while (pos + len < new_size && off + len < old_size && new[pos+len] == idx->data[off+len])
+			len++;
+		if (len > best) {
+			best = len;
+			*off_out = off;
+		}
+	}
+	return best;
+}
+
+static void emit_insert(struct buffer *b, const uint8_t *data, size_t len)
+{
+	if (!len)
+		return;
+	put_varint(b, (uint64_t)len << 1 | CMD_INSERT);
+	buffer_write_bytes(b, data, len);
+}
+
+static void emit_copy(struct buffer *b, size_t off, size_t len)
+{
+	put_varint(b, (uint64_t)len << 1 | CMD_COPY);
+	put_varint(b, off);
+}
+
+/*
+ * Encode `new` as a delta against `old`. Returns NULL if the delta would not
+ * be smaller than `max_size` bytes.
+ */
+static uint8_t *delta_encode(const uint8_t *old, size_t old_size, const uint8_t *new,
+		size_t new_size, unsigned block_size, size_t max_size, size_t *size_out)
+{
+	if (old_size < block_size || new_size < block_size || old_size / block_size >= UINT32_MAX)
+		return NULL;
+
+	struct block_index idx;
+	block_index_init(&idx, old, old_size, block_size);
+
+	// ROLL_MULT^(block_size-1), to remove the outgoing byte
+	uint32_t out_mult = 1;
+	for (unsigned i = 1; i < block_size; i++) {
+		out_mult *= ROLL_MULT;
+	}
+
+	struct buffer b;
+	buffer_init(&b, NULL, 0);
+	size_t pos = 0, lit = 0;
+	uint32_t h = 0;
+	bool have_hash = false;
+	while (pos + block_size <= new_size) {
+		if (!have_hash) {
+			h = roll_init(new + pos, block_size);
+			have_hash = true;
+		}
+		size_t off;
+		size_t len = find_match(&idx, old_size, h, new, new_size, pos, &off);
+		if (len) {
+			// extend backwards into the pending literal bytes
+			while (pos > lit && off > 0 && new[pos-1] == old[off-1]) {
+				pos--;
+				off--;
+				len++;
+			}
+			emit_insert(&b, new + lit, pos - lit);
+			emit_copy(&b, off, len);
+			pos += len;
+			lit = pos;
+			have_hash = false;
+			if (b.index >= max_size)
+				goto fail;
+			continue;
+		}
+		if (pos + block_size < new_size)
+			h = (h - new[pos] * out_mult) * ROLL_MULT + new[pos + block_size];
+		pos++;
+		if (pos - lit > max_size)
+			goto fail;
+	}
+	emit_insert(&b, new + lit, new_size - lit);
+	if (b.index >= max_size)
+		goto fail;
+
+	block_index_fini(&idx);
+	*size_out = b.index;
+	return b.buf;
+fail:
+	block_index_fini(&idx);
+	free(b.buf);
+	return NULL;
+}
+
+/*
+ * Decode a delta into `out`, which holds `size` bytes. If `out` is NULL the
+ * delta is only checked, without writing anything.
+ */
+static bool delta_decode(const uint8_t *delta, size_t delta_size, const uint8_t *old,
+		size_t old_size, uint8_t *out, size_t size)
+{
+	const uint8_t *p = delta, *end = delta + delta_size;
+	size_t pos = 0;
+	while (p < end) {
+		uint64_t cmd, off;
+		if (!get_varint(&p, end, &cmd))
+			return false;
+		uint64_t len = cmd >> 1;
+		if (len > size - pos)
+			return false;
+		if ((cmd & 1) == CMD_INSERT) {
+			if (len > (uint64_t)(end - p))
+				return false;
+			if (out)
+				memcpy(out + pos, p, len);
+			p += len;
+		} else {
+			if (!get_varint(&p, end, &off) || off > old_size || len > old_size - off)
+				return false;
+			if (out)
+				memcpy(out + pos, old + off, len);
+		}
+		pos += len;
+	}
+	return pos == size;
+}
+
+/*
+ * Creating patches.
+ */
+
+struct entry_ref {
+	char *name;
+	int no;
+};
+
+typedef kvec_t(struct entry_ref) entry_list;
+
+struct delta_item {
+	struct entry_ref *ref;
+	struct entry_ref *old_ref; // entry of the same name in the old archive, or NULL
+	struct archive_data *new;
+	struct archive_data *old;
+	uint32_t type;            // 0 = unchanged
+	uint64_t hash;
+	uint64_t old_hash;
+	uint8_t *delta;
+	size_t delta_size;
+};
+
+struct delta_job {
+	size_t min_delta_size;
+	unsigned block_size;
+	struct delta_item *items;
+};
+
+static void collect_entry(struct archive_data *data, void *user)
+{
+	struct entry_ref ref = { .name = xstrdup(data->name), .no = data->no };
+	kv_push(struct entry_ref, *(entry_list*)user, ref);
+}
+
+static void diff_item(size_t i, possibly_unused int worker, void *user)
+{
+	struct delta_job *job = user;
+	struct delta_item *item = &job->items[i];
+	struct archive_data *new = item->new, *old = item->old;
+	item->hash = hash64(new->data, new->size, 0);
+	if (!old) {
+		item->type = OP_PUT;
+		return;
+	}
+	item->old_hash = hash64(old->data, old->size, 0);
+	if (old->size == new->size && item->old_hash == item->hash) {
+		item->type = 0;
+		return;
+	}
+	item->type = OP_PUT;
+	if (new->size < job->min_delta_size)
+		return;
+	// not worth it unless it saves at least 1/8 of the entry
+	item->delta = delta_encode(old->data, old->size, new->data, new->size, job->block_size,
+			new->size - new->size / 8, &item->delta_size);
+	if (item->delta)
+		item->type = OP_DELTA;
+}
+
+static bool write_op(FILE *f, uint32_t type, const char *name, uint64_t size, uint64_t hash,
+		uint64_t base_size, uint64_t base_hash, const uint8_t *payload, uint64_t payload_size)
+{
+	uint8_t hdr[OP_HEADER_SIZE];
+	size_t name_len = strlen(name);
+	LittleEndian_putDW(hdr, 0, type);
+	LittleEndian_putDW(hdr, 4, name_len);
+	put_u64(hdr, 8, size);
+	put_u64(hdr, 16, hash);
+	put_u64(hdr, 24, payload_size);
+	put_u64(hdr, 32, base_size);
+	put_u64(hdr, 40, base_hash);
+	if (fwrite(hdr, OP_HEADER_SIZE, 1, f) != 1)
+		return false;
+	if (name_len && fwrite(name, name_len, 1, f) != 1)
+		return false;
+	if (payload_size && fwrite(payload, payload_size, 1, f) != 1)
+		return false;
+	return true;
+}
+
+static struct hash_table *index_entries(entry_list *list)
+{
+	struct hash_table *ht = ht_create(max(kv_size(*list), (size_t)16));
+	for (size_t i = 0; i < kv_size(*list); i++) {
+		ht_put(ht, kv_A(*list, i).name, &kv_A(*list, i));
+	}
+	return ht;
+}
+
+static void free_entries(entry_list *list)
+{
+	for (size_t i = 0; i < kv_size(*list); i++) {
+		free(kv_A(*list, i).name);
+	}
+	kv_destroy(*list);
+}
+
+static void release_batch(struct delta_item *items, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		free(items[i].delta);
+		archive_free_data(items[i].new);
+		if (items[i].old)
+			archive_free_data(items[i].old);
+	}
+}
+
+bool archive_delta_create(struct archive *old, struct archive *new, const char *path,
+		const struct archive_delta_options *opts, struct archive_delta_stats *stats)
+{
+	struct archive_delta_options dflt = {0};
+	if (!opts)
+		opts = &dflt;
+	struct archive_delta_stats dummy;
+	if (!stats)
+		stats = &dummy;
+	memset(stats, 0, sizeof(struct archive_delta_stats));
+
+	struct delta_job job = {
+		.min_delta_size = opts->min_delta_size ? opts->min_delta_size : DEFAULT_MIN_DELTA_SIZE,
+		.block_size = opts->block_size ? opts->block_size : DEFAULT_BLOCK_SIZE,
+	};
+	if (job.block_size < MIN_BLOCK_SIZE)
+		job.block_size = MIN_BLOCK_SIZE;
+
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		return false;
+	}
+
+	entry_list old_list, new_list;
+	kv_init(old_list);
+	kv_init(new_list);
+	archive_for_each(old, collect_entry, &old_list);
+	archive_for_each(new, collect_entry, &new_list);
+	struct hash_table *old_index = index_entries(&old_list);
+	struct hash_table *new_index = index_entries(&new_list);
+
+	bool ok = false;
+	uint32_t nr_ops = 0;
+	struct thread_pool *pool = thread_pool_create(opts->nr_threads);
+	job.items = xcalloc(BATCH_ENTRIES, sizeof(struct delta_item));
+
+	uint8_t hdr[HEADER_SIZE] = {0};
+	memcpy(hdr, PATCH_MAGIC, 4);
+	LittleEndian_putDW(hdr, 4, PATCH_VERSION);
+	put_u64(hdr, 16, archive_fingerprint(old));
+	if (fwrite(hdr, HEADER_SIZE, 1, f) != 1)
+		goto write_error;
+
+	// removals first, so that applying a patch never has two entries of the
+	// same name
+	for (size_t i = 0; i < kv_size(old_list); i++) {
+		struct entry_ref *ref = &kv_A(old_list, i);
+		if (ht_get(new_index, ref->name, NULL))
+			continue;
+		if (!write_op(f, OP_REMOVE, ref->name, 0, 0, 0, 0, NULL, 0))
+			goto write_error;
+		stats->nr_removed++;
+		nr_ops++;
+	}
+
+	for (size_t start = 0; start < kv_size(new_list);) {
+		// load a batch (serially: not every archive type supports
+		// concurrent loads)
+		size_t n = 0, bytes = 0;
+		bool load_ok = true;
+		while (start + n < kv_size(new_list) && n < BATCH_ENTRIES && bytes < BATCH_BYTES) {
+			struct delta_item *item = &job.items[n];
+			memset(item, 0, sizeof(struct delta_item));
+			item->ref = &kv_A(new_list, start + n);
+			item->old_ref = ht_get(old_index, item->ref->name, NULL);
+			item->new = archive_get(new, item->ref->no);
+			if (!item->new) {
+				WARNING("Failed to load '%s'", item->ref->name);
+				load_ok = false;
+				break;
+			}
+			if (item->old_ref && !(item->old = archive_get(old, item->old_ref->no))) {
+				WARNING("Failed to load '%s'", item->old_ref->name);
+				archive_free_data(item->new);
+				load_ok = false;
+				break;
+			}
+			bytes += item->new->size + (item->old ? item->old->size : 0);
+			n++;
+		}
+		if (!load_ok) {
+			release_batch(job.items, n);
+			goto out;
+		}
+
+		thread_pool_run(pool, n, diff_item, &job);
+
+		bool write_ok = true;
+		for (size_t i = 0; i < n; i++) {
+			struct delta_item *item = &job.items[i];
+			struct archive_data *d = item->new;
+			if (write_ok && item->type == OP_PUT) {
+				write_ok = write_op(f, OP_PUT, item->ref->name, d->size, item->hash, 0, 0,
+						d->data, d->size);
+				if (item->old)
+					stats->nr_replaced++;
+				else
+					stats->nr_added++;
+				nr_ops++;
+			} else if (write_ok && item->type == OP_DELTA) {
+				write_ok = write_op(f, OP_DELTA, item->ref->name, d->size, item->hash,
+						item->old->size, item->old_hash,
+						item->delta, item->delta_size);
+				stats->nr_deltas++;
+				nr_ops++;
+			} else if (!item->type) {
+				stats->nr_unchanged++;
+			}
+		}
+		release_batch(job.items, n);
+		if (!write_ok)
+			goto write_error;
+		start += n;
+	}
+
+	stats->patch_size = ftell(f);
+	LittleEndian_putDW(hdr, 8, nr_ops);
+	if (fseek(f, 0, SEEK_SET) || fwrite(hdr, HEADER_SIZE, 1, f) != 1)
+		goto write_error;
+	ok = true;
+	goto out;
+write_error:
+	WARNING("Failed to write '%s': %s", path, strerror(errno));
+out:
+	if (fclose(f)) {
+		WARNING("fclose failed: %s", strerror(errno));
+		ok = false;
+	}
+	free(job.items);
+	thread_pool_free(pool);
+	ht_free(old_index);
+	ht_free(new_index);
+	free_entries(&old_list);
+	free_entries(&new_list);
+	return ok;
+}
+
+/*
+ * Reading patches.
+ */
+
+struct patch_op {
+	uint32_t type;
+	char *name;
+	uint64_t size;
+	uint64_t hash;
+	uint64_t base_size;
+	uint64_t base_hash;
+	uint64_t payload_off;
+	uint64_t payload_size;
+};
+
+struct patch {
+	struct archive_file file;
+	uint64_t fingerprint;
+	uint32_t nr_ops;
+	struct patch_op *ops;
+};
+
+static void patch_close(struct patch *p)
+{
+	for (uint32_t i = 0; i < p->nr_ops; i++) {
+		free(p->ops[i].name);
+	}
+	free(p->ops);
+	archive_file_close(&p->file);
+}
+
+static bool patch_open(struct patch *p, const char *path, int flags, int *error)
+{
+	memset(p, 0, sizeof(struct patch));
+	if (!archive_file_open(&p->file, path, flags, error))
+		return false;
+
+	uint8_t buf[OP_HEADER_SIZE];
+	const uint8_t *hdr = p->file.size >= HEADER_SIZE
+		? archive_file_view(&p->file, buf, HEADER_SIZE, 0) : NULL;
+	if (!hdr || memcmp(hdr, PATCH_MAGIC, 4) || LittleEndian_getDW(hdr, 4) != PATCH_VERSION)
+		goto bad_patch;
+	uint32_t nr_ops = LittleEndian_getDW(hdr, 8);
+	p->fingerprint = get_u64(hdr, 16);
+	if ((uint64_t)nr_ops * OP_HEADER_SIZE > p->file.size - HEADER_SIZE)
+		goto bad_patch;
+
+	p->ops = xcalloc(max(nr_ops, 1u), sizeof(struct patch_op));
+	uint64_t off = HEADER_SIZE;
+	for (uint32_t i = 0; i < nr_ops; i++) {
+		struct patch_op *op = &p->ops[i];
+		if (p->file.size - off < OP_HEADER_SIZE)
+			goto bad_patch;
+		const uint8_t *h = archive_file_view(&p->file, buf, OP_HEADER_SIZE, off);
+		if (!h)
+			goto file_error;
+		op->type = LittleEndian_getDW(h, 0);
+		uint32_t name_len = LittleEndian_getDW(h, 4);
+		op->size = get_u64(h, 8);
+		op->hash = get_u64(h, 16);
+		op->payload_size = get_u64(h, 24);
+		op->base_size = get_u64(h, 32);
+		op->base_hash = get_u64(h, 40);
+		off += OP_HEADER_SIZE;
+		if (op->type < OP_REMOVE || op->type > OP_DELTA || !name_len
+				|| name_len > p->file.size - off)
+			goto bad_patch;
+		op->name = xmalloc(name_len + 1);
+		p->nr_ops = i + 1;
+		if (!archive_file_read(&p->file, op->name, name_len, off))
+			goto file_error;
+		op->name[name_len] = '\0';
+		off += name_len;
+		op->payload_off = off;
+		if (op->payload_size > p->file.size - off)
+			goto bad_patch;
+		if (op->type == OP_PUT && op->payload_size != op->size)
+			goto bad_patch;
+		off += op->payload_size;
+	}
+	return true;
+bad_patch:
+	*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+	patch_close(p);
+	return false;
+file_error:
+	*error = ARCHIVE_FILE_ERROR;
+	patch_close(p);
+	return false;
+}
+
+/*
+ * Get the payload of an operation. If the patch is mmapped, this points into
+ * the mapping; otherwise it is read into a new buffer and `*owned` is set.
+ */
+static uint8_t *patch_payload(struct patch *p, struct patch_op *op, bool *owned)
+{
+	*owned = !p->file.map || !op->payload_size;
+	if (!*owned)
+		return p->file.map + op->payload_off;
+	uint8_t *buf = xmalloc(max(op->payload_size, (uint64_t)1));
+	if (!archive_file_read(&p->file, buf, op->payload_size, op->payload_off)) {
+		WARNING("Failed to read patch data for '%s': %s", op->name, strerror(errno));
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * Reconstruct the contents written by an OP_DELTA from the old contents.
+ */
+static uint8_t *patch_apply_delta(struct patch *p, struct patch_op *op, const uint8_t *old,
+		size_t old_size)
+{
+	if (old_size != op->base_size || hash64(old, old_size, 0) != op->base_hash) {
+		WARNING("'%s' doesn't match the version the patch was made against", op->name);
+		return NULL;
+	}
+	bool owned;
+	uint8_t *delta = patch_payload(p, op, &owned);
+	if (!delta)
+		return NULL;
+	// check the delta before allocating its output
+	uint8_t *out = NULL;
+	if (delta_decode(delta, op->payload_size, old, old_size, NULL, op->size)) {
+		out = xmalloc(max(op->size, (uint64_t)1));
+		delta_decode(delta, op->payload_size, old, old_size, out, op->size);
+	}
+	if (!out || hash64(out, op->size, 0) != op->hash) {
+		WARNING("Corrupt patch data for '%s'", op->name);
+		free(out);
+		out = NULL;
+	}
+	if (owned)
+		free(delta);
+	return out;
+}
+
+/*
+ * Overlay archives.
+ */
+
+struct overlay_entry {
+	char *name;
+	int no;
+	int base_no;          // -1 for added entries
+	size_t size;
+	struct patch_op *op;  // NULL if unchanged
+	bool removed;
+};
+
+struct delta_overlay {
+	struct archive ar;
+	struct archive *base;
+	struct patch patch;
+	size_t nr_entries;
+	struct overlay_entry *entries; // sorted by number
+	struct hash_table *name_index;
+	struct hash_table *basename_index;
+};
+
+struct overlay_data {
+	struct archive_data data;
+	struct overlay_entry *entry;
+	struct archive_data *base; // loaded base entry whose data is shared
+	bool owned;                // data must be freed
+};
+
+static bool overlay_exists(struct archive *ar, int no);
+static bool overlay_exists_by_name(struct archive *ar, const char *name, int *id_out);
+static bool overlay_exists_by_basename(struct archive *ar, const char *name, int *id_out);
+static struct archive_data *overlay_get(struct archive *ar, int no);
+static struct archive_data *overlay_get_by_name(struct archive *ar, const char *name);
+static struct archive_data *overlay_get_by_basename(struct archive *ar, const char *name);
+static bool overlay_load_file(struct archive_data *data);
+static void overlay_release_file(struct archive_data *data);
+static struct archive_data *overlay_copy_descriptor(struct archive_data *src);
+static void overlay_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
+static void overlay_free_data(struct archive_data *data);
+static void overlay_free(struct archive *ar);
+
+struct archive_ops overlay_archive_ops = {
+	.exists = overlay_exists,
+	.exists_by_name = overlay_exists_by_name,
+	.exists_by_basename = overlay_exists_by_basename,
+	.get = overlay_get,
+	.get_by_name = overlay_get_by_name,
+	.get_by_basename = overlay_get_by_basename,
+	.load_file = overlay_load_file,
+	.load_files = NULL,
+	.get_extent = NULL,
+	.release_file = overlay_release_file,
+	.copy_descriptor = overlay_copy_descriptor,
+	.for_each = overlay_for_each,
+	.free_data = overlay_free_data,
+	.free = overlay_free,
+};
+
+static int entry_no_cmp(const void *_a, const void *_b)
+{
+	const struct overlay_entry *a = _a, *b = _b;
+	return (a->no > b->no) - (a->no < b->no);
+}
+
+static struct overlay_entry *overlay_find(struct delta_overlay *ov, int no)
+{
+	struct overlay_entry key = { .no = no };
+	return bsearch(&key, ov->entries, ov->nr_entries, sizeof(struct overlay_entry), entry_no_cmp);
+}
+
+static struct overlay_entry *overlay_find_by_basename(struct delta_overlay *ov, const char *name)
+{
+	char *key = archive_basename(name);
+	struct overlay_entry *e = ht_get(ov->basename_index, key, NULL);
+	free(key);
+	return e;
+}
+
+static bool overlay_exists(struct archive *ar, int no)
+{
+	return !!overlay_find((struct delta_overlay*)ar, no);
+}
+
+static bool overlay_exists_by_name(struct archive *ar, const char *name, int *id_out)
+{
+	struct overlay_entry *e = ht_get(((struct delta_overlay*)ar)->name_index, name, NULL);
+	if (e && id_out)
+		*id_out = e->no;
+	return !!e;
+}
+
+static bool overlay_exists_by_basename(struct archive *ar, const char *name, int *id_out)
+{
+	struct overlay_entry *e = overlay_find_by_basename((struct delta_overlay*)ar, name);
+	if (e && id_out)
+		*id_out = e->no;
+	return !!e;
+}
+
+static struct archive_data *overlay_descriptor(struct delta_overlay *ov, struct overlay_entry *e)
+{
+	struct overlay_data *d = xcalloc(1, sizeof(struct overlay_data));
+	d->data.size = e->size;
+	d->data.name = xstrdup(e->name);
+	d->data.no = e->no;
+	d->data.archive = &ov->ar;
+	d->entry = e;
+	return &d->data;
+}
+
+static bool overlay_load_file(struct archive_data *data)
+{
+	if (data->data)
+		return true;
+
+	struct overlay_data *d = (struct overlay_data*)data;
+	struct delta_overlay *ov = (struct delta_overlay*)data->archive;
+	struct overlay_entry *e = d->entry;
+	if (!e->op) {
+		d->base = archive_get(ov->base, e->base_no);
+		if (!d->base)
+			return false;
+		data->data = d->base->data;
+		data->size = d->base->size;
+		return true;
+	}
+	if (e->op->type == OP_PUT) {
+		data->data = patch_payload(&ov->patch, e->op, &d->owned);
+		return !!data->data;
+	}
+
+	struct archive_data *base = archive_get(ov->base, e->base_no);
+	if (!base)
+		return false;
+	data->data = patch_apply_delta(&ov->patch, e->op, base->data, base->size);
+	archive_free_data(base);
+	d->owned = true;
+	return !!data->data;
+}
+
+static struct archive_data *overlay_get_entry(struct delta_overlay *ov, struct overlay_entry *e)
+{
+	if (!e)
+		return NULL;
+	struct archive_data *data = overlay_descriptor(ov, e);
+	if (!overlay_load_file(data)) {
+		overlay_free_data(data);
+		return NULL;
+	}
+	return data;
+}
+
+static struct archive_data *overlay_get(struct archive *ar, int no)
+{
+	struct delta_overlay *ov = (struct delta_overlay*)ar;
+	return overlay_get_entry(ov, overlay_find(ov, no));
+}
+
+static struct archive_data *overlay_get_by_name(struct archive *ar, const char *name)
+{
+	struct delta_overlay *ov = (struct delta_overlay*)ar;
+	return overlay_get_entry(ov, ht_get(ov->name_index, name, NULL));
+}
+
+static struct archive_data *overlay_get_by_basename(struct archive *ar, const char *name)
+{
+	struct delta_overlay *ov = (struct delta_overlay*)ar;
+	return overlay_get_entry(ov, overlay_find_by_basename(ov, name));
+}
+
+static void overlay_release_file(struct archive_data *data)
+{
+	struct overlay_data *d = (struct overlay_data*)data;
+	if (d->base) {
+		archive_free_data(d->base);
+		d->base = NULL;
+	} else if (d->owned) {
+		free(data->data);
+	}
+	data->data = NULL;
+	d->owned = false;
+}
+
+static struct archive_data *overlay_copy_descriptor(struct archive_data *src)
+{
+	struct overlay_data *s = (struct overlay_data*)src;
+	return overlay_descriptor((struct delta_overlay*)src->archive, s->entry);
+}
+
+static void overlay_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user)
+{
+	struct delta_overlay *ov = (struct delta_overlay*)ar;
+	for (size_t i = 0; i < ov->nr_entries; i++) {
+		struct archive_data *data = overlay_descriptor(ov, &ov->entries[i]);
+		iter(data, user);
+		overlay_free_data(data);
+	}
+}
+
+static void overlay_free_data(struct archive_data *data)
+{
+	overlay_release_file(data);
+	free(data->name);
+	free(data);
+}
+
+static void overlay_free(struct archive *ar)
+{
+	struct delta_overlay *ov = (struct delta_overlay*)ar;
+	for (size_t i = 0; i < ov->nr_entries; i++) {
+		free(ov->entries[i].name);
+	}
+	free(ov->entries);
+	if (ov->name_index)
+		ht_free(ov->name_index);
+	if (ov->basename_index)
+		ht_free(ov->basename_index);
+	patch_close(&ov->patch);
+	free(ov);
+}
+
+typedef kvec_t(struct overlay_entry) overlay_entry_list;
+
+static void collect_base_entry(struct archive_data *data, void *user)
+{
+	struct overlay_entry e = {
+		.name = xstrdup(data->name),
+		.no = data->no,
+		.base_no = data->no,
+		.size = data->size,
+	};
+	kv_push(struct overlay_entry, *(overlay_entry_list*)user, e);
+}
+
+struct archive *archive_delta_overlay(struct archive *base, const char *path, int flags,
+		int *error)
+{
+	struct delta_overlay *ov = xcalloc(1, sizeof(struct delta_overlay));
+	if (!patch_open(&ov->patch, path, flags, error)) {
+		free(ov);
+		return NULL;
+	}
+	ov->base = base;
+	ov->ar.mmapped = false;
+	ov->ar.ops = &overlay_archive_ops;
+	ov->ar.conv = base->conv;
+
+	if (archive_fingerprint(base) != ov->patch.fingerprint) {
+		WARNING("'%s' was made against a different archive", path);
+		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+		goto err;
+	}
+
+	overlay_entry_list list;
+	kv_init(list);
+	archive_for_each(base, collect_base_entry, &list);
+	int next_no = 0;
+	struct hash_table *index = ht_create(max(kv_size(list), (size_t)16));
+	for (size_t i = 0; i < kv_size(list); i++) {
+		ht_put(index, kv_A(list, i).name, (void*)(uintptr_t)(i + 1));
+		next_no = max(next_no, kv_A(list, i).no + 1);
+	}
+
+	bool ok = true;
+	for (uint32_t i = 0; i < ov->patch.nr_ops && ok; i++) {
+		struct patch_op *op = &ov->patch.ops[i];
+		size_t idx = (uintptr_t)ht_get(index, op->name, NULL);
+		struct overlay_entry *e = idx ? &kv_A(list, idx - 1) : NULL;
+		if (e && e->removed)
+			e = NULL;
+		if (op->type == OP_PUT && !e) {
+			struct overlay_entry added = {
+				.name = xstrdup(op->name),
+				.no = next_no++,
+				.base_no = -1,
+				.size = op->size,
+				.op = op,
+			};
+			kv_push(struct overlay_entry, list, added);
+			ht_put(index, op->name, NULL)->value = (void*)(uintptr_t)kv_size(list);
+		} else if (!e) {
+			WARNING("Patch refers to missing entry '%s'", op->name);
+			ok = false;
+		} else if (op->type == OP_REMOVE) {
+			e->removed = true;
+		} else if (op->type == OP_DELTA && e->base_no < 0) {
+			WARNING("Patch has a delta for added entry '%s'", op->name);
+			ok = false;
+		} else {
+			e->op = op;
+			e->size = op->size;
+		}
+	}
+	ht_free(index);
+
+	// keep the live entries, sorted by number
+	size_t n = 0;
+	for (size_t i = 0; i < kv_size(list); i++) {
+		if (kv_A(list, i).removed)
+			free(kv_A(list, i).name);
+		else
+			kv_A(list, n++) = kv_A(list, i);
+	}
+	ov->entries = list.a;
+	ov->nr_entries = n;
+	if (!ok) {
+		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+		goto err;
+	}
+	qsort(ov->entries, n, sizeof(struct overlay_entry), entry_no_cmp);
+
+	ov->name_index = ht_create(max(n, (size_t)16));
+	ov->basename_index = ht_create(max(n, (size_t)16));
+	for (size_t i = 0; i < n; i++) {
+		struct overlay_entry *e = &ov->entries[i];
+		ht_put(ov->name_index, e->name, e);
+		char *key = archive_basename(e->name);
+		struct ht_slot *slot = ht_put(ov->basename_index, key, NULL);
+		if (!slot->value)
+			slot->value = e;
+		free(key);
+	}
+	_sys4_trace_archive_open(&ov->ar, path);
+	return &ov->ar;
+err:
+	overlay_free(&ov->ar);
+	return NULL;
+}
+
+/*
+ * Applying patches to AFA archives in place.
+ *
+ * New and changed entries are appended after the data section. The index
+ * lives between the header and the data section; if the new index doesn't fit
+ * there, the start of the data section is moved forward and the entries it
+ * passes over are appended as well.
+ */
+
+// extra room left for future indices when the data section has to be moved
+#define INDEX_SLACK 1024
+
+struct afa_table_entry {
+	const char *name;
+	size_t name_len;
+	int32_t no;
+	uint32_t unknown0;
+	uint32_t unknown1;
+	uint64_t pos;      // position of the data in the patched file
+	uint64_t size;
+	int64_t src;       // position of the data in the unpatched file (-1 = added)
+	uint64_t src_size;
+	struct patch_op *op;
+	bool removed;
+};
+
+typedef kvec_t(struct afa_table_entry) afa_table;
+
+static uint8_t *build_file_table(afa_table *table, uint32_t version, uint64_t data_start,
+		size_t *size_out)
+{
+	struct buffer b;
+	buffer_init(&b, NULL, 0);
+	for (size_t i = 0; i < kv_size(*table); i++) {
+		struct afa_table_entry *e = &kv_A(*table, i);
+		if (e->removed)
+			continue;
+		// name is NUL-terminated and padded to a multiple of 4 bytes
+		size_t padded_len = (e->name_len + 4) & ~(size_t)3;
+		buffer_write_int32(&b, e->name_len);
+		buffer_write_int32(&b, padded_len);
+		buffer_write_bytes(&b, (const uint8_t*)e->name, e->name_len);
+		for (size_t j = e->name_len; j < padded_len; j++) {
+			buffer_write_int8(&b, 0);
+		}
+		if (version == 1)
+			buffer_write_int32(&b, e->no + 1);
+		buffer_write_int32(&b, e->unknown0);
+		buffer_write_int32(&b, e->unknown1);
+		buffer_write_int32(&b, e->pos - data_start);
+		buffer_write_int32(&b, e->size);
+	}
+	*size_out = b.index;
+	return b.buf;
+}
+
+static uint8_t *afa_read_data(struct afa_archive *ar, uint64_t pos, uint64_t size)
+{
+	uint8_t *buf = xmalloc(max(size, (uint64_t)1));
+	if (!archive_file_read(&ar->file, buf, size, pos)) {
+		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * Get the contents to write at the new position of an entry.
+ */
+static uint8_t *afa_entry_contents(struct patch *p, struct afa_archive *ar,
+		struct afa_table_entry *e, bool *owned)
+{
+	*owned = true;
+	if (!e->op)
+		return afa_read_data(ar, e->src, e->size);
+
+	if (e->op->type == OP_PUT) {
+		uint8_t *data = patch_payload(p, e->op, owned);
+		if (data && hash64(data, e->op->size, 0) != e->op->hash) {
+			WARNING("Corrupt patch data for '%s'", e->op->name);
+			if (*owned)
+				free(data);
+			return NULL;
+		}
+		return data;
+	}
+
+	uint8_t *base = afa_read_data(ar, e->src, e->src_size);
+	if (!base)
+		return NULL;
+	uint8_t *data = patch_apply_delta(p, e->op, base, e->src_size);
+	free(base);
+	return data;
+}
+
+bool archive_delta_apply_afa(const char *afa_path, const char *patch_path)
+{
+	int error = ARCHIVE_SUCCESS;
+	struct patch patch;
+	if (!patch_open(&patch, patch_path, 0, &error)) {
+		WARNING("Failed to open '%s': %s", patch_path, archive_strerror(error));
+		return false;
+	}
+	struct afa_archive *ar = afa_open(afa_path, 0, &error);
+	if (!ar) {
+		WARNING("Failed to open '%s': %s", afa_path, archive_strerror(error));
+		patch_close(&patch);
+		return false;
+	}
+
+	bool ok = false;
+	FILE *f = NULL;
+	uint8_t *table = NULL, *packed = NULL;
+	afa_table entries;
+	kv_init(entries);
+	struct hash_table *index = ht_create(max(ar->nr_files, 16u));
+
+	uint8_t hdr_buf[16];
+	const uint8_t *hdr = archive_file_view(&ar->file, hdr_buf, 16, 0);
+	if (!hdr || memcmp(hdr + 8, "AlicArch", 8) || (ar->version != 1 && ar->version != 2)) {
+		WARNING("Only AFA v1 and v2 archives can be patched in place");
+		goto out;
+	}
+	if (archive_fingerprint(&ar->ar) != patch.fingerprint) {
+		WARNING("'%s' was made against a different archive", patch_path);
+		goto out;
+	}
+
+	int32_t next_no = 0;
+	for (uint32_t i = 0; i < ar->nr_files; i++) {
+		struct afa_entry *fe = &ar->files[i];
+		struct afa_table_entry e = {
+			.name = fe->name->text,
+			.name_len = fe->name->size,
+			.no = fe->no,
+			.unknown0 = fe->unknown0,
+			.unknown1 = fe->unknown1,
+			.pos = (uint64_t)ar->data_start + fe->off,
+			.size = fe->size,
+			.src = (uint64_t)ar->data_start + fe->off,
+			.src_size = fe->size,
+		};
+		kv_push(struct afa_table_entry, entries, e);
+		ht_put(index, fe->name->text, (void*)(uintptr_t)(i + 1));
+		next_no = max(next_no, fe->no + 1);
+	}
+
+	// lay out the new data after the end of the data section
+	uint64_t end = (uint64_t)ar->data_start + ar->data_size;
+	for (uint32_t i = 0; i < patch.nr_ops; i++) {
+		struct patch_op *op = &patch.ops[i];
+		size_t idx = (uintptr_t)ht_get(index, op->name, NULL);
+		struct afa_table_entry *e = idx ? &kv_A(entries, idx - 1) : NULL;
+		if (e && e->removed)
+			e = NULL;
+		if (op->type == OP_PUT && !e) {
+			struct afa_table_entry added = {
+				.name = op->name,
+				.name_len = strlen(op->name),
+				.no = next_no++,
+				.src = -1,
+			};
+			kv_push(struct afa_table_entry, entries, added);
+			ht_put(index, op->name, NULL)->value = (void*)(uintptr_t)kv_size(entries);
+			e = &kv_A(entries, kv_size(entries) - 1);
+		} else if (!e || (op->type == OP_DELTA && e->src < 0)) {
+			WARNING("Patch refers to missing entry '%s'", op->name);
+			goto out;
+		} else if (op->type == OP_REMOVE) {
+			e->removed = true;
+			continue;
+		}
+		if (op->size > UINT32_MAX) {
+			WARNING("AFA archives are limited to 4GiB");
+			goto out;
+		}
+		e->op = op;
+		e->pos = end;
+		e->size = op->size;
+		end += op->size;
+	}
+
+	// AFAv2 numbers entries by position
+	uint32_t nr_files = 0;
+	for (size_t i = 0; i < kv_size(entries); i++) {
+		struct afa_table_entry *e = &kv_A(entries, i);
+		if (e->removed)
+			continue;
+		if (ar->version == 2)
+			e->no = nr_files;
+		nr_files++;
+	}
+
+	size_t table_size, packed_size;
+	uint64_t data_start = ar->data_start;
+	for (int tries = 0; ; tries++) {
+		table = build_file_table(&entries, ar->version, data_start, &table_size);
+		packed_size = sys4_deflate_bound(table_size);
+		packed = xmalloc(packed_size);
+		if (sys4_deflate(packed, &packed_size, table, table_size, SYS4_Z_BEST_COMPRESSION) != SYS4_Z_OK) {
+			WARNING("compress2 failed");
+			goto out;
+		}
+		if (44 + packed_size <= data_start)
+			break;
+		if (tries == 4) {
+			WARNING("Failed to make room for the index of '%s'", afa_path);
+			goto out;
+		}
+		free(table);
+		free(packed);
+
+		// move the start of the data section past the new index, and
+		// the entries at the front of it to the end of the file
+		data_start = 44 + packed_size + INDEX_SLACK;
+		for (size_t i = 0; i < kv_size(entries); i++) {
+			struct afa_table_entry *e = &kv_A(entries, i);
+			if (e->removed || e->pos >= data_start + 8)
+				continue;
+			e->pos = end;
+			end += e->size;
+		}
+	}
+	if (end > UINT32_MAX) {
+		WARNING("AFA archives are limited to 4GiB");
+		goto out;
+	}
+
+	f = file_open_utf8(afa_path, "r+b");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", afa_path, strerror(errno));
+		goto out;
+	}
+	int fd = fileno(f);
+
+	// 1. append the data: the old index stays valid until it is replaced
+	for (size_t i = 0; i < kv_size(entries); i++) {
+		struct afa_table_entry *e = &kv_A(entries, i);
+		if (e->removed || !e->size || (int64_t)e->pos == e->src)
+			continue;
+		bool owned;
+		uint8_t *data = afa_entry_contents(&patch, ar, e, &owned);
+		if (!data)
+			goto out;
+		bool write_ok = archive_pwrite(fd, data, e->size, e->pos);
+		if (owned)
+			free(data);
+		if (!write_ok)
+			goto write_error;
+	}
+	// extend the file in case the last entries were empty
+	fseek(f, 0, SEEK_END);
+	if ((uint64_t)ftell(f) < end && !archive_pwrite(fd, "", 1, end - 1))
+		goto write_error;
+
+	// 2. replace the index (and move the data section header) in one write
+	struct buffer b;
+	buffer_init(&b, NULL, 0);
+	buffer_write_int32(&b, data_start);
+	buffer_write_bytes(&b, (uint8_t*)"INFO", 4);
+	buffer_write_int32(&b, packed_size + 16);
+	buffer_write_int32(&b, table_size);
+	buffer_write_int32(&b, nr_files);
+	buffer_write_bytes(&b, packed, packed_size);
+	while (24 + b.index < data_start) {
+		buffer_write_int8(&b, 0);
+	}
+	buffer_write_bytes(&b, (uint8_t*)"DATA", 4);
+	buffer_write_int32(&b, end - data_start);
+	bool write_ok = archive_pwrite(fd, b.buf, b.index, 24);
+	free(b.buf);
+	if (!write_ok)
+		goto write_error;
+	ok = true;
+	goto out;
+write_error:
+	WARNING("Failed to write '%s': %s", afa_path, strerror(errno));
+out:
+	if (f && fclose(f)) {
+		WARNING("fclose failed: %s", strerror(errno));
+		ok = false;
+	}
+	free(table);
+	free(packed);
+	ht_free(index);
+	kv_destroy(entries);
+	archive_free(&ar->ar);
+	patch_close(&patch);
+	return ok;
+}
@@ -0,0 +1,375 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/file.h"
+#include "archive_io.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+
+bool archive_pread(int fd, void *buf, size_t size, uint64_t off)
+{
+	if (_lseeki64(fd, off, SEEK_SET) < 0)
+		return false;
+	uint8_t *p = buf;
+	while (size > 0) {
+		int r = _read(fd, p, size > 0x40000000 ? 0x40000000 : size);
+		if (r <= 0)
+			return false;
+		p += r;
+		size -= r;
+	}
+	return true;
+}
+
+bool archive_pwrite(int fd, const void *buf, size_t size, uint64_t off)
+{
+	if (_lseeki64(fd, off, SEEK_SET) < 0)
+		return false;
+	const uint8_t *p = buf;
+	while (size > 0) {
+		int r = _write(fd, p, size > 0x40000000 ? 0x40000000 : size);
+		if (r <= 0)
+			return false;
+		p += r;
+		size -= r;
+	}
+	return true;
+}
+
+#else
+
+bool archive_pread(int fd, void *buf, size_t size, uint64_t off)
+{
+	uint8_t *p = buf;
+	while (size > 0) {
+		ssize_t r = pread(fd, p, size, off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (r == 0) {
+			errno = EIO;
+			return false;
+		}
+		p += r;
+		size -= r;
+		off += r;
+	}
+	return true;
+}
+
+bool archive_pwrite(int fd, const void *buf, size_t size, uint64_t off)
+{
+	const uint8_t *p = buf;
+	while (size > 0) {
+		ssize_t r = pwrite(fd, p, size, off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += r;
+		size -= r;
+		off += r;
+	}
+	return true;
+}
+
+#endif
+
+#ifdef _WIN32
+
+static int open_rdonly(const char *path, uint64_t *size)
+{
+	// go through stdio so that UTF-8 paths are handled
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f)
+		return -1;
+	int fd = _dup(_fileno(f));
+	fclose(f);
+	if (fd < 0)
+		return -1;
+	struct _stat64 s;
+	if (_fstat64(fd, &s)) {
+		_close(fd);
+		return -1;
+	}
+	*size = s.st_size;
+	return fd;
+}
+
+#define close_fd _close
+
+static uint8_t *map_file(possibly_unused int fd, possibly_unused size_t size,
+		possibly_unused int flags)
+{
+	return NULL;
+}
+
+#else
+
+static int open_rdonly(const char *path, uint64_t *size)
+{
+#ifdef O_CLOEXEC
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+#else
+	int fd = open(path, O_RDONLY);
+#endif
+	if (fd < 0)
+		return -1;
+	struct stat s;
+	if (fstat(fd, &s)) {
+		close(fd);
+		return -1;
+	}
+	*size = s.st_size;
+	return fd;
+}
+
+#define close_fd close
+
+static uint8_t *map_file(int fd, size_t size, int flags)
+{
+	int mmap_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (flags & ARCHIVE_MMAP_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+#endif
+	uint8_t *map = mmap(NULL, size, PROT_READ, mmap_flags, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	// only a hint: ignored unless the kernel supports THP for file mappings
+	madvise(map, size, MADV_HUGEPAGE);
+#endif
+	return map;
+}
+
+#endif
+
+bool archive_file_maps(possibly_unused int flags)
+{
+#ifdef _WIN32
+	return false;
+#else
+	return flags & (ARCHIVE_MMAP | ARCHIVE_MMAP_POPULATE);
+#endif
+}
+
+bool archive_file_open(struct archive_file *file, const char *path, int flags, int *error)
+{
+	if (!archive_file_maps(flags))
+		flags &= ~(ARCHIVE_MMAP | ARCHIVE_MMAP_POPULATE);
+	if (flags & ARCHIVE_MMAP_POPULATE)
+		flags |= ARCHIVE_MMAP;
+
+	uint64_t size;
+	file->map = NULL;
+	file->fd = open_rdonly(path, &size);
+	if (file->fd < 0) {
+		WARNING("open failed: %s", strerror(errno));
+		*error = ARCHIVE_FILE_ERROR;
+		return false;
+	}
+	if (size > SIZE_MAX) {
+		WARNING("File too large: %s", path);
+		close_fd(file->fd);
+		*error = ARCHIVE_FILE_ERROR;
+		return false;
+	}
+	file->size = size;
+
+	// an empty file can't be mapped (and can't be a valid archive either)
+	if ((flags & ARCHIVE_MMAP) && file->size > 0) {
+		if (!(file->map = map_file(file->fd, file->size, flags))) {
+			WARNING("mmap failed: %s", strerror(errno));
+			close_fd(file->fd);
+			*error = ARCHIVE_FILE_ERROR;
+			return false;
+		}
+		// the mapping keeps the file alive; no need to hold on to the fd
+		close_fd(file->fd);
+		file->fd = -1;
+	}
+	return true;
+}
+
+void archive_file_close(struct archive_file *file)
+{
+	if (file->map)
+		munmap(file->map, file->size);
+	if (file->fd >= 0)
+		close_fd(file->fd);
+	file->map = NULL;
+	file->fd = -1;
+}
+
+const uint8_t *archive_file_view(struct archive_file *file, void *buf, size_t size, uint64_t off)
+{
+	if (off > file->size || size > file->size - off)
+		return NULL;
+	if (file->map)
+		return file->map + off;
+	if (!archive_pread(file->fd, buf, size, off))
+		return NULL;
+	return buf;
+}
+
+bool archive_file_read(struct archive_file *file, void *buf, size_t size, uint64_t off)
+{
+	const uint8_t *p = archive_file_view(file, buf, size, off);
+	if (!p)
+		return false;
+	if (p != buf)
+		memcpy(buf, p, size);
+	return true;
+}
+
+void archive_file_prefetch(struct archive_file *file, uint64_t off, size_t size)
+{
+	if (!size || off > file->size || size > file->size - off)
+		return;
+#ifndef _WIN32
+	if (file->map) {
+#ifdef MADV_WILLNEED
+		// madvise wants a page-aligned address
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		uint64_t start = off & ~(page - 1);
+		madvise(file->map + start, off + size - start, MADV_WILLNEED);
+#endif
+	} else {
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(file->fd, off, size, POSIX_FADV_WILLNEED);
+#endif
+	}
+#endif
+}
+
+static bool read_batch_pread(struct archive_read_req *reqs, size_t n)
+{
+	bool ok = true;
+	for (size_t i = 0; i < n; i++) {
+		reqs[i].ok = archive_pread(reqs[i].fd, reqs[i].buf, reqs[i].size, reqs[i].off);
+		ok = ok && reqs[i].ok;
+	}
+	return ok;
+}
+
+#ifdef HAVE_LIBURING
+
+// number of reads in flight at once
+#define URING_QUEUE_DEPTH 64
+
+/*
+ * Submit reads in batches of up to URING_QUEUE_DEPTH and reap completions as
+ * they arrive. Short reads (rare for regular files) are finished off
+ * synchronously with pread.
+ */
+static bool read_batch_uring(struct archive_read_req *reqs, size_t n, bool *ok_out)
+{
+	struct io_uring ring;
+	if (io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0) < 0)
+		return false;
+
+	bool ok = true;
+	size_t next = 0, in_flight = 0;
+	while (next < n || in_flight > 0) {
+		while (next < n && in_flight < URING_QUEUE_DEPTH) {
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+			if (!sqe)
+				break;
+			io_uring_prep_read(sqe, reqs[next].fd, reqs[next].buf,
+					reqs[next].size, reqs[next].off);
+			io_uring_sqe_set_data(sqe, &reqs[next]);
+			next++;
+			in_flight++;
+		}
+
+		int r = io_uring_submit_and_wait(&ring, 1);
+		if (r < 0 && r != -EINTR) {
+			WARNING("io_uring_submit_and_wait failed: %s", strerror(-r));
+			break;
+		}
+
+		unsigned head, nr_seen = 0;
+		struct io_uring_cqe *cqe;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			struct archive_read_req *req = io_uring_cqe_get_data(cqe);
+			if (cqe->res < 0) {
+				req->ok = archive_pread(req->fd, req->buf, req->size, req->off);
+			} else if ((size_t)cqe->res < req->size) {
+				size_t done = cqe->res;
+				req->ok = archive_pread(req->fd, req->buf + done,
+						req->size - done, req->off + done);
+			} else {
+				req->ok = true;
+			}
+			ok = ok && req->ok;
+			nr_seen++;
+		}
+		io_uring_cq_advance(&ring, nr_seen);
+		in_flight -= nr_seen;
+	}
+
+	io_uring_queue_exit(&ring);
+
+	// anything left over (submission failure) is read synchronously
+	if (next < n || in_flight > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (reqs[i].ok)
+				continue;
+			reqs[i].ok = archive_pread(reqs[i].fd, reqs[i].buf, reqs[i].size, reqs[i].off);
+		}
+		ok = true;
+		for (size_t i = 0; i < n; i++)
+			ok = ok && reqs[i].ok;
+	}
+
+	*ok_out = ok;
+	return true;
+}
+
+#endif /* HAVE_LIBURING */
+
+bool archive_read_batch(struct archive_read_req *reqs, size_t n, possibly_unused bool use_io_uring)
+{
+	for (size_t i = 0; i < n; i++) {
+		reqs[i].ok = false;
+	}
+#ifdef HAVE_LIBURING
+	bool ok;
+	// not worth setting up a ring for a single read
+	if (use_io_uring && n > 1 && read_batch_uring(reqs, n, &ok))
+		return ok;
+#endif
+	return read_batch_pread(reqs, n);
+}
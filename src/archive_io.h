@@ -0,0 +1,90 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_ARCHIVE_IO_H
+#define SYSTEM4_ARCHIVE_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A single positioned read, used for batched loading.
+ */
+struct archive_read_req {
+	int fd;
+	uint64_t off;
+	size_t size;
+	uint8_t *buf;
+	bool ok;
+};
+
+/*
+ * Read exactly `size` bytes at offset `off` without touching the file position
+ * (where the platform allows it).
+ */
+bool archive_pread(int fd, void *buf, size_t size, uint64_t off);
+
+/*
+ * Write exactly `size` bytes at offset `off`. On platforms without pwrite
+ * this moves the file position, so concurrent use is only safe on POSIX.
+ */
+bool archive_pwrite(int fd, const void *buf, size_t size, uint64_t off);
+
+/*
+ * Perform a batch of reads. When `use_io_uring` is set and io_uring is
+ * available, all reads are submitted to the kernel at once and reaped as they
+ * complete; otherwise they are issued one at a time with `archive_pread`.
+ * Returns true if every read succeeded. The `ok` field of each request is set
+ * individually.
+ */
+bool archive_read_batch(struct archive_read_req *reqs, size_t n, bool use_io_uring);
+
+struct archive_file;
+
+/*
+ * Open `path` as the backing store of an archive. If `flags` includes
+ * ARCHIVE_MMAP (and the platform supports it) the file is also mapped.
+ * On failure `*error` is set and false is returned.
+ */
+bool archive_file_open(struct archive_file *file, const char *path, int flags, int *error);
+void archive_file_close(struct archive_file *file);
+
+/*
+ * Whether archive_file_open maps (non-empty) files when given `flags`.
+ */
+bool archive_file_maps(int flags);
+
+/*
+ * Get `size` bytes at offset `off`. For mapped files this returns a pointer
+ * into the mapping and `buf` is unused; otherwise the bytes are read into
+ * `buf`. Returns NULL if the range is out of bounds or the read failed.
+ */
+const uint8_t *archive_file_view(struct archive_file *file, void *buf, size_t size, uint64_t off);
+
+/*
+ * Copy `size` bytes at offset `off` into `buf`.
+ */
+bool archive_file_read(struct archive_file *file, void *buf, size_t size, uint64_t off);
+
+/*
+ * Hint that `size` bytes at offset `off` will be read soon, so that the OS
+ * can start reading them in the background (madvise/posix_fadvise
+ * WILLNEED). Does nothing where no such hint exists.
+ */
+void archive_file_prefetch(struct archive_file *file, uint64_t off, size_t size);
+
+#endif /* SYSTEM4_ARCHIVE_IO_H */
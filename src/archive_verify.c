@@ -0,0 +1,396 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <zlib.h>
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/file.h"
+#include "system4/hashtable.h"
+#include "archive_io.h"
+#include "hash.h"
+#include "kvec.h"
+#include "thread_pool.h"
+
+// entries read with pread are hashed in chunks of this size
+#define CHUNK_SIZE (1024 * 1024)
+
+#define MANIFEST_MAGIC "# libsys4 archive manifest"
+// 2: FLAT entries are hashed as stored (compressed), not as loaded
+#define MANIFEST_VERSION 2
+
+struct hasher {
+	enum archive_hash_type type;
+	struct hash64_state xxh;
+	uLong crc;
+};
+
+static void hasher_init(struct hasher *h, enum archive_hash_type type)
+{
+	h->type = type;
+	if (type == ARCHIVE_HASH_CRC32)
+		h->crc = crc32(0, Z_NULL, 0);
+	else
+		hash64_init(&h->xxh, 0);
+}
+
+static void hasher_update(struct hasher *h, const uint8_t *data, size_t size)
+{
+	if (h->type != ARCHIVE_HASH_CRC32) {
+		hash64_update(&h->xxh, data, size);
+		return;
+	}
+	// crc32 takes a uInt length
+	while (size > 0) {
+		uInt n = size > 0x40000000 ? 0x40000000 : size;
+		h->crc = crc32(h->crc, data, n);
+		data += n;
+		size -= n;
+	}
+}
+
+static uint64_t hasher_digest(struct hasher *h)
+{
+	if (h->type == ARCHIVE_HASH_CRC32)
+		return h->crc;
+	return hash64_digest(&h->xxh);
+}
+
+struct verify_item {
+	char *name;
+	struct archive_extent ext;
+	uint64_t size;
+	uint64_t hash;
+	bool hashed;
+	bool ok;
+};
+
+struct verify_job {
+	enum archive_hash_type type;
+	kvec_t(struct verify_item) items;
+	struct verify_item **order;
+	uint8_t **bufs;
+};
+
+static void collect_entry(struct archive_data *data, void *user)
+{
+	struct verify_job *job = user;
+	struct verify_item item = { .name = xstrdup(data->name) };
+	if (archive_get_extent(data, &item.ext)) {
+		item.size = item.ext.size;
+		kv_push(struct verify_item, job->items, item);
+		return;
+	}
+
+	// no direct access to the stored bytes: hash the loaded data instead
+	item.hashed = true;
+	if (archive_load_file(data)) {
+		struct hasher h;
+		hasher_init(&h, job->type);
+		hasher_update(&h, data->data, data->size);
+		item.hash = hasher_digest(&h);
+		item.size = data->size;
+		item.ok = true;
+		archive_release_file(data);
+	}
+	kv_push(struct verify_item, job->items, item);
+}
+
+static void hash_item(size_t i, int worker, void *user)
+{
+	struct verify_job *job = user;
+	struct verify_item *item = job->order[i];
+	if (item->hashed)
+		return;
+
+	struct hasher h;
+	hasher_init(&h, job->type);
+	if (item->ext.ptr) {
+		hasher_update(&h, item->ext.ptr, item->ext.size);
+	} else {
+		uint8_t *buf = job->bufs[worker];
+		for (size_t off = 0; off < item->ext.size; off += CHUNK_SIZE) {
+			size_t n = min(item->ext.size - off, (size_t)CHUNK_SIZE);
+			if (!archive_pread(item->ext.fd, buf, n, item->ext.off + off)) {
+				item->hashed = true;
+				return;
+			}
+			hasher_update(&h, buf, n);
+		}
+	}
+	item->hash = hasher_digest(&h);
+	item->hashed = true;
+	item->ok = true;
+}
+
+static int item_cmp(const void *_a, const void *_b)
+{
+	const struct verify_item *a = *(const struct verify_item**)_a;
+	const struct verify_item *b = *(const struct verify_item**)_b;
+	if (a->ext.fd != b->ext.fd)
+		return a->ext.fd < b->ext.fd ? -1 : 1;
+	if (a->ext.off != b->ext.off)
+		return a->ext.off < b->ext.off ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Hash the stored bytes of every entry in `ar`. Work is handed out in file
+ * order, so that the threads together sweep through the archive more or less
+ * sequentially.
+ */
+static void hash_archive(struct archive *ar, struct verify_job *job, int nr_threads)
+{
+	kv_init(job->items);
+	archive_for_each(ar, collect_entry, job);
+
+	size_t n = kv_size(job->items);
+	job->order = xcalloc(n, sizeof(struct verify_item*));
+	for (size_t i = 0; i < n; i++) {
+		job->order[i] = &kv_A(job->items, i);
+	}
+	qsort(job->order, n, sizeof(struct verify_item*), item_cmp);
+
+	struct thread_pool *pool = thread_pool_create(nr_threads);
+	int nr_workers = thread_pool_nr_threads(pool);
+	job->bufs = xcalloc(nr_workers, sizeof(uint8_t*));
+	// entries outside of a mapping are read into per-thread buffers (even a
+	// "mapped" archive may not have been mapped, e.g. on Windows)
+	bool need_bufs = false;
+	for (size_t i = 0; i < n; i++) {
+		struct verify_item *item = &kv_A(job->items, i);
+		if (!item->hashed && !item->ext.ptr)
+			need_bufs = true;
+	}
+	if (need_bufs) {
+		for (int i = 0; i < nr_workers; i++) {
+			job->bufs[i] = xmalloc(CHUNK_SIZE);
+		}
+	}
+	thread_pool_run(pool, n, hash_item, job);
+	thread_pool_free(pool);
+
+	for (int i = 0; i < nr_workers; i++) {
+		free(job->bufs[i]);
+	}
+	free(job->bufs);
+	free(job->order);
+}
+
+static void verify_job_fini(struct verify_job *job)
+{
+	for (size_t i = 0; i < kv_size(job->items); i++) {
+		free(kv_A(job->items, i).name);
+	}
+	kv_destroy(job->items);
+}
+
+struct archive_manifest *archive_manifest_create(struct archive *ar, enum archive_hash_type type,
+		int nr_threads)
+{
+	struct verify_job job = { .type = type };
+	hash_archive(ar, &job, nr_threads);
+
+	struct archive_manifest *m = xcalloc(1, sizeof(struct archive_manifest));
+	m->hash_type = type;
+	m->nr_entries = kv_size(job.items);
+	m->entries = xcalloc(m->nr_entries, sizeof(struct archive_manifest_entry));
+	for (size_t i = 0; i < m->nr_entries; i++) {
+		struct verify_item *item = &kv_A(job.items, i);
+		if (!item->ok) {
+			WARNING("Failed to read '%s'", item->name);
+			archive_manifest_free(m);
+			verify_job_fini(&job);
+			return NULL;
+		}
+		m->entries[i].name = item->name;
+		m->entries[i].size = item->size;
+		m->entries[i].hash = item->hash;
+		item->name = NULL;
+	}
+	verify_job_fini(&job);
+	return m;
+}
+
+void archive_manifest_free(struct archive_manifest *m)
+{
+	for (size_t i = 0; i < m->nr_entries; i++) {
+		free(m->entries[i].name);
+	}
+	free(m->entries);
+	free(m);
+}
+
+static const char *hash_type_name(enum archive_hash_type type)
+{
+	return type == ARCHIVE_HASH_CRC32 ? "crc32" : "xxh64";
+}
+
+/*
+ * The manifest format is line-based text:
+ *
+ *     # libsys4 archive manifest v2: xxh64
+ *     <hash (hex)> <size> <name>
+ *     ...
+ *
+ * The name extends to the end of the line and is stored verbatim. Version 1
+ * manifests have no version in the header.
+ */
+bool archive_manifest_write(struct archive_manifest *m, const char *path)
+{
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		return false;
+	}
+	fprintf(f, MANIFEST_MAGIC " v%d: %s\n", MANIFEST_VERSION, hash_type_name(m->hash_type));
+	for (size_t i = 0; i < m->nr_entries; i++) {
+		struct archive_manifest_entry *e = &m->entries[i];
+		fprintf(f, "%0*" PRIx64 " %" PRIu64 " %s\n",
+				m->hash_type == ARCHIVE_HASH_CRC32 ? 8 : 16,
+				e->hash, e->size, e->name);
+	}
+	bool ok = !ferror(f);
+	if (fclose(f))
+		ok = false;
+	if (!ok)
+		WARNING("Failed to write '%s': %s", path, strerror(errno));
+	return ok;
+}
+
+struct archive_manifest *archive_manifest_read(const char *path)
+{
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	char line[4096];
+	struct archive_manifest *m = xcalloc(1, sizeof(struct archive_manifest));
+	if (!fgets(line, sizeof(line), f) || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)))
+		goto bad_manifest;
+	char *type = line + strlen(MANIFEST_MAGIC);
+	long version = 1;
+	if (!strncmp(type, " v", 2))
+		version = strtol(type + 2, &type, 10);
+	if (strncmp(type, ": ", 2))
+		goto bad_manifest;
+	type += 2;
+	if (version != MANIFEST_VERSION) {
+		WARNING("%s: unsupported manifest version %ld (create it again)", path, version);
+		free(m);
+		fclose(f);
+		return NULL;
+	}
+	if (!strncmp(type, "xxh64", 5))
+		m->hash_type = ARCHIVE_HASH_XXH64;
+	else if (!strncmp(type, "crc32", 5))
+		m->hash_type = ARCHIVE_HASH_CRC32;
+	else
+		goto bad_manifest;
+
+	kvec_t(struct archive_manifest_entry) entries;
+	kv_init(entries);
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+		char *p;
+		struct archive_manifest_entry e;
+		e.hash = strtoull(line, &p, 16);
+		if (*p++ != ' ')
+			goto bad_entry;
+		e.size = strtoull(p, &p, 10);
+		if (*p++ != ' ')
+			goto bad_entry;
+		e.name = xstrdup(p);
+		kv_push(struct archive_manifest_entry, entries, e);
+		continue;
+bad_entry:
+		WARNING("%s: invalid manifest entry: %s", path, line);
+		for (size_t i = 0; i < kv_size(entries); i++) {
+			free(kv_A(entries, i).name);
+		}
+		kv_destroy(entries);
+		free(m);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	m->nr_entries = kv_size(entries);
+	m->entries = kv_data(entries);
+	return m;
+bad_manifest:
+	WARNING("%s: not an archive manifest", path);
+	free(m);
+	fclose(f);
+	return NULL;
+}
+
+int archive_verify(struct archive *ar, struct archive_manifest *manifest, int nr_threads)
+{
+	struct verify_job job = { .type = manifest->hash_type };
+	hash_archive(ar, &job, nr_threads);
+
+	struct hash_table *ht = ht_create(manifest->nr_entries * 3 / 2);
+	for (size_t i = 0; i < manifest->nr_entries; i++) {
+		struct ht_slot *slot = ht_put(ht, manifest->entries[i].name, NULL);
+		if (!slot->value)
+			slot->value = &manifest->entries[i];
+	}
+
+	int nr_errors = 0;
+	bool *seen = xcalloc(manifest->nr_entries, sizeof(bool));
+	for (size_t i = 0; i < kv_size(job.items); i++) {
+		struct verify_item *item = &kv_A(job.items, i);
+		struct archive_manifest_entry *e = ht_get(ht, item->name, NULL);
+		if (!e) {
+			WARNING("%s: not in manifest", item->name);
+			nr_errors++;
+			continue;
+		}
+		seen[e - manifest->entries] = true;
+		if (!item->ok) {
+			WARNING("%s: read failed", item->name);
+			nr_errors++;
+		} else if (item->size != e->size || item->hash != e->hash) {
+			WARNING("%s: checksum mismatch", item->name);
+			nr_errors++;
+		}
+	}
+	for (size_t i = 0; i < manifest->nr_entries; i++) {
+		if (seen[i])
+			continue;
+		// duplicate manifest entries are only checked once
+		if (ht_get(ht, manifest->entries[i].name, NULL) != &manifest->entries[i])
+			continue;
+		WARNING("%s: missing from archive", manifest->entries[i].name);
+		nr_errors++;
+	}
+
+	free(seen);
+	ht_free(ht);
+	verify_job_fini(&job);
+	return nr_errors;
+}
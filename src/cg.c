@@ -17,9 +17,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "system4.h"
 #include "system4/archive.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/file.h"
 #include "system4/ajp.h"
 #include "system4/dcf.h"
@@ -28,7 +30,9 @@
 #include "system4/pms.h"
 #include "system4/png.h"
 #include "system4/qnt.h"
+#include "system4/trace.h"
 #include "system4/webp.h"
+#include "coverage.h"
 
 const char *cg_file_extensions[_ALCG_NR_FORMATS] = {
 	[ALCG_UNKNOWN] = "",
@@ -132,10 +136,26 @@ void cg_free(struct cg *cg)
 {
 	if (!cg)
 		return;
-	free(cg->pixels);
+	if (cg->mapping)
+		munmap(cg->mapping, cg->mapping_size);
+	else if (cg->pooled)
+		cg_pool_free(cg->pixels);
+	else
+		free(cg->pixels);
+	free(cg->coverage.tiles);
 	free(cg);
 }
 
+/*
+ * Get the alpha coverage of a CG, computing it if the decoder didn't.
+ */
+const struct cg_coverage *cg_get_coverage(struct cg *cg)
+{
+	if (!cg->coverage.valid && cg->pixels && cg->metrics.w > 0 && cg->metrics.h > 0)
+		coverage_compute(&cg->coverage, cg->pixels, cg->metrics.w, cg->metrics.h);
+	return &cg->coverage;
+}
+
 static struct cg *cg_load_internal(uint8_t *buf, size_t buf_size, struct archive *ar)
 {
 	struct cg *cg = xcalloc(1, sizeof(struct cg));
@@ -177,9 +197,18 @@ static struct cg *cg_load_internal(uint8_t *buf, size_t buf_size, struct archive
 	return NULL;
 }
 
+static size_t cg_bytes(struct cg *cg)
+{
+	return cg ? (size_t)cg->metrics.w * cg->metrics.h * 4 : 0;
+}
+
 struct cg *cg_load_data(struct archive_data *dfile)
 {
-	return cg_load_internal(dfile->data, dfile->size, dfile->archive);
+	uint64_t t = sys4_trace_begin();
+	struct cg *cg = cg_load_internal(dfile->data, dfile->size, dfile->archive);
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_CG_LOAD, dfile->archive, dfile->no, NULL, cg_bytes(cg), cg);
+	return cg;
 }
 
 /*
@@ -189,25 +218,32 @@ struct cg *cg_load_data(struct archive_data *dfile)
 */
 struct cg *cg_load(struct archive *ar, int no)
 {
-	struct cg *cg;
+	struct cg *cg = NULL;
 	struct archive_data *dfile;
+	uint64_t t = sys4_trace_begin();
 
 	if (!(dfile = archive_get(ar, no))) {
 		WARNING("Failed to load CG %d", no);
-		return NULL;
+		goto end;
 	}
 
 	cg = cg_load_data(dfile);
 	archive_free_data(dfile);
+end:
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_CG_LOAD, ar, no, NULL, cg_bytes(cg), cg);
 	return cg;
 }
 
 struct cg *cg_load_file(const char *filename)
 {
 	size_t buf_size;
+	uint64_t t = sys4_trace_begin();
 	uint8_t *buf = file_read(filename, &buf_size);
 	struct cg *cg = cg_load_internal(buf, buf_size, NULL);
 	free(buf);
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_CG_LOAD_FILE, NULL, -1, filename, cg_bytes(cg), cg);
 	return cg;
 }
 
@@ -216,17 +252,124 @@ struct cg *cg_load_buffer(uint8_t *buf, size_t buf_size)
 	return cg_load_internal(buf, buf_size, NULL);
 }
 
-int cg_write(struct cg *cg, enum cg_type type, FILE *f)
+static void canvas_clear_rows(struct cg_canvas *canvas, int from, int to)
+{
+	if (from >= to)
+		return;
+	if (canvas->stride == (size_t)canvas->w * 4) {
+		memset(cg_canvas_at(canvas, 0, from), 0, (size_t)(to - from) * canvas->stride);
+		return;
+	}
+	for (int row = from; row < to; row++)
+		memset(cg_canvas_at(canvas, 0, row), 0, (size_t)canvas->w * 4);
+}
+
+/*
+ * Clear the part of a canvas outside of the w*h rectangle at (x,y), e.g.
+ * before decoding an image into that rectangle.
+ */
+void cg_canvas_clear_border(struct cg_canvas *canvas, int x, int y, int w, int h)
+{
+	canvas_clear_rows(canvas, 0, y);
+	for (int row = y; row < y + h; row++) {
+		memset(cg_canvas_at(canvas, 0, row), 0, (size_t)x * 4);
+		memset(cg_canvas_at(canvas, x + w, row), 0, (size_t)(canvas->w - x - w) * 4);
+	}
+	canvas_clear_rows(canvas, y + h, canvas->h);
+}
+
+static bool cg_load_into_internal(uint8_t *buf, size_t buf_size, struct archive *ar,
+		struct cg_canvas *dst, int x, int y, struct cg_metrics *metrics)
+{
+	struct cg_metrics m = {0};
+	if (!metrics)
+		metrics = &m;
+
+	// formats which can decode rows in place
+	switch (cg_check_format(buf)) {
+	case ALCG_QNT:
+		qnt_get_metrics(buf, metrics);
+		return qnt_extract_into(buf, dst, x, y);
+	case ALCG_PNG:
+		return png_cg_get_metrics(buf, buf_size, metrics)
+			&& png_cg_extract_into(buf, buf_size, dst, x, y);
+	case ALCG_PMS8:
+	case ALCG_PMS16:
+		pms_get_metrics(buf, metrics);
+		return pms_extract_into(buf, buf_size, dst, x, y);
+	case ALCG_PCF:
+		return pcf_get_metrics(buf, buf_size, metrics)
+			&& pcf_extract_into(buf, buf_size, dst, x, y);
+	case ALCG_WEBP:
+		webp_get_metrics(buf, buf_size, metrics);
+		return webp_extract_into(buf, buf_size, dst, x, y, ar);
+	default:
+		break;
+	}
+
+	// everything else is decoded and then copied row by row
+	struct cg *cg = cg_load_internal(buf, buf_size, ar);
+	if (!cg)
+		return false;
+	*metrics = cg->metrics;
+	bool ok = cg_canvas_fits(dst, x, y, cg->metrics.w, cg->metrics.h);
+	if (ok) {
+		const uint8_t *src = cg->pixels;
+		for (int row = 0; row < cg->metrics.h; row++) {
+			memcpy(cg_canvas_at(dst, x, y + row), src, (size_t)cg->metrics.w * 4);
+			src += (size_t)cg->metrics.w * 4;
+		}
+	} else {
+		WARNING("CG doesn't fit in canvas");
+	}
+	cg_free(cg);
+	return ok;
+}
+
+/*
+ * Decode a CG directly into a canvas, with its top-left corner at (x,y).
+ * Pixels outside of the image are left untouched. The display offset in the
+ * CG's metrics is not applied. If `metrics` is non-NULL, it receives the
+ * CG's metrics.
+ */
+bool cg_load_data_into(struct archive_data *dfile, struct cg_canvas *dst, int x, int y,
+		struct cg_metrics *metrics)
+{
+	uint64_t t = sys4_trace_begin();
+	bool ok = cg_load_into_internal(dfile->data, dfile->size, dfile->archive, dst, x, y, metrics);
+	if (t) {
+		size_t bytes = ok && metrics ? (size_t)metrics->w * metrics->h * 4 : 0;
+		_sys4_trace_end(t, SYS4_TRACE_CG_LOAD, dfile->archive, dfile->no, NULL, bytes, ok);
+	}
+	return ok;
+}
+
+bool cg_load_buffer_into(uint8_t *buf, size_t buf_size, struct cg_canvas *dst, int x, int y,
+		struct cg_metrics *metrics)
+{
+	return cg_load_into_internal(buf, buf_size, NULL, dst, x, y, metrics);
+}
+
+/*
+ * Encode a CG. If `opts` is NULL, CG_WRITE_OPTIONS_DEFAULT is used.
+ */
+int cg_write_with_options(struct cg *cg, enum cg_type type, FILE *f,
+		const struct cg_write_options *opts)
 {
 	switch (type) {
 	case ALCG_QNT:
 		return qnt_write(cg, f);
 	case ALCG_PNG:
-		return png_cg_write(cg, f);
+		return png_cg_write_with_options(cg, f, opts);
 	case ALCG_WEBP:
-		return webp_write(cg, f);
+		return webp_write_with_options(cg, f, opts);
 	default:
 		WARNING("encoding not supported for CG type");
 	}
 	return 0;
 }
+
+int cg_write(struct cg *cg, enum cg_type type, FILE *f)
+{
+	return cg_write_with_options(cg, type, f, NULL);
+}
@@ -0,0 +1,262 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/cg.h"
+#include "system4/cg_atlas.h"
+#include "kvec.h"
+#include "thread_pool.h"
+
+/*
+ * Skyline bottom-left packer. The skyline is the upper edge of the packed
+ * area, stored as a list of horizontal segments from left to right covering
+ * the full width of the atlas. Each rectangle is placed where its bottom
+ * edge ends up lowest.
+ */
+
+struct skyline_node {
+	int x, y, w;
+};
+
+struct skyline {
+	int w, h;
+	kvec_t(struct skyline_node) nodes;
+};
+
+static void skyline_init(struct skyline *s, int w, int h)
+{
+	s->w = w;
+	s->h = h;
+	kv_init(s->nodes);
+	struct skyline_node n = { 0, 0, w };
+	kv_push(struct skyline_node, s->nodes, n);
+}
+
+static void skyline_erase(struct skyline *s, size_t i)
+{
+	memmove(&kv_A(s->nodes, i), &kv_A(s->nodes, i+1),
+			(kv_size(s->nodes) - i - 1) * sizeof(struct skyline_node));
+	s->nodes.n--;
+}
+
+/*
+ * Get the y coordinate at which a w*h rectangle fits with its left edge at
+ * node i, or -1 if it doesn't fit there.
+ */
+static int skyline_fit(struct skyline *s, size_t i, int w, int h)
+{
+	if (kv_A(s->nodes, i).x + w > s->w)
+		return -1;
+	int y = 0;
+	for (int left = w; left > 0; i++) {
+		struct skyline_node *n = &kv_A(s->nodes, i);
+		y = max(y, n->y);
+		if (y + h > s->h)
+			return -1;
+		left -= n->w;
+	}
+	return y;
+}
+
+static bool skyline_insert(struct skyline *s, int w, int h, int *x_out, int *y_out)
+{
+	int best_bottom = INT_MAX, best_w = INT_MAX, best_y = 0;
+	size_t best_i = 0;
+	for (size_t i = 0; i < kv_size(s->nodes); i++) {
+		int y = skyline_fit(s, i, w, h);
+		if (y < 0)
+			continue;
+		struct skyline_node *n = &kv_A(s->nodes, i);
+		if (y + h < best_bottom || (y + h == best_bottom && n->w < best_w)) {
+			best_bottom = y + h;
+			best_w = n->w;
+			best_y = y;
+			best_i = i;
+		}
+	}
+	if (best_bottom == INT_MAX)
+		return false;
+
+	*x_out = kv_A(s->nodes, best_i).x;
+	*y_out = best_y;
+
+	// insert the new segment and cut it out of the segments it covers
+	struct skyline_node n = { *x_out, best_y + h, w };
+	kv_push(struct skyline_node, s->nodes, n);
+	memmove(&kv_A(s->nodes, best_i+1), &kv_A(s->nodes, best_i),
+			(kv_size(s->nodes) - best_i - 1) * sizeof(struct skyline_node));
+	kv_A(s->nodes, best_i) = n;
+	for (size_t i = best_i + 1; i < kv_size(s->nodes);) {
+		struct skyline_node *prev = &kv_A(s->nodes, i-1);
+		struct skyline_node *cur = &kv_A(s->nodes, i);
+		int overlap = prev->x + prev->w - cur->x;
+		if (overlap <= 0)
+			break;
+		cur->x += overlap;
+		cur->w -= overlap;
+		if (cur->w > 0)
+			break;
+		skyline_erase(s, i);
+	}
+
+	// merge neighbouring segments at the same height
+	for (size_t i = 0; i + 1 < kv_size(s->nodes);) {
+		if (kv_A(s->nodes, i).y == kv_A(s->nodes, i+1).y) {
+			kv_A(s->nodes, i).w += kv_A(s->nodes, i+1).w;
+			skyline_erase(s, i+1);
+		} else {
+			i++;
+		}
+	}
+	return true;
+}
+
+/*
+ * Atlas building.
+ */
+
+struct atlas_job {
+	struct cg_atlas *atlas;
+	struct archive_data **files;
+	struct cg_atlas_rect **order;
+};
+
+static void decode_entry(size_t i, possibly_unused int worker, void *user)
+{
+	struct atlas_job *job = user;
+	struct cg_atlas_rect *r = job->order[i];
+	size_t no = r - job->atlas->rects;
+
+	// decode into the slot reserved from the CG's metrics
+	struct cg_canvas slot = {
+		.pixels = job->atlas->pixels + ((size_t)r->atlas_y * job->atlas->w + r->atlas_x) * 4,
+		.w = r->w,
+		.h = r->h,
+		.stride = (size_t)job->atlas->w * 4,
+	};
+	if (!cg_load_data_into(job->files[no], &slot, 0, 0, NULL)) {
+		WARNING("Failed to decode CG '%s'", job->files[no]->name);
+		r->packed = false;
+	}
+	archive_free_data(job->files[no]);
+	job->files[no] = NULL;
+}
+
+static int rect_cmp(const void *_a, const void *_b)
+{
+	const struct cg_atlas_rect *a = *(const struct cg_atlas_rect**)_a;
+	const struct cg_atlas_rect *b = *(const struct cg_atlas_rect**)_b;
+	if (a->h != b->h)
+		return b->h - a->h;
+	if (a->w != b->w)
+		return b->w - a->w;
+	return a < b ? -1 : a > b;
+}
+
+struct cg_atlas *cg_atlas_build(struct cg_atlas_source *sources, size_t nr_sources,
+		const struct cg_atlas_options *opts)
+{
+	struct cg_atlas_options dflt = {
+		.max_w = 4096,
+		.max_h = 4096,
+		.padding = 1,
+		.nr_threads = 0,
+	};
+	if (!opts)
+		opts = &dflt;
+
+	struct cg_atlas *atlas = xcalloc(1, sizeof(struct cg_atlas));
+	atlas->nr_rects = nr_sources;
+	atlas->rects = xcalloc(nr_sources, sizeof(struct cg_atlas_rect));
+
+	// read headers; the data is kept for decoding
+	struct archive_data **files = xcalloc(nr_sources, sizeof(struct archive_data*));
+	struct cg_atlas_rect **order = xcalloc(nr_sources, sizeof(struct cg_atlas_rect*));
+	size_t nr_valid = 0;
+	for (size_t i = 0; i < nr_sources; i++) {
+		struct cg_metrics m = {0};
+		if (!(files[i] = archive_get(sources[i].ar, sources[i].no))) {
+			WARNING("Failed to load CG %d", sources[i].no);
+			continue;
+		}
+		if (!cg_get_metrics_data(files[i], &m) || m.w <= 0 || m.h <= 0) {
+			WARNING("Failed to read metrics for CG '%s'", files[i]->name);
+			archive_free_data(files[i]);
+			files[i] = NULL;
+			continue;
+		}
+		atlas->rects[i].w = m.w;
+		atlas->rects[i].h = m.h;
+		atlas->rects[i].x = m.x;
+		atlas->rects[i].y = m.y;
+		order[nr_valid++] = &atlas->rects[i];
+	}
+
+	// tallest first
+	qsort(order, nr_valid, sizeof(struct cg_atlas_rect*), rect_cmp);
+
+	// the height is rounded up to a multiple of 4 afterwards, so only pack
+	// into the part of max_h that can be rounded up to without exceeding it
+	int pack_h = opts->max_h >= 4 ? opts->max_h & ~3 : opts->max_h;
+
+	// padding is reserved to the right and below each image, so the
+	// packing area is extended by the same amount
+	struct skyline sky;
+	skyline_init(&sky, opts->max_w + opts->padding, pack_h + opts->padding);
+	size_t nr_packed = 0;
+	int used_h = 0;
+	for (size_t i = 0; i < nr_valid; i++) {
+		struct cg_atlas_rect *r = order[i];
+		if (!skyline_insert(&sky, r->w + opts->padding, r->h + opts->padding,
+					&r->atlas_x, &r->atlas_y)) {
+			archive_free_data(files[r - atlas->rects]);
+			files[r - atlas->rects] = NULL;
+			continue;
+		}
+		r->packed = true;
+		used_h = max(used_h, r->atlas_y + r->h);
+		order[nr_packed++] = order[i];
+	}
+	kv_destroy(sky.nodes);
+
+	atlas->w = opts->max_w;
+	atlas->h = min((used_h + 3) & ~3, opts->max_h);
+	atlas->pixels = xcalloc((size_t)atlas->w * atlas->h, 4);
+
+	struct atlas_job job = {
+		.atlas = atlas,
+		.files = files,
+		.order = order,
+	};
+	parallel_for(opts->nr_threads, nr_packed, decode_entry, &job);
+
+	free(order);
+	free(files);
+	return atlas;
+}
+
+void cg_atlas_free(struct cg_atlas *atlas)
+{
+	free(atlas->pixels);
+	free(atlas->rects);
+	free(atlas);
+}
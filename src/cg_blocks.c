@@ -0,0 +1,575 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "system4.h"
+#include "system4/cg.h"
+#include "system4/cg_blocks.h"
+#include "thread_pool.h"
+
+/*
+ * CPU encoder for BC1, BC3 and BC7 (mode 6) textures.
+ *
+ * All formats use the same approach: choose two endpoints spanning the
+ * colors in the block, quantize them to the format's precision, and then
+ * assign each pixel the nearest color on the line between them. The inner
+ * loops work on fixed-size arrays of 16 pixels so that the compiler can
+ * vectorize them.
+ */
+
+// interpolation weights (out of 64) for BC7 4-bit indices
+static const int bc7_weights4[16] = {
+	0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+struct block {
+	float px[16][4];
+};
+
+static inline float clampf(float v, float lo, float hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static inline int round_clamp(float v, int hi)
+{
+	if (v <= 0.0f)
+		return 0;
+	int i = (int)(v + 0.5f);
+	return i > hi ? hi : i;
+}
+
+/*
+ * Fetch a 4x4 block, repeating edge pixels for blocks that extend past the
+ * edge of the image.
+ */
+static void fetch_block(const uint8_t *pixels, int w, int h, int bx, int by, struct block *b)
+{
+	for (int y = 0; y < 4; y++) {
+		int sy = min(by*4 + y, h - 1);
+		for (int x = 0; x < 4; x++) {
+			int sx = min(bx*4 + x, w - 1);
+			const uint8_t *p = pixels + ((size_t)sy * w + sx) * 4;
+			for (int c = 0; c < 4; c++) {
+				b->px[y*4+x][c] = p[c];
+			}
+		}
+	}
+}
+
+/*
+ * Endpoints from the bounding box of the block. The box diagonal is chosen
+ * according to the sign of each channel's correlation with the channel of
+ * greatest extent.
+ */
+static void bbox_endpoints(struct block *b, int nch, float e0[4], float e1[4])
+{
+	float lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+	float mean[4] = { 0 };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < nch; c++) {
+			lo[c] = b->px[i][c] < lo[c] ? b->px[i][c] : lo[c];
+			hi[c] = b->px[i][c] > hi[c] ? b->px[i][c] : hi[c];
+			mean[c] += b->px[i][c];
+		}
+	}
+	int major = 0;
+	for (int c = 0; c < nch; c++) {
+		mean[c] /= 16.0f;
+		if (hi[c] - lo[c] > hi[major] - lo[major])
+			major = c;
+	}
+	for (int c = 0; c < nch; c++) {
+		float cov = 0;
+		for (int i = 0; i < 16; i++) {
+			cov += (b->px[i][c] - mean[c]) * (b->px[i][major] - mean[major]);
+		}
+		e0[c] = cov < 0 ? hi[c] : lo[c];
+		e1[c] = cov < 0 ? lo[c] : hi[c];
+	}
+}
+
+/*
+ * Endpoints along the principal axis of the block's colors: the extremes of
+ * the pixels projected onto the axis.
+ */
+static void pca_endpoints(struct block *b, int nch, float e0[4], float e1[4])
+{
+	float mean[4] = { 0 };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < nch; c++) {
+			mean[c] += b->px[i][c];
+		}
+	}
+	for (int c = 0; c < nch; c++) {
+		mean[c] /= 16.0f;
+	}
+
+	float cov[4][4] = { { 0 } };
+	for (int i = 0; i < 16; i++) {
+		float d[4];
+		for (int c = 0; c < nch; c++) {
+			d[c] = b->px[i][c] - mean[c];
+		}
+		for (int r = 0; r < nch; r++) {
+			for (int c = 0; c < nch; c++) {
+				cov[r][c] += d[r] * d[c];
+			}
+		}
+	}
+
+	// power iteration, starting from the row with the largest variance
+	int start = 0;
+	for (int c = 1; c < nch; c++) {
+		if (cov[c][c] > cov[start][start])
+			start = c;
+	}
+	float axis[4] = { 0 };
+	for (int c = 0; c < nch; c++) {
+		axis[c] = cov[start][c];
+	}
+	for (int iter = 0; iter < 8; iter++) {
+		float next[4] = { 0 }, m = 0;
+		for (int r = 0; r < nch; r++) {
+			for (int c = 0; c < nch; c++) {
+				next[r] += cov[r][c] * axis[c];
+			}
+			m = fabsf(next[r]) > m ? fabsf(next[r]) : m;
+		}
+		if (m < 1e-6f)
+			break;
+		for (int c = 0; c < nch; c++) {
+			axis[c] = next[c] / m;
+		}
+	}
+
+	float len2 = 0;
+	for (int c = 0; c < nch; c++) {
+		len2 += axis[c] * axis[c];
+	}
+	if (len2 < 1e-6f) {
+		// solid block
+		for (int c = 0; c < nch; c++) {
+			e0[c] = e1[c] = mean[c];
+		}
+		return;
+	}
+
+	float tmin = 1e30f, tmax = -1e30f;
+	for (int i = 0; i < 16; i++) {
+		float t = 0;
+		for (int c = 0; c < nch; c++) {
+			t += (b->px[i][c] - mean[c]) * axis[c];
+		}
+		tmin = t < tmin ? t : tmin;
+		tmax = t > tmax ? t : tmax;
+	}
+	for (int c = 0; c < nch; c++) {
+		e0[c] = clampf(mean[c] + axis[c] * tmin / len2, 0, 255);
+		e1[c] = clampf(mean[c] + axis[c] * tmax / len2, 0, 255);
+	}
+}
+
+static void choose_endpoints(struct block *b, int nch, int quality, float e0[4], float e1[4])
+{
+	if (quality <= CG_BLOCK_FAST)
+		bbox_endpoints(b, nch, e0, e1);
+	else
+		pca_endpoints(b, nch, e0, e1);
+}
+
+/*
+ * Assign each pixel the nearest palette entry. Returns the total squared
+ * error.
+ */
+static float assign_indices(struct block *b, int nch, const float pal[][4], int nr_pal, uint8_t idx[16])
+{
+	float total = 0;
+	for (int i = 0; i < 16; i++) {
+		float best = 1e30f;
+		for (int p = 0; p < nr_pal; p++) {
+			float err = 0;
+			for (int c = 0; c < nch; c++) {
+				float d = b->px[i][c] - pal[p][c];
+				err += d * d;
+			}
+			if (err < best) {
+				best = err;
+				idx[i] = p;
+			}
+		}
+		total += best;
+	}
+	return total;
+}
+
+/*
+ * Least squares fit of the endpoints to the pixels, given the index of each
+ * pixel and the weight of the second endpoint for each index. Returns false
+ * if the system is degenerate (e.g. all pixels use the same index).
+ */
+static bool refine_endpoints(struct block *b, int nch, const uint8_t idx[16], const float *weights,
+		float e0[4], float e1[4])
+{
+	float aa = 0, ab = 0, bb = 0;
+	float ax[4] = { 0 }, bx[4] = { 0 };
+	for (int i = 0; i < 16; i++) {
+		float beta = weights[idx[i]];
+		float alpha = 1.0f - beta;
+		aa += alpha * alpha;
+		ab += alpha * beta;
+		bb += beta * beta;
+		for (int c = 0; c < nch; c++) {
+			ax[c] += alpha * b->px[i][c];
+			bx[c] += beta * b->px[i][c];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f)
+		return false;
+	for (int c = 0; c < nch; c++) {
+		e0[c] = clampf((ax[c] * bb - bx[c] * ab) / det, 0, 255);
+		e1[c] = clampf((bx[c] * aa - ax[c] * ab) / det, 0, 255);
+	}
+	return true;
+}
+
+/*
+ * BC1 color block (also used for the color half of BC3).
+ */
+
+static uint16_t pack_565(const float c[4])
+{
+	return (round_clamp(c[0] * 31.0f / 255.0f, 31) << 11)
+		| (round_clamp(c[1] * 63.0f / 255.0f, 63) << 5)
+		| round_clamp(c[2] * 31.0f / 255.0f, 31);
+}
+
+static void unpack_565(uint16_t v, float c[4])
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+	c[3] = 255;
+}
+
+static const float bc1_weights[4] = { 0.0f, 1.0f, 1.0f/3.0f, 2.0f/3.0f };
+
+// quantize endpoints and pick indices; c0 > c1 selects 4-color mode
+static float bc1_quantize(struct block *b, const float e0[4], const float e1[4],
+		uint16_t *c0, uint16_t *c1, uint8_t idx[16])
+{
+	*c0 = pack_565(e0);
+	*c1 = pack_565(e1);
+	if (*c0 < *c1) {
+		uint16_t t = *c0;
+		*c0 = *c1;
+		*c1 = t;
+	}
+	float pal[4][4];
+	unpack_565(*c0, pal[0]);
+	unpack_565(*c1, pal[1]);
+	if (*c0 == *c1) {
+		float err = assign_indices(b, 3, pal, 1, idx);
+		return err;
+	}
+	for (int c = 0; c < 3; c++) {
+		pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3.0f;
+		pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3.0f;
+	}
+	return assign_indices(b, 3, pal, 4, idx);
+}
+
+static void encode_bc1_color(struct block *b, int quality, uint8_t *out)
+{
+	float e0[4], e1[4];
+	uint16_t c0, c1;
+	uint8_t idx[16];
+	choose_endpoints(b, 3, quality, e0, e1);
+	float err = bc1_quantize(b, e0, e1, &c0, &c1, idx);
+
+	for (int iter = 0; quality >= CG_BLOCK_HIGH && iter < 2 && err > 0; iter++) {
+		uint16_t r0, r1;
+		uint8_t ridx[16];
+		if (!refine_endpoints(b, 3, idx, bc1_weights, e0, e1))
+			break;
+		float rerr = bc1_quantize(b, e0, e1, &r0, &r1, ridx);
+		if (rerr >= err)
+			break;
+		err = rerr;
+		c0 = r0;
+		c1 = r1;
+		memcpy(idx, ridx, 16);
+	}
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; i++) {
+		bits |= (uint32_t)idx[i] << (i * 2);
+	}
+	out[0] = c0 & 0xff;
+	out[1] = c0 >> 8;
+	out[2] = c1 & 0xff;
+	out[3] = c1 >> 8;
+	out[4] = bits & 0xff;
+	out[5] = (bits >> 8) & 0xff;
+	out[6] = (bits >> 16) & 0xff;
+	out[7] = bits >> 24;
+}
+
+/*
+ * BC3 alpha block: 8-value interpolation between the extremes.
+ */
+static void encode_bc3_alpha(struct block *b, uint8_t *out)
+{
+	int a0 = 0, a1 = 255;
+	for (int i = 0; i < 16; i++) {
+		int a = b->px[i][3];
+		a0 = a > a0 ? a : a0;
+		a1 = a < a1 ? a : a1;
+	}
+	out[0] = a0;
+	out[1] = a1;
+	memset(out + 2, 0, 6);
+	if (a0 == a1)
+		return;
+
+	int pal[8];
+	pal[0] = a0;
+	pal[1] = a1;
+	for (int i = 2; i < 8; i++) {
+		pal[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+	}
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; i++) {
+		int a = b->px[i][3], best = 0, best_err = 256;
+		for (int p = 0; p < 8; p++) {
+			int err = abs(a - pal[p]);
+			if (err < best_err) {
+				best_err = err;
+				best = p;
+			}
+		}
+		bits |= (uint64_t)best << (i * 3);
+	}
+	for (int i = 0; i < 6; i++) {
+		out[2+i] = (bits >> (i * 8)) & 0xff;
+	}
+}
+
+/*
+ * BC7 mode 6: a single subset with 7-bit RGBA endpoints, a p-bit per
+ * endpoint and 4-bit indices.
+ */
+
+struct bc7_endpoint {
+	uint8_t q[4];
+	int p;
+};
+
+static void bc7_quantize_endpoint(const float e[4], struct bc7_endpoint *out)
+{
+	float best = 1e30f;
+	for (int p = 0; p < 2; p++) {
+		float err = 0;
+		uint8_t q[4];
+		for (int c = 0; c < 4; c++) {
+			q[c] = round_clamp((e[c] - p) / 2.0f, 127);
+			float d = ((q[c] << 1) | p) - e[c];
+			err += d * d;
+		}
+		if (err < best) {
+			best = err;
+			memcpy(out->q, q, 4);
+			out->p = p;
+		}
+	}
+}
+
+static float bc7_quantize(struct block *b, const float e0[4], const float e1[4],
+		struct bc7_endpoint *q0, struct bc7_endpoint *q1, uint8_t idx[16])
+{
+	bc7_quantize_endpoint(e0, q0);
+	bc7_quantize_endpoint(e1, q1);
+	float pal[16][4];
+	for (int c = 0; c < 4; c++) {
+		int v0 = (q0->q[c] << 1) | q0->p;
+		int v1 = (q1->q[c] << 1) | q1->p;
+		for (int i = 0; i < 16; i++) {
+			pal[i][c] = ((64 - bc7_weights4[i]) * v0 + bc7_weights4[i] * v1 + 32) >> 6;
+		}
+	}
+	return assign_indices(b, 4, pal, 16, idx);
+}
+
+struct bitwriter {
+	uint64_t lo, hi;
+	int pos;
+};
+
+static void put_bits(struct bitwriter *w, uint64_t v, int n)
+{
+	if (w->pos < 64) {
+		w->lo |= v << w->pos;
+		if (w->pos + n > 64)
+			w->hi |= v >> (64 - w->pos);
+	} else {
+		w->hi |= v << (w->pos - 64);
+	}
+	w->pos += n;
+}
+
+static void encode_bc7(struct block *b, int quality, uint8_t *out)
+{
+	float e0[4], e1[4];
+	struct bc7_endpoint q0, q1;
+	uint8_t idx[16];
+	choose_endpoints(b, 4, quality, e0, e1);
+	float err = bc7_quantize(b, e0, e1, &q0, &q1, idx);
+
+	if (quality >= CG_BLOCK_HIGH) {
+		float weights[16];
+		for (int i = 0; i < 16; i++) {
+			weights[i] = bc7_weights4[i] / 64.0f;
+		}
+		for (int iter = 0; iter < 2 && err > 0; iter++) {
+			struct bc7_endpoint r0, r1;
+			uint8_t ridx[16];
+			if (!refine_endpoints(b, 4, idx, weights, e0, e1))
+				break;
+			float rerr = bc7_quantize(b, e0, e1, &r0, &r1, ridx);
+			if (rerr >= err)
+				break;
+			err = rerr;
+			q0 = r0;
+			q1 = r1;
+			memcpy(idx, ridx, 16);
+		}
+	}
+
+	// the MSB of the first index is implicitly 0: swap endpoints if needed
+	if (idx[0] & 8) {
+		struct bc7_endpoint t = q0;
+		q0 = q1;
+		q1 = t;
+		for (int i = 0; i < 16; i++) {
+			idx[i] = 15 - idx[i];
+		}
+	}
+
+	struct bitwriter w = { 0 };
+	put_bits(&w, 1 << 6, 7);
+	for (int c = 0; c < 4; c++) {
+		put_bits(&w, q0.q[c], 7);
+		put_bits(&w, q1.q[c], 7);
+	}
+	put_bits(&w, q0.p, 1);
+	put_bits(&w, q1.p, 1);
+	put_bits(&w, idx[0], 3);
+	for (int i = 1; i < 16; i++) {
+		put_bits(&w, idx[i], 4);
+	}
+	for (int i = 0; i < 8; i++) {
+		out[i] = (w.lo >> (i * 8)) & 0xff;
+		out[8+i] = (w.hi >> (i * 8)) & 0xff;
+	}
+}
+
+size_t cg_block_size(enum cg_block_format format)
+{
+	switch (format) {
+	case CG_BLOCK_BC1: return 8;
+	case CG_BLOCK_BC3: return 16;
+	case CG_BLOCK_BC7: return 16;
+	}
+	return 0;
+}
+
+struct encode_job {
+	const uint8_t *pixels;
+	int w, h;
+	int quality;
+	struct cg_blocks *blocks;
+};
+
+static void encode_row(size_t by, possibly_unused int worker, void *user)
+{
+	struct encode_job *job = user;
+	struct cg_blocks *blocks = job->blocks;
+	size_t block_size = cg_block_size(blocks->format);
+	uint8_t *out = blocks->data + by * blocks->blocks_w * block_size;
+	for (int bx = 0; bx < blocks->blocks_w; bx++, out += block_size) {
+		struct block b;
+		fetch_block(job->pixels, job->w, job->h, bx, by, &b);
+		switch (blocks->format) {
+		case CG_BLOCK_BC1:
+			encode_bc1_color(&b, job->quality, out);
+			break;
+		case CG_BLOCK_BC3:
+			encode_bc3_alpha(&b, out);
+			encode_bc1_color(&b, job->quality, out + 8);
+			break;
+		case CG_BLOCK_BC7:
+			encode_bc7(&b, job->quality, out);
+			break;
+		}
+	}
+}
+
+struct cg_blocks *cg_encode_blocks(struct cg *cg, enum cg_block_format format, int quality)
+{
+	if (!cg->pixels || cg->metrics.w <= 0 || cg->metrics.h <= 0) {
+		WARNING("Can't encode empty CG");
+		return NULL;
+	}
+	if (!cg_block_size(format)) {
+		WARNING("Unsupported block format: %d", format);
+		return NULL;
+	}
+
+	struct cg_blocks *blocks = xcalloc(1, sizeof(struct cg_blocks));
+	blocks->format = format;
+	blocks->quality = quality;
+	blocks->w = cg->metrics.w;
+	blocks->h = cg->metrics.h;
+	blocks->blocks_w = (blocks->w + 3) / 4;
+	blocks->blocks_h = (blocks->h + 3) / 4;
+	blocks->size = (size_t)blocks->blocks_w * blocks->blocks_h * cg_block_size(format);
+	blocks->data = xmalloc(blocks->size);
+
+	struct encode_job job = {
+		.pixels = cg->pixels,
+		.w = cg->metrics.w,
+		.h = cg->metrics.h,
+		.quality = quality,
+		.blocks = blocks,
+	};
+	parallel_for(0, blocks->blocks_h, encode_row, &job);
+	return blocks;
+}
+
+void cg_blocks_free(struct cg_blocks *blocks)
+{
+	if (blocks->mapping)
+		munmap(blocks->mapping, blocks->mapping_size);
+	else
+		free(blocks->data);
+	free(blocks);
+}
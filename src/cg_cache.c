@@ -0,0 +1,823 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <utime.h>
+#endif
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/buffer.h"
+#include "system4/cg.h"
+#include "system4/cg_blocks.h"
+#include "system4/cg_cache.h"
+#include "system4/file.h"
+#include "system4/hashtable.h"
+#include "hash.h"
+#include "kvec.h"
+
+/*
+ * Cache file layout (little endian):
+ *
+ *     0   "S4CG"
+ *     4   format version
+ *     8   codec id
+ *     12  cg type
+ *     16  metrics (x, y, w, h, bpp, has_pixel, has_alpha, pixel_pitch, alpha_pitch)
+ *     52  key: hash (u64), off (u64), size (u64)
+ *     76  decoded size (u64)
+ *     84  stored size (u64)
+ *     92  block format (0 = RGBA pixels)
+ *     96  block encoding quality
+ *     100 archive path length
+ *     104 archive path
+ *
+ * The stored data starts at the next multiple of CG_CACHE_DATA_ALIGN. For
+ * block-compressed entries only w and h of the metrics are meaningful.
+ */
+#define CG_CACHE_MAGIC "S4CG"
+#define CG_CACHE_VERSION 2
+#define CG_CACHE_HEADER_SIZE 104
+#define CG_CACHE_DATA_ALIGN 4096
+#define CG_CACHE_EXT ".s4cg"
+
+struct cache_entry {
+	char *name;
+	uint64_t size;
+	uint64_t stamp;  // last use; higher is more recent
+	bool present;
+};
+
+struct cg_cache {
+	// protects everything below except dir, max_size and codec
+	pthread_mutex_t lock;
+	char *dir;
+	uint64_t max_size;
+	uint64_t total_size;
+	uint64_t clock;
+	const struct cg_cache_codec *codec;
+	kvec_t(struct cache_entry) entries;
+	struct hash_table *index;  // name -> entry number + 1
+	uint64_t tmp_seq;          // for unique temporary file names
+};
+
+/*
+ * Raw codec: pixels are stored as-is, and can be mapped directly.
+ */
+
+static bool raw_decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+	if (in_size != out_size)
+		return false;
+	memcpy(out, in, out_size);
+	return true;
+}
+
+const struct cg_cache_codec cg_cache_codec_raw = {
+	.id = 0,
+	.name = "raw",
+	.encode = NULL,
+	.decode = raw_decode,
+};
+
+/*
+ * RLE codec: run-length encoding over 32-bit pixels. A control byte c is
+ * followed either by c+1 literal pixels (c < 0x80), or by a single pixel
+ * repeated (c & 0x7f) + 2 times. Cheap to decode, and effective on the large
+ * flat or transparent areas typical of UI graphics.
+ */
+
+static inline bool pixel_eq(const uint8_t *a, const uint8_t *b)
+{
+	return !memcmp(a, b, 4);
+}
+
+static uint8_t *rle_encode(const uint8_t *in, size_t in_size, size_t *out_size)
+{
+	if (in_size % 4)
+		return NULL;
+	size_t n = in_size / 4;
+	uint8_t *out = xmalloc(in_size + n / 128 + 1);
+	uint8_t *o = out;
+	size_t i = 0;
+	while (i < n) {
+		size_t run = 1;
+		while (i + run < n && run < 129 && pixel_eq(in + (i+run)*4, in + i*4))
+			run++;
+		if (run >= 2) {
+			*o++ = 0x80 | (run - 2);
+			memcpy(o, in + i*4, 4);
+			o += 4;
+			i += run;
+			continue;
+		}
+
+		// literal run, up to the start of the next repeat
+		size_t lit = 1;
+		while (i + lit < n && lit < 128) {
+			if (i + lit + 1 < n && pixel_eq(in + (i+lit)*4, in + (i+lit+1)*4))
+				break;
+			lit++;
+		}
+		*o++ = lit - 1;
+		memcpy(o, in + i*4, lit*4);
+		o += lit*4;
+		i += lit;
+	}
+
+	*out_size = o - out;
+	if (*out_size >= in_size) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+static bool rle_decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+	const uint8_t *in_end = in + in_size;
+	uint8_t *out_end = out + out_size;
+	while (in < in_end) {
+		uint8_t c = *in++;
+		if (c & 0x80) {
+			size_t run = (c & 0x7f) + 2;
+			if (in_end - in < 4 || (size_t)(out_end - out) < run * 4)
+				return false;
+			for (size_t i = 0; i < run; i++, out += 4) {
+				memcpy(out, in, 4);
+			}
+			in += 4;
+		} else {
+			size_t lit = (size_t)c + 1;
+			if ((size_t)(in_end - in) < lit * 4 || (size_t)(out_end - out) < lit * 4)
+				return false;
+			memcpy(out, in, lit * 4);
+			in += lit * 4;
+			out += lit * 4;
+		}
+	}
+	return out == out_end;
+}
+
+const struct cg_cache_codec cg_cache_codec_rle = {
+	.id = 1,
+	.name = "rle",
+	.encode = rle_encode,
+	.decode = rle_decode,
+};
+
+static const struct cg_cache_codec *builtin_codecs[] = {
+	&cg_cache_codec_raw,
+	&cg_cache_codec_rle,
+};
+
+static const struct cg_cache_codec *get_codec(struct cg_cache *cache, uint32_t id)
+{
+	if (cache->codec->id == id)
+		return cache->codec;
+	for (size_t i = 0; i < sizeof(builtin_codecs)/sizeof(*builtin_codecs); i++) {
+		if (builtin_codecs[i]->id == id)
+			return builtin_codecs[i];
+	}
+	return NULL;
+}
+
+/*
+ * Index of cache entries (kept in memory, rebuilt from the directory on open).
+ */
+
+static struct cache_entry *cache_lookup(struct cg_cache *cache, const char *name)
+{
+	intptr_t i = (intptr_t)ht_get(cache->index, name, NULL);
+	if (!i || !kv_A(cache->entries, i-1).present)
+		return NULL;
+	return &kv_A(cache->entries, i-1);
+}
+
+static void cache_insert(struct cg_cache *cache, const char *name, uint64_t size, uint64_t stamp)
+{
+	struct ht_slot *slot = ht_put(cache->index, name, NULL);
+	struct cache_entry *e;
+	if (slot->value) {
+		e = &kv_A(cache->entries, (intptr_t)slot->value - 1);
+		if (e->present)
+			cache->total_size -= e->size;
+	} else {
+		struct cache_entry new_entry = { .name = xstrdup(name) };
+		kv_push(struct cache_entry, cache->entries, new_entry);
+		slot->value = (void*)(intptr_t)kv_size(cache->entries);
+		e = &kv_A(cache->entries, kv_size(cache->entries) - 1);
+	}
+	e->size = size;
+	e->stamp = stamp;
+	e->present = true;
+	cache->total_size += size;
+}
+
+static char *entry_path(struct cg_cache *cache, const char *name)
+{
+	return path_join(cache->dir, name);
+}
+
+static bool has_cache_ext(const char *name)
+{
+	size_t len = strlen(name);
+	size_t ext_len = strlen(CG_CACHE_EXT);
+	return len > ext_len && !strcmp(name + len - ext_len, CG_CACHE_EXT);
+}
+
+static void scan_dir(struct cg_cache *cache)
+{
+	UDIR *d = opendir_utf8(cache->dir);
+	if (!d)
+		return;
+	char *name;
+	while ((name = readdir_utf8(d))) {
+		if (!has_cache_ext(name)) {
+			free(name);
+			continue;
+		}
+		char *path = entry_path(cache, name);
+		ustat s;
+		if (stat_utf8(path, &s) == 0) {
+			cache_insert(cache, name, s.st_size, s.st_mtime);
+			if ((uint64_t)s.st_mtime > cache->clock)
+				cache->clock = s.st_mtime;
+		}
+		free(path);
+		free(name);
+	}
+	closedir_utf8(d);
+}
+
+static void cache_remove(struct cg_cache *cache, struct cache_entry *e)
+{
+	char *path = entry_path(cache, e->name);
+	remove_utf8(path);
+	free(path);
+	cache->total_size -= e->size;
+	e->present = false;
+}
+
+// called with cache->lock held
+static void cache_trim(struct cg_cache *cache)
+{
+	while (cache->total_size > cache->max_size) {
+		struct cache_entry *oldest = NULL;
+		for (size_t i = 0; i < kv_size(cache->entries); i++) {
+			struct cache_entry *e = &kv_A(cache->entries, i);
+			if (e->present && (!oldest || e->stamp < oldest->stamp))
+				oldest = e;
+		}
+		if (!oldest)
+			break;
+		cache_remove(cache, oldest);
+	}
+}
+
+struct cg_cache *cg_cache_open(const char *dir, uint64_t max_size, const struct cg_cache_codec *codec)
+{
+	if (mkdir_p(dir) && errno != EEXIST) {
+		WARNING("Failed to create CG cache directory '%s': %s", dir, strerror(errno));
+		return NULL;
+	}
+
+	struct cg_cache *cache = xcalloc(1, sizeof(struct cg_cache));
+	cache->dir = xstrdup(dir);
+	cache->max_size = max_size;
+	cache->codec = codec ? codec : &cg_cache_codec_raw;
+	cache->index = ht_create(1024);
+	kv_init(cache->entries);
+	cache->clock = time(NULL);
+	pthread_mutex_init(&cache->lock, NULL);
+	scan_dir(cache);
+	cache_trim(cache);
+	return cache;
+}
+
+void cg_cache_close(struct cg_cache *cache)
+{
+	for (size_t i = 0; i < kv_size(cache->entries); i++) {
+		free(kv_A(cache->entries, i).name);
+	}
+	kv_destroy(cache->entries);
+	ht_free(cache->index);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->dir);
+	free(cache);
+}
+
+void cg_cache_trim(struct cg_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache_trim(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Get the file name of an entry. Block-compressed versions of an image are
+ * stored separately from its pixels, one entry per format and quality.
+ */
+static void key_name(const struct cg_cache_key *key, uint32_t block_format, uint32_t block_quality,
+		char name[32])
+{
+	struct hash64_state s;
+	hash64_init(&s, 0);
+	hash64_update(&s, key->archive_path, strlen(key->archive_path));
+	hash64_update(&s, &key->off, sizeof(key->off));
+	hash64_update(&s, &key->size, sizeof(key->size));
+	hash64_update(&s, &key->hash, sizeof(key->hash));
+	if (block_format) {
+		hash64_update(&s, &block_format, sizeof(block_format));
+		hash64_update(&s, &block_quality, sizeof(block_quality));
+	}
+	snprintf(name, 32, "%016" PRIx64 CG_CACHE_EXT, hash64_digest(&s));
+}
+
+void cg_cache_key_init(struct cg_cache_key *key, const char *archive_path, struct archive_data *dfile)
+{
+	struct archive_extent ext;
+	key->archive_path = archive_path;
+	key->off = archive_get_extent(dfile, &ext) ? ext.off : (uint64_t)dfile->no;
+	key->size = dfile->size;
+	key->hash = hash64(dfile->data, dfile->size, 0);
+}
+
+static uint64_t read_u64(struct buffer *r)
+{
+	uint64_t lo = (uint32_t)buffer_read_int32(r);
+	uint64_t hi = (uint32_t)buffer_read_int32(r);
+	return lo | (hi << 32);
+}
+
+static void write_u64(struct buffer *b, uint64_t v)
+{
+	buffer_write_int32(b, v & 0xffffffff);
+	buffer_write_int32(b, v >> 32);
+}
+
+static size_t pixels_size(struct cg_metrics *m)
+{
+	return (size_t)m->w * (size_t)m->h * 4;
+}
+
+/*
+ * Map (or on platforms without mmap, read) a cache file. The mapping is
+ * private and writable, so that callers may modify the pixels of a CG loaded
+ * from the cache without affecting the file.
+ */
+static uint8_t *map_entry(const char *path, size_t *size_out, bool *mapped)
+{
+#ifdef _WIN32
+	*mapped = false;
+	return file_read(path, size_out);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat s;
+	if (fstat(fd, &s) || s.st_size < CG_CACHE_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t *map = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size_out = s.st_size;
+	*mapped = true;
+	return map;
+#endif
+}
+
+static void unmap_entry(uint8_t *map, size_t size, bool mapped)
+{
+	if (mapped)
+		munmap(map, size);
+	else
+		free(map);
+}
+
+struct entry_header {
+	const struct cg_cache_codec *codec;
+	enum cg_type type;
+	struct cg_metrics metrics;
+	uint32_t block_format;
+	uint32_t block_quality;
+	uint64_t decoded_size;
+	uint64_t stored_size;
+	size_t data_off;
+};
+
+static size_t data_offset(size_t path_len)
+{
+	return (CG_CACHE_HEADER_SIZE + path_len + CG_CACHE_DATA_ALIGN - 1)
+		& ~(size_t)(CG_CACHE_DATA_ALIGN - 1);
+}
+
+static bool read_header(struct cg_cache *cache, const struct cg_cache_key *key,
+		const uint8_t *map, size_t map_size, struct entry_header *h)
+{
+	if (map_size < CG_CACHE_HEADER_SIZE || memcmp(map, CG_CACHE_MAGIC, 4))
+		return false;
+
+	struct buffer r;
+	buffer_init(&r, (uint8_t*)map, map_size);
+	buffer_skip(&r, 4);
+	if (buffer_read_int32(&r) != CG_CACHE_VERSION)
+		return false;
+	if (!(h->codec = get_codec(cache, buffer_read_int32(&r))))
+		return false;
+	h->type = buffer_read_int32(&r);
+	h->metrics.x = buffer_read_int32(&r);
+	h->metrics.y = buffer_read_int32(&r);
+	h->metrics.w = buffer_read_int32(&r);
+	h->metrics.h = buffer_read_int32(&r);
+	h->metrics.bpp = buffer_read_int32(&r);
+	h->metrics.has_pixel = buffer_read_int32(&r);
+	h->metrics.has_alpha = buffer_read_int32(&r);
+	h->metrics.pixel_pitch = buffer_read_int32(&r);
+	h->metrics.alpha_pitch = buffer_read_int32(&r);
+	uint64_t hash = read_u64(&r);
+	uint64_t off = read_u64(&r);
+	uint64_t size = read_u64(&r);
+	h->decoded_size = read_u64(&r);
+	h->stored_size = read_u64(&r);
+	h->block_format = buffer_read_int32(&r);
+	h->block_quality = buffer_read_int32(&r);
+	uint32_t path_len = buffer_read_int32(&r);
+
+	// the file name is only a hash of the key, so check the key itself
+	if (hash != key->hash || off != key->off || size != key->size)
+		return false;
+	if (path_len != strlen(key->archive_path) || buffer_remaining(&r) < path_len
+			|| memcmp(map + r.index, key->archive_path, path_len))
+		return false;
+	if (h->metrics.w <= 0 || h->metrics.h <= 0)
+		return false;
+	h->data_off = data_offset(path_len);
+	if (h->data_off > map_size || h->stored_size > map_size - h->data_off)
+		return false;
+	return true;
+}
+
+/*
+ * Get the decoded data of an entry. Raw entries in a mapping are used in
+ * place (and *in_place is set); otherwise the data is decoded into a new
+ * buffer.
+ */
+static uint8_t *load_data(struct entry_header *h, uint8_t *map, bool mapped, bool *in_place)
+{
+	*in_place = false;
+	if (h->codec == &cg_cache_codec_raw && mapped) {
+		if (h->stored_size != h->decoded_size)
+			return NULL;
+		*in_place = true;
+		return map + h->data_off;
+	}
+
+	uint8_t *data = xmalloc(h->decoded_size);
+	if (!h->codec->decode(map + h->data_off, h->stored_size, data, h->decoded_size)) {
+		WARNING("Corrupt CG cache entry (codec: %s)", h->codec->name);
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static struct cg *load_entry(struct cg_cache *cache, const struct cg_cache_key *key,
+		uint8_t *map, size_t map_size, bool mapped)
+{
+	struct entry_header h;
+	if (!read_header(cache, key, map, map_size, &h) || h.block_format)
+		return NULL;
+	if (h.decoded_size != pixels_size(&h.metrics))
+		return NULL;
+
+	bool in_place;
+	uint8_t *pixels = load_data(&h, map, mapped, &in_place);
+	if (!pixels)
+		return NULL;
+
+	struct cg *cg = xcalloc(1, sizeof(struct cg));
+	cg->type = h.type;
+	cg->metrics = h.metrics;
+	cg->pixels = pixels;
+	if (in_place) {
+		cg->mapping = map;
+		cg->mapping_size = map_size;
+	} else {
+		unmap_entry(map, map_size, mapped);
+	}
+	return cg;
+}
+
+static struct cg_blocks *load_blocks_entry(struct cg_cache *cache, const struct cg_cache_key *key,
+		uint8_t *map, size_t map_size, bool mapped, enum cg_block_format format, int quality)
+{
+	struct entry_header h;
+	if (!read_header(cache, key, map, map_size, &h))
+		return NULL;
+	if (h.block_format != (uint32_t)format || h.block_quality != (uint32_t)quality)
+		return NULL;
+
+	struct cg_blocks *blocks = xcalloc(1, sizeof(struct cg_blocks));
+	blocks->format = format;
+	blocks->quality = quality;
+	blocks->w = h.metrics.w;
+	blocks->h = h.metrics.h;
+	blocks->blocks_w = (blocks->w + 3) / 4;
+	blocks->blocks_h = (blocks->h + 3) / 4;
+	blocks->size = (size_t)blocks->blocks_w * blocks->blocks_h * cg_block_size(format);
+	if (h.decoded_size != blocks->size) {
+		free(blocks);
+		return NULL;
+	}
+
+	bool in_place;
+	if (!(blocks->data = load_data(&h, map, mapped, &in_place))) {
+		free(blocks);
+		return NULL;
+	}
+	if (in_place) {
+		blocks->mapping = map;
+		blocks->mapping_size = map_size;
+	} else {
+		unmap_entry(map, map_size, mapped);
+	}
+	return blocks;
+}
+
+/*
+ * Map the entry for `name`, or return NULL if there is no such entry.
+ *
+ * Entries are looked up by name each time the cache lock is taken: another
+ * thread may grow the entry table (moving the entries) in the meantime.
+ */
+static uint8_t *open_entry(struct cg_cache *cache, const char *name, size_t *map_size,
+		bool *mapped)
+{
+	pthread_mutex_lock(&cache->lock);
+	bool present = cache_lookup(cache, name);
+	pthread_mutex_unlock(&cache->lock);
+	if (!present)
+		return NULL;
+
+	char *path = entry_path(cache, name);
+	uint8_t *map = map_entry(path, map_size, mapped);
+	free(path);
+	if (!map) {
+		// removed behind our back
+		pthread_mutex_lock(&cache->lock);
+		struct cache_entry *e = cache_lookup(cache, name);
+		if (e) {
+			cache->total_size -= e->size;
+			e->present = false;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+	return map;
+}
+
+/*
+ * Mark an entry as used, both in memory and (via its mtime) on disk so that
+ * the LRU order survives across runs.
+ */
+static void touch_entry(struct cg_cache *cache, const char *name)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct cache_entry *e = cache_lookup(cache, name);
+	if (e)
+		e->stamp = ++cache->clock;
+	pthread_mutex_unlock(&cache->lock);
+#ifndef _WIN32
+	char *path = entry_path(cache, name);
+	utime(path, NULL);
+	free(path);
+#endif
+}
+
+struct cg *cg_cache_get(struct cg_cache *cache, const struct cg_cache_key *key)
+{
+	char name[32];
+	key_name(key, 0, 0, name);
+	size_t map_size;
+	bool mapped;
+	uint8_t *map = open_entry(cache, name, &map_size, &mapped);
+	if (!map)
+		return NULL;
+
+	struct cg *cg = load_entry(cache, key, map, map_size, mapped);
+	if (!cg) {
+		unmap_entry(map, map_size, mapped);
+		return NULL;
+	}
+	touch_entry(cache, name);
+	return cg;
+}
+
+struct cg_blocks *cg_cache_get_blocks(struct cg_cache *cache, const struct cg_cache_key *key,
+		enum cg_block_format format, int quality)
+{
+	char name[32];
+	key_name(key, format, quality, name);
+	size_t map_size;
+	bool mapped;
+	uint8_t *map = open_entry(cache, name, &map_size, &mapped);
+	if (!map)
+		return NULL;
+
+	struct cg_blocks *blocks = load_blocks_entry(cache, key, map, map_size, mapped, format, quality);
+	if (!blocks) {
+		unmap_entry(map, map_size, mapped);
+		return NULL;
+	}
+	touch_entry(cache, name);
+	return blocks;
+}
+
+static bool write_entry(const char *path, struct buffer *header, const uint8_t *data, size_t size)
+{
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(header->buf, header->index, 1, f) == 1;
+	if (ok && size)
+		ok = fwrite(data, size, 1, f) == 1;
+	if (fclose(f))
+		ok = false;
+	return ok;
+}
+
+/*
+ * Encode and store an entry. `h` supplies the type, metrics and block
+ * format; the codec and sizes are filled in here.
+ */
+static bool put_entry(struct cg_cache *cache, const struct cg_cache_key *key,
+		struct entry_header *h, const uint8_t *data, size_t size)
+{
+	h->codec = cache->codec;
+	h->decoded_size = size;
+	h->stored_size = size;
+	uint8_t *encoded = NULL;
+	if (h->codec->encode && (encoded = h->codec->encode(data, size, &h->stored_size))) {
+		data = encoded;
+	} else {
+		h->codec = &cg_cache_codec_raw;
+		h->stored_size = size;
+	}
+
+	struct buffer b;
+	buffer_init(&b, NULL, 0);
+	buffer_write_bytes(&b, (const uint8_t*)CG_CACHE_MAGIC, 4);
+	buffer_write_int32(&b, CG_CACHE_VERSION);
+	buffer_write_int32(&b, h->codec->id);
+	buffer_write_int32(&b, h->type);
+	buffer_write_int32(&b, h->metrics.x);
+	buffer_write_int32(&b, h->metrics.y);
+	buffer_write_int32(&b, h->metrics.w);
+	buffer_write_int32(&b, h->metrics.h);
+	buffer_write_int32(&b, h->metrics.bpp);
+	buffer_write_int32(&b, h->metrics.has_pixel);
+	buffer_write_int32(&b, h->metrics.has_alpha);
+	buffer_write_int32(&b, h->metrics.pixel_pitch);
+	buffer_write_int32(&b, h->metrics.alpha_pitch);
+	write_u64(&b, key->hash);
+	write_u64(&b, key->off);
+	write_u64(&b, key->size);
+	write_u64(&b, h->decoded_size);
+	write_u64(&b, h->stored_size);
+	buffer_write_int32(&b, h->block_format);
+	buffer_write_int32(&b, h->block_quality);
+	buffer_write_int32(&b, strlen(key->archive_path));
+	buffer_write_bytes(&b, (const uint8_t*)key->archive_path, strlen(key->archive_path));
+	while (b.index % CG_CACHE_DATA_ALIGN)
+		buffer_write_int8(&b, 0);
+
+	// write to a temporary file first so that readers never see a partial entry
+	// (named uniquely, since other threads or processes may store the same entry)
+	char name[32];
+	key_name(key, h->block_format, h->block_quality, name);
+	char *path = entry_path(cache, name);
+	uint64_t seq = __atomic_fetch_add(&cache->tmp_seq, 1, __ATOMIC_RELAXED);
+	int tmp_len = snprintf(NULL, 0, "%s.%ld.%" PRIu64 ".tmp", path, (long)getpid(), seq);
+	char *tmp_path = xmalloc(tmp_len + 1);
+	snprintf(tmp_path, tmp_len + 1, "%s.%ld.%" PRIu64 ".tmp", path, (long)getpid(), seq);
+	bool ok = write_entry(tmp_path, &b, data, h->stored_size);
+#ifdef _WIN32
+	if (ok)
+		remove_utf8(path);
+#endif
+	if (ok && rename(tmp_path, path)) {
+		WARNING("rename failed: %s", strerror(errno));
+		ok = false;
+	}
+	if (ok) {
+		pthread_mutex_lock(&cache->lock);
+		cache_insert(cache, name, b.index + h->stored_size, ++cache->clock);
+		cache_trim(cache);
+		pthread_mutex_unlock(&cache->lock);
+	} else {
+		remove_utf8(tmp_path);
+	}
+
+	free(tmp_path);
+	free(path);
+	free(b.buf);
+	free(encoded);
+	return ok;
+}
+
+bool cg_cache_put(struct cg_cache *cache, const struct cg_cache_key *key, struct cg *cg)
+{
+	if (!cg->pixels || cg->metrics.w <= 0 || cg->metrics.h <= 0)
+		return false;
+
+	struct entry_header h = {
+		.type = cg->type,
+		.metrics = cg->metrics,
+	};
+	return put_entry(cache, key, &h, cg->pixels, pixels_size(&cg->metrics));
+}
+
+bool cg_cache_put_blocks(struct cg_cache *cache, const struct cg_cache_key *key,
+		struct cg_blocks *blocks)
+{
+	struct entry_header h = {
+		.metrics = { .w = blocks->w, .h = blocks->h },
+		.block_format = blocks->format,
+		.block_quality = blocks->quality,
+	};
+	return put_entry(cache, key, &h, blocks->data, blocks->size);
+}
+
+struct cg *cg_cache_load_data(struct cg_cache *cache, const char *archive_path,
+		struct archive_data *dfile)
+{
+	struct cg_cache_key key;
+	cg_cache_key_init(&key, archive_path, dfile);
+	struct cg *cg = cg_cache_get(cache, &key);
+	if (cg)
+		return cg;
+	if (!(cg = cg_load_data(dfile)))
+		return NULL;
+	cg_cache_put(cache, &key, cg);
+	return cg;
+}
+
+struct cg *cg_cache_load(struct cg_cache *cache, const char *archive_path,
+		struct archive *ar, int no)
+{
+	struct archive_data *dfile = archive_get(ar, no);
+	if (!dfile) {
+		WARNING("Failed to load CG %d", no);
+		return NULL;
+	}
+	struct cg *cg = cg_cache_load_data(cache, archive_path, dfile);
+	archive_free_data(dfile);
+	return cg;
+}
+
+struct cg_blocks *cg_cache_load_blocks(struct cg_cache *cache, const char *archive_path,
+		struct archive_data *dfile, enum cg_block_format format, int quality)
+{
+	struct cg_cache_key key;
+	cg_cache_key_init(&key, archive_path, dfile);
+	struct cg_blocks *blocks = cg_cache_get_blocks(cache, &key, format, quality);
+	if (blocks)
+		return blocks;
+
+	// reuse the decoded pixels if they happen to be cached
+	struct cg *cg = cg_cache_get(cache, &key);
+	if (!cg && !(cg = cg_load_data(dfile)))
+		return NULL;
+	blocks = cg_encode_blocks(cg, format, quality);
+	cg_free(cg);
+	if (blocks)
+		cg_cache_put_blocks(cache, &key, blocks);
+	return blocks;
+}
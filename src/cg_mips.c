@@ -0,0 +1,543 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "system4.h"
+#include "system4/cg.h"
+#include "system4/cg_mips.h"
+#include "cpu.h"
+#include "thread_pool.h"
+
+/*
+ * Each level is produced from the previous one by a horizontal pass followed
+ * by a vertical pass. Intermediate levels are kept as premultiplied floats
+ * (one 4-float vector per pixel), so that rounding errors don't accumulate
+ * down the chain and the kernels map directly onto SIMD registers.
+ */
+
+// images smaller than this are filtered on the calling thread
+#define PARALLEL_MIN_PIXELS (256 * 256)
+
+#define KAISER_RADIUS 3.0f
+#define KAISER_ALPHA 4.0f
+
+/*
+ * Filter weights for resampling one axis. Destination pixel i is the
+ * weighted sum of source pixels [first[i], first[i] + n[i]), with weights
+ * taken from weights[i * max_taps].
+ */
+struct filter_table {
+	int dst_size;
+	int max_taps;
+	int *first;
+	int *n;
+	float *weights;
+};
+
+static void table_alloc(struct filter_table *t, int dst_size, int max_taps)
+{
+	t->dst_size = dst_size;
+	t->max_taps = max_taps;
+	t->first = xcalloc(dst_size, sizeof(int));
+	t->n = xcalloc(dst_size, sizeof(int));
+	t->weights = xcalloc((size_t)dst_size * max_taps, sizeof(float));
+}
+
+static void table_free(struct filter_table *t)
+{
+	free(t->first);
+	free(t->n);
+	free(t->weights);
+}
+
+/*
+ * Box filter. Even sizes average pairs of pixels; odd sizes use a 3-tap
+ * polyphase box so that every source pixel contributes equally, rather than
+ * dropping the last row or column.
+ */
+static void box_table(struct filter_table *t, int src_size, int dst_size)
+{
+	table_alloc(t, dst_size, 3);
+	for (int i = 0; i < dst_size; i++) {
+		float *w = t->weights + i * 3;
+		if (src_size == 1) {
+			t->first[i] = 0;
+			t->n[i] = 1;
+			w[0] = 1.0f;
+		} else if (src_size % 2 == 0) {
+			t->first[i] = i * 2;
+			t->n[i] = 2;
+			w[0] = w[1] = 0.5f;
+		} else {
+			t->first[i] = i * 2;
+			t->n[i] = 3;
+			w[0] = (float)(dst_size - i) / src_size;
+			w[1] = (float)dst_size / src_size;
+			w[2] = (float)(i + 1) / src_size;
+		}
+	}
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+static float kaiser_weight(float x)
+{
+	if (fabsf(x) >= KAISER_RADIUS)
+		return 0.0f;
+	float t = x / KAISER_RADIUS;
+	float sinc = x == 0.0f ? 1.0f : sinf(M_PI * x) / (M_PI * x);
+	float window = bessel_i0(KAISER_ALPHA * sqrt(1.0 - t*t)) / bessel_i0(KAISER_ALPHA);
+	return sinc * window;
+}
+
+/*
+ * Kaiser-windowed sinc, stretched to the scale factor. Taps falling outside
+ * the image are clamped to the edge pixel.
+ */
+static void kaiser_table(struct filter_table *t, int src_size, int dst_size)
+{
+	float scale = (float)src_size / dst_size;
+	int max_taps = (int)ceilf(KAISER_RADIUS * scale) * 2 + 2;
+	table_alloc(t, dst_size, max_taps);
+	for (int i = 0; i < dst_size; i++) {
+		float center = (i + 0.5f) * scale - 0.5f;
+		int lo = (int)floorf(center - KAISER_RADIUS * scale) + 1;
+		int hi = (int)ceilf(center + KAISER_RADIUS * scale) - 1;
+		int first = max(lo, 0);
+		int last = min(hi, src_size - 1);
+		float *w = t->weights + (size_t)i * max_taps;
+		float sum = 0;
+		for (int s = lo; s <= hi; s++) {
+			float v = kaiser_weight((s - center) / scale);
+			int c = s < 0 ? 0 : s >= src_size ? src_size - 1 : s;
+			w[c - first] += v;
+			sum += v;
+		}
+		t->first[i] = first;
+		t->n[i] = last - first + 1;
+		for (int k = 0; k < t->n[i]; k++) {
+			w[k] /= sum;
+		}
+	}
+}
+
+/*
+ * Kernels.
+ *
+ * hfilter: filter one row horizontally (pixels are 4 floats).
+ * vfilter: out[i] = sum_k w[k] * rows[k][i] for i in [0, n) floats.
+ */
+
+static void hfilter_scalar(float *out, const float *in, const struct filter_table *t)
+{
+	for (int i = 0; i < t->dst_size; i++, out += 4) {
+		const float *w = t->weights + (size_t)i * t->max_taps;
+		const float *p = in + (size_t)t->first[i] * 4;
+		float acc[4] = { 0 };
+		for (int k = 0; k < t->n[i]; k++, p += 4) {
+			for (int c = 0; c < 4; c++) {
+				acc[c] += w[k] * p[c];
+			}
+		}
+		memcpy(out, acc, sizeof(acc));
+	}
+}
+
+// filter floats [i,n); the SIMD kernels use this for their leftovers
+static void vfilter_tail(float *out, const float **rows, const float *w, int taps, size_t i,
+		size_t n)
+{
+	for (; i < n; i++) {
+		float acc = 0;
+		for (int k = 0; k < taps; k++) {
+			acc += w[k] * rows[k][i];
+		}
+		out[i] = acc;
+	}
+}
+
+static void vfilter_scalar(float *out, const float **rows, const float *w, int taps, size_t n)
+{
+	vfilter_tail(out, rows, w, taps, 0, n);
+}
+
+#ifdef SYS4_SIMD_SSE2
+
+__attribute__((target("sse2")))
+static void hfilter_sse2(float *out, const float *in, const struct filter_table *t)
+{
+	for (int i = 0; i < t->dst_size; i++, out += 4) {
+		const float *w = t->weights + (size_t)i * t->max_taps;
+		const float *p = in + (size_t)t->first[i] * 4;
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < t->n[i]; k++, p += 4) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(p)));
+		}
+		_mm_storeu_ps(out, acc);
+	}
+}
+
+// filter floats [i,n); the AVX2 kernel uses this for its leftovers
+__attribute__((target("sse2")))
+static void vfilter_sse2_tail(float *out, const float **rows, const float *w, int taps,
+		size_t i, size_t n)
+{
+	for (; i + 4 <= n; i += 4) {
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < taps; k++) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(rows[k] + i)));
+		}
+		_mm_storeu_ps(out + i, acc);
+	}
+	vfilter_tail(out, rows, w, taps, i, n);
+}
+
+__attribute__((target("sse2")))
+static void vfilter_sse2(float *out, const float **rows, const float *w, int taps, size_t n)
+{
+	vfilter_sse2_tail(out, rows, w, taps, 0, n);
+}
+
+#endif /* SYS4_SIMD_SSE2 */
+
+#if defined(SYS4_SIMD_SSE2) && defined(SYS4_SIMD_AVX2)
+
+/*
+ * With AVX2, horizontal filtering handles two destination pixels per
+ * register when their taps line up (always true for the box filter on even
+ * sizes), and vertical filtering handles 8 floats at a time.
+ */
+__attribute__((target("avx2")))
+static void hfilter_avx2(float *out, const float *in, const struct filter_table *t)
+{
+	int i = 0;
+	for (; i + 1 < t->dst_size; i += 2, out += 8) {
+		if (t->n[i] != t->n[i+1]) {
+			hfilter_sse2(out, in, &(struct filter_table) {
+					.dst_size = 2,
+					.max_taps = t->max_taps,
+					.first = t->first + i,
+					.n = t->n + i,
+					.weights = t->weights + (size_t)i * t->max_taps });
+			continue;
+		}
+		const float *w0 = t->weights + (size_t)i * t->max_taps;
+		const float *w1 = w0 + t->max_taps;
+		const float *p0 = in + (size_t)t->first[i] * 4;
+		const float *p1 = in + (size_t)t->first[i+1] * 4;
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < t->n[i]; k++, p0 += 4, p1 += 4) {
+			__m256 w = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(w0[k])),
+					_mm_set1_ps(w1[k]), 1);
+			__m256 p = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p0)),
+					_mm_loadu_ps(p1), 1);
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(w, p));
+		}
+		_mm256_storeu_ps(out, acc);
+	}
+	if (i < t->dst_size) {
+		hfilter_sse2(out, in, &(struct filter_table) {
+				.dst_size = 1,
+				.max_taps = t->max_taps,
+				.first = t->first + i,
+				.n = t->n + i,
+				.weights = t->weights + (size_t)i * t->max_taps });
+	}
+}
+
+__attribute__((target("avx2")))
+static void vfilter_avx2(float *out, const float **rows, const float *w, int taps, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < taps; k++) {
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k]),
+						_mm256_loadu_ps(rows[k] + i)));
+		}
+		_mm256_storeu_ps(out + i, acc);
+	}
+	vfilter_sse2_tail(out, rows, w, taps, i, n);
+}
+
+#endif /* SYS4_SIMD_AVX2 */
+
+#if defined(SYS4_SIMD_SSE2) && defined(SYS4_SIMD_AVX2) && defined(SYS4_SIMD_AVX512)
+
+// horizontal filtering is gather-bound, so only the vertical pass is widened
+__attribute__((target("avx512f")))
+static void vfilter_avx512(float *out, const float **rows, const float *w, int taps, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512 acc = _mm512_setzero_ps();
+		for (int k = 0; k < taps; k++) {
+			acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_set1_ps(w[k]),
+						_mm512_loadu_ps(rows[k] + i)));
+		}
+		_mm512_storeu_ps(out + i, acc);
+	}
+	vfilter_tail(out, rows, w, taps, i, n);
+}
+
+#endif /* SYS4_SIMD_AVX512 */
+
+#ifdef SYS4_SIMD_NEON
+
+static void hfilter_neon(float *out, const float *in, const struct filter_table *t)
+{
+	for (int i = 0; i < t->dst_size; i++, out += 4) {
+		const float *w = t->weights + (size_t)i * t->max_taps;
+		const float *p = in + (size_t)t->first[i] * 4;
+		float32x4_t acc = vdupq_n_f32(0);
+		for (int k = 0; k < t->n[i]; k++, p += 4) {
+			acc = vaddq_f32(acc, vmulq_n_f32(vld1q_f32(p), w[k]));
+		}
+		vst1q_f32(out, acc);
+	}
+}
+
+static void vfilter_neon(float *out, const float **rows, const float *w, int taps, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		float32x4_t acc = vdupq_n_f32(0);
+		for (int k = 0; k < taps; k++) {
+			acc = vaddq_f32(acc, vmulq_n_f32(vld1q_f32(rows[k] + i), w[k]));
+		}
+		vst1q_f32(out + i, acc);
+	}
+	vfilter_tail(out, rows, w, taps, i, n);
+}
+
+#endif /* SYS4_SIMD_NEON */
+
+struct mip_kernels {
+	struct cpu_variant v;
+	void (*hfilter)(float *out, const float *in, const struct filter_table *t);
+	void (*vfilter)(float *out, const float **rows, const float *w, int taps, size_t n);
+};
+
+static const struct mip_kernels mip_variants[] = {
+#if defined(SYS4_SIMD_SSE2) && defined(SYS4_SIMD_AVX2) && defined(SYS4_SIMD_AVX512)
+	{ { "avx512", CPU_SSE2 | CPU_AVX2 | CPU_AVX512 }, hfilter_avx2, vfilter_avx512 },
+#endif
+#if defined(SYS4_SIMD_SSE2) && defined(SYS4_SIMD_AVX2)
+	{ { "avx2", CPU_SSE2 | CPU_AVX2 }, hfilter_avx2, vfilter_avx2 },
+#endif
+#ifdef SYS4_SIMD_SSE2
+	{ { "sse2", CPU_SSE2 }, hfilter_sse2, vfilter_sse2 },
+#endif
+#ifdef SYS4_SIMD_NEON
+	{ { "neon", CPU_NEON }, hfilter_neon, vfilter_neon },
+#endif
+	{ { "scalar", 0 }, hfilter_scalar, vfilter_scalar },
+};
+
+static const struct mip_kernels *get_kernels(void)
+{
+	return CPU_SELECT(mip_variants);
+}
+
+/*
+ * Level generation.
+ */
+
+struct mip_job {
+	const struct mip_kernels *kernels;
+	struct filter_table htab, vtab;
+	// source level
+	const float *src;
+	int src_w;
+	// horizontally filtered rows: src_h * dst_w
+	float *tmp;
+	// destination level
+	float *dst;
+	uint8_t *dst_pixels;
+	int dst_w;
+	bool premultiplied;
+};
+
+static void hpass_row(size_t y, possibly_unused int worker, void *user)
+{
+	struct mip_job *job = user;
+	job->kernels->hfilter(job->tmp + y * job->dst_w * 4, job->src + y * job->src_w * 4, &job->htab);
+}
+
+static void store_row(uint8_t *out, const float *in, int w, bool premultiplied)
+{
+	for (int x = 0; x < w; x++, in += 4, out += 4) {
+		float a = in[3] < 0.0f ? 0.0f : in[3] > 255.0f ? 255.0f : in[3];
+		out[3] = (uint8_t)(a + 0.5f);
+		for (int c = 0; c < 3; c++) {
+			// negative lobes can push premultiplied colors above alpha
+			float v = in[c] < 0.0f ? 0.0f : in[c] > a ? a : in[c];
+			if (!premultiplied)
+				v = a > 0.0f ? v * 255.0f / a : 0.0f;
+			out[c] = (uint8_t)(v + 0.5f);
+		}
+	}
+}
+
+static void vpass_row(size_t y, possibly_unused int worker, void *user)
+{
+	struct mip_job *job = user;
+	const float *rows[64];
+	int first = job->vtab.first[y];
+	int n = min(job->vtab.n[y], 64);
+	size_t stride = (size_t)job->dst_w * 4;
+	for (int k = 0; k < n; k++) {
+		rows[k] = job->tmp + (first + k) * stride;
+	}
+	float *out = job->dst + y * stride;
+	job->kernels->vfilter(out, rows, job->vtab.weights + y * job->vtab.max_taps, n, stride);
+	store_row(job->dst_pixels + y * stride, out, job->dst_w, job->premultiplied);
+}
+
+static void load_level0(const uint8_t *pixels, float *out, size_t nr_pixels, bool premultiplied)
+{
+	for (size_t i = 0; i < nr_pixels; i++, pixels += 4, out += 4) {
+		float a = pixels[3];
+		float m = premultiplied ? 1.0f : a / 255.0f;
+		out[0] = pixels[0] * m;
+		out[1] = pixels[1] * m;
+		out[2] = pixels[2] * m;
+		out[3] = a;
+	}
+}
+
+static struct cg_mips *generate_mips(struct cg *cg, int levels, enum cg_mip_filter filter,
+		int flags, const struct mip_kernels *kernels)
+{
+	int w = cg->metrics.w, h = cg->metrics.h;
+	if (!cg->pixels || w <= 0 || h <= 0) {
+		WARNING("Can't generate mips for empty CG");
+		return NULL;
+	}
+
+	int max_levels = 1;
+	for (int s = max(w, h); s > 1; s /= 2)
+		max_levels++;
+	if (levels <= 0 || levels > max_levels)
+		levels = max_levels;
+	if (levels > CG_MIPS_MAX_LEVELS)
+		levels = CG_MIPS_MAX_LEVELS;
+
+	// lay out all levels in a single allocation
+	struct cg_mips *mips = xcalloc(1, sizeof(struct cg_mips));
+	mips->nr_levels = levels;
+	size_t offsets[CG_MIPS_MAX_LEVELS];
+	for (int i = 0; i < levels; i++) {
+		mips->levels[i].w = w;
+		mips->levels[i].h = h;
+		offsets[i] = mips->size;
+		mips->size += (size_t)w * h * 4;
+		w = max(w / 2, 1);
+		h = max(h / 2, 1);
+	}
+	mips->data = xmalloc(mips->size);
+	for (int i = 0; i < levels; i++) {
+		mips->levels[i].pixels = mips->data + offsets[i];
+	}
+	memcpy(mips->levels[0].pixels, cg->pixels, (size_t)cg->metrics.w * cg->metrics.h * 4);
+	if (levels == 1)
+		return mips;
+
+	struct mip_job job = {
+		.kernels = kernels,
+		.premultiplied = flags & CG_MIP_PREMULTIPLIED,
+	};
+	// level 1 is the largest destination, and the first horizontal pass
+	// the largest intermediate
+	size_t nr_pixels = (size_t)cg->metrics.w * cg->metrics.h;
+	size_t l1_pixels = (size_t)mips->levels[1].w * mips->levels[1].h;
+	float *src = xmalloc(max(nr_pixels, l1_pixels) * 4 * sizeof(float));
+	float *dst = xmalloc(max(nr_pixels, l1_pixels) * 4 * sizeof(float));
+	job.tmp = xmalloc((size_t)cg->metrics.h * mips->levels[1].w * 4 * sizeof(float));
+	load_level0(cg->pixels, src, nr_pixels, job.premultiplied);
+
+	struct thread_pool *pool = thread_pool_create(nr_pixels >= PARALLEL_MIN_PIXELS ? 0 : 1);
+	for (int i = 1; i < levels; i++) {
+		struct cg_mip_level *s = &mips->levels[i-1];
+		struct cg_mip_level *d = &mips->levels[i];
+		if (filter == CG_MIP_KAISER) {
+			kaiser_table(&job.htab, s->w, d->w);
+			kaiser_table(&job.vtab, s->h, d->h);
+		} else {
+			box_table(&job.htab, s->w, d->w);
+			box_table(&job.vtab, s->h, d->h);
+		}
+		job.src = src;
+		job.src_w = s->w;
+		job.dst = dst;
+		job.dst_w = d->w;
+		job.dst_pixels = d->pixels;
+		thread_pool_run(pool, s->h, hpass_row, &job);
+		thread_pool_run(pool, d->h, vpass_row, &job);
+		table_free(&job.htab);
+		table_free(&job.vtab);
+
+		float *t = src;
+		src = dst;
+		dst = t;
+	}
+	thread_pool_free(pool);
+
+	free(src);
+	free(dst);
+	free(job.tmp);
+	return mips;
+}
+
+struct cg_mips *cg_generate_mips(struct cg *cg, int levels, enum cg_mip_filter filter, int flags)
+{
+	return generate_mips(cg, levels, filter, flags, get_kernels());
+}
+
+const struct cpu_variant *_cg_mips_variant(unsigned variant)
+{
+	if (variant >= sizeof(mip_variants) / sizeof(mip_variants[0]))
+		return NULL;
+	return &mip_variants[variant].v;
+}
+
+struct cg_mips *_cg_generate_mips_variant(struct cg *cg, int levels, enum cg_mip_filter filter,
+		int flags, unsigned variant)
+{
+	if (!_cg_mips_variant(variant))
+		return NULL;
+	return generate_mips(cg, levels, filter, flags, &mip_variants[variant]);
+}
+
+void cg_mips_free(struct cg_mips *mips)
+{
+	free(mips->data);
+	free(mips);
+}
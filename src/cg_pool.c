@@ -0,0 +1,209 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "system4.h"
+#include "system4/cg_pool.h"
+
+// every buffer is preceded by a header of this size (keeps 16-byte alignment)
+#define HEADER_SIZE 64
+
+#define MIN_POOLED_SIZE (64 * 1024)
+#define NR_CLASSES 26 // up to 64KiB * 2^12.5, ~370MiB
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct buffer_header {
+	size_t size;  // usable size
+	int cls;      // size class, or -1 if not pooled
+	bool mapped;  // huge-page-backed mapping
+	struct buffer_header *next;
+};
+
+_Static_assert(sizeof(struct buffer_header) <= HEADER_SIZE, "buffer header too large");
+
+struct size_class {
+	pthread_mutex_t lock;
+	size_t size;
+	struct buffer_header *free_list;
+};
+
+static struct size_class classes[NR_CLASSES];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t max_resident = 256 * 1024 * 1024;
+static atomic_bool use_huge_pages = true;
+
+static atomic_uint_fast64_t stat_allocs;
+static atomic_uint_fast64_t stat_reuses;
+static atomic_uint_fast64_t stat_frees;
+static atomic_size_t stat_resident;
+static atomic_size_t stat_in_use;
+static atomic_size_t stat_huge;
+
+static void pool_init(void)
+{
+	// classes alternate between 2^n and 1.5 * 2^n times the minimum size
+	for (int i = 0; i < NR_CLASSES; i++) {
+		size_t base = (size_t)MIN_POOLED_SIZE << (i / 2);
+		classes[i].size = i % 2 ? base + base / 2 : base;
+		pthread_mutex_init(&classes[i].lock, NULL);
+	}
+}
+
+static int size_class(size_t size)
+{
+	if (size < MIN_POOLED_SIZE)
+		return -1;
+	for (int i = 0; i < NR_CLASSES; i++) {
+		if (size <= classes[i].size)
+			return i;
+	}
+	return -1;
+}
+
+static struct buffer_header *raw_alloc(size_t size, int cls)
+{
+	struct buffer_header *h = NULL;
+	bool mapped = false;
+#ifndef _WIN32
+	if (size >= HUGE_PAGE_SIZE && atomic_load(&use_huge_pages)) {
+		size_t map_size = (size + HEADER_SIZE + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+		void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+			madvise(map, map_size, MADV_HUGEPAGE);
+#endif
+			h = map;
+			size = map_size - HEADER_SIZE;
+			mapped = true;
+			atomic_fetch_add(&stat_huge, map_size);
+		}
+	}
+#endif
+	if (!h)
+		h = xmalloc(size + HEADER_SIZE);
+	h->size = size;
+	h->cls = cls;
+	h->mapped = mapped;
+	h->next = NULL;
+	return h;
+}
+
+static void raw_free(struct buffer_header *h)
+{
+	if (h->mapped) {
+		atomic_fetch_sub(&stat_huge, h->size + HEADER_SIZE);
+		munmap(h, h->size + HEADER_SIZE);
+	} else {
+		free(h);
+	}
+}
+
+void *cg_pool_alloc(size_t size)
+{
+	pthread_once(&pool_once, pool_init);
+	atomic_fetch_add(&stat_allocs, 1);
+
+	struct buffer_header *h = NULL;
+	int cls = size_class(size);
+	if (cls >= 0) {
+		struct size_class *c = &classes[cls];
+		pthread_mutex_lock(&c->lock);
+		if ((h = c->free_list))
+			c->free_list = h->next;
+		pthread_mutex_unlock(&c->lock);
+		if (h) {
+			atomic_fetch_sub(&stat_resident, h->size);
+			atomic_fetch_add(&stat_reuses, 1);
+		} else {
+			h = raw_alloc(c->size, cls);
+		}
+	} else {
+		h = raw_alloc(size, -1);
+	}
+	atomic_fetch_add(&stat_in_use, h->size);
+	return (uint8_t*)h + HEADER_SIZE;
+}
+
+void *cg_pool_calloc(size_t nmemb, size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size)
+		ERROR("cg_pool_calloc: size overflow");
+	void *p = cg_pool_alloc(nmemb * size);
+	memset(p, 0, nmemb * size);
+	return p;
+}
+
+void cg_pool_free(void *p)
+{
+	if (!p)
+		return;
+	struct buffer_header *h = (struct buffer_header*)((uint8_t*)p - HEADER_SIZE);
+	atomic_fetch_add(&stat_frees, 1);
+	atomic_fetch_sub(&stat_in_use, h->size);
+	if (h->cls < 0 || atomic_load(&stat_resident) + h->size > atomic_load(&max_resident)) {
+		raw_free(h);
+		return;
+	}
+
+	struct size_class *c = &classes[h->cls];
+	atomic_fetch_add(&stat_resident, h->size);
+	pthread_mutex_lock(&c->lock);
+	h->next = c->free_list;
+	c->free_list = h;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cg_pool_configure(size_t max_resident_bytes, bool huge_pages)
+{
+	atomic_store(&max_resident, max_resident_bytes);
+	atomic_store(&use_huge_pages, huge_pages);
+	if (atomic_load(&stat_resident) > max_resident_bytes)
+		cg_pool_trim();
+}
+
+void cg_pool_trim(void)
+{
+	pthread_once(&pool_once, pool_init);
+	for (int i = 0; i < NR_CLASSES; i++) {
+		pthread_mutex_lock(&classes[i].lock);
+		struct buffer_header *h = classes[i].free_list;
+		classes[i].free_list = NULL;
+		pthread_mutex_unlock(&classes[i].lock);
+		while (h) {
+			struct buffer_header *next = h->next;
+			atomic_fetch_sub(&stat_resident, h->size);
+			raw_free(h);
+			h = next;
+		}
+	}
+}
+
+void cg_pool_get_stats(struct cg_pool_stats *stats)
+{
+	stats->allocs = atomic_load(&stat_allocs);
+	stats->reuses = atomic_load(&stat_reuses);
+	stats->frees = atomic_load(&stat_frees);
+	stats->resident_bytes = atomic_load(&stat_resident);
+	stats->in_use_bytes = atomic_load(&stat_in_use);
+	stats->huge_page_bytes = atomic_load(&stat_huge);
+}
@@ -0,0 +1,379 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "system4.h"
+#include "compression.h"
+
+#ifdef SYS4_ZLIB_NG
+#include <zlib-ng.h>
+#define Z(name) zng_##name
+typedef zng_stream z_stream_t;
+typedef size_t z_size_t;
+#else
+#include <zlib.h>
+#define Z(name) name
+typedef z_stream z_stream_t;
+typedef uLong z_size_t;
+#endif
+
+#ifdef SYS4_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// zlib's avail_in/avail_out are 32 bits; larger buffers are fed in pieces
+#define Z_CHUNK_MAX 0x40000000u
+#define STREAM_BUF_SIZE (64 * 1024)
+
+/*
+ * Per-thread state.
+ */
+
+struct z_state {
+	bool inflate_ready;
+	z_stream_t inflate;
+#ifdef SYS4_LIBDEFLATE
+	struct libdeflate_decompressor *decompressor;
+	struct libdeflate_compressor *compressor;
+	int compressor_level;
+#endif
+};
+
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+
+static void state_free(void *data)
+{
+	struct z_state *s = data;
+	if (s->inflate_ready)
+		Z(inflateEnd)(&s->inflate);
+#ifdef SYS4_LIBDEFLATE
+	if (s->decompressor)
+		libdeflate_free_decompressor(s->decompressor);
+	if (s->compressor)
+		libdeflate_free_compressor(s->compressor);
+#endif
+	free(s);
+}
+
+static void state_init(void)
+{
+	pthread_key_create(&state_key, state_free);
+}
+
+static struct z_state *get_state(void)
+{
+	pthread_once(&state_once, state_init);
+	struct z_state *s = pthread_getspecific(state_key);
+	if (!s) {
+		s = xcalloc(1, sizeof(struct z_state));
+		pthread_setspecific(state_key, s);
+	}
+	return s;
+}
+
+/*
+ * Get the thread's inflate stream, reset for a new stream.
+ */
+static z_stream_t *get_inflate(void)
+{
+	struct z_state *s = get_state();
+	if (s->inflate_ready) {
+		if (Z(inflateReset)(&s->inflate) == Z_OK)
+			return &s->inflate;
+		Z(inflateEnd)(&s->inflate);
+		s->inflate_ready = false;
+	}
+	memset(&s->inflate, 0, sizeof(s->inflate));
+	if (Z(inflateInit)(&s->inflate) != Z_OK)
+		return NULL;
+	s->inflate_ready = true;
+	return &s->inflate;
+}
+
+#ifdef SYS4_LIBDEFLATE
+static struct libdeflate_decompressor *get_decompressor(void)
+{
+	struct z_state *s = get_state();
+	if (!s->decompressor)
+		s->decompressor = libdeflate_alloc_decompressor();
+	return s->decompressor;
+}
+
+static struct libdeflate_compressor *get_compressor(int level)
+{
+	struct z_state *s = get_state();
+	if (s->compressor && s->compressor_level != level) {
+		libdeflate_free_compressor(s->compressor);
+		s->compressor = NULL;
+	}
+	if (!s->compressor) {
+		s->compressor = libdeflate_alloc_compressor(level);
+		s->compressor_level = level;
+	}
+	return s->compressor;
+}
+
+static enum sys4_z_status libdeflate_status(enum libdeflate_result r)
+{
+	switch (r) {
+	case LIBDEFLATE_SUCCESS:            return SYS4_Z_OK;
+	case LIBDEFLATE_SHORT_OUTPUT:       return SYS4_Z_SHORT;
+	case LIBDEFLATE_INSUFFICIENT_SPACE: return SYS4_Z_OVERFLOW;
+	default:                            return SYS4_Z_DATA_ERROR;
+	}
+}
+#endif
+
+const char *sys4_z_strerror(enum sys4_z_status status)
+{
+	switch (status) {
+	case SYS4_Z_OK:         return "success";
+	case SYS4_Z_SHORT:      return "stream ended early";
+	case SYS4_Z_OVERFLOW:   return "output buffer too small";
+	case SYS4_Z_DATA_ERROR: return "corrupt stream";
+	case SYS4_Z_MEM_ERROR:  return "out of memory";
+	}
+	return "unknown error";
+}
+
+const char *sys4_z_backend(void)
+{
+#if defined(SYS4_LIBDEFLATE)
+	return "libdeflate";
+#elif defined(SYS4_ZLIB_NG)
+	return "zlib-ng";
+#else
+	return "zlib";
+#endif
+}
+
+/*
+ * zlib inflate loop. Decompresses into `out` until the stream ends or the
+ * buffer is full; if `write` is given, full buffers are passed to it and
+ * reused instead. On return `*out_size` is the number of bytes left in
+ * `out` (i.e. not yet passed to `write`).
+ */
+static enum sys4_z_status z_inflate(uint8_t *out, size_t *out_size, const uint8_t *in, size_t in_size,
+		sys4_inflate_write_fun write, void *user)
+{
+	z_stream_t *z = get_inflate();
+	if (!z)
+		return SYS4_Z_MEM_ERROR;
+
+	size_t in_left = in_size;
+	size_t out_left = *out_size;
+	z->next_in = (uint8_t*)in;
+	z->avail_in = 0;
+	z->next_out = out;
+	z->avail_out = 0;
+	int r;
+	for (;;) {
+		if (z->avail_in == 0 && in_left) {
+			z->avail_in = min(in_left, Z_CHUNK_MAX);
+			in_left -= z->avail_in;
+		}
+		if (z->avail_out == 0 && !out_left && write) {
+			if (!write(user, out, *out_size)) {
+				*out_size = 0;
+				return SYS4_Z_OK;
+			}
+			z->next_out = out;
+			out_left = *out_size;
+		}
+		if (z->avail_out == 0 && out_left) {
+			z->avail_out = min(out_left, Z_CHUNK_MAX);
+			out_left -= z->avail_out;
+		}
+		r = Z(inflate)(z, Z_NO_FLUSH);
+		if (r != Z_OK)
+			break;
+	}
+
+	*out_size = z->next_out - out;
+	switch (r) {
+	case Z_STREAM_END:
+		return SYS4_Z_OK;
+	case Z_BUF_ERROR:
+		// no progress possible: either out of output space or out of input
+		if (z->avail_out == 0 && !out_left)
+			return SYS4_Z_OVERFLOW;
+		return SYS4_Z_DATA_ERROR;
+	case Z_MEM_ERROR:
+		return SYS4_Z_MEM_ERROR;
+	default:
+		return SYS4_Z_DATA_ERROR;
+	}
+}
+
+enum sys4_z_status sys4_inflate(uint8_t *out, size_t *out_size, const uint8_t *in, size_t in_size)
+{
+#ifdef SYS4_LIBDEFLATE
+	struct libdeflate_decompressor *d = get_decompressor();
+	if (!d)
+		return SYS4_Z_MEM_ERROR;
+	size_t actual = 0;
+	enum libdeflate_result r = libdeflate_zlib_decompress(d, in, in_size, out, *out_size, &actual);
+	if (r == LIBDEFLATE_SUCCESS)
+		*out_size = actual;
+	return libdeflate_status(r);
+#else
+	return z_inflate(out, out_size, in, in_size, NULL, NULL);
+#endif
+}
+
+enum sys4_z_status sys4_inflate_exact(uint8_t *out, size_t out_size, const uint8_t *in, size_t in_size)
+{
+	size_t size = out_size;
+	enum sys4_z_status r = sys4_inflate(out, &size, in, in_size);
+	if (r == SYS4_Z_OK && size != out_size)
+		return SYS4_Z_SHORT;
+	return r;
+}
+
+enum sys4_z_status sys4_inflate_prefix(uint8_t *out, size_t out_size, const uint8_t *in, size_t in_size)
+{
+	size_t size = out_size;
+	enum sys4_z_status r = sys4_inflate(out, &size, in, in_size);
+#ifdef SYS4_LIBDEFLATE
+	// libdeflate doesn't leave partial output behind; redo it with zlib
+	if (r == SYS4_Z_OVERFLOW) {
+		size = out_size;
+		r = z_inflate(out, &size, in, in_size, NULL, NULL);
+	}
+#endif
+	if (r == SYS4_Z_OVERFLOW)
+		return SYS4_Z_OK;
+	if (r == SYS4_Z_OK && size != out_size)
+		return SYS4_Z_SHORT;
+	return r;
+}
+
+uint8_t *sys4_inflate_alloc(const uint8_t *in, size_t in_size, size_t size_hint, size_t *out_size,
+		enum sys4_z_status *status)
+{
+	size_t cap = size_hint ? size_hint : max(in_size * 4, (size_t)1024);
+	uint8_t *out = xmalloc(cap);
+	enum sys4_z_status r;
+#ifdef SYS4_LIBDEFLATE
+	size_t size;
+	for (;;) {
+		size = cap;
+		r = sys4_inflate(out, &size, in, in_size);
+		if (r != SYS4_Z_OVERFLOW)
+			break;
+		cap *= 2;
+		out = xrealloc(out, cap);
+	}
+#else
+	// continue the same stream into a larger buffer when it fills up
+	z_stream_t *z = get_inflate();
+	if (!z) {
+		r = SYS4_Z_MEM_ERROR;
+		goto out;
+	}
+	z->next_in = (uint8_t*)in;
+	z->avail_in = 0;
+	z->next_out = out;
+	z->avail_out = 0;
+	size_t in_left = in_size;
+	int zr;
+	for (;;) {
+		if (z->avail_in == 0 && in_left) {
+			z->avail_in = min(in_left, Z_CHUNK_MAX);
+			in_left -= z->avail_in;
+		}
+		if (z->avail_out == 0) {
+			size_t used = z->next_out - out;
+			if (used == cap) {
+				cap *= 2;
+				out = xrealloc(out, cap);
+			}
+			z->next_out = out + used;
+			z->avail_out = min(cap - used, Z_CHUNK_MAX);
+		}
+		zr = Z(inflate)(z, Z_NO_FLUSH);
+		if (zr != Z_OK)
+			break;
+	}
+	size_t size = z->next_out - out;
+	r = zr == Z_STREAM_END ? SYS4_Z_OK : zr == Z_MEM_ERROR ? SYS4_Z_MEM_ERROR : SYS4_Z_DATA_ERROR;
+out:
+#endif
+	if (status)
+		*status = r;
+	if (r != SYS4_Z_OK) {
+		free(out);
+		return NULL;
+	}
+	*out_size = size;
+	return size == cap ? out : xrealloc(out, max(size, (size_t)1));
+}
+
+enum sys4_z_status sys4_inflate_stream(const uint8_t *in, size_t in_size,
+		sys4_inflate_write_fun write, void *user)
+{
+	uint8_t *buf = xmalloc(STREAM_BUF_SIZE);
+	size_t size = STREAM_BUF_SIZE;
+	enum sys4_z_status r = z_inflate(buf, &size, in, in_size, write, user);
+	if (r == SYS4_Z_OK && size)
+		write(user, buf, size);
+	free(buf);
+	return r;
+}
+
+size_t sys4_deflate_bound(size_t in_size)
+{
+#ifdef SYS4_LIBDEFLATE
+	struct libdeflate_compressor *c = get_compressor(6);
+	if (c)
+		return libdeflate_zlib_compress_bound(c, in_size);
+#endif
+	return Z(compressBound)(in_size);
+}
+
+enum sys4_z_status sys4_deflate(uint8_t *out, size_t *out_size, const uint8_t *in, size_t in_size,
+		int level)
+{
+#ifdef SYS4_LIBDEFLATE
+	struct libdeflate_compressor *c = get_compressor(level < 0 ? 6 : level);
+	if (!c)
+		return SYS4_Z_MEM_ERROR;
+	size_t size = libdeflate_zlib_compress(c, in, in_size, out, *out_size);
+	if (!size)
+		return SYS4_Z_OVERFLOW;
+	*out_size = size;
+	return SYS4_Z_OK;
+#else
+	z_size_t size = *out_size;
+	int r = Z(compress2)(out, &size, in, in_size, level);
+	switch (r) {
+	case Z_OK:
+		*out_size = size;
+		return SYS4_Z_OK;
+	case Z_BUF_ERROR:
+		return SYS4_Z_OVERFLOW;
+	case Z_MEM_ERROR:
+		return SYS4_Z_MEM_ERROR;
+	default:
+		return SYS4_Z_DATA_ERROR;
+	}
+#endif
+}
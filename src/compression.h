@@ -0,0 +1,88 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_COMPRESSION_H
+#define SYSTEM4_COMPRESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * zlib-format (RFC 1950) compression. Every zlib stream in libsys4 goes
+ * through these functions, so that the backend can be chosen at build time:
+ * system zlib (default), zlib-ng's native API (SYS4_ZLIB_NG) or libdeflate
+ * for whole-buffer (de)compression (SYS4_LIBDEFLATE; streaming still uses
+ * zlib). Decompression state is kept per thread and reused between calls.
+ */
+
+enum sys4_z_status {
+	SYS4_Z_OK = 0,
+	SYS4_Z_SHORT,      // the stream ended before the output was filled
+	SYS4_Z_OVERFLOW,   // the output didn't fit in the buffer
+	SYS4_Z_DATA_ERROR, // corrupt or truncated stream
+	SYS4_Z_MEM_ERROR,
+};
+
+#define SYS4_Z_DEFAULT_COMPRESSION (-1)
+#define SYS4_Z_BEST_SPEED 1
+#define SYS4_Z_BEST_COMPRESSION 9
+
+const char *sys4_z_strerror(enum sys4_z_status status);
+const char *sys4_z_backend(void);
+
+/*
+ * Decompress into `out`, which has room for `*out_size` bytes. On success
+ * `*out_size` is set to the decompressed size.
+ */
+enum sys4_z_status sys4_inflate(uint8_t *out, size_t *out_size, const uint8_t *in, size_t in_size);
+
+/*
+ * Decompress exactly `out_size` bytes; anything else is an error.
+ */
+enum sys4_z_status sys4_inflate_exact(uint8_t *out, size_t out_size, const uint8_t *in, size_t in_size);
+
+/*
+ * Decompress the first `out_size` bytes of the stream, ignoring any data
+ * beyond them.
+ */
+enum sys4_z_status sys4_inflate_prefix(uint8_t *out, size_t out_size, const uint8_t *in, size_t in_size);
+
+/*
+ * Decompress a stream of unknown size into a new buffer. `size_hint` is the
+ * initial buffer size (0 = guess from the input size).
+ */
+uint8_t *sys4_inflate_alloc(const uint8_t *in, size_t in_size, size_t size_hint, size_t *out_size,
+		enum sys4_z_status *status);
+
+/*
+ * Streaming decompression: `write` is called with successive pieces of the
+ * output, and can return false to stop early (which is not an error).
+ */
+typedef bool (*sys4_inflate_write_fun)(void *user, const uint8_t *data, size_t size);
+enum sys4_z_status sys4_inflate_stream(const uint8_t *in, size_t in_size,
+		sys4_inflate_write_fun write, void *user);
+
+/*
+ * Compress into `out`, which has room for `*out_size` bytes (at least
+ * sys4_deflate_bound(in_size) to never overflow). On success `*out_size` is
+ * set to the compressed size. `level` is 0-9 or SYS4_Z_DEFAULT_COMPRESSION.
+ */
+size_t sys4_deflate_bound(size_t in_size);
+enum sys4_z_status sys4_deflate(uint8_t *out, size_t *out_size, const uint8_t *in, size_t in_size,
+		int level);
+
+#endif /* SYSTEM4_COMPRESSION_H */
@@ -0,0 +1,141 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4.h"
+#include "system4/cg.h"
+#include "coverage.h"
+
+static void coverage_init(struct cg_coverage *cov, int w, int h)
+{
+	free(cov->tiles);
+	memset(cov, 0, sizeof(struct cg_coverage));
+	cov->tiles_w = (w + CG_TILE_SIZE - 1) / CG_TILE_SIZE;
+	cov->tiles_h = (h + CG_TILE_SIZE - 1) / CG_TILE_SIZE;
+	cov->tiles = xmalloc((size_t)cov->tiles_w * cov->tiles_h);
+}
+
+void coverage_begin(struct coverage_builder *b, struct cg_coverage *cov, int w, int h)
+{
+	coverage_init(cov, w, h);
+	b->cov = cov;
+	b->w = w;
+	b->h = h;
+	b->y = 0;
+	b->min_x = w;
+	b->max_x = -1;
+	b->min_y = -1;
+	b->max_y = -1;
+	b->tile_lo = xmalloc(cov->tiles_w);
+	b->tile_hi = xcalloc(1, cov->tiles_w);
+	memset(b->tile_lo, 0xff, cov->tiles_w);
+	cov->opaque = true;
+}
+
+static void flush_tile_row(struct coverage_builder *b)
+{
+	uint8_t *out = b->cov->tiles + (size_t)((b->y - 1) / CG_TILE_SIZE) * b->cov->tiles_w;
+	for (int t = 0; t < b->cov->tiles_w; t++) {
+		if (!b->tile_hi[t])
+			out[t] = CG_TILE_EMPTY;
+		else if (b->tile_lo[t] == 0xff)
+			out[t] = CG_TILE_OPAQUE;
+		else
+			out[t] = CG_TILE_MIXED;
+		if (b->tile_lo[t] != 0xff)
+			b->cov->opaque = false;
+	}
+	memset(b->tile_lo, 0xff, b->cov->tiles_w);
+	memset(b->tile_hi, 0, b->cov->tiles_w);
+}
+
+void coverage_add_row(struct coverage_builder *b, const uint8_t *alpha, size_t stride)
+{
+	int first_tile = -1, last_tile = -1;
+	for (int t = 0; t < b->cov->tiles_w; t++) {
+		int x0 = t * CG_TILE_SIZE;
+		int x1 = min(x0 + CG_TILE_SIZE, b->w);
+		uint8_t lo = 0xff, hi = 0;
+		for (int x = x0; x < x1; x++) {
+			uint8_t a = alpha[x * stride];
+			lo = a < lo ? a : lo;
+			hi = a > hi ? a : hi;
+		}
+		b->tile_lo[t] = lo < b->tile_lo[t] ? lo : b->tile_lo[t];
+		b->tile_hi[t] = hi > b->tile_hi[t] ? hi : b->tile_hi[t];
+		if (hi) {
+			if (first_tile < 0)
+				first_tile = t;
+			last_tile = t;
+		}
+	}
+
+	// narrow down the extent of the row from the tiles it touches
+	if (first_tile >= 0) {
+		int x = first_tile * CG_TILE_SIZE;
+		while (!alpha[x * stride])
+			x++;
+		b->min_x = min(b->min_x, x);
+		x = min((last_tile + 1) * CG_TILE_SIZE, b->w) - 1;
+		while (!alpha[x * stride])
+			x--;
+		b->max_x = max(b->max_x, x);
+		if (b->min_y < 0)
+			b->min_y = b->y;
+		b->max_y = b->y;
+	}
+
+	b->y++;
+	if (b->y % CG_TILE_SIZE == 0 || b->y == b->h)
+		flush_tile_row(b);
+}
+
+void coverage_end(struct coverage_builder *b)
+{
+	struct cg_coverage *cov = b->cov;
+	if (b->max_x >= 0) {
+		cov->x = b->min_x;
+		cov->y = b->min_y;
+		cov->w = b->max_x - b->min_x + 1;
+		cov->h = b->max_y - b->min_y + 1;
+	}
+	cov->valid = b->y == b->h;
+	free(b->tile_lo);
+	free(b->tile_hi);
+}
+
+void coverage_set_opaque(struct cg_coverage *cov, int w, int h)
+{
+	coverage_init(cov, w, h);
+	memset(cov->tiles, CG_TILE_OPAQUE, (size_t)cov->tiles_w * cov->tiles_h);
+	cov->valid = true;
+	cov->opaque = true;
+	cov->w = w;
+	cov->h = h;
+}
+
+void coverage_compute(struct cg_coverage *cov, const uint8_t *pixels, int w, int h)
+{
+	struct coverage_builder b;
+	coverage_begin(&b, cov, w, h);
+	for (int y = 0; y < h; y++) {
+		coverage_add_row(&b, pixels + (size_t)y * w * 4 + 3, 4);
+	}
+	coverage_end(&b);
+}
@@ -0,0 +1,46 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_COVERAGE_H
+#define SYSTEM4_COVERAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cg_coverage;
+
+/*
+ * Incremental computation of a struct cg_coverage, fed one row of alpha
+ * values at a time so that decoders can build it while writing the image.
+ */
+struct coverage_builder {
+	struct cg_coverage *cov;
+	int w, h, y;
+	int min_x, max_x, min_y, max_y;
+	uint8_t *tile_lo, *tile_hi;
+};
+
+void coverage_begin(struct coverage_builder *b, struct cg_coverage *cov, int w, int h);
+// `alpha` points to the first alpha value of the row; values are `stride` bytes apart
+void coverage_add_row(struct coverage_builder *b, const uint8_t *alpha, size_t stride);
+void coverage_end(struct coverage_builder *b);
+
+// coverage of an image without an alpha channel
+void coverage_set_opaque(struct cg_coverage *cov, int w, int h);
+// compute the coverage of RGBA pixels in a separate pass
+void coverage_compute(struct cg_coverage *cov, const uint8_t *pixels, int w, int h);
+
+#endif /* SYSTEM4_COVERAGE_H */
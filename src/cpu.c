@@ -0,0 +1,145 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "system4.h"
+#include "cpu.h"
+
+#if defined(SYS4_ARM) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+static const struct {
+	const char *name;
+	unsigned feature;
+} feature_names[] = {
+	{ "sse2",   CPU_SSE2 },
+	{ "avx2",   CPU_AVX2 },
+	{ "avx512", CPU_AVX512 },
+	{ "neon",   CPU_NEON },
+};
+
+#define NR_FEATURES (sizeof(feature_names) / sizeof(feature_names[0]))
+
+static pthread_once_t features_once = PTHREAD_ONCE_INIT;
+static unsigned features = 0;
+
+static unsigned detect_features(void)
+{
+	unsigned f = 0;
+#ifdef SYS4_X86
+	// __builtin_cpu_supports checks OS support (XSAVE state) as well as cpuid
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		f |= CPU_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		f |= CPU_AVX2;
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		f |= CPU_AVX512;
+#elif defined(SYS4_ARM)
+#if defined(__aarch64__)
+	// Advanced SIMD is mandatory on AArch64
+	f |= CPU_NEON;
+#elif defined(__linux__)
+	// HWCAP_NEON; the kernels were built for NEON, but check anyway
+	if (getauxval(AT_HWCAP) & (1 << 12))
+		f |= CPU_NEON;
+#else
+	f |= CPU_NEON;
+#endif
+#endif
+	return f;
+}
+
+/*
+ * SYS4_CPU: "scalar" (or "none"), or a comma separated list of features.
+ */
+static unsigned parse_override(const char *env)
+{
+	if (!strcasecmp(env, "scalar") || !strcasecmp(env, "none"))
+		return 0;
+
+	unsigned mask = 0;
+	while (*env) {
+		size_t len = strcspn(env, ",");
+		bool found = false;
+		for (size_t i = 0; i < NR_FEATURES; i++) {
+			if (strlen(feature_names[i].name) == len
+					&& !strncasecmp(env, feature_names[i].name, len)) {
+				mask |= feature_names[i].feature;
+				found = true;
+			}
+		}
+		if (!found && len)
+			WARNING("SYS4_CPU: unknown feature '%.*s'", (int)len, env);
+		env += len;
+		if (*env == ',')
+			env++;
+	}
+	return mask;
+}
+
+static void features_init(void)
+{
+	features = detect_features();
+	const char *env = getenv("SYS4_CPU");
+	if (env)
+		features &= parse_override(env);
+}
+
+unsigned cpu_features(void)
+{
+	pthread_once(&features_once, features_init);
+	return features;
+}
+
+const void *cpu_select(const void *variants, size_t nr_variants, size_t size)
+{
+	const uint8_t *p = variants;
+	unsigned f = cpu_features();
+	for (size_t i = 0; i < nr_variants; i++, p += size) {
+		const struct cpu_variant *v = (const struct cpu_variant*)p;
+		if ((f & v->features) == v->features)
+			return v;
+	}
+	ERROR("No usable kernel variant (missing scalar fallback?)");
+}
+
+const char *cpu_feature_names(unsigned f, char *buf, size_t size)
+{
+	size_t len = 0;
+	if (!size)
+		return buf;
+	buf[0] = '\0';
+	for (size_t i = 0; i < NR_FEATURES; i++) {
+		if (!(f & feature_names[i].feature))
+			continue;
+		int r = snprintf(buf + len, size - len, "%s%s", len ? "," : "",
+				feature_names[i].name);
+		if (r < 0 || (size_t)r >= size - len)
+			break;
+		len += r;
+	}
+	if (!len)
+		snprintf(buf, size, "scalar");
+	return buf;
+}
@@ -0,0 +1,113 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_CPU_H
+#define SYSTEM4_CPU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "system4/cg_mips.h"
+
+/*
+ * Runtime CPU feature dispatch. SIMD kernels for several instruction sets
+ * are compiled into the same binary (using __attribute__((target))), and the
+ * best variant supported by the running CPU is picked when a kernel family is
+ * first needed.
+ *
+ * Which variants get built is decided at build time: SYS4_NO_SSE2,
+ * SYS4_NO_AVX2, SYS4_NO_AVX512 and SYS4_NO_NEON leave out the corresponding
+ * kernels (see the `simd` meson option). At run time the SYS4_CPU
+ * environment variable restricts the features that are used: "scalar" forces
+ * the portable code everywhere, and a comma separated list such as
+ * "sse2,avx2" allows only the listed features.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SYS4_X86 1
+#include <immintrin.h>
+#ifndef SYS4_NO_SSE2
+#define SYS4_SIMD_SSE2 1
+#endif
+#ifndef SYS4_NO_AVX2
+#define SYS4_SIMD_AVX2 1
+#endif
+#ifndef SYS4_NO_AVX512
+#define SYS4_SIMD_AVX512 1
+#endif
+#endif
+
+// NEON kernels are only built when the compiler targets NEON already
+// (always the case on aarch64); they assume little-endian lane order.
+#if defined(__GNUC__) && defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SYS4_ARM 1
+#ifndef SYS4_NO_NEON
+#define SYS4_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+enum cpu_feature {
+	CPU_SSE2   = 1 << 0,
+	CPU_AVX2   = 1 << 1,
+	CPU_AVX512 = 1 << 2, // AVX-512 F + BW
+	CPU_NEON   = 1 << 3,
+};
+
+/*
+ * Get the features of the running CPU (a mask of enum cpu_feature), minus
+ * any disabled through SYS4_CPU. Detection runs once; later calls are cheap.
+ */
+unsigned cpu_features(void);
+
+static inline bool cpu_has(unsigned features)
+{
+	return (cpu_features() & features) == features;
+}
+
+/*
+ * A kernel family is a struct of function pointers starting with a
+ * struct cpu_variant. Variants are listed best first, and the last one must
+ * be the scalar reference (features = 0), which is always usable.
+ */
+struct cpu_variant {
+	const char *name;
+	unsigned features; // all of these are required
+};
+
+const void *cpu_select(const void *variants, size_t nr_variants, size_t size);
+
+#define CPU_SELECT(variants) \
+	cpu_select(variants, sizeof(variants) / sizeof((variants)[0]), sizeof((variants)[0]))
+
+/*
+ * Get the name of a feature mask, e.g. "sse2,avx2" (or "scalar" for 0).
+ */
+const char *cpu_feature_names(unsigned features, char *buf, size_t size);
+
+/*
+ * Kernel families, exposed so that every variant can be checked against the
+ * scalar reference (tests/cpu_variants.c). `variant` indexes the family's
+ * table; the *_variant functions return NULL past its end. Callers must check
+ * cpu_has() before running a variant.
+ */
+const struct cpu_variant *_cg_mips_variant(unsigned variant);
+struct cg_mips *_cg_generate_mips_variant(struct cg *cg, int levels, enum cg_mip_filter filter,
+		int flags, unsigned variant);
+const struct cpu_variant *_webp_mask_variant(unsigned variant);
+void _webp_mask_row(unsigned variant, uint8_t *dst, const uint8_t *overlay, int n);
+
+#endif /* SYSTEM4_CPU_H */
@@ -26,7 +26,7 @@
 #include "system4/qnt.h"
 #include "system4/string.h"
 #include "system4/utfsjis.h"
-#include <zlib.h>
+#include "compression.h"
 
 bool dcf_checkfmt(const uint8_t *data)
 {
@@ -108,14 +108,14 @@ static uint8_t *dcf_read_dfdl(struct buffer *in, size_t *size_out)
 	}
 	size_t next_pos = in->index + dfdl_size;
 
-	unsigned long uncompressed_size = buffer_read_int32(in);
+	size_t uncompressed_size = buffer_read_int32(in);
 	if (uncompressed_size > 40000) {
 		WARNING("Invalid size for uncompressed chunk map");
 		return NULL;
 	}
 
 	uint8_t *chunk_map = xmalloc(uncompressed_size);
-	if (uncompress(chunk_map, &uncompressed_size, in->buf+in->index, dfdl_size - 4) != Z_OK) {
+	if (sys4_inflate(chunk_map, &uncompressed_size, in->buf+in->index, dfdl_size - 4) != SYS4_Z_OK) {
 		WARNING("Failed to uncompress chunk map");
 		free(chunk_map);
 		return NULL;
@@ -261,6 +261,9 @@ void dcf_extract(const uint8_t *data, size_t size, struct cg *cg, struct archive
 
 	dcf_apply_diff(cg, diff_cg, chunk_map + 4, chunk_map_size - 4);
 	cg_free(diff_cg);
+	// the coverage of the base CG no longer applies
+	free(cg->coverage.tiles);
+	memset(&cg->coverage, 0, sizeof(struct cg_coverage));
 
 cleanup:
 	free(chunk_map);
@@ -20,13 +20,14 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/buffer.h"
 #include "system4/ex.h"
 #include "system4/file.h"
 #include "system4/string.h"
+#include "system4/trace.h"
+#include "compression.h"
 
 #define _EX_ERROR(buf, fmt, ...) ERROR("At 0x%08x: " fmt, (uint32_t)(buf)->index, ##__VA_ARGS__)
 #define EX_ERROR(reader, fmt, ...) ERROR("At 0x%08x: " fmt, (uint32_t)(reader)->buf.index, ##__VA_ARGS__)
@@ -113,7 +114,7 @@ static uint8_t *ex_decode(uint8_t *data, size_t *len, uint32_t *nr_blocks)
 {
 	struct buffer r;
 	uint32_t compressed_size;
-	unsigned long uncompressed_size;
+	size_t uncompressed_size;
 
 	if (!ex_initialized)
 		ex_init();
@@ -147,14 +148,9 @@ static uint8_t *ex_decode(uint8_t *data, size_t *len, uint32_t *nr_blocks)
 	}
 
 	uint8_t *out = xmalloc(uncompressed_size);
-	int rv = uncompress(out, &uncompressed_size, (uint8_t*)buffer_strdata(&r), compressed_size);
-	switch (rv) {
-	case Z_BUF_ERROR:  ERROR("Uncompress failed: Z_BUF_ERROR");
-	case Z_MEM_ERROR:  ERROR("Uncompress failed: Z_MEM_ERROR");
-	case Z_DATA_ERROR: ERROR("Uncompress failed: Z_DATA_ERROR");
-	case Z_OK:         break;
-	default:           ERROR("Uncompress failed: %d", rv);
-	}
+	enum sys4_z_status rv = sys4_inflate(out, &uncompressed_size, (uint8_t*)buffer_strdata(&r), compressed_size);
+	if (rv != SYS4_Z_OK)
+		ERROR("Uncompress failed: %s", sys4_z_strerror(rv));
 
 	// decompress
 	*len = uncompressed_size;
@@ -446,6 +442,13 @@ struct ex *ex_read_file(const char *path)
 	return ex_read_file_conv(path, make_string);
 }
 
+/*
+ * Copying a value shares its table, list or tree with the original: the
+ * ex_copy_* functions below take a reference, and the ex_clone_* functions
+ * make a private copy of one node (sharing everything below it) when a shared
+ * node is about to be modified.
+ */
+
 static void ex_copy_value(struct ex_value *out, struct ex_value *in);
 
 static struct ex_field *ex_copy_fields(struct ex_field *fields, unsigned nr_fields)
@@ -476,9 +479,10 @@ static struct ex_value *ex_copy_values(struct ex_value *values, unsigned nr_valu
 	return out;
 }
 
-static struct ex_table *ex_copy_table(struct ex_table *t)
+static struct ex_table *ex_clone_table(struct ex_table *t)
 {
 	struct ex_table *out = xmalloc(sizeof(struct ex_table));
+	out->refs = 0;
 	out->nr_fields = t->nr_fields;
 	out->fields = ex_copy_fields(t->fields, t->nr_fields);
 	out->nr_columns = t->nr_columns;
@@ -490,9 +494,10 @@ static struct ex_table *ex_copy_table(struct ex_table *t)
 	return out;
 }
 
-static struct ex_list *ex_copy_list(struct ex_list *list)
+static struct ex_list *ex_clone_list(struct ex_list *list)
 {
 	struct ex_list *out = xmalloc(sizeof(struct ex_list));
+	out->refs = 0;
 	out->nr_items = list->nr_items;
 	out->items = xcalloc(list->nr_items, sizeof(struct ex_list_item));
 	for (unsigned i = 0; i < list->nr_items; i++) {
@@ -504,6 +509,7 @@ static struct ex_list *ex_copy_list(struct ex_list *list)
 
 static void _ex_copy_tree(struct ex_tree *out, struct ex_tree *tree)
 {
+	out->refs = 0;
 	out->name = string_ref(tree->name);
 	out->is_leaf = tree->is_leaf;
 	if (tree->is_leaf) {
@@ -523,13 +529,37 @@ static void _ex_copy_tree(struct ex_tree *out, struct ex_tree *tree)
 	}
 }
 
-static struct ex_tree *ex_copy_tree(struct ex_tree *tree)
+static struct ex_tree *ex_clone_tree(struct ex_tree *tree)
 {
 	struct ex_tree *out = xmalloc(sizeof(struct ex_tree));
 	_ex_copy_tree(out, tree);
 	return out;
 }
 
+static struct ex_table *ex_unshare_table(struct ex_table *t)
+{
+	if (!t->refs)
+		return t;
+	t->refs--;
+	return ex_clone_table(t);
+}
+
+static struct ex_list *ex_unshare_list(struct ex_list *list)
+{
+	if (!list->refs)
+		return list;
+	list->refs--;
+	return ex_clone_list(list);
+}
+
+static struct ex_tree *ex_unshare_tree(struct ex_tree *tree)
+{
+	if (!tree->refs)
+		return tree;
+	tree->refs--;
+	return ex_clone_tree(tree);
+}
+
 static void ex_copy_value(struct ex_value *out, struct ex_value *in)
 {
 	out->type = in->type;
@@ -538,9 +568,9 @@ static void ex_copy_value(struct ex_value *out, struct ex_value *in)
 	case EX_INT:    out->i = in->i; break;
 	case EX_FLOAT:  out->f = in->f; break;
 	case EX_STRING: out->s = string_ref(in->s); break;
-	case EX_TABLE:  out->t = ex_copy_table(in->t); break;
-	case EX_LIST:   out->list = ex_copy_list(in->list); break;
-	case EX_TREE:   out->tree = ex_copy_tree(in->tree); break;
+	case EX_TABLE:  out->t = in->t; out->t->refs++; break;
+	case EX_LIST:   out->list = in->list; out->list->refs++; break;
+	case EX_TREE:   out->tree = in->tree; out->tree->refs++; break;
 	}
 }
 
@@ -595,11 +625,13 @@ static bool ex_header_equal(struct ex_table *a, struct ex_table *b)
 	return true;
 }
 
-static void ex_append_table(struct ex_table *out, struct ex_table *in)
+static void ex_append_table(struct ex_value *dst, struct ex_table *in)
 {
-	if (!ex_header_equal(out, in))
+	if (!ex_header_equal(dst->t, in))
 		ERROR("Table headers do not match");
 
+	struct ex_table *out = dst->t = ex_unshare_table(dst->t);
+
 	// FIXME: should check if key exists in table and update rather than append
 	out->rows = xrealloc_array(out->rows, out->nr_rows, out->nr_rows+in->nr_rows, sizeof(struct ex_value*));
 	for (unsigned i = 0; i < in->nr_rows; i++) {
@@ -608,8 +640,9 @@ static void ex_append_table(struct ex_table *out, struct ex_table *in)
 	out->nr_rows += in->nr_rows;
 }
 
-static void ex_append_list(struct ex_list *out, struct ex_list *in)
+static void ex_append_list(struct ex_value *dst, struct ex_list *in)
 {
+	struct ex_list *out = dst->list = ex_unshare_list(dst->list);
 	out->items = xrealloc_array(out->items, out->nr_items, out->nr_items+in->nr_items, sizeof(struct ex_list_item));
 	for (unsigned i = 0; i < in->nr_items; i++) {
 		out->items[out->nr_items+i].size = in->items[i].size;
@@ -680,17 +713,20 @@ struct ex *ex_extract_append(struct ex *base, struct ex *append)
 				break;
 			case EX_TABLE:
 				ex_copy_block(&out->blocks[out->nr_blocks], src);
-				ex_append_table(out->blocks[out->nr_blocks].val.t, append->blocks[i].val.t);
+				ex_append_table(&out->blocks[out->nr_blocks].val, append->blocks[i].val.t);
 				break;
 			case EX_LIST:
 				ex_copy_block(&out->blocks[out->nr_blocks], src);
-				ex_append_list(out->blocks[out->nr_blocks].val.list, append->blocks[i].val.list);
+				ex_append_list(&out->blocks[out->nr_blocks].val, append->blocks[i].val.list);
 				break;
-			case EX_TREE:
+			case EX_TREE: {
+				struct ex_value *dst = &out->blocks[out->nr_blocks].val;
 				ex_copy_block(&out->blocks[out->nr_blocks], src);
-				ex_append_tree(out->blocks[out->nr_blocks].val.tree, append->blocks[i].val.tree);
+				dst->tree = ex_unshare_tree(dst->tree);
+				ex_append_tree(dst->tree, append->blocks[i].val.tree);
 				break;
 			}
+			}
 		} else {
 			ex_copy_block(&out->blocks[out->nr_blocks], &append->blocks[i]);
 		}
@@ -708,9 +744,12 @@ void ex_append(struct ex *base, struct ex *append)
 			case EX_INT:    src->val.i = append->blocks[i].val.i; break;
 			case EX_FLOAT:  src->val.f = append->blocks[i].val.f; break;
 			case EX_STRING: src->val.s = string_ref(append->blocks[i].val.s); break;
-			case EX_TABLE:  ex_append_table(src->val.t, append->blocks[i].val.t); break;
-			case EX_LIST:   ex_append_list(src->val.list, append->blocks[i].val.list); break;
-			case EX_TREE:   ex_append_tree(src->val.tree, append->blocks[i].val.tree); break;
+			case EX_TABLE:  ex_append_table(&src->val, append->blocks[i].val.t); break;
+			case EX_LIST:   ex_append_list(&src->val, append->blocks[i].val.list); break;
+			case EX_TREE:
+				src->val.tree = ex_unshare_tree(src->val.tree);
+				ex_append_tree(src->val.tree, append->blocks[i].val.tree);
+				break;
 			}
 		} else {
 			base->blocks = xrealloc_array(base->blocks, base->nr_blocks, base->nr_blocks+1, sizeof(struct ex_block));
@@ -740,6 +779,17 @@ static void ex_free_table(struct ex_table *table);
 static void ex_free_list(struct ex_list *list);
 static void ex_free_tree(struct ex_tree *tree);
 
+// drop a reference to a tree referenced by an ex_value
+static void ex_unref_tree(struct ex_tree *tree)
+{
+	if (tree->refs) {
+		tree->refs--;
+		return;
+	}
+	ex_free_tree(tree);
+	free(tree);
+}
+
 static void ex_free_value(struct ex_value *value)
 {
 	switch (value->type) {
@@ -753,8 +803,7 @@ static void ex_free_value(struct ex_value *value)
 		ex_free_list(value->list);
 		break;
 	case EX_TREE:
-		ex_free_tree(value->tree);
-		free(value->tree);
+		ex_unref_tree(value->tree);
 		break;
 	default:
 		break;
@@ -782,6 +831,10 @@ static void ex_free_fields(struct ex_field *fields, uint32_t n)
 
 static void ex_free_table(struct ex_table *table)
 {
+	if (table->refs) {
+		table->refs--;
+		return;
+	}
 	ex_free_fields(table->fields, table->nr_fields);
 	for (uint32_t i = 0; i < table->nr_rows; i++) {
 		ex_free_values(table->rows[i], table->nr_columns);
@@ -792,6 +845,10 @@ static void ex_free_table(struct ex_table *table)
 
 static void ex_free_list(struct ex_list *list)
 {
+	if (list->refs) {
+		list->refs--;
+		return;
+	}
 	for (uint32_t i = 0; i < list->nr_items; i++) {
 		ex_free_value(&list->items[i].value);
 	}
@@ -832,8 +889,7 @@ void ex_free(struct ex *ex)
 			ex_free_list(block->val.list);
 			break;
 		case EX_TREE:
-			ex_free_tree(block->val.tree);
-			free(block->val.tree);
+			ex_unref_tree(block->val.tree);
 			break;
 		default:
 			break;
@@ -878,7 +934,7 @@ static struct ex_value *_ex_get(struct ex *ex, const char *name, size_t name_len
 	return NULL;
 }
 
-struct ex_value *ex_get(struct ex *ex, const char *name)
+static struct ex_value *ex_get_path(struct ex *ex, const char *name)
 {
 	char *next = strchr(name, '.');
 	size_t len = next ? (size_t)(next - name) : strlen(name);
@@ -892,6 +948,15 @@ struct ex_value *ex_get(struct ex *ex, const char *name)
 	return ex_tree_get_path(v->tree, next+1);
 }
 
+struct ex_value *ex_get(struct ex *ex, const char *name)
+{
+	uint64_t t = sys4_trace_begin();
+	struct ex_value *v = ex_get_path(ex, name);
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_EX_GET, NULL, -1, name, 0, v);
+	return v;
+}
+
 static struct ex_block *ex_get_block(struct ex *ex, const char *name, enum ex_value_type type)
 {
 	for (unsigned i = 0; i < ex->nr_blocks; i++) {
@@ -903,9 +968,19 @@ static struct ex_block *ex_get_block(struct ex *ex, const char *name, enum ex_va
 	return NULL;
 }
 
+// ex_get_block for the public ex_get_* functions, which are traced
+static struct ex_block *ex_lookup_block(struct ex *ex, const char *name, enum ex_value_type type)
+{
+	uint64_t t = sys4_trace_begin();
+	struct ex_block *b = ex_get_block(ex, name, type);
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_EX_GET, NULL, -1, name, 0, b);
+	return b;
+}
+
 int32_t ex_get_int(struct ex *ex, const char *name, int32_t dflt)
 {
-	struct ex_block *b = ex_get_block(ex, name, EX_INT);
+	struct ex_block *b = ex_lookup_block(ex, name, EX_INT);
 	if (!b)
 		return dflt;
 	return b->val.i;
@@ -913,7 +988,7 @@ int32_t ex_get_int(struct ex *ex, const char *name, int32_t dflt)
 
 float ex_get_float(struct ex *ex, const char *name, float dflt)
 {
-	struct ex_block *b = ex_get_block(ex, name, EX_FLOAT);
+	struct ex_block *b = ex_lookup_block(ex, name, EX_FLOAT);
 	if (!b)
 		return dflt;
 	return b->val.f;
@@ -921,7 +996,7 @@ float ex_get_float(struct ex *ex, const char *name, float dflt)
 
 struct string *ex_get_string(struct ex *ex, const char *name)
 {
-	struct ex_block *b = ex_get_block(ex, name, EX_STRING);
+	struct ex_block *b = ex_lookup_block(ex, name, EX_STRING);
 	if (!b)
 		return NULL;
 	return string_ref(b->val.s);
@@ -929,7 +1004,7 @@ struct string *ex_get_string(struct ex *ex, const char *name)
 
 struct ex_table *ex_get_table(struct ex *ex, const char *name)
 {
-	struct ex_block *b = ex_get_block(ex, name, EX_TABLE);
+	struct ex_block *b = ex_lookup_block(ex, name, EX_TABLE);
 	if (!b)
 		return NULL;
 	return b->val.t;
@@ -937,7 +1012,7 @@ struct ex_table *ex_get_table(struct ex *ex, const char *name)
 
 struct ex_list *ex_get_list(struct ex *ex, const char *name)
 {
-	struct ex_block *b = ex_get_block(ex, name, EX_LIST);;
+	struct ex_block *b = ex_lookup_block(ex, name, EX_LIST);;
 	if (!b)
 		return NULL;
 	return b->val.list;
@@ -945,7 +1020,7 @@ struct ex_list *ex_get_list(struct ex *ex, const char *name)
 
 struct ex_tree *ex_get_tree(struct ex *ex, const char *name)
 {
-	struct ex_block *b = ex_get_block(ex, name, EX_TREE);;
+	struct ex_block *b = ex_lookup_block(ex, name, EX_TREE);;
 	if (!b)
 		return NULL;
 	return b->val.tree;
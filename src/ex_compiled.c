@@ -0,0 +1,954 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/buffer.h"
+#include "system4/ex.h"
+#include "system4/ex_compiled.h"
+#include "system4/file.h"
+#include "system4/hashtable.h"
+#include "system4/string.h"
+#include "system4/trace.h"
+#include "archive_io.h"
+#include "hash.h"
+#include "kvec.h"
+#include "little_endian.h"
+
+/*
+ * Image layout. All integers are 32-bit little endian and every record is
+ * 4-byte aligned. Positions are offsets from the start of the image, except
+ * for string references, which are offsets into the string blob. Records are
+ * written after everything they refer to.
+ *
+ * header:    "S4EX", version, u64 source hash, nr_blocks, blocks, nr_slots,
+ *            slots, strings, strings_size, image_size, reserved
+ * block:     name, name hash, type, data
+ * slots:     nr_slots (a power of two) block numbers + 1, by name hash with
+ *            linear probing; 0 = empty
+ * string:    length, bytes, NUL, padding
+ * table:     nr_fields, fields, nr_rows, nr_columns, key index, key column,
+ *            then (type, data) for every cell, column by column
+ * key index: nr_keys, then (key, row) sorted by key, then row; the key of a
+ *            string is its hash
+ * field:     type, name, has_value, is_index, value type, value data,
+ *            nr_subfields, subfields
+ * list:      nr_items, then (type, data) for every item
+ * tree:      array of nodes in breadth-first order, so that the children of a
+ *            node are consecutive
+ * node:      name, is_leaf, then either (first child, nr_children, 0) or
+ *            (leaf name, value type, value data)
+ *
+ * The data of a value is the integer itself, the bits of the float, the
+ * string reference, or the position of the table/list/root node.
+ */
+#define EXC_MAGIC "S4EX"
+#define EXC_VERSION 1
+#define EXC_HEADER_SIZE 48
+#define EXC_BLOCK_SIZE 16
+#define EXC_FIELD_SIZE 32
+#define EXC_TABLE_SIZE 24
+#define EXC_NODE_SIZE 20
+#define EXC_NO_KEY 0xffffffff
+
+struct ex_compiled {
+	struct archive_file file;
+	uint8_t *buf;
+	const uint8_t *data;
+	size_t size;
+	uint64_t source_hash;
+	uint32_t nr_blocks;
+	uint32_t blocks;
+	uint32_t nr_slots;
+	uint32_t slots;
+	uint32_t strings;
+	uint32_t strings_size;
+};
+
+static void put_u64(uint8_t *b, int i, uint64_t v)
+{
+	LittleEndian_putDW(b, i, (uint32_t)v);
+	LittleEndian_putDW(b, i + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_u64(const uint8_t *b, int i)
+{
+	return (uint32_t)LittleEndian_getDW(b, i) | ((uint64_t)(uint32_t)LittleEndian_getDW(b, i + 4) << 32);
+}
+
+static uint32_t hash32(const char *s, size_t len)
+{
+	return (uint32_t)hash64(s, len, 0);
+}
+
+static bool valid_type(enum ex_value_type type)
+{
+	return type >= EX_INT && type <= EX_TREE;
+}
+
+bool ex_file_hash(const char *path, uint64_t *hash_out)
+{
+	size_t size;
+	uint8_t *data = file_read(path, &size);
+	if (!data)
+		return false;
+	*hash_out = hash64(data, size, 0);
+	free(data);
+	return true;
+}
+
+/*
+ * Compiler
+ */
+
+struct compiler {
+	struct buffer out;
+	struct buffer strings;
+	// text -> string reference + 1
+	struct hash_table *string_refs;
+};
+
+struct key_row {
+	uint32_t key;
+	uint32_t row;
+};
+
+static uint32_t compile_value(struct compiler *c, struct ex_value *v);
+
+static uint32_t compile_cstring(struct compiler *c, const char *text, size_t len)
+{
+	// strings with embedded NULs can't be keyed by their text
+	struct ht_slot *slot = NULL;
+	if (strlen(text) == len) {
+		slot = ht_put(c->string_refs, text, NULL);
+		if (slot->value)
+			return (uint32_t)((uintptr_t)slot->value - 1);
+	}
+	uint32_t ref = c->strings.index;
+	buffer_write_int32(&c->strings, len);
+	buffer_write_bytes(&c->strings, (const uint8_t*)text, len);
+	do {
+		buffer_write_int8(&c->strings, 0);
+	} while (c->strings.index & 3);
+	if (slot)
+		slot->value = (void*)((uintptr_t)ref + 1);
+	return ref;
+}
+
+static uint32_t compile_string(struct compiler *c, struct string *s)
+{
+	if (!s)
+		return compile_cstring(c, "", 0);
+	return compile_cstring(c, s->text, s->size);
+}
+
+static uint32_t compile_fields(struct compiler *c, struct ex_field *fields, uint32_t n)
+{
+	if (!n)
+		return 0;
+	uint32_t *recs = xcalloc(n, 3 * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		struct ex_field *f = &fields[i];
+		recs[i*3] = compile_string(c, f->name);
+		if (f->has_value)
+			recs[i*3+1] = compile_value(c, &f->value);
+		recs[i*3+2] = compile_fields(c, f->subfields, f->nr_subfields);
+	}
+	uint32_t off = c->out.index;
+	for (uint32_t i = 0; i < n; i++) {
+		struct ex_field *f = &fields[i];
+		bool has_value = f->has_value && valid_type(f->value.type);
+		buffer_write_int32(&c->out, f->type);
+		buffer_write_int32(&c->out, recs[i*3]);
+		buffer_write_int32(&c->out, f->has_value);
+		buffer_write_int32(&c->out, f->is_index);
+		buffer_write_int32(&c->out, has_value ? f->value.type : 0);
+		buffer_write_int32(&c->out, has_value ? recs[i*3+1] : 0);
+		buffer_write_int32(&c->out, f->nr_subfields);
+		buffer_write_int32(&c->out, recs[i*3+2]);
+	}
+	free(recs);
+	return off;
+}
+
+static int key_row_cmp(const void *_a, const void *_b)
+{
+	const struct key_row *a = _a, *b = _b;
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	return a->row < b->row ? -1 : a->row > b->row;
+}
+
+static uint32_t compile_key_index(struct compiler *c, struct ex_table *t, unsigned col)
+{
+	enum ex_value_type type = t->fields[col].type;
+	struct key_row *keys = xcalloc(t->nr_rows + 1, sizeof(struct key_row));
+	uint32_t nr_keys = 0;
+	for (uint32_t row = 0; row < t->nr_rows; row++) {
+		struct ex_value *v = &t->rows[row][col];
+		if (v->type != type)
+			continue;
+		if (type == EX_STRING)
+			keys[nr_keys].key = v->s ? hash32(v->s->text, strlen(v->s->text)) : hash32("", 0);
+		else
+			keys[nr_keys].key = v->i;
+		keys[nr_keys++].row = row;
+	}
+	qsort(keys, nr_keys, sizeof(struct key_row), key_row_cmp);
+
+	uint32_t off = c->out.index;
+	buffer_write_int32(&c->out, nr_keys);
+	for (uint32_t i = 0; i < nr_keys; i++) {
+		buffer_write_int32(&c->out, keys[i].key);
+		buffer_write_int32(&c->out, keys[i].row);
+	}
+	free(keys);
+	return off;
+}
+
+static uint32_t compile_table(struct compiler *c, struct ex_table *t)
+{
+	uint32_t fields = compile_fields(c, t->fields, t->nr_fields);
+
+	size_t nr_cells = (size_t)t->nr_rows * t->nr_columns;
+	uint32_t *cells = xcalloc(nr_cells + 1, sizeof(uint32_t));
+	for (uint32_t col = 0; col < t->nr_columns; col++) {
+		for (uint32_t row = 0; row < t->nr_rows; row++) {
+			cells[(size_t)col * t->nr_rows + row] = compile_value(c, &t->rows[row][col]);
+		}
+	}
+
+	// index the first index field, as ex_row_at_*_key do
+	uint32_t key_col = EXC_NO_KEY;
+	uint32_t key_index = 0;
+	for (uint32_t i = 0; i < t->nr_fields; i++) {
+		if (!t->fields[i].is_index)
+			continue;
+		if ((t->fields[i].type == EX_INT || t->fields[i].type == EX_STRING)
+				&& i < t->nr_columns) {
+			key_col = i;
+			key_index = compile_key_index(c, t, i);
+		}
+		break;
+	}
+
+	uint32_t off = c->out.index;
+	buffer_write_int32(&c->out, t->nr_fields);
+	buffer_write_int32(&c->out, fields);
+	buffer_write_int32(&c->out, t->nr_rows);
+	buffer_write_int32(&c->out, t->nr_columns);
+	buffer_write_int32(&c->out, key_index);
+	buffer_write_int32(&c->out, key_col);
+	for (uint32_t col = 0; col < t->nr_columns; col++) {
+		for (uint32_t row = 0; row < t->nr_rows; row++) {
+			struct ex_value *v = &t->rows[row][col];
+			buffer_write_int32(&c->out, valid_type(v->type) ? v->type : 0);
+			buffer_write_int32(&c->out, cells[(size_t)col * t->nr_rows + row]);
+		}
+	}
+	free(cells);
+	return off;
+}
+
+static uint32_t compile_list(struct compiler *c, struct ex_list *list)
+{
+	uint32_t *items = xcalloc(list->nr_items + 1, sizeof(uint32_t));
+	for (uint32_t i = 0; i < list->nr_items; i++) {
+		items[i] = compile_value(c, &list->items[i].value);
+	}
+	uint32_t off = c->out.index;
+	buffer_write_int32(&c->out, list->nr_items);
+	for (uint32_t i = 0; i < list->nr_items; i++) {
+		struct ex_value *v = &list->items[i].value;
+		buffer_write_int32(&c->out, valid_type(v->type) ? v->type : 0);
+		buffer_write_int32(&c->out, items[i]);
+	}
+	free(items);
+	return off;
+}
+
+static uint32_t compile_tree(struct compiler *c, struct ex_tree *root)
+{
+	kvec_t(struct ex_tree*) nodes;
+	kv_init(nodes);
+	kv_push(struct ex_tree*, nodes, root);
+	for (size_t i = 0; i < kv_size(nodes); i++) {
+		struct ex_tree *node = kv_A(nodes, i);
+		if (node->is_leaf)
+			continue;
+		for (uint32_t j = 0; j < node->nr_children; j++) {
+			kv_push(struct ex_tree*, nodes, &node->children[j]);
+		}
+	}
+
+	// first child of inner nodes; value of leaves
+	uint32_t *data = xcalloc(kv_size(nodes), sizeof(uint32_t));
+	uint32_t next_child = 1;
+	for (size_t i = 0; i < kv_size(nodes); i++) {
+		struct ex_tree *node = kv_A(nodes, i);
+		if (node->is_leaf) {
+			data[i] = compile_value(c, &node->leaf.value);
+		} else {
+			data[i] = next_child;
+			next_child += node->nr_children;
+		}
+	}
+
+	uint32_t off = c->out.index;
+	for (size_t i = 0; i < kv_size(nodes); i++) {
+		struct ex_tree *node = kv_A(nodes, i);
+		buffer_write_int32(&c->out, compile_string(c, node->name));
+		buffer_write_int32(&c->out, node->is_leaf);
+		if (node->is_leaf) {
+			enum ex_value_type type = node->leaf.value.type;
+			buffer_write_int32(&c->out, compile_string(c, node->leaf.name));
+			buffer_write_int32(&c->out, valid_type(type) ? type : 0);
+			buffer_write_int32(&c->out, data[i]);
+		} else {
+			buffer_write_int32(&c->out, off + data[i] * EXC_NODE_SIZE);
+			buffer_write_int32(&c->out, node->nr_children);
+			buffer_write_int32(&c->out, 0);
+		}
+	}
+	free(data);
+	kv_destroy(nodes);
+	return off;
+}
+
+static uint32_t compile_value(struct compiler *c, struct ex_value *v)
+{
+	switch (v->type) {
+	case EX_INT:
+		return v->i;
+	case EX_FLOAT: {
+		uint32_t bits;
+		memcpy(&bits, &v->f, sizeof(bits));
+		return bits;
+	}
+	case EX_STRING:
+		return compile_string(c, v->s);
+	case EX_TABLE:
+		return compile_table(c, v->t);
+	case EX_LIST:
+		return compile_list(c, v->list);
+	case EX_TREE:
+		return compile_tree(c, v->tree);
+	}
+	return 0;
+}
+
+bool ex_compile(struct ex *ex, uint64_t source_hash, const char *path)
+{
+	struct compiler c;
+	buffer_init(&c.out, NULL, 0);
+	buffer_init(&c.strings, NULL, 0);
+	c.string_refs = ht_create(4096);
+
+	uint8_t header[EXC_HEADER_SIZE] = {0};
+	buffer_write_bytes(&c.out, header, EXC_HEADER_SIZE);
+
+	uint32_t *names = xcalloc(ex->nr_blocks + 1, sizeof(uint32_t));
+	uint32_t *data = xcalloc(ex->nr_blocks + 1, sizeof(uint32_t));
+	uint32_t *hashes = xcalloc(ex->nr_blocks + 1, sizeof(uint32_t));
+	for (uint32_t i = 0; i < ex->nr_blocks; i++) {
+		struct ex_block *b = &ex->blocks[i];
+		names[i] = compile_string(&c, b->name);
+		hashes[i] = b->name ? hash32(b->name->text, strlen(b->name->text)) : hash32("", 0);
+		data[i] = compile_value(&c, &b->val);
+	}
+
+	uint32_t blocks = c.out.index;
+	for (uint32_t i = 0; i < ex->nr_blocks; i++) {
+		enum ex_value_type type = ex->blocks[i].val.type;
+		buffer_write_int32(&c.out, names[i]);
+		buffer_write_int32(&c.out, hashes[i]);
+		buffer_write_int32(&c.out, valid_type(type) ? type : 0);
+		buffer_write_int32(&c.out, data[i]);
+	}
+
+	// blocks are inserted in order, so that when names repeat the first
+	// block is also the first one probed
+	uint32_t nr_slots = 1;
+	while (nr_slots < (uint64_t)ex->nr_blocks * 2)
+		nr_slots <<= 1;
+	uint32_t *slots = xcalloc(nr_slots, sizeof(uint32_t));
+	for (uint32_t i = 0; i < ex->nr_blocks; i++) {
+		uint32_t h = hashes[i] & (nr_slots - 1);
+		while (slots[h])
+			h = (h + 1) & (nr_slots - 1);
+		slots[h] = i + 1;
+	}
+	uint32_t slots_off = c.out.index;
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		buffer_write_int32(&c.out, slots[i]);
+	}
+	free(slots);
+	free(hashes);
+	free(data);
+	free(names);
+	ht_free(c.string_refs);
+
+	uint32_t strings = c.out.index;
+	buffer_write_bytes(&c.out, c.strings.buf, c.strings.index);
+	free(c.strings.buf);
+
+	if (c.out.index > UINT32_MAX) {
+		WARNING("EX file too large to compile");
+		free(c.out.buf);
+		return false;
+	}
+
+	uint8_t *h = c.out.buf;
+	memcpy(h, EXC_MAGIC, 4);
+	LittleEndian_putDW(h, 4, EXC_VERSION);
+	put_u64(h, 8, source_hash);
+	LittleEndian_putDW(h, 16, ex->nr_blocks);
+	LittleEndian_putDW(h, 20, blocks);
+	LittleEndian_putDW(h, 24, nr_slots);
+	LittleEndian_putDW(h, 28, slots_off);
+	LittleEndian_putDW(h, 32, strings);
+	LittleEndian_putDW(h, 36, c.out.index - strings);
+	LittleEndian_putDW(h, 40, c.out.index);
+
+	// write to a temporary file first, so that an image mapped by someone
+	// else is never truncated under them
+	char *tmp = xmalloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	bool ok = file_write(tmp, c.out.buf, c.out.index);
+	free(c.out.buf);
+	if (ok) {
+#ifdef _WIN32
+		remove_utf8(path);
+#endif
+		if (rename(tmp, path)) {
+			WARNING("Failed to write '%s': %s", path, strerror(errno));
+			remove_utf8(tmp);
+			ok = false;
+		}
+	} else {
+		WARNING("Failed to write '%s'", tmp);
+	}
+	free(tmp);
+	return ok;
+}
+
+/*
+ * Loading
+ */
+
+static bool exc_parse(struct ex_compiled *ex)
+{
+	const uint8_t *d = ex->data;
+	if (ex->size < EXC_HEADER_SIZE || memcmp(d, EXC_MAGIC, 4))
+		return false;
+	if (LittleEndian_getDW(d, 4) != EXC_VERSION)
+		return false;
+	if ((uint32_t)LittleEndian_getDW(d, 40) != ex->size)
+		return false;
+	ex->source_hash = get_u64(d, 8);
+	ex->nr_blocks = LittleEndian_getDW(d, 16);
+	ex->blocks = LittleEndian_getDW(d, 20);
+	ex->nr_slots = LittleEndian_getDW(d, 24);
+	ex->slots = LittleEndian_getDW(d, 28);
+	ex->strings = LittleEndian_getDW(d, 32);
+	ex->strings_size = LittleEndian_getDW(d, 36);
+
+	if (ex->blocks + (uint64_t)ex->nr_blocks * EXC_BLOCK_SIZE > ex->size)
+		return false;
+	if (!ex->nr_slots || (ex->nr_slots & (ex->nr_slots - 1)) || ex->nr_slots <= ex->nr_blocks)
+		return false;
+	if (ex->slots + (uint64_t)ex->nr_slots * 4 > ex->size)
+		return false;
+	if ((uint64_t)ex->strings + ex->strings_size > ex->size)
+		return false;
+	return true;
+}
+
+struct ex_compiled *ex_open_compiled(const char *path)
+{
+	if (!file_exists(path))
+		return NULL;
+	struct ex_compiled *ex = xcalloc(1, sizeof(struct ex_compiled));
+	int error;
+	if (!archive_file_open(&ex->file, path, ARCHIVE_MMAP, &error)) {
+		free(ex);
+		return NULL;
+	}
+	if (ex->file.map) {
+		ex->data = ex->file.map;
+		ex->size = ex->file.size;
+	} else {
+		// no mmap on this platform: read the whole image
+		archive_file_close(&ex->file);
+		if (!(ex->buf = file_read(path, &ex->size))) {
+			free(ex);
+			return NULL;
+		}
+		ex->data = ex->buf;
+	}
+	if (!exc_parse(ex)) {
+		WARNING("Invalid compiled EX file: %s", path);
+		ex_compiled_close(ex);
+		return NULL;
+	}
+	return ex;
+}
+
+void ex_compiled_close(struct ex_compiled *ex)
+{
+	if (!ex)
+		return;
+	if (ex->buf)
+		free(ex->buf);
+	else
+		archive_file_close(&ex->file);
+	free(ex);
+}
+
+uint64_t ex_compiled_source_hash(struct ex_compiled *ex)
+{
+	return ex->source_hash;
+}
+
+struct ex_compiled *ex_open_cached(const char *ex_path, const char *cache_path)
+{
+	uint64_t hash;
+	if (!ex_file_hash(ex_path, &hash))
+		return NULL;
+
+	struct ex_compiled *ex = ex_open_compiled(cache_path);
+	if (ex && ex->source_hash == hash)
+		return ex;
+	ex_compiled_close(ex);
+
+	struct ex *src = ex_read_file(ex_path);
+	if (!src)
+		return NULL;
+	bool ok = ex_compile(src, hash, cache_path);
+	ex_free(src);
+	return ok ? ex_open_compiled(cache_path) : NULL;
+}
+
+/*
+ * Queries. Everything read from the image is bounds checked, so that a
+ * corrupt image yields empty values rather than reads out of the mapping.
+ */
+
+static uint32_t rd(const struct ex_compiled *ex, uint64_t off)
+{
+	if (off + 4 > ex->size)
+		return 0;
+	return LittleEndian_getDW(ex->data, off);
+}
+
+// a NUL-terminated string at position `off`, or NULL
+static const char *str_at(const struct ex_compiled *ex, uint64_t off)
+{
+	if (off + 4 > ex->size)
+		return NULL;
+	uint64_t len = rd(ex, off);
+	if (off + 4 + len + 1 > ex->size || ex->data[off + 4 + len])
+		return NULL;
+	return (const char*)ex->data + off + 4;
+}
+
+static const char *name_at(const struct ex_compiled *ex, uint32_t ref)
+{
+	if (ref >= ex->strings_size)
+		return NULL;
+	return str_at(ex, (uint64_t)ex->strings + ref);
+}
+
+static bool name_eq(const char *a, const char *b, size_t b_len)
+{
+	return a && !strncmp(a, b, b_len) && !a[b_len];
+}
+
+static struct exc_value make_value(const struct ex_compiled *ex, uint32_t type, uint32_t data)
+{
+	struct exc_value v = { .ex = ex, .type = type };
+	switch (type) {
+	case EX_INT:
+		v.i = data;
+		break;
+	case EX_FLOAT:
+		memcpy(&v.f, &data, sizeof(v.f));
+		break;
+	case EX_STRING:
+		if (data >= ex->strings_size)
+			return (struct exc_value) { .ex = ex };
+		v.off = ex->strings + data;
+		break;
+	case EX_TABLE:
+	case EX_LIST:
+	case EX_TREE:
+		v.off = data;
+		break;
+	default:
+		v.type = 0;
+		break;
+	}
+	return v;
+}
+
+uint32_t ex_compiled_nr_blocks(struct ex_compiled *ex)
+{
+	return ex->nr_blocks;
+}
+
+const char *ex_compiled_block_name(struct ex_compiled *ex, uint32_t i)
+{
+	if (i >= ex->nr_blocks)
+		return NULL;
+	return name_at(ex, rd(ex, ex->blocks + (uint64_t)i * EXC_BLOCK_SIZE));
+}
+
+struct exc_value ex_compiled_block(struct ex_compiled *ex, uint32_t i)
+{
+	if (i >= ex->nr_blocks)
+		return (struct exc_value) { .ex = ex };
+	uint64_t b = ex->blocks + (uint64_t)i * EXC_BLOCK_SIZE;
+	return make_value(ex, rd(ex, b + 8), rd(ex, b + 12));
+}
+
+// the first block named `name` (of type `type`, unless 0)
+static struct exc_value get_block(struct ex_compiled *ex, const char *name, size_t len,
+		enum ex_value_type type)
+{
+	uint32_t hash = hash32(name, len);
+	uint32_t mask = ex->nr_slots - 1;
+	uint32_t h = hash & mask;
+	for (uint32_t n = 0; n < ex->nr_slots; n++, h = (h + 1) & mask) {
+		uint32_t i = rd(ex, ex->slots + (uint64_t)h * 4);
+		if (!i || i > ex->nr_blocks)
+			break;
+		uint64_t b = ex->blocks + (uint64_t)(i - 1) * EXC_BLOCK_SIZE;
+		if (rd(ex, b + 4) != hash)
+			continue;
+		if (type && rd(ex, b + 8) != type)
+			continue;
+		if (!name_eq(name_at(ex, rd(ex, b)), name, len))
+			continue;
+		return make_value(ex, rd(ex, b + 8), rd(ex, b + 12));
+	}
+	return (struct exc_value) { .ex = ex };
+}
+
+static struct exc_value lookup_block(struct ex_compiled *ex, const char *name,
+		enum ex_value_type type)
+{
+	uint64_t t = sys4_trace_begin();
+	struct exc_value v = get_block(ex, name, strlen(name), type);
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_EX_GET, NULL, -1, name, 0, v.type);
+	return v;
+}
+
+static struct exc_value tree_get_path(struct exc_value tree, const char *path)
+{
+	const char *next = strchr(path, '.');
+	size_t len = next ? (size_t)(next - path) : strlen(path);
+
+	if (exc_tree_is_leaf(tree)) {
+		if (!next && name_eq(exc_leaf_name(tree), path, len))
+			return exc_leaf_value(tree);
+		return (struct exc_value) { .ex = tree.ex };
+	}
+
+	uint32_t nr_children = exc_tree_nr_children(tree);
+	for (uint32_t i = 0; i < nr_children; i++) {
+		struct exc_value child = exc_tree_child(tree, i);
+		if (!name_eq(exc_tree_name(child), path, len))
+			continue;
+		if (next)
+			return tree_get_path(child, next + 1);
+		if (exc_tree_is_leaf(child))
+			return exc_leaf_value(child);
+		return child;
+	}
+	return (struct exc_value) { .ex = tree.ex };
+}
+
+struct exc_value exc_get(struct ex_compiled *ex, const char *name)
+{
+	uint64_t t = sys4_trace_begin();
+	const char *next = strchr(name, '.');
+	size_t len = next ? (size_t)(next - name) : strlen(name);
+	struct exc_value v = get_block(ex, name, len, 0);
+	if (next)
+		v = v.type == EX_TREE ? tree_get_path(v, next + 1) : (struct exc_value) { .ex = ex };
+	if (t)
+		_sys4_trace_end(t, SYS4_TRACE_EX_GET, NULL, -1, name, 0, v.type);
+	return v;
+}
+
+int32_t exc_get_int(struct ex_compiled *ex, const char *name, int32_t dflt)
+{
+	struct exc_value v = lookup_block(ex, name, EX_INT);
+	return v.type ? v.i : dflt;
+}
+
+float exc_get_float(struct ex_compiled *ex, const char *name, float dflt)
+{
+	struct exc_value v = lookup_block(ex, name, EX_FLOAT);
+	return v.type ? v.f : dflt;
+}
+
+const char *exc_get_string(struct ex_compiled *ex, const char *name)
+{
+	return exc_string(lookup_block(ex, name, EX_STRING));
+}
+
+struct exc_value exc_get_table(struct ex_compiled *ex, const char *name)
+{
+	return lookup_block(ex, name, EX_TABLE);
+}
+
+struct exc_value exc_get_list(struct ex_compiled *ex, const char *name)
+{
+	return lookup_block(ex, name, EX_LIST);
+}
+
+struct exc_value exc_get_tree(struct ex_compiled *ex, const char *name)
+{
+	return lookup_block(ex, name, EX_TREE);
+}
+
+const char *exc_string(struct exc_value v)
+{
+	if (v.type != EX_STRING)
+		return NULL;
+	return str_at(v.ex, v.off);
+}
+
+uint32_t exc_string_size(struct exc_value v)
+{
+	if (!exc_string(v))
+		return 0;
+	return rd(v.ex, v.off);
+}
+
+/*
+ * Tables
+ */
+
+uint32_t exc_table_nr_rows(struct exc_value table)
+{
+	if (table.type != EX_TABLE)
+		return 0;
+	return rd(table.ex, (uint64_t)table.off + 8);
+}
+
+uint32_t exc_table_nr_columns(struct exc_value table)
+{
+	if (table.type != EX_TABLE)
+		return 0;
+	return rd(table.ex, (uint64_t)table.off + 12);
+}
+
+uint32_t exc_table_nr_fields(struct exc_value table)
+{
+	if (table.type != EX_TABLE)
+		return 0;
+	return rd(table.ex, table.off);
+}
+
+static void read_field(const struct ex_compiled *ex, uint64_t rec, struct exc_field *out)
+{
+	out->type = rd(ex, rec);
+	out->name = name_at(ex, rd(ex, rec + 4));
+	out->is_index = rd(ex, rec + 12);
+	out->value = make_value(ex, rd(ex, rec + 16), rd(ex, rec + 20));
+	out->nr_subfields = rd(ex, rec + 24);
+	out->subfields = rd(ex, rec + 28);
+}
+
+bool exc_table_field(struct exc_value table, uint32_t i, struct exc_field *out)
+{
+	if (i >= exc_table_nr_fields(table))
+		return false;
+	uint32_t fields = rd(table.ex, (uint64_t)table.off + 4);
+	read_field(table.ex, fields + (uint64_t)i * EXC_FIELD_SIZE, out);
+	return true;
+}
+
+bool exc_field_subfield(const struct ex_compiled *ex, struct exc_field *field, uint32_t i,
+		struct exc_field *out)
+{
+	if (i >= field->nr_subfields)
+		return false;
+	read_field(ex, field->subfields + (uint64_t)i * EXC_FIELD_SIZE, out);
+	return true;
+}
+
+struct exc_value exc_table_get(struct exc_value table, unsigned row, unsigned col)
+{
+	uint32_t nr_rows = exc_table_nr_rows(table);
+	if (row >= nr_rows || col >= exc_table_nr_columns(table))
+		return (struct exc_value) { .ex = table.ex };
+	uint64_t cell = (uint64_t)table.off + EXC_TABLE_SIZE + ((uint64_t)col * nr_rows + row) * 8;
+	return make_value(table.ex, rd(table.ex, cell), rd(table.ex, cell + 4));
+}
+
+// position of the first entry of the key index not less than `key`
+static uint32_t key_lower_bound(const struct ex_compiled *ex, uint32_t index, uint32_t key)
+{
+	uint32_t lo = 0, hi = rd(ex, index);
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (rd(ex, index + 4 + (uint64_t)mid * 8) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int row_at_key(struct exc_value t, enum ex_value_type type, uint32_t key, const char *s)
+{
+	if (t.type != EX_TABLE)
+		return -1;
+	uint32_t index = rd(t.ex, (uint64_t)t.off + 16);
+	uint32_t col = rd(t.ex, (uint64_t)t.off + 20);
+	struct exc_field field;
+	if (!index || !exc_table_field(t, col, &field) || field.type != type)
+		return -1;
+
+	uint32_t nr_keys = rd(t.ex, index);
+	for (uint32_t i = key_lower_bound(t.ex, index, key); i < nr_keys; i++) {
+		uint64_t e = index + 4 + (uint64_t)i * 8;
+		if (rd(t.ex, e) != key)
+			break;
+		uint32_t row = rd(t.ex, e + 4);
+		if (row > INT32_MAX)
+			break;
+		if (!s)
+			return row;
+		const char *v = exc_string(exc_table_get(t, row, col));
+		if (v && !strcmp(v, s))
+			return row;
+	}
+	return -1;
+}
+
+int exc_row_at_int_key(struct exc_value table, int key)
+{
+	return row_at_key(table, EX_INT, key, NULL);
+}
+
+int exc_row_at_string_key(struct exc_value table, const char *key)
+{
+	return row_at_key(table, EX_STRING, hash32(key, strlen(key)), key);
+}
+
+int exc_col_from_name(struct exc_value table, const char *name)
+{
+	uint32_t nr_fields = exc_table_nr_fields(table);
+	for (uint32_t i = 0; i < nr_fields && i <= INT32_MAX; i++) {
+		struct exc_field f;
+		exc_table_field(table, i, &f);
+		if (f.name && !strcmp(f.name, name))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Lists
+ */
+
+uint32_t exc_list_nr_items(struct exc_value list)
+{
+	if (list.type != EX_LIST)
+		return 0;
+	return rd(list.ex, list.off);
+}
+
+struct exc_value exc_list_get(struct exc_value list, unsigned i)
+{
+	if (i >= exc_list_nr_items(list))
+		return (struct exc_value) { .ex = list.ex };
+	uint64_t item = (uint64_t)list.off + 4 + (uint64_t)i * 8;
+	return make_value(list.ex, rd(list.ex, item), rd(list.ex, item + 4));
+}
+
+/*
+ * Trees
+ */
+
+const char *exc_tree_name(struct exc_value tree)
+{
+	if (tree.type != EX_TREE)
+		return NULL;
+	return name_at(tree.ex, rd(tree.ex, tree.off));
+}
+
+bool exc_tree_is_leaf(struct exc_value tree)
+{
+	if (tree.type != EX_TREE)
+		return false;
+	return rd(tree.ex, (uint64_t)tree.off + 4);
+}
+
+uint32_t exc_tree_nr_children(struct exc_value tree)
+{
+	if (tree.type != EX_TREE || exc_tree_is_leaf(tree))
+		return 0;
+	return rd(tree.ex, (uint64_t)tree.off + 12);
+}
+
+struct exc_value exc_tree_child(struct exc_value tree, unsigned i)
+{
+	if (i >= exc_tree_nr_children(tree))
+		return (struct exc_value) { .ex = tree.ex };
+	uint64_t child = rd(tree.ex, (uint64_t)tree.off + 8) + (uint64_t)i * EXC_NODE_SIZE;
+	if (child + EXC_NODE_SIZE > tree.ex->size)
+		return (struct exc_value) { .ex = tree.ex };
+	return (struct exc_value) { .ex = tree.ex, .type = EX_TREE, .off = child };
+}
+
+struct exc_value exc_tree_get_child(struct exc_value tree, const char *name)
+{
+	uint32_t nr_children = exc_tree_nr_children(tree);
+	for (uint32_t i = 0; i < nr_children; i++) {
+		struct exc_value child = exc_tree_child(tree, i);
+		const char *child_name = exc_tree_name(child);
+		if (child_name && !strcmp(child_name, name))
+			return child;
+	}
+	return (struct exc_value) { .ex = tree.ex };
+}
+
+const char *exc_leaf_name(struct exc_value tree)
+{
+	if (!exc_tree_is_leaf(tree))
+		return NULL;
+	return name_at(tree.ex, rd(tree.ex, (uint64_t)tree.off + 8));
+}
+
+struct exc_value exc_leaf_value(struct exc_value tree)
+{
+	if (!exc_tree_is_leaf(tree))
+		return (struct exc_value) { .ex = tree.ex };
+	return make_value(tree.ex, rd(tree.ex, (uint64_t)tree.off + 12),
+			rd(tree.ex, (uint64_t)tree.off + 16));
+}
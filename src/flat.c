@@ -16,7 +16,6 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/ajp.h"
@@ -26,6 +25,8 @@
 #include "system4/file.h"
 #include "system4/flat.h"
 #include "system4/string.h"
+#include "archive_io.h"
+#include "compression.h"
 
 static const char *get_file_extension(int type, const char *data)
 {
@@ -43,116 +44,247 @@ static const char *get_file_extension(int type, const char *data)
 	}
 }
 
-static void flat_free_data(struct archive_data *data)
+// called with ar->cache_lock held
+static void flat_cache_evict(struct flat_archive *ar, size_t need)
+{
+	while (ar->cache_size + need > ar->cache_budget) {
+		// evict the least recently used entry that isn't in use
+		struct flat_entry *victim = NULL;
+		for (unsigned i = 0; i < ar->nr_entries; i++) {
+			struct flat_entry *e = &ar->entries[i];
+			if (!e->inflated || e->refs)
+				continue;
+			if (!victim || e->last_use < victim->last_use)
+				victim = e;
+		}
+		if (!victim)
+			return;
+		free(victim->inflated);
+		ar->cache_size -= victim->inflated_size;
+		victim->inflated = NULL;
+		victim->inflated_size = 0;
+	}
+}
+
+void flat_set_cache_budget(struct flat_archive *ar, size_t budget)
+{
+	pthread_mutex_lock(&ar->cache_lock);
+	ar->cache_budget = budget;
+	flat_cache_evict(ar, 0);
+	pthread_mutex_unlock(&ar->cache_lock);
+}
+
+static void flat_release_file(struct archive_data *data)
 {
-	struct flat_data *flat = (struct flat_data*)data;
-	if (flat->inflated)
+	struct flat_archive *ar = (struct flat_archive*)data->archive;
+	struct flat_data *flatdata = (struct flat_data*)data;
+	if (flatdata->cached) {
+		pthread_mutex_lock(&ar->cache_lock);
+		ar->entries[data->no].refs--;
+		flat_cache_evict(ar, 0);
+		pthread_mutex_unlock(&ar->cache_lock);
+	} else if (flatdata->inflated) {
 		free(data->data);
-	free(data->name);
+	}
+	if (flatdata->cached || flatdata->inflated) {
+		data->data = ar->data + flatdata->off;
+		data->size = flatdata->size;
+		flatdata->cached = false;
+		flatdata->inflated = false;
+	}
+}
+
+static void flat_free_data(struct archive_data *data)
+{
+	// the name belongs to the archive's entry table
+	flat_release_file(data);
 	free(data);
 }
 
 static void flat_free(struct archive *_ar)
 {
 	struct flat_archive *ar = (struct flat_archive*)_ar;
-	if (ar->needs_free)
+	if (ar->ar.mmapped)
+		archive_file_close(&ar->file);
+	else if (ar->needs_free)
 		free(ar->data);
+	for (unsigned i = 0; i < ar->nr_entries; i++) {
+		free(ar->entries[i].name);
+		free(ar->entries[i].inflated);
+	}
+	free(ar->entries);
 	free(ar->libl_entries);
 	for (unsigned i = 0; i < ar->nr_talt_entries; i++) {
 		free(ar->talt_entries[i].metadata);
 	}
 	free(ar->talt_entries);
+	pthread_mutex_destroy(&ar->cache_lock);
 	free(ar);
 }
 
-static bool flat_get_entry(struct flat_archive *ar, unsigned no, struct flat_data *dst)
+static void flat_add_entry(struct flat_archive *ar, const char *section, uint32_t off,
+		uint32_t size, enum flat_data_type type)
 {
-	if (no < ar->nr_libl_entries) {
-		dst->off = ar->libl_entries[no].off;
-		dst->size = ar->libl_entries[no].size;
-		dst->type = ar->libl_entries[no].type;
-		return true;
-	}
+	unsigned no = ar->nr_entries++;
+	struct flat_entry *e = &ar->entries[no];
+	const char *ext = ".dat";
+	if (off + 4 <= ar->data_size)
+		ext = get_file_extension(type, (const char*)ar->data + off);
+	int len = snprintf(NULL, 0, "%s_%u%s", section, no, ext);
+	e->off = off;
+	e->size = size;
+	e->type = type;
+	e->name = xmalloc(len + 1);
+	snprintf(e->name, len + 1, "%s_%u%s", section, no, ext);
+}
 
-	no -= ar->nr_libl_entries;
-	if (no < ar->nr_talt_entries) {
-		dst->off = ar->talt_entries[no].off;
-		dst->size = ar->talt_entries[no].size;
-		dst->type = FLAT_CG;
-		return true;
+/*
+ * Build the combined entry table. Called by `flat_new` (for an empty archive)
+ * and again once the LIBL and TALT sections have been read.
+ */
+static void flat_index_entries(struct flat_archive *ar)
+{
+	for (unsigned i = 0; i < ar->nr_entries; i++) {
+		free(ar->entries[i].name);
+		free(ar->entries[i].inflated);
+	}
+	free(ar->entries);
+	ar->cache_size = 0;
+	ar->entries = xcalloc(ar->nr_libl_entries + ar->nr_talt_entries, sizeof(struct flat_entry));
+	ar->nr_entries = 0;
+	for (unsigned i = 0; i < ar->nr_libl_entries; i++) {
+		struct libl_entry *e = &ar->libl_entries[i];
+		flat_add_entry(ar, "LIBL", e->off, e->size, e->type);
 	}
+	for (unsigned i = 0; i < ar->nr_talt_entries; i++) {
+		struct talt_entry *e = &ar->talt_entries[i];
+		flat_add_entry(ar, "TALT", e->off, e->size, FLAT_CG);
+	}
+}
 
-	return false;
+static struct flat_entry *flat_get_entry(struct flat_archive *ar, unsigned no)
+{
+	return no < ar->nr_entries ? &ar->entries[no] : NULL;
 }
 
 static struct archive_data *flat_get(struct archive *_ar, int no)
 {
 	struct flat_archive *ar = (struct flat_archive*)_ar;
-	struct flat_data *data = xcalloc(1, sizeof(struct flat_data));
-
-	if (!flat_get_entry(ar, no, data)) {
-		free(data);
+	struct flat_entry *e = flat_get_entry(ar, no);
+	if (!e)
 		return NULL;
-	}
 
-	const char *section = (unsigned)no < ar->nr_libl_entries ? "LIBL" : "TALT";
-
-	data->super.data = ar->data + data->off;
-	data->super.size = data->size;
-	data->super.name = xmalloc(256);
-	snprintf(data->super.name, 256, "%s_%d%s", section, no, get_file_extension(data->type, (const char*)ar->data+data->off));
+	struct flat_data *data = xcalloc(1, sizeof(struct flat_data));
+	data->off = e->off;
+	data->size = e->size;
+	data->type = e->type;
+	data->super.data = ar->data + e->off;
+	data->super.size = e->size;
+	data->super.name = e->name;
 	data->super.no = no;
 	data->super.archive = _ar;
 	return &data->super;
 }
 
-static bool flat_load_file(possibly_unused struct archive_data *data)
+static bool flat_load_file(struct archive_data *data)
 {
 	struct flat_archive *ar = (struct flat_archive*)data->archive;
 	struct flat_data *flatdata = (struct flat_data*)data;
 
+	if (flatdata->inflated || flatdata->cached)
+		return true;
 	if (!data->data) {
 		data->data = ar->data + flatdata->off;
 	}
 
 	// inflate zlib compressed data
-	if (flatdata->type == FLAT_ZLIB && ar->data[flatdata->off+4] == 0x78) {
-		unsigned long size = LittleEndian_getDW(ar->data, flatdata->off);
-		uint8_t *out = xmalloc(size);
-		if (uncompress(out, &size, ar->data + flatdata->off + 4, flatdata->size - 4) != Z_OK) {
-			WARNING("uncompress failed");
-			free(out);
-			return false;
+	if (flatdata->type != FLAT_ZLIB || flatdata->size < 5 || ar->data[flatdata->off+4] != 0x78)
+		return true;
+
+	struct flat_entry *e = &ar->entries[data->no];
+	pthread_mutex_lock(&ar->cache_lock);
+	e->last_use = ++ar->cache_clock;
+	if (e->inflated) {
+		e->refs++;
+		data->data = e->inflated;
+		data->size = e->inflated_size;
+		flatdata->cached = true;
+		pthread_mutex_unlock(&ar->cache_lock);
+		return true;
+	}
+	pthread_mutex_unlock(&ar->cache_lock);
+
+	size_t size = LittleEndian_getDW(ar->data, flatdata->off);
+	uint8_t *out = xmalloc(size);
+	enum sys4_z_status r = sys4_inflate(out, &size, ar->data + flatdata->off + 4, flatdata->size - 4);
+	if (r != SYS4_Z_OK) {
+		WARNING("uncompress failed: %s", sys4_z_strerror(r));
+		free(out);
+		return false;
+	}
+	data->data = out;
+	data->size = size;
+
+	pthread_mutex_lock(&ar->cache_lock);
+	if (e->inflated) {
+		// another thread inflated the same entry in the meantime
+		free(out);
+		e->refs++;
+		data->data = e->inflated;
+		data->size = e->inflated_size;
+		flatdata->cached = true;
+	} else if (size <= ar->cache_budget) {
+		flat_cache_evict(ar, size);
+		if (ar->cache_size + size <= ar->cache_budget) {
+			e->inflated = out;
+			e->inflated_size = size;
+			e->refs = 1;
+			ar->cache_size += size;
+			flatdata->cached = true;
 		}
-		data->data = out;
-		data->size = size;
-		flatdata->inflated = true;
 	}
-
+	pthread_mutex_unlock(&ar->cache_lock);
+	if (!flatdata->cached)
+		flatdata->inflated = true;
 	return true;
 }
 
-static void flat_release_file(possibly_unused struct archive_data *data)
+// everything is in memory already, so there is nothing to batch
+static bool flat_load_files(struct archive_data **files, size_t n)
+{
+	bool ok = true;
+	for (size_t i = 0; i < n; i++) {
+		ok = flat_load_file(files[i]) && ok;
+	}
+	return ok;
+}
+
+static bool flat_get_extent(struct archive_data *data, struct archive_extent *out)
 {
 	struct flat_archive *ar = (struct flat_archive*)data->archive;
 	struct flat_data *flatdata = (struct flat_data*)data;
-	if (flatdata->inflated) {
-		free(data->data);
-		data->data = ar->data + flatdata->off;
-		data->size = flatdata->size;
-		flatdata->inflated = false;
-	}
+
+	// the whole file is always in memory (mapped or read)
+	out->fd = -1;
+	out->off = flatdata->off;
+	out->size = flatdata->size;
+	out->ptr = ar->data + flatdata->off;
+	out->compression = ARCHIVE_STORED;
+	if (flatdata->type == FLAT_ZLIB && flatdata->size >= 5 && ar->data[flatdata->off+4] == 0x78)
+		out->compression = ARCHIVE_ZLIB_SIZE32;
+	return true;
 }
 
 static struct archive_data *flat_copy_descriptor(struct archive_data *_src)
 {
 	struct flat_data *src = (struct flat_data*)_src;
 	struct flat_data *dst = xmalloc(sizeof(struct flat_data));
-	_archive_copy_descriptor_ip(&dst->super, &src->super);
-	dst->off = src->off;
-	dst->size = src->size;
-	dst->type = src->type;
+	*dst = *src;
+	struct flat_archive *ar = (struct flat_archive*)_src->archive;
+	dst->super.data = ar->data + src->off;
+	dst->super.size = src->size;
 	dst->inflated = false;
+	dst->cached = false;
 	return &dst->super;
 }
 
@@ -174,6 +306,8 @@ static struct archive_ops flat_archive_ops = {
 	.get_by_name = NULL,
 	.get_by_basename = NULL,
 	.load_file = flat_load_file,
+	.load_files = flat_load_files,
+	.get_extent = flat_get_extent,
 	.release_file = flat_release_file,
 	.copy_descriptor = flat_copy_descriptor,
 	.for_each = flat_for_each,
@@ -287,6 +421,9 @@ struct flat_archive *flat_new(void)
 {
 	struct flat_archive *ar = xcalloc(1, sizeof(struct flat_archive));
 	ar->ar.ops = &flat_archive_ops;
+	ar->cache_budget = FLAT_DEFAULT_CACHE_BUDGET;
+	pthread_mutex_init(&ar->cache_lock, NULL);
+	flat_index_entries(ar);
 	return ar;
 }
 
@@ -315,17 +452,38 @@ struct flat_archive *flat_open(uint8_t *data, size_t size, int *error)
 	ar->data = data;
 	read_libl(ar);
 	read_talt(ar);
+	flat_index_entries(ar);
 
+	_sys4_trace_archive_open(&ar->ar, NULL);
 	return ar;
 
 bad_archive:
-	free(ar);
+	flat_free(&ar->ar);
 	*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 	return NULL;
 }
 
-struct flat_archive *flat_open_file(const char *path, possibly_unused int flags, int *error)
+struct flat_archive *flat_open_file(const char *path, int flags, int *error)
 {
+	if (flags & (ARCHIVE_MMAP | ARCHIVE_MMAP_POPULATE)) {
+		struct archive_file file;
+		if (!archive_file_open(&file, path, flags, error))
+			return NULL;
+		if (file.map) {
+			struct flat_archive *ar = flat_open(file.map, file.size, error);
+			if (!ar) {
+				archive_file_close(&file);
+				return NULL;
+			}
+			ar->file = file;
+			ar->ar.mmapped = true;
+			_sys4_trace_archive_open(&ar->ar, path);
+			return ar;
+		}
+		// mmap not available: fall back to reading the whole file
+		archive_file_close(&file);
+	}
+
 	size_t size;
 	uint8_t *data = file_read(path, &size);
 	if (!data) {
@@ -340,5 +498,6 @@ struct flat_archive *flat_open_file(const char *path, possibly_unused int flags,
 	}
 
 	ar->needs_free = true;
+	_sys4_trace_archive_open(&ar->ar, path);
 	return ar;
 }
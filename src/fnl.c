@@ -17,13 +17,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
-#include <zlib.h>
 #include "system4.h"
 #include "system4/buffer.h"
 #include "system4/file.h"
 #include "system4/fnl.h"
 #include "system4/utfsjis.h"
 #include "little_endian.h"
+#include "compression.h"
 
 /*
  * NOTE: FNL glyphs are indexed according to the sequential order of code points
@@ -121,17 +121,14 @@ uint8_t *fnl_glyph_data(struct fnl *fnl, struct fnl_glyph *g, unsigned long *siz
 		return NULL;
 	}
 
-	*size = g->height * g->height * 4; // FIXME: determine real bound
-	uint8_t *data = xmalloc(*size);
-	int rv = uncompress(data, size, fnl->data + g->data_pos, g->data_compsize);
-	if (rv != Z_OK) {
-		if (rv == Z_BUF_ERROR)
-			ERROR("uncompress failed: Z_BUF_ERROR");
-		else if (rv == Z_MEM_ERROR)
-			ERROR("uncompress failed: Z_MEM_ERROR");
-		else if (rv == Z_DATA_ERROR)
-			ERROR("uncompress failed: Z_DATA_ERROR");
-	}
+	// the decompressed size isn't stored; the buffer grows as needed
+	size_t data_size;
+	enum sys4_z_status rv;
+	uint8_t *data = sys4_inflate_alloc(fnl->data + g->data_pos, g->data_compsize,
+			g->height * g->height * 4, &data_size, &rv);
+	if (!data)
+		ERROR("uncompress failed: %s", sys4_z_strerror(rv));
+	*size = data_size;
 	return data;
 }
 
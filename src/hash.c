@@ -0,0 +1,185 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+// Implementation of the XXH64 algorithm by Yann Collet.
+// See https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+#include <string.h>
+#include "hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t finalize(uint64_t h, const uint8_t *p, size_t len)
+{
+	while (len >= 8) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	while (len > 0) {
+		h ^= (*p++) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		len--;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t merge_accumulators(const uint64_t v[4])
+{
+	uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+	h = merge_round(h, v[0]);
+	h = merge_round(h, v[1]);
+	h = merge_round(h, v[2]);
+	h = merge_round(h, v[3]);
+	return h;
+}
+
+static const uint8_t *consume_stripes(uint64_t v[4], const uint8_t *p, const uint8_t *limit)
+{
+	while (p + 32 <= limit) {
+		v[0] = round64(v[0], read64(p));
+		v[1] = round64(v[1], read64(p + 8));
+		v[2] = round64(v[2], read64(p + 16));
+		v[3] = round64(v[3], read64(p + 24));
+		p += 32;
+	}
+	return p;
+}
+
+static void init_accumulators(uint64_t v[4], uint64_t seed)
+{
+	v[0] = seed + PRIME64_1 + PRIME64_2;
+	v[1] = seed + PRIME64_2;
+	v[2] = seed;
+	v[3] = seed - PRIME64_1;
+}
+
+uint64_t hash64(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t v[4];
+		init_accumulators(v, seed);
+		p = consume_stripes(v, p, end);
+		h = merge_accumulators(v);
+	} else {
+		h = seed + PRIME64_5;
+	}
+	h += size;
+	return finalize(h, p, end - p);
+}
+
+void hash64_init(struct hash64_state *s, uint64_t seed)
+{
+	memset(s, 0, sizeof(struct hash64_state));
+	s->seed = seed;
+	init_accumulators(s->v, seed);
+}
+
+void hash64_update(struct hash64_state *s, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + size;
+	s->total_len += size;
+
+	// fill partial stripe
+	if (s->buf_len) {
+		size_t n = 32 - s->buf_len;
+		if (n > size)
+			n = size;
+		memcpy(s->buf + s->buf_len, p, n);
+		s->buf_len += n;
+		p += n;
+		if (s->buf_len < 32)
+			return;
+		consume_stripes(s->v, s->buf, s->buf + 32);
+		s->buf_len = 0;
+	}
+
+	p = consume_stripes(s->v, p, end);
+	if (p < end) {
+		memcpy(s->buf, p, end - p);
+		s->buf_len = end - p;
+	}
+}
+
+uint64_t hash64_digest(struct hash64_state *s)
+{
+	uint64_t h;
+	if (s->total_len >= 32)
+		h = merge_accumulators(s->v);
+	else
+		h = s->seed + PRIME64_5;
+	h += s->total_len;
+	return finalize(h, s->buf, s->buf_len);
+}
@@ -0,0 +1,43 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_HASH_H
+#define SYSTEM4_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fast non-cryptographic 64-bit content hash (XXH64).
+ */
+uint64_t hash64(const void *data, size_t size, uint64_t seed);
+
+/*
+ * Incremental interface, for data which doesn't fit in memory at once.
+ */
+struct hash64_state {
+	uint64_t v[4];
+	uint64_t seed;
+	uint64_t total_len;
+	uint8_t buf[32];
+	size_t buf_len;
+};
+
+void hash64_init(struct hash64_state *s, uint64_t seed);
+void hash64_update(struct hash64_state *s, const void *data, size_t size);
+uint64_t hash64_digest(struct hash64_state *s);
+
+#endif /* SYSTEM4_HASH_H */
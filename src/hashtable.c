@@ -14,6 +14,7 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include "system4.h"
@@ -113,6 +114,23 @@ void ht_foreach_value(struct hash_table *ht, void(*fun)(void*))
 	}
 }
 
+struct hash_table *ht_get_or_build(struct hash_table **slot,
+		struct hash_table *(*build)(void *user), void *user,
+		void (*free_table)(struct hash_table *ht))
+{
+	struct hash_table *ht = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (ht)
+		return ht;
+
+	// build privately, then publish with a single compare-and-swap
+	struct hash_table *built = build(user);
+	if (__atomic_compare_exchange_n(slot, &ht, built, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return built;
+	// another thread published its table first
+	free_table(built);
+	return ht;
+}
+
 void ht_free(struct hash_table *ht)
 {
 	for (size_t i = 0; i < ht->nr_buckets; i++) {
@@ -19,6 +19,7 @@
 #include <turbojpeg.h>
 #include "system4.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/jpeg.h"
 
 bool jpeg_cg_checkfmt(const uint8_t *data)
@@ -58,14 +59,15 @@ void jpeg_cg_extract(const uint8_t *data, size_t size, struct cg *cg)
 	if (!get_metrics(decompressor, data, size, &cg->metrics))
 		goto cleanup;
 
-	uint8_t *buf = xmalloc(cg->metrics.w * cg->metrics.h * 4);
+	uint8_t *buf = cg_pool_alloc(cg->metrics.w * cg->metrics.h * 4);
 	if (tjDecompress2(decompressor, data, size, buf, cg->metrics.w, 0, cg->metrics.h, TJPF_RGBA, 0) < 0) {
 		WARNING("JPEG decompression failed: %s", tjGetErrorStr());
-		free(buf);
+		cg_pool_free(buf);
 		goto cleanup;
 	}
 	cg->type = ALCG_JPEG;
 	cg->pixels = buf;
+	cg->pooled = true;
 
 cleanup:
 	tjDestroy(decompressor);
@@ -21,6 +21,7 @@
 #include "system4.h"
 #include "system4/buffer.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/pcf.h"
 #include "system4/qnt.h"
 #include "system4/string.h"
@@ -97,7 +98,7 @@ static bool pcf_read_ptdl(struct buffer *in, struct pcf_header *out)
 	return true;
 }
 
-static struct cg *pcf_read_pcgd(struct buffer *in, struct pcf_header *hdr)
+static const uint8_t *pcf_read_pcgd(struct buffer *in)
 {
 	if (!buffer_check_bytes(in, "pcgd", 4)) {
 		WARNING("Unexpected data at pcgd header");
@@ -109,7 +110,7 @@ static struct cg *pcf_read_pcgd(struct buffer *in, struct pcf_header *hdr)
 		return NULL;
 	}
 
-	return cg_load_buffer((uint8_t*)buffer_strdata(in), buffer_remaining(in));
+	return (const uint8_t*)buffer_strdata(in);
 }
 
 static void pcf_init_metrics(struct pcf_header *pcf, struct cg_metrics *dst)
@@ -123,34 +124,65 @@ static void pcf_init_metrics(struct pcf_header *pcf, struct cg_metrics *dst)
 	dst->alpha_pitch = 1;
 }
 
+/*
+ * Decode the pcf image into `dst` at (x,y), given the headers already read
+ * from `in`. The embedded QNT is decoded in place at its offset within the
+ * pcf canvas, and only the area around it is cleared.
+ */
+static bool pcf_decode(struct buffer *in, struct pcf_header *hdr, struct cg_canvas *dst, int x, int y)
+{
+	const uint8_t *qnt_data = pcf_read_pcgd(in);
+	if (!qnt_data)
+		return false;
+
+	if (!cg_canvas_fits(dst, x, y, hdr->width, hdr->height)) {
+		WARNING("pcf image doesn't fit in canvas");
+		return false;
+	}
+	struct cg_canvas area = {
+		.pixels = cg_canvas_at(dst, x, y),
+		.w = hdr->width,
+		.h = hdr->height,
+		.stride = dst->stride,
+	};
+	struct qnt_header qnt;
+	qnt_extract_header(qnt_data, &qnt);
+	if (!cg_canvas_fits(&area, hdr->x, hdr->y, qnt.width, qnt.height)) {
+		WARNING("pcf CG doesn't fit in pcf canvas");
+		return false;
+	}
+	cg_canvas_clear_border(&area, hdr->x, hdr->y, qnt.width, qnt.height);
+	return qnt_extract_into(qnt_data, &area, hdr->x, hdr->y);
+}
+
+static bool pcf_read_headers(struct buffer *in, struct pcf_header *hdr)
+{
+	return pcf_read_pcf(in, hdr) && pcf_read_ptdl(in, hdr);
+}
+
 bool pcf_extract(const uint8_t *data, size_t size, struct cg *cg)
 {
 	struct pcf_header hdr = {0};
 	struct buffer in;
 	buffer_init(&in, (uint8_t*)data, size);
-	if (!pcf_read_pcf(&in, &hdr)) {
-		goto error;
-	}
-	if (!pcf_read_ptdl(&in, &hdr)) {
+	if (!pcf_read_headers(&in, &hdr))
 		goto error;
-	}
-	struct cg *cg_data = pcf_read_pcgd(&in, &hdr);
-	if (!cg_data) {
-		goto error;
-	}
 
-	uint32_t *pixels = xcalloc(hdr.width * hdr.height, 4);
-	for (int row = 0; row < cg_data->metrics.h; row++) {
-		for (int col = 0; col < cg_data->metrics.w; col++) {
-			const int dst_i = (hdr.y + row) * hdr.width + (hdr.x + col);
-			const int src_i = row * cg_data->metrics.w + col;
-			pixels[dst_i] = ((uint32_t*)cg_data->pixels)[src_i];
-		}
+	struct cg_canvas canvas = {
+		.pixels = cg_pool_alloc((size_t)hdr.width * hdr.height * 4),
+		.w = hdr.width,
+		.h = hdr.height,
+		.stride = (size_t)hdr.width * 4,
+	};
+	if (!pcf_decode(&in, &hdr, &canvas, 0, 0)) {
+		cg_pool_free(canvas.pixels);
+		goto error;
 	}
-	cg->pixels = pixels;
+	cg->type = ALCG_PCF;
+	cg->pixels = canvas.pixels;
+	cg->pooled = true;
 	pcf_init_metrics(&hdr, &cg->metrics);
 
-	cg_free(cg_data);
 	pcf_header_free(&hdr);
 	return true;
 error:
@@ -158,13 +190,30 @@ error:
 	return false;
 }
 
+/*
+ * Extract a pcf image directly into a canvas, with its top-left corner at
+ * (x,y).
+ */
+bool pcf_extract_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y)
+{
+	struct pcf_header hdr = {0};
+	struct buffer in;
+	buffer_init(&in, (uint8_t*)data, size);
+	bool ok = pcf_read_headers(&in, &hdr) && pcf_decode(&in, &hdr, dst, x, y);
+	pcf_header_free(&hdr);
+	return ok;
+}
+
 bool pcf_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *dst)
 {
 	struct pcf_header hdr = {0};
 	struct buffer in;
 	buffer_init(&in, (uint8_t*)data, size);
-	if (!pcf_read_pcf(&in, &hdr))
+	if (!pcf_read_pcf(&in, &hdr)) {
+		pcf_header_free(&hdr);
 		return false;
+	}
 	pcf_init_metrics(&hdr, dst);
+	pcf_header_free(&hdr);
 	return true;
 }
@@ -24,7 +24,9 @@
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/pms.h"
+#include "coverage.h"
 
 struct pms_header {
 	int version;     // PMS data version
@@ -134,7 +136,7 @@ static uint16_t *pms16_extract(struct pms_header *pms, const uint8_t *b)
 {
 	int n, c0, c1, pc0, pc1;
 	const int scanline = pms->width;
-	uint16_t *pic = xmalloc(sizeof(uint16_t) * (pms->width+10) * (pms->height+10));
+	uint16_t *pic = cg_pool_alloc(sizeof(uint16_t) * (pms->width+10) * (pms->height+10));
 
 	for (int y = 0; y < pms->height; y++) {
 		for (int x = 0; x < pms->width;) {
@@ -266,17 +268,25 @@ bool pms_get_metrics(const uint8_t *data, struct cg_metrics *dst)
 }
 
 /* Load a PMS8 CG as an alpha-map. */
-static void pms8_load(const uint8_t *data, struct pms_header *pms, struct cg *cg)
+static void pms8_load(const uint8_t *data, struct pms_header *pms, uint8_t *dst, size_t stride,
+		struct cg_coverage *coverage)
 {
-	cg->type = ALCG_PMS8;
 	uint8_t *alpha = pms8_extract(pms, data + pms->dp);
 
 	// Convert to RGBA
-	cg->pixels = xmalloc(pms->width * pms->height * 4);
-	uint32_t *dst = cg->pixels;
-	for (int i = 0; i < pms->width * pms->height; i++) {
-		dst[i] = alpha[i] << 24;
+	struct coverage_builder cov;
+	if (coverage)
+		coverage_begin(&cov, coverage, pms->width, pms->height);
+	for (int i = 0, y = 0; y < pms->height; y++) {
+		uint32_t *row = (uint32_t*)(dst + y * stride);
+		for (int x = 0; x < pms->width; x++, i++) {
+			row[x] = (uint32_t)alpha[i] << 24;
+		}
+		if (coverage)
+			coverage_add_row(&cov, alpha + i - pms->width, 1);
 	}
+	if (coverage)
+		coverage_end(&cov);
 
 	free(alpha);
 }
@@ -292,43 +302,90 @@ static uint32_t RGB565to8888(uint16_t pc, uint8_t a)
 	return r | g << 8 | b << 16 | a << 24;
 }
 
-static void pms16_load(const uint8_t *data, struct pms_header *pms, struct cg *cg)
+static void pms16_load(const uint8_t *data, struct pms_header *pms, uint8_t *dst, size_t stride,
+		struct cg_coverage *coverage)
 {
-	cg->type = ALCG_PMS16;
 	uint16_t *pixels = pms16_extract(pms, data + pms->dp);
 	uint8_t *alpha = pms->pp ? pms8_extract(pms, data + pms->pp) : NULL;
 
 	// Convert to RGBA
-	cg->pixels = xmalloc(pms->width * pms->height * 4);
-	uint32_t *dst = cg->pixels;
-	for (int i = 0; i < pms->width * pms->height; i++)
-		dst[i] = RGB565to8888(pixels[i], alpha ? alpha[i] : 0xff);
+	struct coverage_builder cov;
+	bool track = coverage && alpha;
+	if (track)
+		coverage_begin(&cov, coverage, pms->width, pms->height);
+	else if (coverage)
+		coverage_set_opaque(coverage, pms->width, pms->height);
+	for (int i = 0, y = 0; y < pms->height; y++) {
+		uint32_t *row = (uint32_t*)(dst + y * stride);
+		for (int x = 0; x < pms->width; x++, i++)
+			row[x] = RGB565to8888(pixels[i], alpha ? alpha[i] : 0xff);
+		if (track)
+			coverage_add_row(&cov, alpha + i - pms->width, 1);
+	}
+	if (track)
+		coverage_end(&cov);
 
-	free(pixels);
+	cg_pool_free(pixels);
 	free(alpha);
 }
 
+static bool pms_check_offsets(struct pms_header *pms, size_t size)
+{
+	if ((size_t)pms->dp > size) {
+		WARNING("PMS pixel offset out of bounds");
+		return false;
+	}
+	if ((size_t)pms->pp > size) {
+		WARNING("PMS palette/alpha offset out of bounds");
+		return false;
+	}
+	if (pms->bpp != 8 && pms->bpp != 16) {
+		WARNING("Unsupported PMS bpp: %d", pms->bpp);
+		return false;
+	}
+	return true;
+}
+
 void pms_extract(const uint8_t *data, size_t size, struct cg *cg)
 {
 	struct pms_header pms;
 	pms_read_header(&pms, data);
 	pms_init_metrics(&pms, &cg->metrics);
-
-	if ((size_t)pms.dp > size) {
-		WARNING("PMS pixel offset out of bounds");
+	if (!pms_check_offsets(&pms, size))
 		return;
+
+	cg->pixels = cg_pool_alloc(pms.width * pms.height * 4);
+	cg->pooled = true;
+	if (pms.bpp == 8) {
+		cg->type = ALCG_PMS8;
+		pms8_load(data, &pms, cg->pixels, pms.width * 4, &cg->coverage);
+	} else {
+		cg->type = ALCG_PMS16;
+		pms16_load(data, &pms, cg->pixels, pms.width * 4, &cg->coverage);
 	}
-	if ((size_t)pms.pp > size) {
-		WARNING("PMS palette/alpha offset out of bounds");
-		return;
+}
+
+/*
+ * Extract a PMS image directly into a canvas, with its top-left corner at
+ * (x,y). The display offset from the header is not applied; pass it in
+ * (x,y) if wanted.
+ */
+bool pms_extract_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y)
+{
+	struct pms_header pms;
+	pms_read_header(&pms, data);
+	if (!pms_check_offsets(&pms, size))
+		return false;
+	if (!cg_canvas_fits(dst, x, y, pms.width, pms.height)) {
+		WARNING("PMS image doesn't fit in canvas");
+		return false;
 	}
 
 	if (pms.bpp == 8)
-		pms8_load(data, &pms, cg);
-	else if (pms.bpp == 16)
-		pms16_load(data, &pms, cg);
+		pms8_load(data, &pms, cg_canvas_at(dst, x, y), dst->stride, NULL);
 	else
-		WARNING("Unsupported PMS bpp: %d", pms.bpp);
+		pms16_load(data, &pms, cg_canvas_at(dst, x, y), dst->stride, NULL);
+	return true;
 }
 
 uint8_t *pms_extract_mask(const uint8_t *data, size_t size)
@@ -18,14 +18,17 @@
 #include <string.h>
 #include <assert.h>
 #include <png.h>
+#include <zlib.h>
 
 #include "system4.h"
 #include "system4/ald.h"
 #include "system4/buffer.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/png.h"
 
 #include "little_endian.h"
+#include "thread_pool.h"
 
 bool png_cg_checkfmt(const uint8_t *data)
 {
@@ -44,34 +47,44 @@ static void read_png_data(png_structp png_ptr, png_bytep out, size_t length)
 	buffer_read_bytes(buf, out, length);
 }
 
-static void extract_rgb(png_structp png_ptr, png_infop info_ptr, struct cg *cg)
+static void extract_rgb(png_structp png_ptr, png_infop info_ptr, struct cg_metrics *metrics,
+		uint8_t *dst, size_t stride)
 {
 	const png_uint_32 row_bytes = png_get_rowbytes(png_ptr, info_ptr);
 	uint8_t *row_data = xmalloc(row_bytes);
-	uint8_t *pixels = cg->pixels;
 
-	for (int row = 0; row < cg->metrics.h; row++) {
+	for (int row = 0; row < metrics->h; row++) {
 		png_read_row(png_ptr, (png_bytep)row_data, NULL);
-		int row_off = row * cg->metrics.w * 4;
+		uint8_t *pixels = dst + row * stride;
 		int i = 0;
-		for (int col = 0; col < cg->metrics.w; col++) {
-			pixels[row_off + col*4 + 0] = row_data[i++];
-			pixels[row_off + col*4 + 1] = row_data[i++];
-			pixels[row_off + col*4 + 2] = row_data[i++];
-			pixels[row_off + col*4 + 3] = 0xFF;
+		for (int col = 0; col < metrics->w; col++) {
+			pixels[col*4 + 0] = row_data[i++];
+			pixels[col*4 + 1] = row_data[i++];
+			pixels[col*4 + 2] = row_data[i++];
+			pixels[col*4 + 3] = 0xFF;
 		}
 	}
 
 	free(row_data);
 }
 
-static void extract_rgba(png_structp png_ptr, png_infop info_ptr, struct cg *cg)
+static void extract_rgba(png_structp png_ptr, png_infop info_ptr, struct cg_metrics *metrics,
+		uint8_t *dst, size_t stride)
 {
-	assert((int)png_get_rowbytes(png_ptr, info_ptr) == cg->metrics.w*4);
+	assert((int)png_get_rowbytes(png_ptr, info_ptr) == metrics->w*4);
 
-	for (int row = 0; row < cg->metrics.h; row++) {
-		uint8_t *row_data = (uint8_t*)cg->pixels + row*cg->metrics.w*4;
-		png_read_row(png_ptr, (png_bytep)row_data, NULL);
+	for (int row = 0; row < metrics->h; row++) {
+		png_read_row(png_ptr, (png_bytep)(dst + row * stride), NULL);
+	}
+}
+
+static void extract_rows(png_structp png_ptr, png_infop info_ptr, struct cg_metrics *metrics,
+		uint8_t *dst, size_t stride)
+{
+	if (metrics->has_alpha) {
+		extract_rgba(png_ptr, info_ptr, metrics, dst, stride);
+	} else {
+		extract_rgb(png_ptr, info_ptr, metrics, dst, stride);
 	}
 }
 
@@ -160,77 +173,336 @@ void png_cg_extract(const uint8_t *data, size_t size, struct cg *cg)
 	if (!png_read_init(&png_ptr, &info_ptr, &cg->metrics, &buf))
 		return;
 
-	cg->pixels = xmalloc(cg->metrics.w * cg->metrics.h * 4);
-	if (cg->metrics.has_alpha) {
-		extract_rgba(png_ptr, info_ptr, cg);
-	} else {
-		extract_rgb(png_ptr, info_ptr, cg);
-	}
+	cg->pixels = cg_pool_alloc(cg->metrics.w * cg->metrics.h * 4);
+	cg->pooled = true;
+	extract_rows(png_ptr, info_ptr, &cg->metrics, cg->pixels, cg->metrics.w * 4);
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 }
 
-int png_cg_write(struct cg *cg, FILE *f)
+/*
+ * Extract a PNG image directly into a canvas, with its top-left corner at
+ * (x,y). Pixels outside of the image are left untouched.
+ */
+bool png_cg_extract_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y)
 {
-	int r = 0;
+	struct buffer buf;
+	struct cg_metrics metrics;
 	png_structp png_ptr = NULL;
 	png_infop info_ptr = NULL;
-	png_byte **row_pointers = NULL;
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr) {
-		WARNING("png_create_write_struct failed");
-		goto cleanup;
+	buffer_init(&buf, (uint8_t*)data, size);
+	if (!png_read_init(&png_ptr, &info_ptr, &metrics, &buf))
+		return false;
+
+	bool ok = cg_canvas_fits(dst, x, y, metrics.w, metrics.h);
+	if (ok)
+		extract_rows(png_ptr, info_ptr, &metrics, cg_canvas_at(dst, x, y), dst->stride);
+	else
+		WARNING("PNG image doesn't fit in canvas");
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	return ok;
+}
+
+/*
+ * PNG encoder. The image is filtered, then split into bands of rows which are
+ * deflated in parallel as raw deflate streams. Every band but the last ends
+ * with a sync flush, so the pieces can be joined into a single zlib stream,
+ * and each band is primed with the tail of the previous one so that matches
+ * can still cross band boundaries. Band boundaries only depend on the image
+ * size, so the output is the same for any number of threads.
+ */
+
+#define PNG_BAND_SIZE (512*1024)
+#define PNG_WINDOW_SIZE 32768
+
+struct png_band {
+	int row;
+	int nr_rows;
+	uint8_t *out;
+	size_t out_size;
+	uLong adler;
+	bool ok;
+};
+
+struct png_encoder {
+	const uint8_t *pixels;
+	int w;
+	int h;
+	size_t row_size; // filtered row, including the filter byte
+	uint8_t *filtered;
+	const struct cg_write_options *opts;
+	int nr_bands;
+	struct png_band *bands;
+};
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+static void filter_row(enum cg_png_filter filter, const uint8_t *row, const uint8_t *prev,
+		size_t len, uint8_t *out)
+{
+	*out++ = filter;
+	switch (filter) {
+	case CG_PNG_FILTER_NONE:
+		memcpy(out, row, len);
+		break;
+	case CG_PNG_FILTER_SUB:
+		memcpy(out, row, 4);
+		for (size_t i = 4; i < len; i++)
+			out[i] = row[i] - row[i-4];
+		break;
+	case CG_PNG_FILTER_UP:
+		for (size_t i = 0; i < len; i++)
+			out[i] = row[i] - prev[i];
+		break;
+	case CG_PNG_FILTER_AVERAGE:
+		for (size_t i = 0; i < 4; i++)
+			out[i] = row[i] - (prev[i] >> 1);
+		for (size_t i = 4; i < len; i++)
+			out[i] = row[i] - ((row[i-4] + prev[i]) >> 1);
+		break;
+	case CG_PNG_FILTER_PAETH:
+		for (size_t i = 0; i < 4; i++)
+			out[i] = row[i] - prev[i];
+		for (size_t i = 4; i < len; i++)
+			out[i] = row[i] - paeth(row[i-4], prev[i], prev[i-4]);
+		break;
+	default:
+		break;
 	}
+}
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr) {
-		WARNING("png_create_info_struct failed");
-		goto cleanup;
+// sum of absolute values, as in libpng's filter heuristic
+static size_t filter_cost(const uint8_t *out, size_t len)
+{
+	size_t sum = 0;
+	for (size_t i = 1; i <= len; i++)
+		sum += abs((int8_t)out[i]);
+	return sum;
+}
+
+static void filter_band(size_t i, possibly_unused int worker, void *user)
+{
+	struct png_encoder *enc = user;
+	struct png_band *band = &enc->bands[i];
+	size_t len = (size_t)enc->w * 4;
+	uint8_t *zero = xcalloc(1, len);
+	uint8_t *scratch = enc->opts->png_filter == CG_PNG_FILTER_ADAPTIVE ? xmalloc(enc->row_size * 2) : NULL;
+
+	for (int y = band->row; y < band->row + band->nr_rows; y++) {
+		const uint8_t *row = enc->pixels + y * len;
+		const uint8_t *prev = y > 0 ? row - len : zero;
+		uint8_t *out = enc->filtered + y * enc->row_size;
+		if (!scratch) {
+			filter_row(enc->opts->png_filter, row, prev, len, out);
+			continue;
+		}
+		// keep the best candidate in `out`, try the others in scratch
+		filter_row(CG_PNG_FILTER_NONE, row, prev, len, out);
+		size_t best = filter_cost(out, len);
+		for (int f = CG_PNG_FILTER_SUB; f <= CG_PNG_FILTER_PAETH; f++) {
+			filter_row(f, row, prev, len, scratch);
+			size_t cost = filter_cost(scratch, len);
+			if (cost < best) {
+				best = cost;
+				memcpy(out, scratch, enc->row_size);
+			}
+		}
 	}
 
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		WARNING("png_init_io failed");
-		goto cleanup;
+	free(scratch);
+	free(zero);
+}
+
+static void deflate_band(size_t i, possibly_unused int worker, void *user)
+{
+	struct png_encoder *enc = user;
+	struct png_band *band = &enc->bands[i];
+	const uint8_t *in = enc->filtered + band->row * enc->row_size;
+	size_t in_size = band->nr_rows * enc->row_size;
+	int strategy = enc->opts->png_filter == CG_PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+	z_stream s = {0};
+	if (deflateInit2(&s, enc->opts->level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+		WARNING("deflateInit2 failed");
+		return;
 	}
+	if (i > 0) {
+		size_t dict_size = min(band->row * enc->row_size, PNG_WINDOW_SIZE);
+		deflateSetDictionary(&s, in - dict_size, dict_size);
+	}
+
+	size_t cap = deflateBound(&s, in_size) + 16;
+	band->out = xmalloc(cap);
+	s.next_in = (Bytef*)in;
+	s.avail_in = in_size;
+	s.next_out = band->out;
+	s.avail_out = cap;
+	int flush = i + 1 == (size_t)enc->nr_bands ? Z_FINISH : Z_SYNC_FLUSH;
+	int r;
+	for (;;) {
+		r = deflate(&s, flush);
+		if (r == Z_STREAM_ERROR || s.avail_out != 0)
+			break;
+		cap *= 2;
+		band->out = xrealloc(band->out, cap);
+		s.next_out = band->out + s.total_out;
+		s.avail_out = cap - s.total_out;
+	}
+	band->ok = flush == Z_FINISH ? r == Z_STREAM_END : r == Z_OK && s.avail_in == 0;
+	band->out_size = s.total_out;
+	band->adler = adler32(adler32(0, NULL, 0), in, in_size);
+	deflateEnd(&s);
+}
 
-	png_init_io(png_ptr, f);
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uLong chunk_begin(FILE *f, const char *type, size_t len, bool *ok)
+{
+	uint8_t hdr[8];
+	put_be32(hdr, len);
+	memcpy(hdr + 4, type, 4);
+	*ok = *ok && fwrite(hdr, 8, 1, f) == 1;
+	return crc32(crc32(0, NULL, 0), hdr + 4, 4);
+}
+
+static uLong chunk_data(FILE *f, uLong crc, const uint8_t *data, size_t len, bool *ok)
+{
+	if (len)
+		*ok = *ok && fwrite(data, len, 1, f) == 1;
+	return crc32(crc, data, len);
+}
 
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		WARNING("png_write_header failed");
-		goto cleanup;
+static void chunk_end(FILE *f, uLong crc, bool *ok)
+{
+	uint8_t b[4];
+	put_be32(b, crc);
+	*ok = *ok && fwrite(b, 4, 1, f) == 1;
+}
+
+static bool png_write_stream(struct png_encoder *enc, FILE *f)
+{
+	static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	bool ok = fwrite(sig, 8, 1, f) == 1;
+
+	uint8_t ihdr[13] = {0};
+	put_be32(ihdr, enc->w);
+	put_be32(ihdr + 4, enc->h);
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = 6; // RGBA
+	uLong crc = chunk_begin(f, "IHDR", 13, &ok);
+	crc = chunk_data(f, crc, ihdr, 13, &ok);
+	chunk_end(f, crc, &ok);
+
+	// one IDAT per band; the zlib header goes in the first and the checksum
+	// in the last
+	static const uint8_t flevel[10] = { 0, 0, 1, 1, 1, 1, 2, 3, 3, 3 };
+	uint8_t zhdr[2] = { 0x78, flevel[enc->opts->level] << 6 };
+	zhdr[1] += 31 - ((zhdr[0] << 8) + zhdr[1]) % 31;
+	uLong adler = enc->bands[0].adler;
+	for (int i = 1; i < enc->nr_bands; i++) {
+		size_t len = enc->bands[i].nr_rows * enc->row_size;
+		adler = adler32_combine(adler, enc->bands[i].adler, len);
+	}
+	uint8_t ztrailer[4];
+	put_be32(ztrailer, adler);
+
+	for (int i = 0; i < enc->nr_bands; i++) {
+		struct png_band *band = &enc->bands[i];
+		bool first = i == 0;
+		bool last = i + 1 == enc->nr_bands;
+		size_t len = band->out_size + (first ? 2 : 0) + (last ? 4 : 0);
+		crc = chunk_begin(f, "IDAT", len, &ok);
+		if (first)
+			crc = chunk_data(f, crc, zhdr, 2, &ok);
+		crc = chunk_data(f, crc, band->out, band->out_size, &ok);
+		if (last)
+			crc = chunk_data(f, crc, ztrailer, 4, &ok);
+		chunk_end(f, crc, &ok);
 	}
 
-	png_set_IHDR(png_ptr, info_ptr, cg->metrics.w, cg->metrics.h,
-		     8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-		     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-	png_write_info(png_ptr, info_ptr);
+	crc = chunk_begin(f, "IEND", 0, &ok);
+	chunk_end(f, crc, &ok);
+	return ok;
+}
 
-	png_uint_32 stride = cg->metrics.w * 4;
-	row_pointers = png_malloc(png_ptr, cg->metrics.h * sizeof(png_byte*));
-	for (int i = 0; i < cg->metrics.h; i++) {
-		row_pointers[i] = cg->pixels + i*stride;
+int png_cg_write_with_options(struct cg *cg, FILE *f, const struct cg_write_options *opts)
+{
+	struct cg_write_options dflt = CG_WRITE_OPTIONS_DEFAULT;
+	if (!opts)
+		opts = &dflt;
+	if (opts->level < 0 || opts->level > 9) {
+		WARNING("Invalid PNG compression level: %d", opts->level);
+		return 0;
+	}
+	if (opts->png_filter < CG_PNG_FILTER_NONE || opts->png_filter > CG_PNG_FILTER_ADAPTIVE) {
+		WARNING("Invalid PNG filter: %d", opts->png_filter);
+		return 0;
+	}
+	if (cg->metrics.w <= 0 || cg->metrics.h <= 0) {
+		WARNING("Invalid PNG dimensions: %dx%d", cg->metrics.w, cg->metrics.h);
+		return 0;
 	}
 
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		WARNING("png_write_image failed");
-		goto cleanup;
+	struct png_encoder enc = {
+		.pixels = cg->pixels,
+		.w = cg->metrics.w,
+		.h = cg->metrics.h,
+		.row_size = (size_t)cg->metrics.w * 4 + 1,
+		.opts = opts,
+	};
+	int rows_per_band = max(1, (int)(PNG_BAND_SIZE / enc.row_size));
+	enc.nr_bands = (enc.h + rows_per_band - 1) / rows_per_band;
+	enc.bands = xcalloc(enc.nr_bands, sizeof(struct png_band));
+	for (int i = 0; i < enc.nr_bands; i++) {
+		enc.bands[i].row = i * rows_per_band;
+		enc.bands[i].nr_rows = min(rows_per_band, enc.h - enc.bands[i].row);
 	}
+	enc.filtered = xmalloc(enc.row_size * enc.h);
 
-	png_write_image(png_ptr, row_pointers);
+	parallel_for(opts->nr_threads, enc.nr_bands, filter_band, &enc);
+	parallel_for(opts->nr_threads, enc.nr_bands, deflate_band, &enc);
 
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		WARNING("png_write_end failed");
-		goto cleanup;
+	int r = 1;
+	for (int i = 0; i < enc.nr_bands; i++) {
+		if (!enc.bands[i].ok) {
+			WARNING("PNG compression failed");
+			r = 0;
+			break;
+		}
+	}
+	if (r && !png_write_stream(&enc, f)) {
+		WARNING("PNG write failed");
+		r = 0;
 	}
 
-	png_write_end(png_ptr, NULL);
-	r = 1;
-cleanup:
-	if (row_pointers)
-		png_free(png_ptr, row_pointers);
-	if (png_ptr)
-		png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : NULL);
+	for (int i = 0; i < enc.nr_bands; i++)
+		free(enc.bands[i].out);
+	free(enc.bands);
+	free(enc.filtered);
 	return r;
 }
 
+int png_cg_write(struct cg *cg, FILE *f)
+{
+	return png_cg_write_with_options(cg, f, NULL);
+}
+
@@ -0,0 +1,437 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/archive.h"
+#include "system4/archive_catalog.h"
+#include "system4/dasm.h"
+#include "system4/file.h"
+#include "system4/instructions.h"
+#include "system4/prefetch.h"
+#include "system4/string.h"
+#include "kvec.h"
+
+#define PREFETCH_MAGIC "# libsys4 prefetch manifest\n"
+
+static const char *scope_names[] = {
+	[PREFETCH_FUNCTION] = "function",
+	[PREFETCH_SCENARIO] = "scenario",
+};
+
+#define NOT_RESOLVED -2
+#define NOT_FOUND -1
+
+// an archive entry named by a literal
+struct ref {
+	int archive;
+	int no;
+	const char *name; // points into the catalog
+};
+
+typedef kvec_t(int32_t) index_list;
+
+struct scan {
+	struct ain *ain;
+	struct archive_catalog *cat;
+	kvec_t(struct ref) refs;
+	// ref index of each string/message (or NOT_RESOLVED/NOT_FOUND)
+	int32_t *string_refs;
+	int32_t *message_refs;
+	index_list *function_refs;
+	index_list *label_refs;
+	index_list *label_calls;
+};
+
+// a group under construction
+struct scan_group {
+	enum prefetch_scope scope;
+	const char *name;
+	index_list refs;
+};
+
+static int32_t resolve(struct scan *s, int32_t *cache, const struct string *str)
+{
+	if (*cache != NOT_RESOLVED)
+		return *cache;
+	struct archive_catalog_entry e;
+	*cache = NOT_FOUND;
+	if (str->size > 0 && (archive_catalog_lookup(s->cat, str->text, &e)
+				|| archive_catalog_lookup_basename(s->cat, str->text, &e))) {
+		*cache = kv_size(s->refs);
+		kv_push(struct ref, s->refs, ((struct ref) { e.archive, e.no, e.name }));
+	}
+	return *cache;
+}
+
+static int32_t literal_ref(struct scan *s, int type, int32_t i)
+{
+	if (type == T_STRING && i >= 0 && i < s->ain->nr_strings)
+		return resolve(s, &s->string_refs[i], s->ain->strings[i]);
+	if (type == T_MSG && i >= 0 && i < s->ain->nr_messages)
+		return resolve(s, &s->message_refs[i], s->ain->messages[i]);
+	return NOT_FOUND;
+}
+
+struct label {
+	uint32_t address;
+	int32_t index;
+};
+
+static int label_cmp(const void *_a, const void *_b)
+{
+	const struct label *a = _a;
+	const struct label *b = _b;
+	return a->address < b->address ? -1 : a->address > b->address;
+}
+
+static void scan_code(struct scan *s)
+{
+	struct ain *ain = s->ain;
+
+	// scenario labels in address order
+	int32_t nr_labels = ain->nr_scenario_labels;
+	struct label *labels = xcalloc(nr_labels + 1, sizeof(struct label));
+	for (int32_t i = 0; i < nr_labels; i++)
+		labels[i] = (struct label) { ain->scenario_labels[i].address, i };
+	qsort(labels, nr_labels, sizeof(struct label), label_cmp);
+
+	struct dasm dasm = {0};
+	int32_t next_label = 0, label = -1;
+	bool seen_func = false;
+	for (dasm_init(&dasm, ain); !dasm_eof(&dasm); dasm_next(&dasm)) {
+		int opcode = dasm_opcode(&dasm);
+		// a label's code ends at the next label or the end of its function
+		if (opcode == FUNC || opcode == ENDFUNC)
+			label = -1;
+		if (opcode == FUNC)
+			seen_func = true;
+		while (next_label < nr_labels && labels[next_label].address <= dasm_addr(&dasm))
+			label = labels[next_label++].index;
+
+		int fno = dasm_function(&dasm);
+		bool in_function = seen_func && fno >= 0 && fno < ain->nr_functions;
+		for (int i = 0; i < dasm_nr_args(&dasm); i++) {
+			int type = dasm_arg_type(&dasm, i);
+			int32_t arg = dasm_arg(&dasm, i);
+			if (type == T_FUNC) {
+				if (label >= 0 && opcode != FUNC && opcode != ENDFUNC
+						&& arg >= 0 && arg < ain->nr_functions)
+					kv_push(int32_t, s->label_calls[label], arg);
+				continue;
+			}
+			int32_t ref = literal_ref(s, type, arg);
+			if (ref < 0)
+				continue;
+			if (in_function)
+				kv_push(int32_t, s->function_refs[fno], ref);
+			if (label >= 0)
+				kv_push(int32_t, s->label_refs[label], ref);
+		}
+	}
+	free(labels);
+}
+
+static int scan_group_cmp(const void *_a, const void *_b)
+{
+	const struct scan_group *a = _a;
+	const struct scan_group *b = _b;
+	if (a->scope != b->scope)
+		return a->scope < b->scope ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+static int ref_cmp(const void *_a, const void *_b)
+{
+	const struct ref *a = _a;
+	const struct ref *b = _b;
+	if (a->archive != b->archive)
+		return a->archive < b->archive ? -1 : 1;
+	return a->no < b->no ? -1 : a->no > b->no;
+}
+
+static void append_list(index_list *dst, index_list *src)
+{
+	for (size_t i = 0; i < kv_size(*src); i++)
+		kv_push(int32_t, *dst, kv_A(*src, i));
+}
+
+/*
+ * Turn the refs of groups [first,last) (which share a scope and name) into
+ * a single group of unique entries. Returns false if there are none.
+ */
+static bool make_group(struct scan *s, struct scan_group *first, struct scan_group *last,
+		struct prefetch_group *out)
+{
+	size_t n = 0;
+	for (struct scan_group *g = first; g < last; g++)
+		n += kv_size(g->refs);
+	if (!n)
+		return false;
+
+	struct ref *refs = xcalloc(n, sizeof(struct ref));
+	n = 0;
+	for (struct scan_group *g = first; g < last; g++) {
+		for (size_t i = 0; i < kv_size(g->refs); i++)
+			refs[n++] = kv_A(s->refs, kv_A(g->refs, i));
+	}
+	qsort(refs, n, sizeof(struct ref), ref_cmp);
+
+	out->scope = first->scope;
+	out->name = xstrdup(first->name);
+	out->entries = xcalloc(n, sizeof(struct prefetch_entry));
+	out->nr_entries = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (i > 0 && !ref_cmp(&refs[i], &refs[i-1]))
+			continue;
+		struct prefetch_entry *e = &out->entries[out->nr_entries++];
+		e->archive = xstrdup(archive_catalog_archive_name(s->cat, refs[i].archive));
+		e->name = xstrdup(refs[i].name);
+	}
+	free(refs);
+	return true;
+}
+
+struct prefetch_manifest *prefetch_manifest_create(struct ain *ain, struct archive_catalog *cat)
+{
+	struct scan s = {
+		.ain = ain,
+		.cat = cat,
+		.string_refs = xmalloc((ain->nr_strings + 1) * sizeof(int32_t)),
+		.message_refs = xmalloc((ain->nr_messages + 1) * sizeof(int32_t)),
+		.function_refs = xcalloc(ain->nr_functions + 1, sizeof(index_list)),
+		.label_refs = xcalloc(ain->nr_scenario_labels + 1, sizeof(index_list)),
+		.label_calls = xcalloc(ain->nr_scenario_labels + 1, sizeof(index_list)),
+	};
+	kv_init(s.refs);
+	for (int32_t i = 0; i < ain->nr_strings; i++)
+		s.string_refs[i] = NOT_RESOLVED;
+	for (int32_t i = 0; i < ain->nr_messages; i++)
+		s.message_refs[i] = NOT_RESOLVED;
+
+	if (ain->code)
+		scan_code(&s);
+
+	size_t nr_groups = ain->nr_functions + ain->nr_scenario_labels;
+	struct scan_group *groups = xcalloc(nr_groups + 1, sizeof(struct scan_group));
+	for (int32_t i = 0; i < ain->nr_functions; i++) {
+		groups[i].scope = PREFETCH_FUNCTION;
+		groups[i].name = ain->functions[i].name;
+		groups[i].refs = s.function_refs[i];
+	}
+	for (int32_t i = 0; i < ain->nr_scenario_labels; i++) {
+		struct scan_group *g = &groups[ain->nr_functions + i];
+		g->scope = PREFETCH_SCENARIO;
+		g->name = ain->scenario_labels[i].name;
+		g->refs = s.label_refs[i];
+		for (size_t j = 0; j < kv_size(s.label_calls[i]); j++)
+			append_list(&g->refs, &s.function_refs[kv_A(s.label_calls[i], j)]);
+	}
+	qsort(groups, nr_groups, sizeof(struct scan_group), scan_group_cmp);
+
+	struct prefetch_manifest *m = xcalloc(1, sizeof(struct prefetch_manifest));
+	m->groups = xcalloc(nr_groups + 1, sizeof(struct prefetch_group));
+	for (size_t i = 0; i < nr_groups;) {
+		size_t j = i + 1;
+		while (j < nr_groups && !scan_group_cmp(&groups[i], &groups[j]))
+			j++;
+		if (make_group(&s, &groups[i], &groups[j], &m->groups[m->nr_groups]))
+			m->nr_groups++;
+		i = j;
+	}
+
+	// scenario groups own their (grown) copies of label_refs
+	for (size_t i = 0; i < nr_groups; i++) {
+		if (groups[i].scope == PREFETCH_SCENARIO)
+			kv_destroy(groups[i].refs);
+	}
+	for (int32_t i = 0; i < ain->nr_functions; i++)
+		kv_destroy(s.function_refs[i]);
+	for (int32_t i = 0; i < ain->nr_scenario_labels; i++)
+		kv_destroy(s.label_calls[i]);
+	free(groups);
+	free(s.function_refs);
+	free(s.label_refs);
+	free(s.label_calls);
+	free(s.string_refs);
+	free(s.message_refs);
+	kv_destroy(s.refs);
+	return m;
+}
+
+static void free_group(struct prefetch_group *g)
+{
+	for (size_t i = 0; i < g->nr_entries; i++) {
+		free(g->entries[i].archive);
+		free(g->entries[i].name);
+	}
+	free(g->entries);
+	free(g->name);
+}
+
+void prefetch_manifest_free(struct prefetch_manifest *m)
+{
+	if (!m)
+		return;
+	for (size_t i = 0; i < m->nr_groups; i++)
+		free_group(&m->groups[i]);
+	free(m->groups);
+	free(m);
+}
+
+static bool valid_field(const char *s)
+{
+	return *s && !strpbrk(s, "\t\r\n");
+}
+
+bool prefetch_manifest_write(struct prefetch_manifest *m, const char *path)
+{
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		return false;
+	}
+	fputs(PREFETCH_MAGIC, f);
+	for (size_t i = 0; i < m->nr_groups; i++) {
+		struct prefetch_group *g = &m->groups[i];
+		if (!valid_field(g->name)) {
+			WARNING("Can't write group name '%s'", g->name);
+			continue;
+		}
+		fprintf(f, "%s\t%s\n", scope_names[g->scope], g->name);
+		for (size_t j = 0; j < g->nr_entries; j++) {
+			struct prefetch_entry *e = &g->entries[j];
+			if (valid_field(e->archive) && valid_field(e->name))
+				fprintf(f, "\t%s\t%s\n", e->archive, e->name);
+		}
+	}
+	bool ok = !ferror(f);
+	if (fclose(f))
+		ok = false;
+	if (!ok)
+		WARNING("Failed to write '%s': %s", path, strerror(errno));
+	return ok;
+}
+
+static int group_cmp(const void *_a, const void *_b)
+{
+	const struct prefetch_group *a = _a;
+	const struct prefetch_group *b = _b;
+	if (a->scope != b->scope)
+		return a->scope < b->scope ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+struct prefetch_manifest *prefetch_manifest_read(const char *path)
+{
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f) {
+		WARNING("Failed to open '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	char line[4096];
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PREFETCH_MAGIC)) {
+		WARNING("%s: not a prefetch manifest", path);
+		fclose(f);
+		return NULL;
+	}
+
+	kvec_t(struct prefetch_group) groups;
+	kvec_t(struct prefetch_entry) entries;
+	kv_init(groups);
+	kv_init(entries);
+	struct prefetch_manifest *m = xcalloc(1, sizeof(struct prefetch_manifest));
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+		char *tab = strchr(line + 1, '\t');
+		if (!tab || !tab[1])
+			goto bad_line;
+		*tab = '\0';
+		if (line[0] == '\t') {
+			if (!kv_size(groups))
+				goto bad_line;
+			struct prefetch_entry e = { xstrdup(line + 1), xstrdup(tab + 1) };
+			kv_push(struct prefetch_entry, entries, e);
+			kv_A(groups, kv_size(groups) - 1).nr_entries++;
+			continue;
+		}
+		struct prefetch_group g = { .name = xstrdup(tab + 1) };
+		if (!strcmp(line, scope_names[PREFETCH_FUNCTION]))
+			g.scope = PREFETCH_FUNCTION;
+		else if (!strcmp(line, scope_names[PREFETCH_SCENARIO]))
+			g.scope = PREFETCH_SCENARIO;
+		else {
+			free(g.name);
+			goto bad_line;
+		}
+		kv_push(struct prefetch_group, groups, g);
+		continue;
+bad_line:
+		WARNING("%s: invalid manifest line: %s", path, line);
+	}
+	fclose(f);
+
+	// hand out the entries in file order, then sort for lookups
+	size_t next = 0;
+	for (size_t i = 0; i < kv_size(groups); i++) {
+		struct prefetch_group *g = &kv_A(groups, i);
+		g->entries = xcalloc(g->nr_entries + 1, sizeof(struct prefetch_entry));
+		memcpy(g->entries, entries.a + next, g->nr_entries * sizeof(struct prefetch_entry));
+		next += g->nr_entries;
+	}
+	kv_destroy(entries);
+	m->nr_groups = kv_size(groups);
+	m->groups = groups.a;
+	qsort(m->groups, m->nr_groups, sizeof(struct prefetch_group), group_cmp);
+	return m;
+}
+
+struct prefetch_group *prefetch_manifest_get(struct prefetch_manifest *m,
+		enum prefetch_scope scope, const char *name)
+{
+	struct prefetch_group key = { .scope = scope, .name = (char*)name };
+	return bsearch(&key, m->groups, m->nr_groups, sizeof(struct prefetch_group), group_cmp);
+}
+
+int prefetch_group_start(struct prefetch_group *g, struct archive_catalog *cat)
+{
+	int nr_found = 0;
+	const char *archive_name = NULL;
+	int archive = -1;
+	for (size_t i = 0; i < g->nr_entries; i++) {
+		struct prefetch_entry *e = &g->entries[i];
+		// entries are grouped by archive
+		if (!archive_name || strcmp(archive_name, e->archive)) {
+			archive_name = e->archive;
+			archive = archive_catalog_find(cat, e->archive);
+		}
+		int no;
+		if (archive >= 0
+				&& archive_exists_by_name(archive_catalog_archive(cat, archive), e->name, &no)
+				&& archive_catalog_prefetch(cat, archive, no))
+			nr_found++;
+	}
+	return nr_found;
+}
@@ -24,18 +24,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
+#include "compression.h"
+#include "coverage.h"
 #include "system4/qnt.h"
 
-/*
-  zlib の展開バッファで、幅×高さ×３に、さらにどれくらい余裕をとるか
-   (リクルスで 1164バイトというのがあった)
-*/
-#define ZLIBBUF_MARGIN 5*1024
-
 /*
  * Get information from header
  *
@@ -83,11 +79,16 @@ void qnt_extract_header(const uint8_t *b, struct qnt_header *qnt)
 static void extract_pixel(struct qnt_header *qnt, uint8_t *pic, const uint8_t *b)
 {
 	int i, j, x, y, w, h;
-	unsigned long ucbuf = (qnt->width+1) * (qnt->height+1) * 3 + ZLIBBUF_MARGIN;
-	uint8_t *raw = malloc(sizeof(uint8_t) * ucbuf);
-
-	if (Z_OK != uncompress(raw, &ucbuf, b, qnt->pixel_size)) {
-		WARNING("uncompress failed\n");
+	// planes are stored in 2x2 blocks; anything after them is ignored
+	// (some CGs have trailing data; one in リクルス had 1164 extra bytes)
+	size_t raw_size = (size_t)((qnt->width+1) & ~1) * ((qnt->height+1) & ~1) * 3;
+	uint8_t *raw = xcalloc(1, raw_size);
+
+	enum sys4_z_status r = sys4_inflate_prefix(raw, raw_size, b, qnt->pixel_size);
+	if (r == SYS4_Z_SHORT) {
+		WARNING("qnt pixel data is truncated");
+	} else if (r != SYS4_Z_OK) {
+		WARNING("uncompress failed: %s", sys4_z_strerror(r));
 		free(raw);
 		return;
 	}
@@ -166,11 +167,15 @@ static void extract_pixel(struct qnt_header *qnt, uint8_t *pic, const uint8_t *b
 static void extract_alpha(struct qnt_header *qnt, uint8_t *pic, const uint8_t *b)
 {
 	int i, x, y, w, h;
-	unsigned long ucbuf = (qnt->width+1) * (qnt->height+1) + ZLIBBUF_MARGIN;
-	uint8_t *raw = malloc(sizeof(uint8_t) * ucbuf);
-
-	if (Z_OK != uncompress(raw, &ucbuf, b, qnt->alpha_size)) {
-		WARNING("uncompress failed\n");
+	// rows are padded to an even width; anything after them is ignored
+	size_t raw_size = (size_t)((qnt->width+1) & ~1) * qnt->height;
+	uint8_t *raw = xcalloc(1, raw_size);
+
+	enum sys4_z_status r = sys4_inflate_prefix(raw, raw_size, b, qnt->alpha_size);
+	if (r == SYS4_Z_SHORT) {
+		WARNING("qnt alpha data is truncated");
+	} else if (r != SYS4_Z_OK) {
+		WARNING("uncompress failed: %s", sys4_z_strerror(r));
 		free(raw);
 		return;
 	}
@@ -237,6 +242,49 @@ bool qnt_get_metrics(const uint8_t *data, struct cg_metrics *dst)
 	return true;
 }
 
+/*
+ * Decode the image into `dst`, a buffer of RGBA rows `stride` bytes apart.
+ * If `coverage` is non-NULL it is filled in from the alpha channel.
+ */
+static void qnt_decode(const uint8_t *data, struct qnt_header *qnt, uint8_t *dst, size_t stride,
+		struct cg_coverage *coverage)
+{
+	uint8_t *pixels = cg_pool_calloc(3, (qnt->width+10) * (qnt->height+10));
+	extract_pixel(qnt, pixels, data + qnt->hdr_size);
+
+	// combine color/alpha data
+	uint8_t *alpha = cg_pool_alloc((qnt->width+10) * (qnt->height+10));
+	if (qnt->alpha_size) {
+		extract_alpha(qnt, alpha, data + qnt->hdr_size + qnt->pixel_size);
+	} else {
+		// FIXME: Some CGs don't display correctly unless we add an alpha channel here.
+		//        Not sure why. It seems to affect some but not all alpha-less CGs.
+		//        E.g. CG#90 (and similar) from the Rance 2 digest version.
+		memset(alpha, 0xFF, (qnt->width+10)*(qnt->height+10));
+	}
+	struct coverage_builder cov;
+	bool track = coverage && qnt->alpha_size;
+	if (track)
+		coverage_begin(&cov, coverage, qnt->width, qnt->height);
+	else if (coverage)
+		coverage_set_opaque(coverage, qnt->width, qnt->height);
+	for (int src_i = 0, p = 0, y = 0; y < qnt->height; y++) {
+		uint8_t *row = dst + y * stride;
+		for (int x = 0, dst_i = 0; x < qnt->width; x++, p++) {
+			row[dst_i++] = pixels[src_i++];
+			row[dst_i++] = pixels[src_i++];
+			row[dst_i++] = pixels[src_i++];
+			row[dst_i++] = alpha[p];
+		}
+		if (track)
+			coverage_add_row(&cov, alpha + p - qnt->width, 1);
+	}
+	if (track)
+		coverage_end(&cov);
+	cg_pool_free(alpha);
+	cg_pool_free(pixels);
+}
+
 /*
  * Extract qnt header and pixel
  *
@@ -250,31 +298,26 @@ void qnt_extract(const uint8_t *data, struct cg *cg)
 	qnt_extract_header(data, &qnt);
 	qnt_init_metrics(&qnt, &cg->metrics);
 
-	uint8_t *pixels = xcalloc(3, (qnt.width+10) * (qnt.height+10));
-	extract_pixel(&qnt, pixels, data + qnt.hdr_size);
-
 	cg->type = ALCG_QNT;
+	cg->pixels = cg_pool_alloc((qnt.width+10) * (qnt.height+10) * 4);
+	cg->pooled = true;
+	qnt_decode(data, &qnt, cg->pixels, qnt.width * 4, &cg->coverage);
+}
 
-	// combine color/alpha data
-	uint8_t *alpha = xmalloc((qnt.width+10) * (qnt.height+10));
-	uint8_t *tmp = xmalloc((qnt.width+10) * (qnt.height+10) * 4);
-	if (qnt.alpha_size) {
-		extract_alpha(&qnt, alpha, data + qnt.hdr_size + qnt.pixel_size);
-	} else {
-		// FIXME: Some CGs don't display correctly unless we add an alpha channel here.
-		//        Not sure why. It seems to affect some but not all alpha-less CGs.
-		//        E.g. CG#90 (and similar) from the Rance 2 digest version.
-		memset(alpha, 0xFF, (qnt.width+10)*(qnt.height+10));
-	}
-	for (int src_i = 0, dst_i = 0, p = 0; p < qnt.width * qnt.height; p++) {
-		tmp[dst_i++] = pixels[src_i++];
-		tmp[dst_i++] = pixels[src_i++];
-		tmp[dst_i++] = pixels[src_i++];
-		tmp[dst_i++] = alpha[p];
+/*
+ * Extract a qnt image directly into a canvas, with its top-left corner at
+ * (x,y). Pixels outside of the image are left untouched.
+ */
+bool qnt_extract_into(const uint8_t *data, struct cg_canvas *dst, int x, int y)
+{
+	struct qnt_header qnt;
+	qnt_extract_header(data, &qnt);
+	if (!cg_canvas_fits(dst, x, y, qnt.width, qnt.height)) {
+		WARNING("QNT image doesn't fit in canvas");
+		return false;
 	}
-	free(alpha);
-	free(pixels);
-	cg->pixels = tmp;
+	qnt_decode(data, &qnt, cg_canvas_at(dst, x, y), dst->stride, NULL);
+	return true;
 }
 
 /*
@@ -327,11 +370,11 @@ static uint8_t *encode_pixels(struct qnt_header *qnt, uint8_t **rows) {
 	}
 	assert(p == buf + bufsize);
 
-	unsigned long destsize = compressBound(bufsize);
+	size_t destsize = sys4_deflate_bound(bufsize);
 	uint8_t *compressed = malloc(destsize);
-	int r = compress2(compressed, &destsize, buf, bufsize, Z_BEST_COMPRESSION);
-	if (r != Z_OK) {
-		WARNING("qnt: compress() failed with error code %d", r);
+	enum sys4_z_status r = sys4_deflate(compressed, &destsize, buf, bufsize, SYS4_Z_BEST_COMPRESSION);
+	if (r != SYS4_Z_OK) {
+		WARNING("qnt: compress() failed: %s", sys4_z_strerror(r));
 		free(buf);
 		free(compressed);
 		return NULL;
@@ -353,11 +396,11 @@ static uint8_t *encode_alpha(struct qnt_header *qnt, uint8_t **rows) {
 			buf[y * width + x] = rows[y][x * 4 + 3];
 	}
 
-	unsigned long destsize = compressBound(bufsize);
+	size_t destsize = sys4_deflate_bound(bufsize);
 	uint8_t *compressed = malloc(destsize);
-	int r = compress2(compressed, &destsize, buf, bufsize, Z_BEST_COMPRESSION);
-	if (r != Z_OK) {
-		WARNING("qnt: compress() failed with error code %d", r);
+	enum sys4_z_status r = sys4_deflate(compressed, &destsize, buf, bufsize, SYS4_Z_BEST_COMPRESSION);
+	if (r != SYS4_Z_OK) {
+		WARNING("qnt: compress() failed: %s", sys4_z_strerror(r));
 		free(buf);
 		free(compressed);
 		return NULL;
@@ -0,0 +1,188 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "system4.h"
+#include "thread_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+struct thread_pool {
+	int nr_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	// current job
+	unsigned generation;
+	thread_pool_fun fn;
+	void *user;
+	size_t n;
+	atomic_size_t next;
+	int nr_busy;
+	bool quit;
+};
+
+struct worker_arg {
+	struct thread_pool *pool;
+	int id;
+};
+
+int sys_nr_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+static void run_job(struct thread_pool *pool, int worker)
+{
+	size_t i;
+	while ((i = atomic_fetch_add(&pool->next, 1)) < pool->n) {
+		pool->fn(i, worker, pool->user);
+	}
+}
+
+static void *worker_main(void *data)
+{
+	struct worker_arg *arg = data;
+	struct thread_pool *pool = arg->pool;
+	int id = arg->id;
+	unsigned generation = 0;
+	free(arg);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (!pool->quit && pool->generation == generation)
+			pthread_cond_wait(&pool->job_cond, &pool->mutex);
+		if (pool->quit)
+			break;
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+
+		run_job(pool, id);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->nr_busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+struct thread_pool *thread_pool_create(int nr_threads)
+{
+	if (nr_threads <= 0)
+		nr_threads = sys_nr_cpus();
+
+	struct thread_pool *pool = xcalloc(1, sizeof(struct thread_pool));
+	pool->nr_threads = nr_threads;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	// worker 0 is the thread calling thread_pool_run
+	pool->threads = xcalloc(nr_threads, sizeof(pthread_t));
+	for (int i = 1; i < nr_threads; i++) {
+		struct worker_arg *arg = xmalloc(sizeof(struct worker_arg));
+		arg->pool = pool;
+		arg->id = i;
+		if (pthread_create(&pool->threads[i], NULL, worker_main, arg)) {
+			WARNING("pthread_create failed");
+			free(arg);
+			pool->nr_threads = i;
+			break;
+		}
+	}
+	return pool;
+}
+
+void thread_pool_free(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 1; i < pool->nr_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+int thread_pool_nr_threads(struct thread_pool *pool)
+{
+	return pool->nr_threads;
+}
+
+void thread_pool_run(struct thread_pool *pool, size_t n, thread_pool_fun fn, void *user)
+{
+	if (!n)
+		return;
+	if (pool->nr_threads == 1 || n == 1) {
+		for (size_t i = 0; i < n; i++) {
+			fn(i, 0, user);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->fn = fn;
+	pool->user = user;
+	pool->n = n;
+	atomic_store(&pool->next, 0);
+	pool->nr_busy = pool->nr_threads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	run_job(pool, 0);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->nr_busy > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void parallel_for(int nr_threads, size_t n, thread_pool_fun fn, void *user)
+{
+	if (nr_threads <= 0)
+		nr_threads = sys_nr_cpus();
+	if (nr_threads == 1 || n <= 1) {
+		for (size_t i = 0; i < n; i++) {
+			fn(i, 0, user);
+		}
+		return;
+	}
+	struct thread_pool *pool = thread_pool_create(min((size_t)nr_threads, n));
+	thread_pool_run(pool, n, fn, user);
+	thread_pool_free(pool);
+}
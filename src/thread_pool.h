@@ -0,0 +1,52 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef SYSTEM4_THREAD_POOL_H
+#define SYSTEM4_THREAD_POOL_H
+
+#include <stddef.h>
+
+struct thread_pool;
+
+typedef void (*thread_pool_fun)(size_t i, int worker, void *user);
+
+/*
+ * Get the number of online CPUs (at least 1).
+ */
+int sys_nr_cpus(void);
+
+/*
+ * Create a pool of worker threads. If `nr_threads` is <= 0, one thread per
+ * CPU is used. The calling thread counts as one of the threads.
+ */
+struct thread_pool *thread_pool_create(int nr_threads);
+void thread_pool_free(struct thread_pool *pool);
+int thread_pool_nr_threads(struct thread_pool *pool);
+
+/*
+ * Call `fn(i, worker, user)` for every `i` in [0,n) and wait for all calls to
+ * return. `worker` is in [0,thread_pool_nr_threads(pool)) and identifies the
+ * calling thread, so that per-thread scratch space can be indexed by it.
+ * Indices are handed out in increasing order.
+ */
+void thread_pool_run(struct thread_pool *pool, size_t n, thread_pool_fun fn, void *user);
+
+/*
+ * Convenience wrapper: run a single job on a temporary pool.
+ */
+void parallel_for(int nr_threads, size_t n, thread_pool_fun fn, void *user);
+
+#endif /* SYSTEM4_THREAD_POOL_H */
@@ -0,0 +1,714 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/archive_catalog.h"
+#include "system4/cg.h"
+#include "system4/cg_cache.h"
+#include "system4/file.h"
+#include "system4/hashtable.h"
+#include "system4/trace.h"
+#include "kvec.h"
+#include "little_endian.h"
+#include "thread_pool.h"
+
+/*
+ * Trace file layout (little endian):
+ *
+ *     0   "S4TR"
+ *     4   format version
+ *     8   wall clock time at the start of the trace (u64, ns since the epoch)
+ *     16  records
+ *
+ * Every record is 32 bytes:
+ *
+ *     0   time (u64, ns since the start of the trace)
+ *     8   latency (u32, ns)
+ *     12  op (u16; bit 15 set if the operation failed)
+ *     14  thread (u16)
+ *     16  archive (u32)
+ *     20  entry number (i32)
+ *     24  bytes (u32)
+ *     28  name (u32, string id; 0 = none)
+ *
+ * Two kinds of records define the ids used by events, before their first
+ * use: REC_STRING (name = string id, bytes = length, followed by the string
+ * itself) and REC_ARCHIVE (archive = archive id, name = string id of the
+ * path it was opened with).
+ */
+#define TRACE_MAGIC "S4TR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_SIZE 32
+
+#define REC_FAILED  0x8000
+#define REC_STRING  0x7FFF
+#define REC_ARCHIVE 0x7FFE
+
+bool sys4_tracing = false;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_fp = NULL;
+static uint64_t trace_t0;
+static unsigned trace_generation = 0;
+static struct hash_table *trace_strings;
+static uint32_t trace_nr_strings;
+static uint32_t trace_nr_archives;
+static uint16_t trace_nr_threads;
+
+struct traced_archive {
+	struct archive *ar;
+	uint32_t id;
+};
+static kvec_t(struct traced_archive) trace_archives;
+
+// call nesting depth, so that only the outermost call is logged
+static _Thread_local int trace_depth = 0;
+static _Thread_local uint16_t trace_tid = 0;
+static _Thread_local unsigned trace_tid_generation = 0;
+
+static const char *op_names[SYS4_TRACE_NR_OPS] = {
+	[SYS4_TRACE_ARCHIVE_GET]             = "archive_get",
+	[SYS4_TRACE_ARCHIVE_GET_BY_NAME]     = "archive_get_by_name",
+	[SYS4_TRACE_ARCHIVE_GET_BY_BASENAME] = "archive_get_by_basename",
+	[SYS4_TRACE_ARCHIVE_LOAD_FILE]       = "archive_load_file",
+	[SYS4_TRACE_CG_LOAD]                 = "cg_load",
+	[SYS4_TRACE_CG_LOAD_FILE]            = "cg_load_file",
+	[SYS4_TRACE_EX_GET]                  = "ex_get",
+	[SYS4_TRACE_AIN_GET]                 = "ain_get",
+};
+
+const char *sys4_trace_op_name(enum sys4_trace_op op)
+{
+	if (op < 0 || op >= SYS4_TRACE_NR_OPS)
+		return "unknown";
+	return op_names[op];
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void put_u64(uint8_t *b, int i, uint64_t v)
+{
+	LittleEndian_putDW(b, i, v);
+	LittleEndian_putDW(b, i + 4, v >> 32);
+}
+
+static uint64_t get_u64(const uint8_t *b, int i)
+{
+	return (uint32_t)LittleEndian_getDW(b, i) | ((uint64_t)(uint32_t)LittleEndian_getDW(b, i + 4) << 32);
+}
+
+static void write_record(uint64_t time, uint32_t latency, uint16_t op, uint16_t thread,
+		uint32_t archive, int32_t no, uint32_t bytes, uint32_t name)
+{
+	uint8_t rec[TRACE_RECORD_SIZE];
+	put_u64(rec, 0, time);
+	LittleEndian_putDW(rec, 8, latency);
+	LittleEndian_putW(rec, 12, op);
+	LittleEndian_putW(rec, 14, thread);
+	LittleEndian_putDW(rec, 16, archive);
+	LittleEndian_putDW(rec, 20, no);
+	LittleEndian_putDW(rec, 24, bytes);
+	LittleEndian_putDW(rec, 28, name);
+	fwrite(rec, TRACE_RECORD_SIZE, 1, trace_fp);
+}
+
+// trace_mutex must be held
+static uint32_t intern_string(const char *s)
+{
+	if (!s)
+		return 0;
+	struct ht_slot *slot = ht_put(trace_strings, s, NULL);
+	if (!slot->value) {
+		uint32_t len = strlen(s);
+		slot->value = (void*)(uintptr_t)++trace_nr_strings;
+		write_record(0, 0, REC_STRING, 0, 0, 0, len, trace_nr_strings);
+		fwrite(s, len, 1, trace_fp);
+	}
+	return (uintptr_t)slot->value;
+}
+
+// trace_mutex must be held
+static uint32_t register_archive(struct archive *ar, const char *path)
+{
+	uint32_t id = ++trace_nr_archives;
+	write_record(0, 0, REC_ARCHIVE, 0, id, 0, 0, intern_string(path));
+	for (size_t i = 0; i < kv_size(trace_archives); i++) {
+		if (kv_A(trace_archives, i).ar == ar) {
+			kv_A(trace_archives, i).id = id;
+			return id;
+		}
+	}
+	kv_push(struct traced_archive, trace_archives, ((struct traced_archive) { ar, id }));
+	return id;
+}
+
+// trace_mutex must be held
+static uint32_t archive_id(struct archive *ar)
+{
+	if (!ar)
+		return 0;
+	for (size_t i = 0; i < kv_size(trace_archives); i++) {
+		if (kv_A(trace_archives, i).ar == ar)
+			return kv_A(trace_archives, i).id;
+	}
+	// opened before the trace was started
+	return register_archive(ar, NULL);
+}
+
+bool sys4_trace_start(const char *path)
+{
+	if (!path && !(path = getenv("SYS4_TRACE")))
+		return false;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_fp) {
+		pthread_mutex_unlock(&trace_mutex);
+		WARNING("A trace is already being recorded");
+		return false;
+	}
+	if (!(trace_fp = file_open_utf8(path, "wb"))) {
+		pthread_mutex_unlock(&trace_mutex);
+		WARNING("fopen(\"%s\"): %s", path, strerror(errno));
+		return false;
+	}
+
+	uint8_t header[TRACE_HEADER_SIZE];
+	memcpy(header, TRACE_MAGIC, 4);
+	LittleEndian_putDW(header, 4, TRACE_VERSION);
+	put_u64(header, 8, now_ns(CLOCK_REALTIME));
+	fwrite(header, TRACE_HEADER_SIZE, 1, trace_fp);
+
+	trace_t0 = now_ns(CLOCK_MONOTONIC);
+	trace_generation++;
+	trace_strings = ht_create(1024);
+	trace_nr_strings = 0;
+	trace_nr_archives = 0;
+	trace_nr_threads = 0;
+	kv_init(trace_archives);
+	__atomic_store_n(&sys4_tracing, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&trace_mutex);
+	return true;
+}
+
+void sys4_trace_stop(void)
+{
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_fp) {
+		pthread_mutex_unlock(&trace_mutex);
+		return;
+	}
+	__atomic_store_n(&sys4_tracing, false, __ATOMIC_RELAXED);
+	if (fclose(trace_fp))
+		WARNING("Error writing trace: %s", strerror(errno));
+	trace_fp = NULL;
+	ht_free(trace_strings);
+	kv_destroy(trace_archives);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+uint64_t _sys4_trace_begin(void)
+{
+	trace_depth++;
+	return now_ns(CLOCK_MONOTONIC);
+}
+
+void _sys4_trace_end(uint64_t start, enum sys4_trace_op op, struct archive *ar, int no,
+		const char *name, size_t bytes, bool ok)
+{
+	uint64_t end = now_ns(CLOCK_MONOTONIC);
+	if (--trace_depth > 0)
+		return;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_fp || start < trace_t0) {
+		pthread_mutex_unlock(&trace_mutex);
+		return;
+	}
+	if (trace_tid_generation != trace_generation) {
+		trace_tid_generation = trace_generation;
+		trace_tid = ++trace_nr_threads;
+	}
+	uint64_t latency = end - start;
+	uint16_t rec_op = op | (ok ? 0 : REC_FAILED);
+	uint32_t ar_id = archive_id(ar);
+	uint32_t name_id = intern_string(name);
+	write_record(start - trace_t0, min(latency, UINT32_MAX), rec_op, trace_tid, ar_id, no,
+			min(bytes, UINT32_MAX), name_id);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void _sys4_trace_archive_open(struct archive *ar, const char *path)
+{
+	if (!sys4_trace_enabled())
+		return;
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_fp)
+		register_archive(ar, path);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+struct archive_data *_archive_get_traced(struct archive *ar, int no)
+{
+	uint64_t t = _sys4_trace_begin();
+	struct archive_data *data = ar->ops->get ? ar->ops->get(ar, no) : NULL;
+	_sys4_trace_end(t, SYS4_TRACE_ARCHIVE_GET, ar, no, NULL, data ? data->size : 0, data);
+	return data;
+}
+
+struct archive_data *_archive_get_by_name_traced(struct archive *ar, const char *name)
+{
+	uint64_t t = _sys4_trace_begin();
+	struct archive_data *data = ar->ops->get_by_name ? ar->ops->get_by_name(ar, name) : NULL;
+	_sys4_trace_end(t, SYS4_TRACE_ARCHIVE_GET_BY_NAME, ar, data ? data->no : -1, name,
+			data ? data->size : 0, data);
+	return data;
+}
+
+struct archive_data *_archive_get_by_basename_traced(struct archive *ar, const char *name)
+{
+	uint64_t t = _sys4_trace_begin();
+	struct archive_data *data = ar->ops->get_by_basename ? ar->ops->get_by_basename(ar, name) : NULL;
+	_sys4_trace_end(t, SYS4_TRACE_ARCHIVE_GET_BY_BASENAME, ar, data ? data->no : -1, name,
+			data ? data->size : 0, data);
+	return data;
+}
+
+bool _archive_load_file_traced(struct archive_data *data)
+{
+	uint64_t t = _sys4_trace_begin();
+	struct archive *ar = data->archive;
+	bool ok = ar->ops->load_file ? ar->ops->load_file(data) : false;
+	_sys4_trace_end(t, SYS4_TRACE_ARCHIVE_LOAD_FILE, ar, data->no, NULL, ok ? data->size : 0, ok);
+	return ok;
+}
+
+/*
+ * Reading traces.
+ */
+
+struct sys4_trace *sys4_trace_read(const char *path)
+{
+	size_t size;
+	uint8_t *buf = file_read(path, &size);
+	if (!buf) {
+		WARNING("Failed to read trace \"%s\"", path);
+		return NULL;
+	}
+	if (size < TRACE_HEADER_SIZE || memcmp(buf, TRACE_MAGIC, 4)
+			|| LittleEndian_getDW(buf, 4) != TRACE_VERSION) {
+		WARNING("\"%s\" is not a trace file", path);
+		free(buf);
+		return NULL;
+	}
+
+	struct sys4_trace *trace = xcalloc(1, sizeof(struct sys4_trace));
+	trace->start = get_u64(buf, 8);
+	trace->archive_names = xcalloc(1, sizeof(char*));
+	trace->strings = xcalloc(1, sizeof(char*));
+	kvec_t(struct sys4_trace_event) events;
+	kv_init(events);
+
+	size_t off = TRACE_HEADER_SIZE;
+	while (off + TRACE_RECORD_SIZE <= size) {
+		const uint8_t *rec = buf + off;
+		off += TRACE_RECORD_SIZE;
+		uint16_t op = (uint16_t)LittleEndian_getW(rec, 12);
+		uint32_t archive = LittleEndian_getDW(rec, 16);
+		uint32_t bytes = LittleEndian_getDW(rec, 24);
+		uint32_t name = LittleEndian_getDW(rec, 28);
+		if (op == REC_STRING) {
+			if (name != trace->nr_strings + 1 || bytes > size - off)
+				goto truncated;
+			trace->strings = xrealloc_array(trace->strings, name, name + 1, sizeof(char*));
+			trace->strings[name] = xmalloc(bytes + 1);
+			memcpy(trace->strings[name], buf + off, bytes);
+			trace->strings[name][bytes] = '\0';
+			trace->nr_strings = name;
+			off += bytes;
+			continue;
+		}
+		if (name > trace->nr_strings)
+			goto truncated;
+		if (op == REC_ARCHIVE) {
+			if (archive != trace->nr_archives + 1)
+				goto truncated;
+			trace->archive_names = xrealloc_array(trace->archive_names, archive,
+					archive + 1, sizeof(char*));
+			trace->archive_names[archive] = name ? xstrdup(trace->strings[name]) : NULL;
+			trace->nr_archives = archive;
+			continue;
+		}
+		if ((op & ~REC_FAILED) >= SYS4_TRACE_NR_OPS || archive > trace->nr_archives)
+			goto truncated;
+		kv_push(struct sys4_trace_event, events, ((struct sys4_trace_event) {
+			.time = get_u64(rec, 0),
+			.latency = LittleEndian_getDW(rec, 8),
+			.op = op & ~REC_FAILED,
+			.thread = LittleEndian_getW(rec, 14),
+			.archive = archive,
+			.no = LittleEndian_getDW(rec, 20),
+			.bytes = bytes,
+			.failed = op & REC_FAILED,
+			.name = name ? trace->strings[name] : NULL,
+		}));
+	}
+	if (off != size) {
+truncated:
+		// e.g. the program was killed while recording; keep what was read
+		WARNING("Trace \"%s\" is truncated or corrupt at offset %zu", path, off);
+	}
+
+	trace->nr_events = kv_size(events);
+	trace->events = events.a;
+	free(buf);
+	return trace;
+}
+
+void sys4_trace_free(struct sys4_trace *trace)
+{
+	if (!trace)
+		return;
+	for (uint32_t i = 1; i <= trace->nr_archives; i++)
+		free(trace->archive_names[i]);
+	for (uint32_t i = 1; i <= trace->nr_strings; i++)
+		free(trace->strings[i]);
+	free(trace->archive_names);
+	free(trace->strings);
+	free(trace->events);
+	free(trace);
+}
+
+/*
+ * Statistics.
+ */
+
+struct op_samples {
+	kvec_t(uint32_t) latency;
+};
+
+static int u32_cmp(const void *_a, const void *_b)
+{
+	uint32_t a = *(const uint32_t*)_a;
+	uint32_t b = *(const uint32_t*)_b;
+	return a < b ? -1 : a > b;
+}
+
+static void finish_stats(struct sys4_trace_stats *stats, struct op_samples *samples)
+{
+	for (int op = 0; op < SYS4_TRACE_NR_OPS; op++) {
+		struct sys4_trace_latency *l = &stats->ops[op];
+		size_t n = kv_size(samples[op].latency);
+		if (n) {
+			uint32_t *a = samples[op].latency.a;
+			qsort(a, n, sizeof(uint32_t), u32_cmp);
+			l->min = a[0];
+			l->p50 = a[(n - 1) * 50 / 100];
+			l->p90 = a[(n - 1) * 90 / 100];
+			l->p99 = a[(n - 1) * 99 / 100];
+			l->max = a[n - 1];
+		}
+		kv_destroy(samples[op].latency);
+	}
+}
+
+static void add_sample(struct sys4_trace_stats *stats, struct op_samples *samples, int op,
+		uint32_t latency, uint32_t bytes, bool failed)
+{
+	struct sys4_trace_latency *l = &stats->ops[op];
+	l->count++;
+	l->failed += failed;
+	l->bytes += bytes;
+	l->total += latency;
+	kv_push(uint32_t, samples[op].latency, latency);
+}
+
+void sys4_trace_summarize(struct sys4_trace *trace, struct sys4_trace_stats *out)
+{
+	struct op_samples samples[SYS4_TRACE_NR_OPS];
+	memset(out, 0, sizeof(struct sys4_trace_stats));
+	for (int op = 0; op < SYS4_TRACE_NR_OPS; op++)
+		kv_init(samples[op].latency);
+
+	uint64_t first = UINT64_MAX, last = 0;
+	for (size_t i = 0; i < trace->nr_events; i++) {
+		struct sys4_trace_event *e = &trace->events[i];
+		add_sample(out, samples, e->op, e->latency, e->bytes, e->failed);
+		first = min(first, e->time);
+		last = max(last, e->time + e->latency);
+	}
+	out->wall_time = trace->nr_events ? last - first : 0;
+	finish_stats(out, samples);
+}
+
+static void print_ns(FILE *out, uint64_t ns)
+{
+	if (ns < 10000)
+		fprintf(out, " %7"PRIu64"ns", ns);
+	else if (ns < 10000000)
+		fprintf(out, " %7.1fus", ns / 1000.0);
+	else
+		fprintf(out, " %7.1fms", ns / 1000000.0);
+}
+
+void sys4_trace_print_stats(const struct sys4_trace_stats *stats, FILE *out)
+{
+	fprintf(out, "%-24s %8s %6s %7s %10s %9s %9s %9s %9s %9s\n", "op", "count", "failed",
+			"skipped", "MiB", "min", "p50", "p90", "p99", "max");
+	for (int op = 0; op < SYS4_TRACE_NR_OPS; op++) {
+		const struct sys4_trace_latency *l = &stats->ops[op];
+		if (!l->count && !l->skipped)
+			continue;
+		fprintf(out, "%-24s %8"PRIu64" %6"PRIu64" %7"PRIu64" %10.1f", op_names[op],
+				l->count, l->failed, l->skipped, l->bytes / (1024.0 * 1024.0));
+		print_ns(out, l->min);
+		print_ns(out, l->p50);
+		print_ns(out, l->p90);
+		print_ns(out, l->p99);
+		print_ns(out, l->max);
+		fputc('\n', out);
+	}
+	fprintf(out, "wall time: %.3fs\n", stats->wall_time / 1000000000.0);
+}
+
+/*
+ * Replay.
+ */
+
+struct replay_stream {
+	kvec_t(size_t) events;
+};
+
+struct replay {
+	struct sys4_trace *trace;
+	const struct sys4_replay_options *opts;
+	const char *dir;
+	struct archive_catalog *catalog;
+	struct cg_cache *cache;
+	struct archive **archives;  // by trace archive id (NULL = unresolved)
+	char **archive_paths;       // by trace archive id, for cg_cache keys
+	struct replay_stream *streams;
+	uint64_t t0;
+	// per event results
+	uint32_t *latency;
+	uint32_t *bytes;
+	uint8_t *result;
+};
+
+enum { REPLAY_OK, REPLAY_FAILED, REPLAY_SKIPPED };
+
+// file name of a path recorded on any platform
+static const char *file_name(const char *path)
+{
+	const char *p = path + strlen(path);
+	while (p > path && p[-1] != '/' && p[-1] != '\\')
+		p--;
+	return p;
+}
+
+static void resolve_archives(struct replay *r)
+{
+	uint32_t n = r->trace->nr_archives;
+	r->archives = xcalloc(n + 1, sizeof(struct archive*));
+	r->archive_paths = xcalloc(n + 1, sizeof(char*));
+	for (uint32_t i = 1; i <= n; i++) {
+		const char *path = r->trace->archive_names[i];
+		if (!path)
+			continue;
+		const char *base = file_name(path);
+		int a = archive_catalog_find(r->catalog, base);
+		if (a < 0) {
+			WARNING("Archive \"%s\" not found in %s", base, r->dir);
+		} else {
+			r->archives[i] = archive_catalog_archive(r->catalog, a);
+			r->archive_paths[i] = path_join(r->dir,
+					archive_catalog_archive_name(r->catalog, a));
+		}
+	}
+}
+
+static char *resolve_file(struct replay *r, const char *name)
+{
+	if (file_exists(name))
+		return xstrdup(name);
+	return path_join(r->dir, file_name(name));
+}
+
+static int replay_event(struct replay *r, struct sys4_trace_event *e, uint32_t *bytes)
+{
+	struct archive *ar = r->archives[e->archive];
+	struct archive_data *data = NULL;
+	struct cg *cg = NULL;
+
+	switch (e->op) {
+	case SYS4_TRACE_ARCHIVE_GET:
+	case SYS4_TRACE_ARCHIVE_LOAD_FILE:
+		if (!ar)
+			return REPLAY_SKIPPED;
+		data = archive_get(ar, e->no);
+		break;
+	case SYS4_TRACE_ARCHIVE_GET_BY_NAME:
+		if (!ar || !e->name)
+			return REPLAY_SKIPPED;
+		data = archive_get_by_name(ar, e->name);
+		break;
+	case SYS4_TRACE_ARCHIVE_GET_BY_BASENAME:
+		if (!ar || !e->name)
+			return REPLAY_SKIPPED;
+		data = archive_get_by_basename(ar, e->name);
+		break;
+	case SYS4_TRACE_CG_LOAD:
+		if (!ar)
+			return REPLAY_SKIPPED;
+		if (r->cache)
+			cg = cg_cache_load(r->cache, r->archive_paths[e->archive], ar, e->no);
+		else
+			cg = cg_load(ar, e->no);
+		break;
+	case SYS4_TRACE_CG_LOAD_FILE: {
+		if (!e->name)
+			return REPLAY_SKIPPED;
+		char *path = resolve_file(r, e->name);
+		cg = cg_load_file(path);
+		free(path);
+		break;
+	}
+	default:
+		return REPLAY_SKIPPED;
+	}
+
+	if (data) {
+		*bytes = min(data->size, UINT32_MAX);
+		archive_free_data(data);
+		return REPLAY_OK;
+	}
+	if (cg) {
+		*bytes = min((size_t)cg->metrics.w * cg->metrics.h * 4, UINT32_MAX);
+		cg_free(cg);
+		return REPLAY_OK;
+	}
+	return REPLAY_FAILED;
+}
+
+static void wait_until(uint64_t t)
+{
+	uint64_t now = now_ns(CLOCK_MONOTONIC);
+	if (now >= t)
+		return;
+	struct timespec ts = {
+		.tv_sec = (t - now) / 1000000000ull,
+		.tv_nsec = (t - now) % 1000000000ull,
+	};
+	while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static void replay_stream(size_t i, possibly_unused int worker, void *user)
+{
+	struct replay *r = user;
+	struct replay_stream *s = &r->streams[i];
+	for (size_t j = 0; j < kv_size(s->events); j++) {
+		size_t ev = kv_A(s->events, j);
+		struct sys4_trace_event *e = &r->trace->events[ev];
+		if (r->opts->realtime)
+			wait_until(r->t0 + e->time);
+		uint64_t start = now_ns(CLOCK_MONOTONIC);
+		r->bytes[ev] = 0;
+		r->result[ev] = replay_event(r, e, &r->bytes[ev]);
+		r->latency[ev] = min(now_ns(CLOCK_MONOTONIC) - start, UINT32_MAX);
+	}
+}
+
+bool sys4_trace_replay(struct sys4_trace *trace, const char *dir,
+		const struct sys4_replay_options *opts, struct sys4_trace_stats *out)
+{
+	if (!opts->catalog_path) {
+		WARNING("Replay needs a catalog path");
+		return false;
+	}
+
+	struct replay r = {
+		.trace = trace,
+		.opts = opts,
+		.dir = dir,
+	};
+	if (!(r.catalog = archive_catalog_open(dir, opts->catalog_path, opts->archive_flags)))
+		return false;
+	if (opts->cg_cache_dir && !(r.cache = cg_cache_open(opts->cg_cache_dir, opts->cg_cache_size, NULL))) {
+		archive_catalog_close(r.catalog);
+		return false;
+	}
+	resolve_archives(&r);
+
+	// one stream per recorded thread
+	uint16_t nr_streams = 0;
+	for (size_t i = 0; i < trace->nr_events; i++)
+		nr_streams = max(nr_streams, trace->events[i].thread);
+	r.streams = xcalloc(nr_streams + 1, sizeof(struct replay_stream));
+	for (size_t i = 0; i < trace->nr_events; i++)
+		kv_push(size_t, r.streams[trace->events[i].thread].events, i);
+
+	r.latency = xcalloc(trace->nr_events, sizeof(uint32_t));
+	r.bytes = xcalloc(trace->nr_events, sizeof(uint32_t));
+	r.result = xcalloc(trace->nr_events, 1);
+
+	r.t0 = now_ns(CLOCK_MONOTONIC);
+	parallel_for(opts->nr_threads, nr_streams + 1, replay_stream, &r);
+	uint64_t end = now_ns(CLOCK_MONOTONIC);
+
+	struct op_samples samples[SYS4_TRACE_NR_OPS];
+	memset(out, 0, sizeof(struct sys4_trace_stats));
+	for (int op = 0; op < SYS4_TRACE_NR_OPS; op++)
+		kv_init(samples[op].latency);
+	for (size_t i = 0; i < trace->nr_events; i++) {
+		int op = trace->events[i].op;
+		if (r.result[i] == REPLAY_SKIPPED)
+			out->ops[op].skipped++;
+		else
+			add_sample(out, samples, op, r.latency[i], r.bytes[i], r.result[i] == REPLAY_FAILED);
+	}
+	out->wall_time = end - r.t0;
+	finish_stats(out, samples);
+
+	for (uint16_t i = 0; i <= nr_streams; i++)
+		kv_destroy(r.streams[i].events);
+	for (uint32_t i = 1; i <= trace->nr_archives; i++)
+		free(r.archive_paths[i]);
+	free(r.streams);
+	free(r.archives);
+	free(r.archive_paths);
+	free(r.latency);
+	free(r.bytes);
+	free(r.result);
+	if (r.cache)
+		cg_cache_close(r.cache);
+	archive_catalog_close(r.catalog);
+	return true;
+}
@@ -20,10 +20,13 @@
 
 #include "system4.h"
 #include "system4/ald.h"
+#include "system4/archive.h"
 #include "system4/cg.h"
+#include "system4/cg_pool.h"
 #include "system4/file.h"
 #include "system4/webp.h"
 
+#include "cpu.h"
 #include "little_endian.h"
 
 bool webp_checkfmt(const uint8_t *data)
@@ -71,48 +74,253 @@ static int get_base_cg(uint8_t *data, size_t size)
 	return LittleEndian_getDW(data, 8);
 }
 
-void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
+static bool webp_decode_into(const uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y,
+		int w, int h)
 {
-	cg->pixels = WebPDecodeRGBA(data, size, &cg->metrics.w, &cg->metrics.h);
-	webp_init_metrics(&cg->metrics);
-	cg->type = ALCG_WEBP;
+	WebPDecoderConfig config;
+	if (!WebPInitDecoderConfig(&config)) {
+		WARNING("WebPInitDecoderConfig failed");
+		return false;
+	}
+	config.options.use_threads = 1;
+	config.output.colorspace = MODE_RGBA;
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = cg_canvas_at(dst, x, y);
+	config.output.u.RGBA.stride = dst->stride;
+	config.output.u.RGBA.size = dst->stride * (h - 1) + (size_t)w * 4;
+	VP8StatusCode r = WebPDecode(data, size, &config);
+	WebPFreeDecBuffer(&config.output);
+	if (r != VP8_STATUS_OK) {
+		WARNING("WebP decode failed (status %d)", r);
+		return false;
+	}
+	return true;
+}
 
-	if (!ar)
-		return;
+/*
+ * Overlay masking: the base CG is decoded into the destination first, and
+ * then every overlay pixel that isn't magenta (255,0,255) is copied over it.
+ */
 
-	int base = get_base_cg(data, size);
-	if (base < 0)
-		return;
+static void mask_row_scalar(uint8_t *dst, const uint8_t *overlay, int n)
+{
+	for (int i = 0; i < n; i++, dst += 4, overlay += 4) {
+		if (overlay[0] != 255 || overlay[1] != 0 || overlay[2] != 255)
+			memcpy(dst, overlay, 4);
+	}
+}
+
+#ifdef SYS4_SIMD_SSE2
+
+__attribute__((target("sse2")))
+static void mask_row_sse2(uint8_t *dst, const uint8_t *overlay, int n)
+{
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	const __m128i magenta = _mm_set1_epi32(0x00ff00ff);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i o = _mm_loadu_si128((const __m128i*)(overlay + i*4));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i*4));
+		__m128i m = _mm_cmpeq_epi32(_mm_and_si128(o, rgb), magenta);
+		d = _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, o));
+		_mm_storeu_si128((__m128i*)(dst + i*4), d);
+	}
+	mask_row_scalar(dst + i*4, overlay + i*4, n - i);
+}
+
+#endif /* SYS4_SIMD_SSE2 */
+
+#ifdef SYS4_SIMD_AVX2
+
+__attribute__((target("avx2")))
+static void mask_row_avx2(uint8_t *dst, const uint8_t *overlay, int n)
+{
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	const __m256i magenta = _mm256_set1_epi32(0x00ff00ff);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i o = _mm256_loadu_si256((const __m256i*)(overlay + i*4));
+		__m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(o, rgb), magenta);
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i*4));
+		_mm256_storeu_si256((__m256i*)(dst + i*4), _mm256_blendv_epi8(o, d, m));
+	}
+	mask_row_scalar(dst + i*4, overlay + i*4, n - i);
+}
+
+#endif /* SYS4_SIMD_AVX2 */
+
+#ifdef SYS4_SIMD_AVX512
+
+__attribute__((target("avx512f,avx512bw")))
+static void mask_row_avx512(uint8_t *dst, const uint8_t *overlay, int n)
+{
+	const __m512i rgb = _mm512_set1_epi32(0x00ffffff);
+	const __m512i magenta = _mm512_set1_epi32(0x00ff00ff);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i o = _mm512_loadu_si512(overlay + i*4);
+		__mmask16 m = _mm512_cmpneq_epi32_mask(_mm512_and_si512(o, rgb), magenta);
+		_mm512_mask_storeu_epi32(dst + i*4, m, o);
+	}
+	mask_row_scalar(dst + i*4, overlay + i*4, n - i);
+}
+
+#endif /* SYS4_SIMD_AVX512 */
+
+#ifdef SYS4_SIMD_NEON
+
+static void mask_row_neon(uint8_t *dst, const uint8_t *overlay, int n)
+{
+	const uint32x4_t rgb = vdupq_n_u32(0x00ffffff);
+	const uint32x4_t magenta = vdupq_n_u32(0x00ff00ff);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint32x4_t o = vreinterpretq_u32_u8(vld1q_u8(overlay + i*4));
+		uint32x4_t d = vreinterpretq_u32_u8(vld1q_u8(dst + i*4));
+		uint32x4_t m = vceqq_u32(vandq_u32(o, rgb), magenta);
+		vst1q_u8(dst + i*4, vreinterpretq_u8_u32(vbslq_u32(m, d, o)));
+	}
+	mask_row_scalar(dst + i*4, overlay + i*4, n - i);
+}
+
+#endif /* SYS4_SIMD_NEON */
+
+struct mask_kernels {
+	struct cpu_variant v;
+	void (*mask_row)(uint8_t *dst, const uint8_t *overlay, int n);
+};
+
+static const struct mask_kernels mask_variants[] = {
+#ifdef SYS4_SIMD_AVX512
+	{ { "avx512", CPU_AVX512 }, mask_row_avx512 },
+#endif
+#ifdef SYS4_SIMD_AVX2
+	{ { "avx2", CPU_AVX2 }, mask_row_avx2 },
+#endif
+#ifdef SYS4_SIMD_SSE2
+	{ { "sse2", CPU_SSE2 }, mask_row_sse2 },
+#endif
+#ifdef SYS4_SIMD_NEON
+	{ { "neon", CPU_NEON }, mask_row_neon },
+#endif
+	{ { "scalar", 0 }, mask_row_scalar },
+};
+
+const struct cpu_variant *_webp_mask_variant(unsigned variant)
+{
+	if (variant >= sizeof(mask_variants) / sizeof(mask_variants[0]))
+		return NULL;
+	return &mask_variants[variant].v;
+}
+
+void _webp_mask_row(unsigned variant, uint8_t *dst, const uint8_t *overlay, int n)
+{
+	mask_variants[variant].mask_row(dst, overlay, n);
+}
+
+// Base CGs can themselves be overlays; this bounds the chain.
+#define WEBP_MAX_BASE_DEPTH 16
+static _Thread_local int base_depth = 0;
 
-	// FIXME: possible infinite recursion on broken/malicious ALD
-	struct cg *base_cg = cg_load(ar, base-1);
-	if (!base_cg) {
+static bool webp_load_base(struct archive *ar, int no, struct cg_canvas *dst, int x, int y,
+		int w, int h)
+{
+	if (base_depth >= WEBP_MAX_BASE_DEPTH) {
+		WARNING("webp base CG chain is too deep");
+		return false;
+	}
+	struct archive_data *dfile = archive_get(ar, no);
+	if (!dfile) {
 		WARNING("failed to load webp base CG");
-		return;
+		return false;
 	}
-	if (base_cg->metrics.w != cg->metrics.w || base_cg->metrics.h != cg->metrics.h) {
+
+	struct cg_canvas area = {
+		.pixels = cg_canvas_at(dst, x, y),
+		.w = w,
+		.h = h,
+		.stride = dst->stride,
+	};
+	struct cg_metrics m = {0};
+	base_depth++;
+	bool ok = cg_load_data_into(dfile, &area, 0, 0, &m);
+	base_depth--;
+	archive_free_data(dfile);
+	if (!ok) {
+		WARNING("failed to load webp base CG");
+		return false;
+	}
+	if (m.w != w || m.h != h) {
 		WARNING("webp base CG dimensions don't match: (%d,%d) / (%d,%d)",
-		        base_cg->metrics.w, base_cg->metrics.h, cg->metrics.w, cg->metrics.h);
-		cg_free(base_cg);
-		return;
+		        m.w, m.h, w, h);
+		return false;
 	}
+	return true;
+}
 
-	// mask alpha color
-	uint8_t *pixels = cg->pixels;
-	uint8_t *base_pixels = base_cg->pixels;
-	for (int row = 0; row < cg->metrics.h; row++) {
-		for (int x = 0; x < cg->metrics.w; x++) {
-			int p = cg->metrics.w*row*4 + x*4;
-			if (pixels[p] == 255 && pixels[p+1] == 0 && pixels[p+2] == 255) {
-				pixels[p+0] = base_pixels[p+0];
-				pixels[p+1] = base_pixels[p+1];
-				pixels[p+2] = base_pixels[p+2];
-				pixels[p+3] = base_pixels[p+3];
-			}
-		}
+/*
+ * Extract a webp image directly into a canvas, with its top-left corner at
+ * (x,y). If the image is an overlay and `ar` is given, its base CG is
+ * loaded from `ar` and shows through the magenta pixels.
+ */
+bool webp_extract_into(uint8_t *data, size_t size, struct cg_canvas *dst, int x, int y,
+		struct archive *ar)
+{
+	int w, h;
+	if (!WebPGetInfo(data, size, &w, &h))
+		return false;
+	if (!cg_canvas_fits(dst, x, y, w, h)) {
+		WARNING("webp image doesn't fit in canvas");
+		return false;
 	}
 
-	cg_free(base_cg);
+	int base = ar ? get_base_cg(data, size) : -1;
+	if (base < 0)
+		return webp_decode_into(data, size, dst, x, y, w, h);
+
+	struct cg_canvas overlay = {
+		.pixels = cg_pool_alloc((size_t)w * h * 4),
+		.w = w,
+		.h = h,
+		.stride = (size_t)w * 4,
+	};
+	if (!webp_decode_into(data, size, &overlay, 0, 0, w, h)) {
+		cg_pool_free(overlay.pixels);
+		return false;
+	}
+	// if the base can't be loaded, the overlay is used as-is
+	const struct mask_kernels *k = webp_load_base(ar, base-1, dst, x, y, w, h)
+		? CPU_SELECT(mask_variants) : NULL;
+	for (int row = 0; row < h; row++) {
+		uint8_t *d = cg_canvas_at(dst, x, y + row);
+		const uint8_t *o = cg_canvas_at(&overlay, 0, row);
+		if (k)
+			k->mask_row(d, o, w);
+		else
+			memcpy(d, o, (size_t)w * 4);
+	}
+	cg_pool_free(overlay.pixels);
+	return true;
+}
+
+void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
+{
+	if (!WebPGetInfo(data, size, &cg->metrics.w, &cg->metrics.h))
+		return;
+	struct cg_canvas canvas = {
+		.pixels = cg_pool_alloc((size_t)cg->metrics.w * cg->metrics.h * 4),
+		.w = cg->metrics.w,
+		.h = cg->metrics.h,
+		.stride = (size_t)cg->metrics.w * 4,
+	};
+	if (!webp_extract_into(data, size, &canvas, 0, 0, ar)) {
+		cg_pool_free(canvas.pixels);
+		return;
+	}
+	cg->pixels = canvas.pixels;
+	cg->pooled = true;
+	webp_init_metrics(&cg->metrics);
+	cg->type = ALCG_WEBP;
 }
 
 #include <stdio.h>
@@ -120,16 +328,60 @@ void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
 #include <errno.h>
 #include <webp/encode.h>
 
-int webp_write(struct cg *cg, FILE *f)
+static int webp_write_file(const uint8_t *data, size_t size, const WebPPicture *pic)
+{
+	return fwrite(data, size, 1, pic->custom_ptr) == 1;
+}
+
+int webp_write_with_options(struct cg *cg, FILE *f, const struct cg_write_options *opts)
 {
-	uint8_t *out;
-	size_t len = WebPEncodeLosslessRGBA(cg->pixels, cg->metrics.w, cg->metrics.h, cg->metrics.w*4, &out);
-	if (fwrite(out, len, 1, f) != 1) {
-		WARNING("webp_write: %s", strerror(errno));
+	struct cg_write_options dflt = CG_WRITE_OPTIONS_DEFAULT;
+	if (!opts)
+		opts = &dflt;
+
+	WebPConfig config;
+	if (!WebPConfigInit(&config)) {
+		WARNING("WebPConfigInit failed");
 		return 0;
 	}
-	WebPFree(out);
-	return 1;
+	if (opts->lossy) {
+		WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, opts->quality);
+		config.method = opts->level * 6 / 9;
+	} else {
+		// sets quality and method from the level
+		WebPConfigLosslessPreset(&config, opts->level);
+	}
+	config.thread_level = opts->nr_threads != 1;
+	if (!WebPValidateConfig(&config)) {
+		WARNING("Invalid WebP encoder settings");
+		return 0;
+	}
+
+	WebPPicture pic;
+	if (!WebPPictureInit(&pic)) {
+		WARNING("WebPPictureInit failed");
+		return 0;
+	}
+	pic.use_argb = !opts->lossy;
+	pic.width = cg->metrics.w;
+	pic.height = cg->metrics.h;
+	pic.writer = webp_write_file;
+	pic.custom_ptr = f;
+	int r = 1;
+	if (!WebPPictureImportRGBA(&pic, cg->pixels, cg->metrics.w * 4)) {
+		WARNING("WebPPictureImportRGBA failed");
+		r = 0;
+	} else if (!WebPEncode(&config, &pic)) {
+		WARNING("webp_write: encoding failed (error %d)", pic.error_code);
+		r = 0;
+	}
+	WebPPictureFree(&pic);
+	return r;
+}
+
+int webp_write(struct cg *cg, FILE *f)
+{
+	return webp_write_with_options(cg, f, NULL);
 }
 
 void webp_save(const char *path, uint8_t *pixels, int w, int h, bool alpha)
@@ -0,0 +1,123 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Write AFA archives with various options, read them back and check that
+ * every entry has the right contents and is aligned as requested.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4.h"
+#include "system4/afa.h"
+#include "system4/archive.h"
+
+#define NR_ENTRIES 40
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+static uint8_t *entry_data(int i, size_t *size)
+{
+	// a few empty entries, and every 7th entry a duplicate of entry 0
+	*size = i % 11 == 5 ? 0 : (i * 977) % 5000 + 1;
+	if (i % 7 == 0)
+		*size = 1234;
+	uint8_t *data = xmalloc(*size ? *size : 1);
+	rng_state = i % 7 == 0 ? 7 : i + 100;
+	for (size_t j = 0; j < *size; j++) {
+		data[j] = rng();
+	}
+	return data;
+}
+
+static bool check(uint32_t version, uint32_t align, bool dedup, const char *path)
+{
+	struct afa_writer *w = afa_writer_create();
+	for (int i = 0; i < NR_ENTRIES; i++) {
+		char name[32];
+		size_t size;
+		sprintf(name, "entry%d.dat", i);
+		uint8_t *data = entry_data(i, &size);
+		afa_writer_add_data(w, name, data, size);
+	}
+	struct afa_writer_options opts = {
+		.version = version,
+		.align = align,
+		.dedup = dedup,
+	};
+	bool ok = afa_writer_write(w, path, &opts);
+	afa_writer_free(w);
+	if (!ok) {
+		printf("v%u align=%u dedup=%d: write failed\n", version, align, dedup);
+		return false;
+	}
+
+	int error;
+	struct afa_archive *ar = afa_open(path, 0, &error);
+	if (!ar) {
+		printf("v%u align=%u dedup=%d: open failed\n", version, align, dedup);
+		return false;
+	}
+	for (int i = 0; i < NR_ENTRIES && ok; i++) {
+		char name[32];
+		size_t size;
+		sprintf(name, "entry%d.dat", i);
+		uint8_t *expected = entry_data(i, &size);
+		struct archive_data *data = archive_get_by_name(&ar->ar, name);
+		struct archive_extent ext;
+		if (!data || !archive_load_file(data)) {
+			printf("v%u align=%u dedup=%d: %s missing\n", version, align, dedup, name);
+			ok = false;
+		} else if (data->size != size || memcmp(data->data, expected, size)) {
+			printf("v%u align=%u dedup=%d: %s has wrong contents\n", version, align, dedup, name);
+			ok = false;
+		} else if (!archive_get_extent(data, &ext) || ext.off % align) {
+			printf("v%u align=%u dedup=%d: %s is at %llu\n", version, align, dedup, name,
+					(unsigned long long)ext.off);
+			ok = false;
+		}
+		if (data)
+			archive_free_data(data);
+		free(expected);
+	}
+	archive_free(&ar->ar);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "afa_writer_test.afa";
+	static const uint32_t aligns[] = { 1, 4, 16, 4096 };
+	bool ok = true;
+	for (uint32_t version = 1; version <= 2; version++) {
+		for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+			ok = check(version, aligns[i], false, path) && ok;
+			ok = check(version, aligns[i], true, path) && ok;
+		}
+	}
+	remove(path);
+	printf("%s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark ain_search against the naive scan (converting every text with
+ * sjis2utf and running strstr on it) on synthetic SJIS text, and check that
+ * both give the same results.
+ *
+ * Usage: ain_search_bench [<nr_messages> <nr_strings> [<nr_threads>]]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "system4.h"
+#include "system4/ain.h"
+#include "system4/ain_search.h"
+#include "system4/string.h"
+#include "system4/utfsjis.h"
+
+#define NR_QUERIES 200
+#define NR_NAIVE_QUERIES 20
+#define QUERY_REPEAT 20
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static const char *words[] = {
+	"Rance", "Sill", "attack", "HP", "item", "door", "key", "the", "and", "ok",
+};
+
+/*
+ * Hiragana, katakana and ASCII words, in SJIS.
+ */
+static struct string *random_text(void)
+{
+	char buf[256];
+	int n = 0;
+	int len = 5 + rng() % 40;
+	for (int i = 0; i < len && n < 240; i++) {
+		int r = rng() % 10;
+		if (r < 6) {
+			buf[n++] = 0x82;
+			buf[n++] = 0x9f + rng() % 83;
+		} else if (r < 8) {
+			buf[n++] = 0x83;
+			buf[n++] = 0x40 + rng() % 60;
+		} else {
+			n += sprintf(buf + n, "%s ", words[rng() % 10]);
+		}
+	}
+	return make_string(buf, n);
+}
+
+/*
+ * 2-5 whole characters from a random message.
+ */
+static char *random_query(struct ain_search *s, int nr_messages)
+{
+	const char *t;
+	size_t len;
+	do {
+		t = ain_search_text(s, AIN_SEARCH_MESSAGE, rng() % nr_messages);
+		len = strlen(t);
+	} while (len < 12);
+	size_t off = rng() % (len - 9);
+	while (off && (t[off] & 0xc0) == 0x80)
+		off--;
+	size_t l = 0;
+	for (int nc = 2 + rng() % 4; nc && off + l < len; nc--) {
+		l++;
+		while ((t[off + l] & 0xc0) == 0x80)
+			l++;
+	}
+	char *q = xmalloc(l + 1);
+	memcpy(q, t + off, l);
+	q[l] = '\0';
+	return q;
+}
+
+static bool naive_match(const char *text, const char *query, int flags)
+{
+	if (flags & AIN_SEARCH_PREFIX)
+		return !strncmp(text, query, strlen(query));
+	return strstr(text, query);
+}
+
+/*
+ * What tools do without an index.
+ */
+static size_t naive_search(struct ain *ain, const char *query)
+{
+	size_t n = 0;
+	for (int i = 0; i < ain->nr_messages; i++) {
+		char *utf = sjis2utf(ain->messages[i]->text, ain->messages[i]->size);
+		n += naive_match(utf, query, 0);
+		free(utf);
+	}
+	for (int i = 0; i < ain->nr_strings; i++) {
+		char *utf = sjis2utf(ain->strings[i]->text, ain->strings[i]->size);
+		n += naive_match(utf, query, 0);
+		free(utf);
+	}
+	return n;
+}
+
+/*
+ * Compare the results of a query with a scan of the converted texts.
+ */
+static bool check_query(struct ain_search *s, int nr_messages, int nr_strings,
+		const char *query, int flags)
+{
+	size_t n;
+	struct ain_search_result *r = ain_search_find(s, query, flags, &n);
+	size_t k = 0;
+	bool ok = true;
+	const struct { enum ain_search_kind kind; int flag; int count; } kinds[] = {
+		{ AIN_SEARCH_MESSAGE, AIN_SEARCH_MESSAGES, nr_messages },
+		{ AIN_SEARCH_STRING, AIN_SEARCH_STRINGS, nr_strings },
+	};
+	for (int j = 0; j < 2 && ok; j++) {
+		if ((flags & (AIN_SEARCH_MESSAGES | AIN_SEARCH_STRINGS))
+				&& !(flags & kinds[j].flag))
+			continue;
+		for (int i = 0; i < kinds[j].count; i++) {
+			const char *text = ain_search_text(s, kinds[j].kind, i);
+			if (!naive_match(text, query, flags))
+				continue;
+			if (k >= n || r[k].kind != kinds[j].kind || r[k].index != i) {
+				ok = false;
+				break;
+			}
+			k++;
+		}
+	}
+	if (!ok || k != n) {
+		printf("query '%s' (flags %d): results differ from the naive scan\n", query, flags);
+		ok = false;
+	}
+	free(r);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int nr_messages = argc > 2 ? atoi(argv[1]) : 150000;
+	int nr_strings = argc > 2 ? atoi(argv[2]) : 50000;
+	int nr_threads = argc > 3 ? atoi(argv[3]) : 0;
+
+	struct ain *ain = ain_new(4, 0);
+	ain->messages = xcalloc(nr_messages, sizeof(struct string*));
+	ain->nr_messages = nr_messages;
+	for (int i = 0; i < nr_messages; i++) {
+		ain->messages[i] = random_text();
+	}
+	ain->strings = xcalloc(nr_strings, sizeof(struct string*));
+	ain->nr_strings = nr_strings;
+	for (int i = 0; i < nr_strings; i++) {
+		ain->strings[i] = random_text();
+	}
+
+	double t = now();
+	struct ain_search *s = ain_search_create(ain, nr_threads);
+	printf("build: %.2f s (%d messages, %d strings)\n", now() - t, nr_messages, nr_strings);
+
+	char *queries[NR_QUERIES];
+	double times[NR_QUERIES];
+	size_t total = 0;
+	for (int i = 0; i < NR_QUERIES; i++) {
+		queries[i] = random_query(s, nr_messages);
+		size_t n;
+		free(ain_search_find(s, queries[i], 0, &n));
+		t = now();
+		for (int r = 0; r < QUERY_REPEAT; r++) {
+			free(ain_search_find(s, queries[i], 0, &n));
+		}
+		times[i] = (now() - t) / QUERY_REPEAT;
+		total += n;
+	}
+	qsort(times, NR_QUERIES, sizeof(double), cmp_double);
+	printf("index: median %.1f us, p90 %.1f us, max %.1f us (%.1f results per query)\n",
+			times[NR_QUERIES/2] * 1e6, times[NR_QUERIES*9/10] * 1e6,
+			times[NR_QUERIES-1] * 1e6, (double)total / NR_QUERIES);
+
+	for (int i = 0; i < NR_NAIVE_QUERIES; i++) {
+		t = now();
+		naive_search(ain, queries[i]);
+		times[i] = now() - t;
+	}
+	qsort(times, NR_NAIVE_QUERIES, sizeof(double), cmp_double);
+	printf("naive: median %.1f ms, max %.1f ms\n",
+			times[NR_NAIVE_QUERIES/2] * 1e3, times[NR_NAIVE_QUERIES-1] * 1e3);
+
+	static const int flags[] = {
+		0,
+		AIN_SEARCH_PREFIX,
+		AIN_SEARCH_MESSAGES,
+		AIN_SEARCH_STRINGS | AIN_SEARCH_PREFIX,
+	};
+	bool ok = true;
+	for (int i = 0; i < NR_QUERIES && ok; i++) {
+		for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+			ok = check_query(s, nr_messages, nr_strings, queries[i], flags[f]) && ok;
+		}
+	}
+	ok = check_query(s, nr_messages, nr_strings, "", 0) && ok;
+	printf("results: %s\n", ok ? "ok" : "FAILED");
+
+	for (int i = 0; i < NR_QUERIES; i++) {
+		free(queries[i]);
+	}
+	ain_search_free(s);
+	ain_free(ain);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Build a catalog of a directory holding a valid archive next to files that
+ * the catalog has to skip, and check that it is considered current until the
+ * directory changes.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4.h"
+#include "system4/afa.h"
+#include "system4/archive.h"
+#include "system4/archive_catalog.h"
+#include "system4/file.h"
+
+static bool write_junk(const char *dir, const char *name, const char *contents)
+{
+	char *path = path_join(dir, name);
+	bool ok = file_write(path, (uint8_t*)contents, strlen(contents));
+	free(path);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = argc > 1 ? argv[1] : "archive_catalog_test";
+	char *cat_path = xmalloc(strlen(dir) + 5);
+	sprintf(cat_path, "%s.cat", dir);
+	if (mkdir_p(dir) && !is_directory(dir)) {
+		printf("can't create %s\n", dir);
+		return 1;
+	}
+
+	struct afa_writer *w = afa_writer_create();
+	afa_writer_add_data(w, "a.txt", (uint8_t*)xstrdup("hello"), 5);
+	char *afa_path = path_join(dir, "data.afa");
+	bool ok = afa_writer_write(w, afa_path, NULL);
+	afa_writer_free(w);
+	// an unopenable archive and a duplicate ALD volume
+	ok = ok && write_junk(dir, "bad.afa", "not an archive");
+	ok = ok && write_junk(dir, "setA.ald", "not an archive");
+	ok = ok && write_junk(dir, "seta.ald", "not an archive");
+	if (!ok) {
+		printf("can't write test files\n");
+		return 1;
+	}
+
+	remove(cat_path);
+	struct archive_catalog *cat = archive_catalog_open(dir, cat_path, 0);
+	if (!cat) {
+		printf("can't build catalog\n");
+		return 1;
+	}
+	struct archive_catalog_entry e;
+	if (!archive_catalog_lookup(cat, "a.txt", &e) || e.size != 5) {
+		printf("entry missing from catalog\n");
+		ok = false;
+	}
+	if (!archive_catalog_is_current(cat)) {
+		printf("fresh catalog is stale\n");
+		ok = false;
+	}
+	archive_catalog_close(cat);
+
+	// a change to a skipped file is still noticed
+	write_junk(dir, "bad.afa", "still not an archive");
+	cat = archive_catalog_open(dir, cat_path, 0);
+	if (!cat || !archive_catalog_is_current(cat)) {
+		printf("catalog not rebuilt\n");
+		ok = false;
+	}
+	write_junk(dir, "other.afa", "new file");
+	if (cat && archive_catalog_is_current(cat)) {
+		printf("new file not noticed\n");
+		ok = false;
+	}
+	if (cat)
+		archive_catalog_close(cat);
+
+	static const char *files[] = {
+		"data.afa", "bad.afa", "setA.ald", "seta.ald", "other.afa"
+	};
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		char *path = path_join(dir, files[i]);
+		remove(path);
+		free(path);
+	}
+	remove(dir);
+	remove(cat_path);
+	free(cat_path);
+	free(afa_path);
+	printf("%s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,331 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Take an AFA archive through a series of versions. For each step, create a
+ * patch from the current archive to the next version, and check that both
+ * the overlay and the archive patched in place have exactly the contents of
+ * the next version. The steps grow the index past the end of the original
+ * index (moving entries), within the slack left by that move, and past the
+ * slack again.
+ *
+ * Usage: archive_delta [<directory for temporary files>]
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4.h"
+#include "system4/afa.h"
+#include "system4/archive.h"
+#include "system4/archive_delta.h"
+#include "kvec.h"
+
+#define LARGE_SIZE (200 * 1024)
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+struct entry {
+	char *name;
+	uint8_t *data;
+	size_t size;
+};
+
+typedef kvec_t(struct entry) version;
+
+static void random_bytes(uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		data[i] = rng();
+	}
+}
+
+static void add_entry(version *v, const char *name, size_t size)
+{
+	struct entry e = {
+		.name = xstrdup(name),
+		.data = xmalloc(size ? size : 1),
+		.size = size,
+	};
+	random_bytes(e.data, size);
+	kv_push(struct entry, *v, e);
+}
+
+static void free_entry(struct entry *e)
+{
+	free(e->name);
+	free(e->data);
+}
+
+static void free_version(version *v)
+{
+	for (size_t i = 0; i < kv_size(*v); i++) {
+		free_entry(&kv_A(*v, i));
+	}
+	kv_destroy(*v);
+}
+
+static void copy_version(version *dst, version *src)
+{
+	kv_init(*dst);
+	for (size_t i = 0; i < kv_size(*src); i++) {
+		struct entry *s = &kv_A(*src, i);
+		struct entry e = {
+			.name = xstrdup(s->name),
+			.data = xmalloc(s->size ? s->size : 1),
+			.size = s->size,
+		};
+		memcpy(e.data, s->data, s->size);
+		kv_push(struct entry, *dst, e);
+	}
+}
+
+/*
+ * Remove every `nth` entry, replace or edit some of the others and add
+ * `nr_added` entries with names `name_len` characters long.
+ */
+static void next_version(version *v, int step, int nth, int nr_added, int name_len)
+{
+	for (size_t i = 0; i < kv_size(*v); ) {
+		if (nth && rng() % nth == 0) {
+			free_entry(&kv_A(*v, i));
+			kv_A(*v, i) = kv_A(*v, kv_size(*v) - 1);
+			kv_size(*v)--;
+			continue;
+		}
+		struct entry *e = &kv_A(*v, i);
+		switch (rng() % 4) {
+		case 0:
+			// replaced
+			e->size = rng() % 3000;
+			e->data = xrealloc(e->data, e->size ? e->size : 1);
+			random_bytes(e->data, e->size);
+			break;
+		case 1:
+			// a few bytes changed and some inserted (delta-encoded when large)
+			if (e->size) {
+				for (int k = 0; k < 3; k++) {
+					e->data[rng() % e->size] = rng();
+				}
+				size_t at = rng() % e->size;
+				e->data = xrealloc(e->data, e->size + 100);
+				memmove(e->data + at + 100, e->data + at, e->size - at);
+				random_bytes(e->data + at, 100);
+				e->size += 100;
+			}
+			break;
+		}
+		i++;
+	}
+	for (int i = 0; i < nr_added; i++) {
+		char name[256];
+		int n = sprintf(name, "step%d_%d_", step, i);
+		for (; n < name_len; n++) {
+			name[n] = 'a' + rng() % 26;
+		}
+		name[n] = '\0';
+		add_entry(v, name, i % 4 == 0 ? LARGE_SIZE : rng() % 3000);
+	}
+}
+
+static void write_version(version *v, uint32_t afa_version, const char *path)
+{
+	struct afa_writer *w = afa_writer_create();
+	for (size_t i = 0; i < kv_size(*v); i++) {
+		struct entry *e = &kv_A(*v, i);
+		uint8_t *data = xmalloc(e->size ? e->size : 1);
+		memcpy(data, e->data, e->size);
+		afa_writer_add_data(w, e->name, data, e->size);
+	}
+	struct afa_writer_options opts = { .version = afa_version };
+	if (!afa_writer_write(w, path, &opts))
+		ERROR("Failed to write '%s'", path);
+	afa_writer_free(w);
+}
+
+struct count_data {
+	version *v;
+	size_t nr_entries;
+	bool ok;
+};
+
+static void count_entry(struct archive_data *data, void *user)
+{
+	struct count_data *c = user;
+	c->nr_entries++;
+	for (size_t i = 0; i < kv_size(*c->v); i++) {
+		if (!strcmp(kv_A(*c->v, i).name, data->name))
+			return;
+	}
+	printf("unexpected entry '%s'\n", data->name);
+	c->ok = false;
+}
+
+/*
+ * Check that `ar` contains exactly the entries of `v`.
+ */
+static bool check_contents(struct archive *ar, version *v, const char *what)
+{
+	for (size_t i = 0; i < kv_size(*v); i++) {
+		struct entry *e = &kv_A(*v, i);
+		struct archive_data *data = archive_get_by_name(ar, e->name);
+		if (!data) {
+			printf("%s: '%s' is missing\n", what, e->name);
+			return false;
+		}
+		bool same = data->size == e->size && !memcmp(data->data, e->data, e->size);
+		archive_free_data(data);
+		if (!same) {
+			printf("%s: '%s' has the wrong contents\n", what, e->name);
+			return false;
+		}
+	}
+	struct count_data c = { .v = v, .ok = true };
+	archive_for_each(ar, count_entry, &c);
+	if (c.ok && c.nr_entries != kv_size(*v)) {
+		printf("%s: %zu entries, expected %zu\n", what, c.nr_entries, kv_size(*v));
+		return false;
+	}
+	return c.ok;
+}
+
+/*
+ * Patch `work` to `next` (through both the overlay and in place). Returns the new start of the data
+ * section, or 0 on failure.
+ */
+static uint32_t step(const char *work, version *next, uint32_t afa_version, const char *tmp)
+{
+	char target[512], patch[512], what[64];
+	sprintf(target, "%s/delta_target.afa", tmp);
+	sprintf(patch, "%s/delta.s4pa", tmp);
+	sprintf(what, "v%u", afa_version);
+	write_version(next, afa_version, target);
+
+	int error;
+	struct afa_archive *old = afa_open(work, 0, &error);
+	struct afa_archive *new = afa_open(target, 0, &error);
+	if (!old || !new)
+		ERROR("Failed to open archives");
+	struct archive_delta_options opts = {0};
+	struct archive_delta_stats stats;
+	if (!archive_delta_create(&old->ar, &new->ar, patch, &opts, &stats)) {
+		printf("%s: archive_delta_create failed\n", what);
+		return 0;
+	}
+	archive_free(&new->ar);
+	printf("%s: %u unchanged, %u added, %u replaced, %u deltas, %u removed, %" PRIu64 " bytes\n",
+			what, stats.nr_unchanged, stats.nr_added, stats.nr_replaced,
+			stats.nr_deltas, stats.nr_removed, stats.patch_size);
+
+	for (int flags = 0; flags <= ARCHIVE_MMAP; flags += ARCHIVE_MMAP) {
+		struct archive *overlay = archive_delta_overlay(&old->ar, patch, flags, &error);
+		if (!overlay) {
+			printf("%s: archive_delta_overlay failed\n", what);
+			return 0;
+		}
+		bool ok = check_contents(overlay, next, flags ? "overlay (mmap)" : "overlay");
+		archive_free(overlay);
+		if (!ok)
+			return 0;
+	}
+	archive_free(&old->ar);
+
+	if (!archive_delta_apply_afa(work, patch)) {
+		printf("%s: archive_delta_apply_afa failed\n", what);
+		return 0;
+	}
+	struct afa_archive *patched = afa_open(work, 0, &error);
+	if (!patched) {
+		printf("%s: patched archive can't be opened\n", what);
+		return 0;
+	}
+	bool ok = check_contents(&patched->ar, next, "patched");
+	uint32_t data_start = patched->data_start;
+	archive_free(&patched->ar);
+	return ok ? data_start : 0;
+}
+
+static bool check(uint32_t afa_version, const char *tmp)
+{
+	char work[512];
+	sprintf(work, "%s/delta_work.afa", tmp);
+
+	version cur, next;
+	kv_init(cur);
+	for (int i = 0; i < 30; i++) {
+		char name[32];
+		sprintf(name, "file%02d.dat", i);
+		add_entry(&cur, name, i % 5 == 0 ? LARGE_SIZE : rng() % 3000);
+	}
+	write_version(&cur, afa_version, work);
+	int error;
+	struct afa_archive *ar = afa_open(work, 0, &error);
+	uint32_t data_start = ar->data_start;
+	archive_free(&ar->ar);
+
+	// 1. the index outgrows the original one: the data section is moved
+	// 2. a few short names fit in the slack left by the move
+	// 3. many long names exhaust the slack: the data section moves again
+	static const struct { int nth, nr_added, name_len; const char *expect; } steps[] = {
+		{ 5, 8, 16, "moved" },
+		{ 0, 2, 12, "same" },
+		{ 6, 200, 60, "moved" },
+	};
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]) && ok; i++) {
+		copy_version(&next, &cur);
+		next_version(&next, i, steps[i].nth, steps[i].nr_added, steps[i].name_len);
+		uint32_t new_start = step(work, &next, afa_version, tmp);
+		if (!new_start) {
+			ok = false;
+		} else if (!strcmp(steps[i].expect, "moved") ? new_start <= data_start : new_start != data_start) {
+			printf("v%u step %zu: data section at %u (was %u), expected it to be %s\n",
+					afa_version, i + 1, new_start, data_start, steps[i].expect);
+			ok = false;
+		}
+		data_start = new_start;
+		free_version(&cur);
+		cur = next;
+	}
+	free_version(&cur);
+	printf("v%u: %s\n", afa_version, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tmp = argc > 1 ? argv[1] : ".";
+	bool ok = true;
+	ok = check(1, tmp) && ok;
+	ok = check(2, tmp) && ok;
+
+	static const char *files[] = { "delta_work.afa", "delta_target.afa", "delta.s4pa" };
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		char path[512];
+		sprintf(path, "%s/%s", tmp, files[i]);
+		remove(path);
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check that the whole-buffer (exact size, prefix, growing buffer) and
+ * streaming inflate paths of the configured zlib backend agree, on streams
+ * made by the backend itself at several levels and by system zlib, and that
+ * they all reject the same broken streams.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "system4.h"
+#include "compression.h"
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+enum payload_kind {
+	PAYLOAD_ZEROS,
+	PAYLOAD_TEXT,
+	PAYLOAD_IMAGE,
+	PAYLOAD_RANDOM,
+	NR_PAYLOAD_KINDS,
+};
+
+static const char *payload_names[] = { "zeros", "text", "image", "random" };
+
+static const size_t payload_sizes[] = {
+	0, 1, 100, 32768, 65536 + 7, 1024 * 1024 + 3, 3 * 1024 * 1024,
+};
+
+static uint8_t *make_payload(enum payload_kind kind, size_t size)
+{
+	static const char *words[] = { "Rance", "attack", "the", "door", "key", "\x82\xa0", "\x83\x41" };
+	uint8_t *data = xmalloc(size ? size : 1);
+	for (size_t i = 0; i < size; ) {
+		switch (kind) {
+		case PAYLOAD_ZEROS:
+			data[i++] = 0;
+			break;
+		case PAYLOAD_TEXT: {
+			const char *w = words[rng() % 7];
+			for (; *w && i < size; w++)
+				data[i++] = *w;
+			if (i < size)
+				data[i++] = rng() % 8 ? ' ' : '\n';
+			break;
+		}
+		case PAYLOAD_IMAGE:
+			// smooth rows of RGBA pixels with a little noise
+			data[i] = (i / 4 % 256 + i / 4096) + (i % 4 == 3 ? 255 : rng() % 4);
+			i++;
+			break;
+		default:
+			data[i++] = rng();
+			break;
+		}
+	}
+	return data;
+}
+
+struct stream_out {
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+};
+
+static bool stream_write(void *user, const uint8_t *data, size_t size)
+{
+	struct stream_out *out = user;
+	if (out->size + size > out->cap) {
+		out->cap = max(out->cap * 2, out->size + size);
+		out->data = xrealloc(out->data, out->cap);
+	}
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+	return true;
+}
+
+static bool stream_stop(void *user, possibly_unused const uint8_t *data, size_t size)
+{
+	size_t *total = user;
+	*total += size;
+	return false;
+}
+
+#define CHECK(cond, ...) \
+	do { \
+		if (!(cond)) { \
+			printf("%s/%zu/%s: ", payload_names[kind], size, encoder); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			return false; \
+		} \
+	} while (0)
+
+static bool check_stream(enum payload_kind kind, const uint8_t *src, size_t size,
+		uint8_t *z, size_t z_size, const char *encoder)
+{
+	uint8_t *out = xmalloc(size + 16);
+	enum sys4_z_status r;
+
+	r = sys4_inflate_exact(out, size, z, z_size);
+	CHECK(r == SYS4_Z_OK, "sys4_inflate_exact: %s", sys4_z_strerror(r));
+	CHECK(!memcmp(out, src, size), "sys4_inflate_exact: wrong output");
+
+	size_t n = size + 16;
+	r = sys4_inflate(out, &n, z, z_size);
+	CHECK(r == SYS4_Z_OK && n == size && !memcmp(out, src, size), "sys4_inflate disagrees");
+
+	struct stream_out s = {0};
+	r = sys4_inflate_stream(z, z_size, stream_write, &s);
+	CHECK(r == SYS4_Z_OK, "sys4_inflate_stream: %s", sys4_z_strerror(r));
+	CHECK(s.size == size && !memcmp(s.data, src, size), "sys4_inflate_stream disagrees");
+	free(s.data);
+	s = (struct stream_out){0};
+
+	for (size_t hint = 0; hint <= 1; hint++) {
+		uint8_t *a = sys4_inflate_alloc(z, z_size, hint, &n, &r);
+		CHECK(a && n == size && !memcmp(a, src, size), "sys4_inflate_alloc (hint %zu) disagrees", hint);
+		free(a);
+	}
+
+	r = sys4_inflate_prefix(out, size / 2, z, z_size);
+	CHECK(r == SYS4_Z_OK && !memcmp(out, src, size / 2), "sys4_inflate_prefix disagrees");
+
+	// stopping a stream early is not an error
+	size_t total = 0;
+	r = sys4_inflate_stream(z, z_size, stream_stop, &total);
+	CHECK(r == SYS4_Z_OK && total <= size, "stopped sys4_inflate_stream: %s", sys4_z_strerror(r));
+
+	// wrong sizes
+	r = sys4_inflate_exact(out, size + 1, z, z_size);
+	CHECK(r == SYS4_Z_SHORT, "sys4_inflate_exact (size + 1): %s", sys4_z_strerror(r));
+	if (size) {
+		r = sys4_inflate_exact(out, size - 1, z, z_size);
+		CHECK(r == SYS4_Z_OVERFLOW, "sys4_inflate_exact (size - 1): %s", sys4_z_strerror(r));
+	}
+
+	// truncated streams are rejected by every path
+	size_t in_size = z_size - 1 - rng() % (z_size / 2);
+	r = sys4_inflate_exact(out, size, z, in_size);
+	CHECK(r != SYS4_Z_OK, "sys4_inflate_exact accepted a truncated stream");
+	r = sys4_inflate_stream(z, in_size, stream_write, &s);
+	CHECK(r != SYS4_Z_OK, "sys4_inflate_stream accepted a truncated stream");
+	free(s.data);
+	s = (struct stream_out){0};
+	uint8_t *a = sys4_inflate_alloc(z, in_size, 0, &n, &r);
+	CHECK(!a, "sys4_inflate_alloc accepted a truncated stream");
+
+	// a corrupt byte may land in bits that don't matter (e.g. unused code
+	// lengths), but then every path must produce the right output
+	size_t at = z_size / 2;
+	z[at] ^= 0x55;
+	r = sys4_inflate_exact(out, size, z, z_size);
+	bool exact_ok = r == SYS4_Z_OK;
+	CHECK(!exact_ok || !memcmp(out, src, size), "sys4_inflate_exact: wrong output for a corrupt stream");
+	r = sys4_inflate_stream(z, z_size, stream_write, &s);
+	bool stream_ok = r == SYS4_Z_OK && s.size == size;
+	CHECK(!stream_ok || !memcmp(s.data, src, size), "sys4_inflate_stream: wrong output for a corrupt stream");
+	free(s.data);
+	a = sys4_inflate_alloc(z, z_size, 0, &n, &r);
+	CHECK(!a || (n == size && !memcmp(a, src, size)), "sys4_inflate_alloc: wrong output for a corrupt stream");
+	CHECK(exact_ok == stream_ok && exact_ok == !!a, "corrupt stream accepted by %s%s%s",
+			exact_ok ? "sys4_inflate_exact " : "", stream_ok ? "sys4_inflate_stream " : "",
+			a ? "sys4_inflate_alloc" : "");
+	free(a);
+	z[at] ^= 0x55;
+
+	// the per-thread state still works after errors
+	r = sys4_inflate_exact(out, size, z, z_size);
+	CHECK(r == SYS4_Z_OK && !memcmp(out, src, size), "sys4_inflate_exact fails after errors");
+
+	free(out);
+	return true;
+}
+
+int main(void)
+{
+	printf("backend: %s\n", sys4_z_backend());
+	bool ok = true;
+	for (int kind = 0; kind < NR_PAYLOAD_KINDS; kind++) {
+		bool kind_ok = true;
+		for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++) {
+			size_t size = payload_sizes[i];
+			uint8_t *src = make_payload(kind, size);
+			size_t bound = max(sys4_deflate_bound(size), (size_t)compressBound(size));
+			uint8_t *z = xmalloc(bound);
+
+			static const int levels[] = { 0, 1, 6, 9 };
+			for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+				char encoder[32];
+				sprintf(encoder, "level %d", levels[l]);
+				size_t z_size = bound;
+				enum sys4_z_status r = sys4_deflate(z, &z_size, src, size, levels[l]);
+				if (r != SYS4_Z_OK) {
+					printf("%s/%zu/%s: sys4_deflate: %s\n", payload_names[kind], size,
+							encoder, sys4_z_strerror(r));
+					kind_ok = false;
+					continue;
+				}
+				kind_ok = check_stream(kind, src, size, z, z_size, encoder) && kind_ok;
+			}
+
+			// as written by the games' tools
+			uLongf z_size = bound;
+			if (compress2(z, &z_size, src, size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+				printf("%s/%zu: compress2 failed\n", payload_names[kind], size);
+				kind_ok = false;
+			} else {
+				kind_ok = check_stream(kind, src, size, z, z_size, "zlib") && kind_ok;
+			}
+			free(z);
+			free(src);
+		}
+		printf("%s: %s\n", payload_names[kind], kind_ok ? "ok" : "FAILED");
+		ok = kind_ok && ok;
+	}
+	return ok ? 0 : 1;
+}
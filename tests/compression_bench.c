@@ -0,0 +1,177 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the configured zlib backend (see compression.h) with system zlib.
+ * Each payload is compressed with zlib at the default level, as the games'
+ * tools do, and then inflated (whole-buffer and streaming) and deflated
+ * again by both. Throughput is in MB/s of uncompressed data.
+ *
+ * Usage: compression_bench [<file>...]
+ *
+ * The files should be real payloads, e.g. the extracted contents of game
+ * archives; without any, synthetic text and image data is used.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "system4.h"
+#include "system4/file.h"
+#include "compression.h"
+
+// each measurement is repeated for at least this long
+#define MIN_TIME 0.2
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct payload {
+	const uint8_t *data;
+	size_t size;
+	const uint8_t *z;
+	size_t z_size;
+	uint8_t *out;
+	size_t out_cap;
+	int level;
+};
+
+static bool zlib_inflate_whole(struct payload *p)
+{
+	uLongf size = p->size;
+	return uncompress(p->out, &size, p->z, p->z_size) == Z_OK && size == p->size;
+}
+
+static bool sys4_inflate_whole(struct payload *p)
+{
+	return sys4_inflate_exact(p->out, p->size, p->z, p->z_size) == SYS4_Z_OK;
+}
+
+static bool discard(possibly_unused void *user, possibly_unused const uint8_t *data,
+		possibly_unused size_t size)
+{
+	return true;
+}
+
+static bool sys4_inflate_streaming(struct payload *p)
+{
+	return sys4_inflate_stream(p->z, p->z_size, discard, NULL) == SYS4_Z_OK;
+}
+
+static bool zlib_deflate_whole(struct payload *p)
+{
+	uLongf size = p->out_cap;
+	return compress2(p->out, &size, p->data, p->size, p->level) == Z_OK;
+}
+
+static bool sys4_deflate_whole(struct payload *p)
+{
+	size_t size = p->out_cap;
+	return sys4_deflate(p->out, &size, p->data, p->size, p->level) == SYS4_Z_OK;
+}
+
+static double measure(bool (*fun)(struct payload*), struct payload *p)
+{
+	int n = 0;
+	double start = now(), t;
+	do {
+		if (!fun(p))
+			ERROR("compression failed");
+		n++;
+	} while ((t = now() - start) < MIN_TIME);
+	return p->size * (double)n / t / 1e6;
+}
+
+static void bench(const char *name, const uint8_t *data, size_t size)
+{
+	struct payload p = {
+		.data = data,
+		.size = size,
+		.out_cap = max(sys4_deflate_bound(size), (size_t)compressBound(size)),
+	};
+	p.out = xmalloc(max(p.out_cap, size));
+	uLongf z_size = compressBound(size);
+	uint8_t *z = xmalloc(z_size);
+	if (compress2(z, &z_size, data, size, Z_DEFAULT_COMPRESSION) != Z_OK)
+		ERROR("compress2 failed");
+	p.z = z;
+	p.z_size = z_size;
+
+	printf("%s: %zu bytes, ratio %.2f\n", name, size, size ? (double)z_size / size : 0);
+	printf("  inflate       zlib %8.1f   %s %8.1f   %s (stream) %8.1f\n",
+			measure(zlib_inflate_whole, &p), sys4_z_backend(), measure(sys4_inflate_whole, &p),
+			sys4_z_backend(), measure(sys4_inflate_streaming, &p));
+	static const int levels[] = { 1, 6, 9 };
+	for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		p.level = levels[i];
+		printf("  deflate -%d    zlib %8.1f   %s %8.1f\n", p.level,
+				measure(zlib_deflate_whole, &p), sys4_z_backend(), measure(sys4_deflate_whole, &p));
+	}
+	free(z);
+	free(p.out);
+}
+
+int main(int argc, char *argv[])
+{
+	printf("MB/s of uncompressed data; backend: %s\n", sys4_z_backend());
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			size_t size;
+			uint8_t *data = file_read(argv[i], &size);
+			if (!data) {
+				printf("%s: can't be read\n", argv[i]);
+				return 1;
+			}
+			bench(argv[i], data, size);
+			free(data);
+		}
+		return 0;
+	}
+
+	// script-like text, and RGBA pixels with smooth gradients and noise
+	size_t size = 4 * 1024 * 1024;
+	uint8_t *data = xmalloc(size);
+	static const char *words[] = { "Rance", "attack", "the", "door", "key", "\x82\xa0", "\x83\x41" };
+	for (size_t i = 0; i < size; ) {
+		for (const char *w = words[rng() % 7]; *w && i < size; w++)
+			data[i++] = *w;
+		if (i < size)
+			data[i++] = rng() % 8 ? ' ' : '\n';
+	}
+	bench("text", data, size);
+	for (size_t i = 0; i < size; i++) {
+		data[i] = (i / 4 % 256 + i / 4096) + (i % 4 == 3 ? 255 : rng() % 4);
+	}
+	bench("image", data, size);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Check every SIMD kernel variant the CPU supports against the scalar
+ * reference, on sizes that exercise the leftover paths.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4/cg.h"
+#include "system4/cg_mips.h"
+#include "cpu.h"
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+static unsigned nr_variants(const struct cpu_variant *(*get)(unsigned))
+{
+	unsigned n = 0;
+	while (get(n))
+		n++;
+	return n;
+}
+
+/*
+ * Mip filters. The SIMD kernels may contract multiplies and adds
+ * differently, so levels are allowed to differ by one step per channel.
+ */
+
+static const int mip_sizes[][2] = {
+	{ 1, 1 }, { 3, 1 }, { 1, 5 }, { 7, 3 }, { 17, 9 }, { 33, 31 }, { 129, 67 },
+};
+
+static bool check_mips(unsigned variant, unsigned scalar)
+{
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(mip_sizes) / sizeof(mip_sizes[0]); i++) {
+		int w = mip_sizes[i][0], h = mip_sizes[i][1];
+		struct cg cg = {0};
+		cg.metrics.w = w;
+		cg.metrics.h = h;
+		cg.metrics.bpp = 32;
+		cg.metrics.has_pixel = true;
+		cg.metrics.has_alpha = true;
+		cg.metrics.pixel_pitch = w * 4;
+		cg.pixels = malloc((size_t)w * h * 4);
+		for (int p = 0; p < w * h * 4; p++) {
+			((uint8_t*)cg.pixels)[p] = rng();
+		}
+		for (int filter = CG_MIP_BOX; filter <= CG_MIP_KAISER; filter++) {
+			for (int flags = 0; flags <= CG_MIP_PREMULTIPLIED; flags++) {
+				struct cg_mips *a = _cg_generate_mips_variant(&cg, 0, filter, flags, scalar);
+				struct cg_mips *b = _cg_generate_mips_variant(&cg, 0, filter, flags, variant);
+				for (size_t p = 0; p < a->size; p++) {
+					if (abs(a->data[p] - b->data[p]) > 1) {
+						printf("mips/%s: %dx%d filter=%d flags=%d: byte %zu is %u, expected %u\n",
+								_cg_mips_variant(variant)->name, w, h, filter,
+								flags, p, b->data[p], a->data[p]);
+						ok = false;
+						break;
+					}
+				}
+				cg_mips_free(a);
+				cg_mips_free(b);
+			}
+		}
+		free(cg.pixels);
+	}
+	return ok;
+}
+
+/*
+ * WebP overlay masks. These must match exactly.
+ */
+
+static bool check_mask(unsigned variant, unsigned scalar)
+{
+	enum { MAX_PIXELS = 71 };
+	uint8_t overlay[MAX_PIXELS * 4], base[MAX_PIXELS * 4];
+	uint8_t a[MAX_PIXELS * 4], b[MAX_PIXELS * 4];
+	for (int i = 0; i < MAX_PIXELS; i++) {
+		for (int c = 0; c < 4; c++) {
+			overlay[i*4 + c] = rng();
+			base[i*4 + c] = rng();
+		}
+		// about half magenta, with some near misses
+		if (rng() % 2) {
+			overlay[i*4 + 0] = 255;
+			overlay[i*4 + 1] = rng() % 4 ? 0 : 1;
+			overlay[i*4 + 2] = 255;
+		}
+	}
+	for (int n = 0; n <= MAX_PIXELS; n++) {
+		memcpy(a, base, sizeof(a));
+		memcpy(b, base, sizeof(b));
+		_webp_mask_row(scalar, a, overlay, n);
+		_webp_mask_row(variant, b, overlay, n);
+		if (memcmp(a, b, sizeof(a))) {
+			printf("mask/%s: wrong result for %d pixels\n",
+					_webp_mask_variant(variant)->name, n);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_family(const char *family, const struct cpu_variant *(*get)(unsigned),
+		bool (*check)(unsigned variant, unsigned scalar))
+{
+	bool ok = true;
+	unsigned scalar = nr_variants(get) - 1;
+	for (unsigned v = 0; v < scalar; v++) {
+		const struct cpu_variant *cv = get(v);
+		if (!cpu_has(cv->features)) {
+			printf("%s/%s: not supported, skipped\n", family, cv->name);
+			continue;
+		}
+		bool r = check(v, scalar);
+		printf("%s/%s: %s\n", family, cv->name, r ? "ok" : "FAILED");
+		ok = r && ok;
+	}
+	return ok;
+}
+
+int main(void)
+{
+	bool ok = true;
+	ok = check_family("mips", _cg_mips_variant, check_mips) && ok;
+	ok = check_family("mask", _webp_mask_variant, check_mask) && ok;
+	return ok ? 0 : 1;
+}
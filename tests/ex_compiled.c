@@ -0,0 +1,631 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Generate random EX files (tables with and without indices and sub-tables,
+ * nested lists and trees), and check that the compiled image answers every
+ * query exactly as the EX parsed by ex_read does.
+ *
+ * Names are generated without one being a prefix of another, since ex_get
+ * matches prefixes where exc_get doesn't.
+ *
+ * Usage: ex_compiled [<directory for temporary files>]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "system4.h"
+#include "system4/buffer.h"
+#include "system4/ex.h"
+#include "system4/ex_compiled.h"
+#include "system4/file.h"
+#include "system4/string.h"
+#include "compression.h"
+
+#define DFLT_INT 0x5eed
+#define DFLT_FLOAT -1234.5f
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+/*
+ * Writing EX files
+ */
+
+static unsigned name_seq;
+
+static void write_string(struct buffer *b, const char *s)
+{
+	// strings are sometimes NUL-padded in real files
+	size_t len = strlen(s);
+	size_t padded = rng() % 2 ? (len + 4) & ~3 : len;
+	buffer_write_int32(b, padded);
+	buffer_write_bytes(b, (const uint8_t*)s, len);
+	for (size_t i = len; i < padded; i++) {
+		buffer_write_int8(b, 0);
+	}
+}
+
+static void write_name(struct buffer *b, const char *prefix)
+{
+	char name[32];
+	sprintf(name, "%s%05u", prefix, name_seq++);
+	write_string(b, name);
+}
+
+static void write_random_string(struct buffer *b)
+{
+	char s[64];
+	size_t len = rng() % 5 ? rng() % 40 : 0;
+	for (size_t i = 0; i < len; i++) {
+		// ASCII and SJIS lead/trail bytes, never NUL
+		s[i] = rng() % 3 ? 'a' + rng() % 26 : 0x81 + rng() % 0x7e;
+	}
+	s[len] = '\0';
+	write_string(b, s);
+}
+
+static void write_scalar(struct buffer *b, enum ex_value_type type)
+{
+	switch (type) {
+	case EX_INT:
+		buffer_write_int32(b, rng() % 3 ? (int32_t)(rng() % 200) - 100 : (int32_t)(rng() << 8));
+		break;
+	case EX_FLOAT:
+		buffer_write_float(b, (float)(int32_t)rng() / 1000.0f);
+		break;
+	default:
+		write_random_string(b);
+		break;
+	}
+}
+
+static enum ex_value_type random_scalar_type(void)
+{
+	static const enum ex_value_type types[] = { EX_INT, EX_FLOAT, EX_STRING };
+	return types[rng() % 3];
+}
+
+struct field {
+	enum ex_value_type type;
+	int nr_subfields;
+	enum ex_value_type subfields[4];
+	int index_keys;  // index fields: keys are drawn from this many values
+};
+
+static void write_field(struct buffer *b, struct field *f, bool is_index)
+{
+	buffer_write_int32(b, f->type);
+	write_name(b, "f");
+	bool has_value = f->type != EX_TABLE && !is_index && rng() % 2;
+	buffer_write_int32(b, has_value);
+	buffer_write_int32(b, is_index);
+	if (has_value)
+		write_scalar(b, f->type);
+	if (f->type == EX_TABLE) {
+		buffer_write_int32(b, f->nr_subfields);
+		for (int i = 0; i < f->nr_subfields; i++) {
+			struct field sub = { .type = f->subfields[i] };
+			write_field(b, &sub, false);
+		}
+	}
+}
+
+static void write_key(struct buffer *b, struct field *f)
+{
+	int key = rng() % f->index_keys;
+	if (f->type == EX_INT) {
+		buffer_write_int32(b, key * 7 - 20);
+	} else {
+		char s[16];
+		sprintf(s, "key%d", key);
+		write_string(b, s);
+	}
+}
+
+/*
+ * A table with its header (as in a block, or an item of a list).
+ */
+static void write_table(struct buffer *b)
+{
+	struct field fields[6];
+	int nr_fields = 1 + rng() % 6;
+	int index = rng() % 3 ? (int)(rng() % nr_fields) : -1;
+	for (int i = 0; i < nr_fields; i++) {
+		struct field *f = &fields[i];
+		memset(f, 0, sizeof(struct field));
+		if (i == index) {
+			f->type = rng() % 2 ? EX_INT : EX_STRING;
+			f->index_keys = 1 + rng() % 40;
+		} else if (rng() % 5 == 0) {
+			f->type = EX_TABLE;
+			f->nr_subfields = 1 + rng() % 4;
+			for (int j = 0; j < f->nr_subfields; j++) {
+				f->subfields[j] = random_scalar_type();
+			}
+		} else {
+			f->type = random_scalar_type();
+		}
+	}
+
+	buffer_write_int32(b, nr_fields);
+	for (int i = 0; i < nr_fields; i++) {
+		write_field(b, &fields[i], i == index);
+	}
+
+	int nr_rows = rng() % 4 ? rng() % 30 : 0;
+	buffer_write_int32(b, nr_fields);
+	buffer_write_int32(b, nr_rows);
+	for (int r = 0; r < nr_rows; r++) {
+		for (int i = 0; i < nr_fields; i++) {
+			struct field *f = &fields[i];
+			buffer_write_int32(b, f->type);
+			if (i == index) {
+				write_key(b, f);
+			} else if (f->type == EX_TABLE) {
+				// a sub-table: no header of its own
+				int sub_rows = rng() % 4;
+				buffer_write_int32(b, f->nr_subfields);
+				buffer_write_int32(b, sub_rows);
+				for (int sr = 0; sr < sub_rows; sr++) {
+					for (int j = 0; j < f->nr_subfields; j++) {
+						buffer_write_int32(b, f->subfields[j]);
+						write_scalar(b, f->subfields[j]);
+					}
+				}
+			} else {
+				write_scalar(b, f->type);
+			}
+		}
+	}
+}
+
+static void write_list(struct buffer *b, int depth)
+{
+	int nr_items = rng() % 12;
+	buffer_write_int32(b, nr_items);
+	for (int i = 0; i < nr_items; i++) {
+		enum ex_value_type type = random_scalar_type();
+		if (depth < 2 && rng() % 6 == 0)
+			type = rng() % 2 ? EX_LIST : EX_TABLE;
+		buffer_write_int32(b, type);
+		size_t size_at = b->index;
+		buffer_write_int32(b, 0);
+		if (type == EX_LIST)
+			write_list(b, depth + 1);
+		else if (type == EX_TABLE)
+			write_table(b);
+		else
+			write_scalar(b, type);
+		buffer_write_int32_at(b, size_at, b->index - size_at - 4);
+	}
+}
+
+static void write_tree(struct buffer *b, int depth)
+{
+	char name[32];
+	sprintf(name, "t%05u", name_seq++);
+	write_string(b, name);
+	bool is_leaf = depth >= 3 || rng() % 3 == 0;
+	buffer_write_int32(b, is_leaf);
+	if (!is_leaf) {
+		int nr_children = rng() % 5;
+		buffer_write_int32(b, nr_children);
+		for (int i = 0; i < nr_children; i++) {
+			write_tree(b, depth + 1);
+		}
+		return;
+	}
+	enum ex_value_type type = rng() % 5 ? random_scalar_type() : EX_LIST;
+	buffer_write_int32(b, type);
+	size_t size_at = b->index;
+	buffer_write_int32(b, 0);
+	write_string(b, name);
+	if (type == EX_LIST)
+		write_list(b, 1);
+	else
+		write_scalar(b, type);
+	buffer_write_int32_at(b, size_at, b->index - size_at - 4);
+	buffer_write_int32(b, 0);
+}
+
+static void write_block(struct buffer *b, enum ex_value_type type, const char *name)
+{
+	buffer_write_int32(b, type);
+	size_t size_at = b->index;
+	buffer_write_int32(b, 0);
+	if (name)
+		write_string(b, name);
+	else
+		write_name(b, "b");
+	switch (type) {
+	case EX_TABLE:
+		write_table(b);
+		break;
+	case EX_LIST:
+		write_list(b, 0);
+		break;
+	case EX_TREE:
+		write_tree(b, 0);
+		break;
+	default:
+		write_scalar(b, type);
+		break;
+	}
+	buffer_write_int32_at(b, size_at, b->index - size_at - 4);
+}
+
+static uint8_t *make_ex(int nr_blocks, size_t *size_out)
+{
+	static const enum ex_value_type types[] = {
+		EX_INT, EX_FLOAT, EX_STRING, EX_TABLE, EX_LIST, EX_TREE,
+	};
+	struct buffer data;
+	buffer_init(&data, NULL, 0);
+	for (int i = 0; i < nr_blocks; i++) {
+		write_block(&data, types[rng() % 6], NULL);
+	}
+	// blocks of different types may share a name
+	write_block(&data, EX_STRING, "b00000");
+	write_block(&data, EX_INT, "b00000");
+	nr_blocks += 2;
+
+	size_t z_size = sys4_deflate_bound(data.index);
+	uint8_t *z = xmalloc(z_size);
+	if (sys4_deflate(z, &z_size, data.buf, data.index, SYS4_Z_DEFAULT_COMPRESSION) != SYS4_Z_OK)
+		ERROR("sys4_deflate failed");
+	ex_encode(z, z_size);
+
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	buffer_write_bytes(&out, (const uint8_t*)"HEAD", 4);
+	buffer_write_int32(&out, 0xc);
+	buffer_write_bytes(&out, (const uint8_t*)"EXTF", 4);
+	buffer_write_int32(&out, 1);
+	buffer_write_int32(&out, nr_blocks);
+	buffer_write_bytes(&out, (const uint8_t*)"DATA", 4);
+	buffer_write_int32(&out, z_size);
+	buffer_write_int32(&out, data.index);
+	buffer_write_bytes(&out, z, z_size);
+	free(z);
+	free(data.buf);
+	*size_out = out.index;
+	return out.buf;
+}
+
+/*
+ * Comparing
+ */
+
+static char where[1024];
+
+#define FAIL(...) \
+	do { \
+		printf("%s: ", where); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return false; \
+	} while (0)
+
+static bool same_float(float a, float b)
+{
+	return !memcmp(&a, &b, sizeof(float));
+}
+
+static bool same_string(const char *a, const char *b)
+{
+	return (!a && !b) || (a && b && !strcmp(a, b));
+}
+
+static bool compare_value(struct ex_value *a, struct exc_value b);
+
+static bool compare_field(struct ex_field *a, struct exc_field *b, const struct ex_compiled *c)
+{
+	if (a->type != b->type)
+		FAIL("field type %d, compiled %d", a->type, b->type);
+	if (strcmp(a->name->text, b->name))
+		FAIL("field name '%s', compiled '%s'", a->name->text, b->name);
+	if (!!a->is_index != b->is_index)
+		FAIL("field '%s': is_index differs", a->name->text);
+	if (a->has_value ? !compare_value(&a->value, b->value) : b->value.type != 0)
+		FAIL("field '%s': default value differs", a->name->text);
+	if (a->nr_subfields != b->nr_subfields)
+		FAIL("field '%s': %u subfields, compiled %u", a->name->text, a->nr_subfields,
+				b->nr_subfields);
+	for (uint32_t i = 0; i < a->nr_subfields; i++) {
+		struct exc_field sub;
+		if (!exc_field_subfield(c, b, i, &sub))
+			FAIL("field '%s': subfield %u is missing", a->name->text, i);
+		if (!compare_field(&a->subfields[i], &sub, c))
+			return false;
+	}
+	struct exc_field sub;
+	if (exc_field_subfield(c, b, a->nr_subfields, &sub))
+		FAIL("field '%s': subfield past the end", a->name->text);
+	return true;
+}
+
+static bool compare_table(struct ex_table *a, struct exc_value b)
+{
+	if (a->nr_rows != exc_table_nr_rows(b) || a->nr_columns != exc_table_nr_columns(b))
+		FAIL("table is %ux%u, compiled %ux%u", a->nr_rows, a->nr_columns,
+				exc_table_nr_rows(b), exc_table_nr_columns(b));
+	if (a->nr_fields != exc_table_nr_fields(b))
+		FAIL("table has %u fields, compiled %u", a->nr_fields, exc_table_nr_fields(b));
+	for (uint32_t i = 0; i < a->nr_fields; i++) {
+		struct exc_field f;
+		if (!exc_table_field(b, i, &f))
+			FAIL("field %u is missing", i);
+		if (!compare_field(&a->fields[i], &f, b.ex))
+			return false;
+		if (ex_col_from_name(a, a->fields[i].name->text) != exc_col_from_name(b, f.name))
+			FAIL("col_from_name('%s') differs", f.name);
+	}
+	struct exc_field f;
+	if (exc_table_field(b, a->nr_fields, &f))
+		FAIL("field past the end");
+	if (ex_col_from_name(a, "nope") != exc_col_from_name(b, "nope"))
+		FAIL("col_from_name('nope') differs");
+
+	size_t len = strlen(where);
+	for (uint32_t r = 0; r <= a->nr_rows; r++) {
+		for (uint32_t col = 0; col <= a->nr_columns; col++) {
+			sprintf(where + len, "[%u][%u]", r, col);
+			if (!compare_value(ex_table_get(a, r, col), exc_table_get(b, r, col)))
+				return false;
+		}
+	}
+	where[len] = '\0';
+
+	// look up every key present (and some that aren't) in both ways
+	for (int key = -30; key < 300; key++) {
+		if (ex_row_at_int_key(a, key) != exc_row_at_int_key(b, key))
+			FAIL("row_at_int_key(%d): %d, compiled %d", key, ex_row_at_int_key(a, key),
+					exc_row_at_int_key(b, key));
+	}
+	for (int key = 0; key < 45; key++) {
+		char s[16];
+		sprintf(s, "key%d", key);
+		if (ex_row_at_string_key(a, s) != exc_row_at_string_key(b, s))
+			FAIL("row_at_string_key('%s'): %d, compiled %d", s, ex_row_at_string_key(a, s),
+					exc_row_at_string_key(b, s));
+	}
+	return true;
+}
+
+static bool compare_list(struct ex_list *a, struct exc_value b)
+{
+	if (a->nr_items != exc_list_nr_items(b))
+		FAIL("list has %u items, compiled %u", a->nr_items, exc_list_nr_items(b));
+	size_t len = strlen(where);
+	for (uint32_t i = 0; i <= a->nr_items; i++) {
+		sprintf(where + len, "[%u]", i);
+		if (!compare_value(ex_list_get(a, i), exc_list_get(b, i)))
+			return false;
+	}
+	where[len] = '\0';
+	return true;
+}
+
+static bool compare_tree(struct ex_tree *a, struct exc_value b)
+{
+	if (!a)
+		return b.type == 0 ? true : (printf("%s: unexpected tree\n", where), false);
+	if (b.type != EX_TREE)
+		FAIL("tree is missing");
+	if (strcmp(a->name->text, exc_tree_name(b)))
+		FAIL("tree name '%s', compiled '%s'", a->name->text, exc_tree_name(b));
+	if (a->is_leaf != exc_tree_is_leaf(b))
+		FAIL("is_leaf differs");
+	if (!compare_value(ex_leaf_value(a), exc_leaf_value(b)))
+		return false;
+	if (a->is_leaf) {
+		if (strcmp(a->leaf.name->text, exc_leaf_name(b)))
+			FAIL("leaf name '%s', compiled '%s'", a->leaf.name->text, exc_leaf_name(b));
+		return true;
+	}
+	if (a->nr_children != exc_tree_nr_children(b))
+		FAIL("%u children, compiled %u", a->nr_children, exc_tree_nr_children(b));
+	size_t len = strlen(where);
+	for (uint32_t i = 0; i < a->nr_children; i++) {
+		const char *name = a->children[i].name->text;
+		sprintf(where + len, ".%s", name);
+		if (!compare_tree(&a->children[i], exc_tree_child(b, i)))
+			return false;
+		if (!compare_tree(ex_tree_get_child(a, name), exc_tree_get_child(b, name)))
+			return false;
+	}
+	where[len] = '\0';
+	if (exc_tree_child(b, a->nr_children).type)
+		FAIL("child past the end");
+	return compare_tree(ex_tree_get_child(a, "nope"), exc_tree_get_child(b, "nope"));
+}
+
+static bool compare_value(struct ex_value *a, struct exc_value b)
+{
+	if (!a) {
+		if (b.type)
+			FAIL("unexpected value of type %d", b.type);
+		return true;
+	}
+	if (a->type != b.type)
+		FAIL("type %d, compiled %d", a->type, b.type);
+	switch (a->type) {
+	case EX_INT:
+		if (a->i != b.i)
+			FAIL("%d, compiled %d", a->i, b.i);
+		return true;
+	case EX_FLOAT:
+		if (!same_float(a->f, b.f))
+			FAIL("%f, compiled %f", a->f, b.f);
+		return true;
+	case EX_STRING:
+		if (!same_string(a->s->text, exc_string(b)) || (uint32_t)a->s->size != exc_string_size(b))
+			FAIL("'%s', compiled '%s'", a->s->text, exc_string(b));
+		return true;
+	case EX_TABLE:
+		return compare_table(a->t, b);
+	case EX_LIST:
+		return compare_list(a->list, b);
+	case EX_TREE:
+		return compare_tree(a->tree, b);
+	default:
+		FAIL("unexpected type %d", a->type);
+	}
+}
+
+/*
+ * Check ex_get on every path into a tree, including paths past a leaf.
+ */
+static bool compare_paths(struct ex *ex, struct ex_compiled *c, struct ex_tree *tree, char *path)
+{
+	size_t len = strlen(path);
+	strcpy(where, path);
+	if (!compare_value(ex_get(ex, path), exc_get(c, path)))
+		return false;
+	strcpy(path + len, ".nope");
+	strcpy(where, path);
+	if (!compare_value(ex_get(ex, path), exc_get(c, path)))
+		return false;
+	if (tree->is_leaf) {
+		sprintf(path + len, ".%s", tree->leaf.name->text);
+		strcpy(where, path);
+		if (!compare_value(ex_get(ex, path), exc_get(c, path)))
+			return false;
+	} else {
+		for (uint32_t i = 0; i < tree->nr_children; i++) {
+			sprintf(path + len, ".%s", tree->children[i].name->text);
+			if (!compare_paths(ex, c, &tree->children[i], path))
+				return false;
+		}
+	}
+	path[len] = '\0';
+	return true;
+}
+
+static bool compare_block_queries(struct ex *ex, struct ex_compiled *c, const char *name)
+{
+	sprintf(where, "%s", name);
+	if (ex_get_int(ex, name, DFLT_INT) != exc_get_int(c, name, DFLT_INT))
+		FAIL("get_int differs");
+	if (!same_float(ex_get_float(ex, name, DFLT_FLOAT), exc_get_float(c, name, DFLT_FLOAT)))
+		FAIL("get_float differs");
+	struct string *s = ex_get_string(ex, name);
+	bool same = same_string(s ? s->text : NULL, exc_get_string(c, name));
+	if (s)
+		free_string(s);
+	if (!same)
+		FAIL("get_string differs");
+
+	struct ex_table *t = ex_get_table(ex, name);
+	struct exc_value tv = exc_get_table(c, name);
+	if (t ? !compare_table(t, tv) : tv.type != 0)
+		FAIL("get_table differs");
+	struct ex_list *l = ex_get_list(ex, name);
+	struct exc_value lv = exc_get_list(c, name);
+	if (l ? !compare_list(l, lv) : lv.type != 0)
+		FAIL("get_list differs");
+	if (!compare_tree(ex_get_tree(ex, name), exc_get_tree(c, name)))
+		return false;
+
+	return compare_value(ex_get(ex, name), exc_get(c, name));
+}
+
+static bool compare(struct ex *ex, struct ex_compiled *c)
+{
+	if (ex->nr_blocks != ex_compiled_nr_blocks(c)) {
+		printf("%u blocks, compiled %u\n", ex->nr_blocks, ex_compiled_nr_blocks(c));
+		return false;
+	}
+	for (uint32_t i = 0; i < ex->nr_blocks; i++) {
+		struct ex_block *blk = &ex->blocks[i];
+		sprintf(where, "block %u (%s)", i, blk->name->text);
+		if (!same_string(blk->name->text, ex_compiled_block_name(c, i)))
+			FAIL("compiled name is '%s'", ex_compiled_block_name(c, i));
+		if (!compare_value(&blk->val, ex_compiled_block(c, i)))
+			return false;
+		if (!compare_block_queries(ex, c, blk->name->text))
+			return false;
+		if (blk->val.type == EX_TREE) {
+			char path[1024];
+			strcpy(path, blk->name->text);
+			if (!compare_paths(ex, c, blk->val.tree, path))
+				return false;
+		}
+	}
+	sprintf(where, "block %u", ex->nr_blocks);
+	if (ex_compiled_block_name(c, ex->nr_blocks) || ex_compiled_block(c, ex->nr_blocks).type)
+		FAIL("block past the end");
+	return compare_block_queries(ex, c, "nope") && compare_block_queries(ex, c, "b99999.x");
+}
+
+static bool check(uint32_t seed, const char *tmp)
+{
+	char ex_path[512], exc_path[512];
+	sprintf(ex_path, "%s/ex_compiled_test.ex", tmp);
+	sprintf(exc_path, "%s/ex_compiled_test.exc", tmp);
+
+	rng_state = seed;
+	name_seq = 0;
+	size_t size;
+	uint8_t *data = make_ex(60, &size);
+	if (!file_write(ex_path, data, size))
+		ERROR("Failed to write '%s'", ex_path);
+	struct ex *ex = ex_read(data, size);
+	free(data);
+
+	uint64_t hash;
+	bool ok = ex_file_hash(ex_path, &hash) && ex_compile(ex, hash, exc_path);
+	struct ex_compiled *c = ok ? ex_open_compiled(exc_path) : NULL;
+	if (!c) {
+		printf("seed %u: compiling failed\n", seed);
+		ok = false;
+	} else {
+		ok = compare(ex, c);
+		ex_compiled_close(c);
+	}
+
+	// the cached image is used as is
+	if (ok) {
+		c = ex_open_cached(ex_path, exc_path);
+		ok = c && ex_compiled_source_hash(c) == hash && compare(ex, c);
+		ex_compiled_close(c);
+	}
+
+	ex_free(ex);
+	remove(ex_path);
+	remove(exc_path);
+	printf("seed %u: %s\n", seed, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tmp = argc > 1 ? argv[1] : ".";
+	bool ok = true;
+	for (uint32_t seed = 1; seed <= 8; seed++) {
+		ok = check(seed, tmp) && ok;
+	}
+	return ok ? 0 : 1;
+}
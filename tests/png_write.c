@@ -0,0 +1,149 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Encode images with every PNG filter and compression level, decode them
+ * with libpng and check that the pixels survive, and that the output is the
+ * same for any number of threads.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include "system4.h"
+#include "system4/cg.h"
+#include "system4/png.h"
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+// includes images spanning several encoder bands
+static const int sizes[][2] = {
+	{ 1, 1 }, { 7, 3 }, { 1, 300 }, { 300, 1 }, { 129, 67 }, { 300, 600 },
+};
+
+static void make_image(struct cg *cg, int w, int h)
+{
+	memset(cg, 0, sizeof(struct cg));
+	cg->type = ALCG_PNG;
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	cg->metrics.bpp = 32;
+	cg->metrics.has_pixel = true;
+	cg->metrics.has_alpha = true;
+	cg->metrics.pixel_pitch = w * 4;
+	uint8_t *p = cg->pixels = xmalloc((size_t)w * h * 4);
+	// smooth gradients with some noise and flat regions, so that every
+	// filter has something to do
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++, p += 4) {
+			p[0] = x * 255 / w;
+			p[1] = y * 255 / h;
+			p[2] = ((x / 16 + y / 16) & 1) * 200 + (rng() & 7);
+			p[3] = (x + y) % 300 < 200 ? 255 : rng();
+		}
+	}
+}
+
+static uint8_t *encode(struct cg *cg, int level, int filter, int nr_threads, size_t *size)
+{
+	struct cg_write_options opts = CG_WRITE_OPTIONS_DEFAULT;
+	opts.level = level;
+	opts.png_filter = filter;
+	opts.nr_threads = nr_threads;
+	FILE *f = tmpfile();
+	if (!f)
+		ERROR("tmpfile failed");
+	if (!png_cg_write_with_options(cg, f, &opts)) {
+		fclose(f);
+		return NULL;
+	}
+	*size = ftell(f);
+	uint8_t *data = xmalloc(*size);
+	rewind(f);
+	if (fread(data, 1, *size, f) != *size)
+		ERROR("fread failed");
+	fclose(f);
+	return data;
+}
+
+static bool decode_matches(uint8_t *png, size_t size, struct cg *cg)
+{
+	png_image image = { .version = PNG_IMAGE_VERSION };
+	if (!png_image_begin_read_from_memory(&image, png, size)) {
+		printf("libpng: %s\n", image.message);
+		return false;
+	}
+	if (image.width != (png_uint_32)cg->metrics.w || image.height != (png_uint_32)cg->metrics.h) {
+		printf("decoded as %ux%u\n", image.width, image.height);
+		png_image_free(&image);
+		return false;
+	}
+	image.format = PNG_FORMAT_RGBA;
+	size_t pixels_size = PNG_IMAGE_SIZE(image);
+	uint8_t *pixels = xmalloc(pixels_size);
+	bool ok = png_image_finish_read(&image, NULL, pixels, 0, NULL);
+	if (!ok)
+		printf("libpng: %s\n", image.message);
+	else if (memcmp(pixels, cg->pixels, pixels_size))
+		ok = false;
+	free(pixels);
+	png_image_free(&image);
+	return ok;
+}
+
+int main(void)
+{
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct cg cg;
+		bool size_ok = true;
+		make_image(&cg, sizes[i][0], sizes[i][1]);
+		for (int filter = CG_PNG_FILTER_NONE; filter <= CG_PNG_FILTER_ADAPTIVE; filter++) {
+			for (int level = 0; level <= 9; level++) {
+				size_t size, size_mt;
+				uint8_t *png = encode(&cg, level, filter, 1, &size);
+				uint8_t *png_mt = encode(&cg, level, filter, 4, &size_mt);
+				const char *problem = NULL;
+				if (!png || !png_mt)
+					problem = "encoding failed";
+				else if (!decode_matches(png, size, &cg))
+					problem = "wrong pixels";
+				else if (size != size_mt || memcmp(png, png_mt, size))
+					problem = "output depends on the number of threads";
+				if (problem) {
+					printf("%dx%d filter=%d level=%d: %s\n", sizes[i][0], sizes[i][1],
+							filter, level, problem);
+					size_ok = false;
+				}
+				free(png);
+				free(png_mt);
+			}
+		}
+		printf("%dx%d: %s\n", sizes[i][0], sizes[i][1], size_ok ? "ok" : "FAILED");
+		ok = size_ok && ok;
+		free(cg.pixels);
+	}
+	return ok ? 0 : 1;
+}
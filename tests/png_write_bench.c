@@ -0,0 +1,109 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * PNG export throughput (MB/s of RGBA input) and output size for every
+ * filter and compression level.
+ *
+ * Usage: png_write_bench [<width> <height> [<nr_threads>]]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "system4.h"
+#include "system4/cg.h"
+#include "system4/png.h"
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 8;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *filter_names[] = {
+	[CG_PNG_FILTER_NONE] = "none",
+	[CG_PNG_FILTER_SUB] = "sub",
+	[CG_PNG_FILTER_UP] = "up",
+	[CG_PNG_FILTER_AVERAGE] = "average",
+	[CG_PNG_FILTER_PAETH] = "paeth",
+	[CG_PNG_FILTER_ADAPTIVE] = "adaptive",
+};
+
+int main(int argc, char *argv[])
+{
+	int w = argc > 2 ? atoi(argv[1]) : 1500;
+	int h = argc > 2 ? atoi(argv[2]) : 1200;
+	int nr_threads = argc > 3 ? atoi(argv[3]) : 0;
+
+	// a CG-like image: gradients, flat areas with a little noise and a
+	// partly transparent region
+	struct cg cg = {0};
+	cg.type = ALCG_PNG;
+	cg.metrics.w = w;
+	cg.metrics.h = h;
+	cg.metrics.bpp = 32;
+	cg.metrics.has_pixel = true;
+	cg.metrics.has_alpha = true;
+	cg.metrics.pixel_pitch = w * 4;
+	uint8_t *p = cg.pixels = xmalloc((size_t)w * h * 4);
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++, p += 4) {
+			p[0] = x * 255 / w;
+			p[1] = y * 255 / h;
+			p[2] = ((x / 16 + y / 16) & 1) * 200 + (rng() & 7);
+			p[3] = (x + y) % 300 < 200 ? 255 : (x * y) & 255;
+		}
+	}
+
+	FILE *f = tmpfile();
+	if (!f)
+		ERROR("tmpfile failed");
+	printf("%dx%d, %d threads\n", w, h, nr_threads);
+	printf("filter    level     MB/s        bytes\n");
+	for (int filter = CG_PNG_FILTER_NONE; filter <= CG_PNG_FILTER_ADAPTIVE; filter++) {
+		for (int level = 0; level <= 9; level++) {
+			struct cg_write_options opts = CG_WRITE_OPTIONS_DEFAULT;
+			opts.level = level;
+			opts.png_filter = filter;
+			opts.nr_threads = nr_threads;
+			rewind(f);
+			double t = now();
+			if (!png_cg_write_with_options(&cg, f, &opts))
+				ERROR("PNG encoding failed");
+			fflush(f);
+			t = now() - t;
+			long size = ftell(f);
+			printf("%-8s  %5d  %7.1f  %11ld\n", filter_names[filter], level,
+					(double)w * h * 4 / t / 1e6, size);
+		}
+	}
+	fclose(f);
+	free(cg.pixels);
+	return 0;
+}
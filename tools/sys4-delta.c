@@ -0,0 +1,128 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Create archive delta patches and apply them to AFA archives (see
+ * system4/archive_delta.h).
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "system4/aar.h"
+#include "system4/afa.h"
+#include "system4/archive.h"
+#include "system4/archive_delta.h"
+#include "system4/dlf.h"
+#include "system4/file.h"
+
+static void usage(void)
+{
+	puts("Usage: sys4-delta create [options] <old-archive> <new-archive> <patch>");
+	puts("       sys4-delta apply <afa-archive> <patch>");
+	puts("");
+	puts("Archives may be .afa, .aar or .dlf files. 'apply' patches an AFA");
+	puts("archive in place.");
+	puts("");
+	puts("Options:");
+	puts("  -m <bytes>   store changed entries smaller than this whole (default: 65536)");
+	puts("  -b <bytes>   block size of the matcher (default: 64)");
+	puts("  -j <n>       use <n> threads (default: one per CPU)");
+	puts("  -h           show this message");
+}
+
+static struct archive *open_archive(const char *path)
+{
+	const char *ext = file_extension(path);
+	struct archive *ar = NULL;
+	int error = ARCHIVE_SUCCESS;
+	if (ext && !strcasecmp(ext, "aar")) {
+		struct aar_archive *a = aar_open(path, ARCHIVE_MMAP, &error);
+		ar = a ? &a->ar : NULL;
+	} else if (ext && !strcasecmp(ext, "dlf")) {
+		struct dlf_archive *a = dlf_open(path, ARCHIVE_MMAP, &error);
+		ar = a ? &a->ar : NULL;
+	} else {
+		struct afa_archive *a = afa_open(path, ARCHIVE_MMAP, &error);
+		ar = a ? &a->ar : NULL;
+	}
+	if (!ar)
+		fprintf(stderr, "Failed to open '%s': %s\n", path, archive_strerror(error));
+	return ar;
+}
+
+static int create(int argc, char *argv[])
+{
+	struct archive_delta_options opts = {0};
+	int c;
+	while ((c = getopt(argc, argv, "m:b:j:h")) != -1) {
+		switch (c) {
+		case 'm':
+			opts.min_delta_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			opts.block_size = atoi(optarg);
+			break;
+		case 'j':
+			opts.nr_threads = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (argc - optind != 3) {
+		usage();
+		return 1;
+	}
+
+	struct archive *old = open_archive(argv[optind]);
+	struct archive *new = open_archive(argv[optind + 1]);
+	int status = 1;
+	struct archive_delta_stats stats;
+	if (old && new && archive_delta_create(old, new, argv[optind + 2], &opts, &stats)) {
+		printf("%u unchanged, %u added, %u replaced, %u delta-encoded, %u removed\n",
+				stats.nr_unchanged, stats.nr_added, stats.nr_replaced,
+				stats.nr_deltas, stats.nr_removed);
+		printf("patch size: %" PRIu64 " bytes\n", stats.patch_size);
+		status = 0;
+	}
+	if (old)
+		archive_free(old);
+	if (new)
+		archive_free(new);
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+	if (!strcmp(argv[1], "create"))
+		return create(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "apply") && argc == 4)
+		return archive_delta_apply_afa(argv[2], argv[3]) ? 0 : 1;
+	usage();
+	return !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help") ? 0 : 1;
+}
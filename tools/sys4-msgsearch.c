@@ -0,0 +1,94 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Search the messages and strings of an .ain file (see system4/ain_search.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "system4/ain.h"
+#include "system4/ain_search.h"
+
+static void usage(void)
+{
+	puts("Usage: sys4-msgsearch [options] <ain-file> <query>...");
+	puts("");
+	puts("Print the messages and strings containing each (UTF-8) query.");
+	puts("");
+	puts("Options:");
+	puts("  -m           only search messages");
+	puts("  -s           only search strings");
+	puts("  -p           only match at the start of the text");
+	puts("  -j <n>       build the index on <n> threads (default: one per CPU)");
+	puts("  -h           show this message");
+}
+
+int main(int argc, char *argv[])
+{
+	int flags = 0;
+	int nr_threads = 0;
+	int c;
+	while ((c = getopt(argc, argv, "mspj:h")) != -1) {
+		switch (c) {
+		case 'm':
+			flags |= AIN_SEARCH_MESSAGES;
+			break;
+		case 's':
+			flags |= AIN_SEARCH_STRINGS;
+			break;
+		case 'p':
+			flags |= AIN_SEARCH_PREFIX;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (argc - optind < 2) {
+		usage();
+		return 1;
+	}
+
+	int error;
+	struct ain *ain = ain_open(argv[optind], &error);
+	if (!ain) {
+		fprintf(stderr, "Failed to open '%s': %s\n", argv[optind], ain_strerror(error));
+		return 1;
+	}
+	struct ain_search *s = ain_search_create(ain, nr_threads);
+	ain_free(ain);
+
+	for (int i = optind + 1; i < argc; i++) {
+		size_t n;
+		struct ain_search_result *r = ain_search_find(s, argv[i], flags, &n);
+		for (size_t j = 0; j < n; j++) {
+			printf("%s %d: %s\n", r[j].kind == AIN_SEARCH_MESSAGE ? "message" : "string",
+					r[j].index, ain_search_text(s, r[j].kind, r[j].index));
+		}
+		free(r);
+	}
+
+	ain_search_free(s);
+	return 0;
+}
@@ -0,0 +1,124 @@
+/* Copyright (C) 2026 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Summarize an access trace (see system4/trace.h), or replay it against a
+ * game directory.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "system4/archive.h"
+#include "system4/trace.h"
+
+static void usage(void)
+{
+	puts("Usage: sys4-replay [options] <trace> [<game-dir>]");
+	puts("");
+	puts("Print the latencies recorded in <trace>. If <game-dir> is given, the");
+	puts("trace is replayed against it and the replay latencies are printed too.");
+	puts("");
+	puts("Options:");
+	puts("  -j <n>       replay on <n> threads (default: one per CPU)");
+	puts("  -m           map archive files");
+	puts("  -p           map and populate archive files");
+	puts("  -u           use io_uring for archive reads");
+	puts("  -c <path>    catalog of the game directory (default: <game-dir>/.sys4-catalog)");
+	puts("  -C <dir>     load CGs through a cache in <dir>");
+	puts("  -s <MiB>     size of the CG cache (default: 1024)");
+	puts("  -r           replay in real time instead of as fast as possible");
+	puts("  -h           show this message");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sys4_replay_options opts = {
+		.cg_cache_size = 1024ull * 1024 * 1024,
+	};
+	char *catalog = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "j:mpuc:C:s:rh")) != -1) {
+		switch (c) {
+		case 'j':
+			opts.nr_threads = atoi(optarg);
+			break;
+		case 'm':
+			opts.archive_flags |= ARCHIVE_MMAP;
+			break;
+		case 'p':
+			opts.archive_flags |= ARCHIVE_MMAP | ARCHIVE_MMAP_POPULATE;
+			break;
+		case 'u':
+			opts.archive_flags |= ARCHIVE_IO_URING;
+			break;
+		case 'c':
+			opts.catalog_path = optarg;
+			break;
+		case 'C':
+			opts.cg_cache_dir = optarg;
+			break;
+		case 's':
+			opts.cg_cache_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'r':
+			opts.realtime = true;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind >= argc || argc - optind > 2) {
+		usage();
+		return 1;
+	}
+
+	struct sys4_trace *trace = sys4_trace_read(argv[optind]);
+	if (!trace)
+		return 1;
+
+	struct sys4_trace_stats stats;
+	sys4_trace_summarize(trace, &stats);
+	printf("Recorded (%zu events):\n", trace->nr_events);
+	sys4_trace_print_stats(&stats, stdout);
+
+	int status = 0;
+	if (argc - optind == 2) {
+		const char *dir = argv[optind + 1];
+		if (!opts.catalog_path) {
+			size_t len = strlen(dir) + sizeof("/.sys4-catalog");
+			catalog = malloc(len);
+			snprintf(catalog, len, "%s/.sys4-catalog", dir);
+			opts.catalog_path = catalog;
+		}
+		if (sys4_trace_replay(trace, dir, &opts, &stats)) {
+			printf("\nReplayed:\n");
+			sys4_trace_print_stats(&stats, stdout);
+		} else {
+			status = 1;
+		}
+	}
+
+	free(catalog);
+	sys4_trace_free(trace);
+	return status;
+}